@@ -717,6 +717,40 @@ static ggml_type kv_cache_type_from_str(const std::string & s) {
     throw std::runtime_error("Unsupported cache type: " + s);
 }
 
+// per-layer cache types from a comma separated list of FIRST[-LAST]:TYPE
+// the layers that are not in the list are GGML_TYPE_COUNT
+static std::vector<ggml_type> kv_cache_types_from_spec(const std::string & spec) {
+    std::vector<ggml_type> types;
+    for (const auto & item : string_split<std::string>(spec, ',')) {
+        const size_t pos_type = item.find(':');
+        if (pos_type == std::string::npos) {
+            throw std::invalid_argument("invalid per-layer cache type, expected FIRST[-LAST]:TYPE: " + item);
+        }
+
+        const std::string layers = item.substr(0, pos_type);
+        const size_t pos_last = layers.find('-');
+
+        int il0 = -1;
+        int il1 = -1;
+        try {
+            il0 = std::stoi(layers.substr(0, pos_last));
+            il1 = pos_last == std::string::npos ? il0 : std::stoi(layers.substr(pos_last + 1));
+        } catch (const std::logic_error &) {
+            // not a number, handled below
+        }
+        if (il0 < 0 || il1 < il0) {
+            throw std::invalid_argument("invalid layer range in per-layer cache type: " + item);
+        }
+
+        const ggml_type type = kv_cache_type_from_str(item.substr(pos_type + 1));
+        if ((int) types.size() <= il1) {
+            types.resize(il1 + 1, GGML_TYPE_COUNT);
+        }
+        std::fill(types.begin() + il0, types.begin() + il1 + 1, type);
+    }
+    return types;
+}
+
 static std::string get_all_kv_cache_types() {
     std::ostringstream msg;
     for (const auto & type : kv_cache_types) {
@@ -859,6 +893,15 @@ static bool common_params_parse_ex(int argc, char ** argv, common_params_context
         params.tensor_buft_overrides.push_back({nullptr, nullptr});
     }
 
+    // the layers that are not in the per-layer lists use -ctk/-ctv
+    for (auto & [types, type] : { std::make_pair(&params.cache_types_k_layer, params.cache_type_k),
+                                  std::make_pair(&params.cache_types_v_layer, params.cache_type_v) }) {
+        if (!types->empty()) {
+            std::replace(types->begin(), types->end(), GGML_TYPE_COUNT, type);
+            types->push_back(GGML_TYPE_COUNT);
+        }
+    }
+
     if (params.reranking && params.embedding) {
         throw std::invalid_argument("error: either --embedding or --reranking can be specified, but not both");
     }
@@ -1338,6 +1381,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.ctx_shift = false;
         }
     ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER, LLAMA_EXAMPLE_IMATRIX, LLAMA_EXAMPLE_PERPLEXITY}).set_env("LLAMA_ARG_NO_CONTEXT_SHIFT"));
+    add_opt(common_arg(
+        {"--context-sinks"}, "N",
+        string_format("when the context of a slot is full, keep its first N tokens (attention sinks) and evict the oldest tokens\n"
+            "after them in small steps instead of discarding half of the context (default: %d, 0 = disabled)", params.n_ctx_sinks),
+        [](common_params & params, int value) {
+            params.n_ctx_sinks = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CONTEXT_SINKS"));
     add_opt(common_arg(
         {"--chunks"}, "N",
         string_format("max number of chunks to process (default: %d, -1 = all)", params.n_chunks),
@@ -1982,6 +2033,24 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cache_type_v = kv_cache_type_from_str(value);
         }
     ).set_env("LLAMA_ARG_CACHE_TYPE_V"));
+    add_opt(common_arg(
+        {"--cache-type-k-layers"}, "SPEC",
+        "per-layer KV cache data types for K, comma separated list of FIRST[-LAST]:TYPE\n"
+        "e.g. 0-1:f16,2-31:q4_0, the other layers use --cache-type-k\n"
+        "(see llama-perplexity --kv-calibrate)",
+        [](common_params & params, const std::string & value) {
+            params.cache_types_k_layer = kv_cache_types_from_spec(value);
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_K_LAYERS"));
+    add_opt(common_arg(
+        {"--cache-type-v-layers"}, "SPEC",
+        "per-layer KV cache data types for V, comma separated list of FIRST[-LAST]:TYPE\n"
+        "e.g. 0-1:f16,2-31:q4_0, the other layers use --cache-type-v\n"
+        "(see llama-perplexity --kv-calibrate)",
+        [](common_params & params, const std::string & value) {
+            params.cache_types_v_layer = kv_cache_types_from_spec(value);
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_V_LAYERS"));
     add_opt(common_arg(
         {"--perplexity", "--all-logits"},
         string_format("return logits for all tokens in the batch (default: %s)", params.logits_all ? "true" : "false"),
@@ -2038,6 +2107,21 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.kl_divergence = true;
         }
     ).set_examples({LLAMA_EXAMPLE_PERPLEXITY}));
+    add_opt(common_arg(
+        {"--kv-calibrate"},
+        "choose per-layer KV cache types: measures the perplexity increase from storing the K and V of each layer\n"
+        "in the --cache-type-k/--cache-type-v types, and keeps the most sensitive layers in f16",
+        [](common_params & params) {
+            params.kv_calibrate = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_PERPLEXITY}));
+    add_opt(common_arg(
+        {"--kv-calibrate-ppl"}, "P",
+        string_format("maximum increase of the perplexity in percent for --kv-calibrate (default: %.1f)", (double)params.kv_calibrate_ppl),
+        [](common_params & params, const std::string & value) {
+            params.kv_calibrate_ppl = std::stof(value);
+        }
+    ).set_examples({LLAMA_EXAMPLE_PERPLEXITY}));
     add_opt(common_arg(
         {"--save-all-logits", "--kl-divergence-base"}, "FNAME",
         "set logits file",
@@ -2066,6 +2150,16 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--kv-block-size"}, "N",
+        string_format("paged KV cache: allocate the cache in blocks of N cells per sequence, shared prefixes share blocks and no defragmentation is needed (default: %d, 0 = disabled)", params.kv_block_size),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -2658,6 +2752,43 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--kv-pool"},
+        string_format("share the KV cache between slots as a pool instead of splitting it into n_ctx / n_parallel per slot (default: %s)", params.kv_pool ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.kv_pool = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_POOL"));
+    add_opt(common_arg(
+        {"--ctx-size-slot"}, "N",
+        string_format("max context size of a single slot when using --kv-pool (default: %d, 0 = whole context)", params.n_ctx_slot),
+        [](common_params & params, int value) {
+            params.n_ctx_slot = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CTX_SIZE_SLOT"));
+    add_opt(common_arg(
+        {"--itl-target"}, "N",
+        string_format("target p99 inter-token latency in ms of generating slots: long prompts are processed in chunks between\n"
+            "their decode steps, sized to meet the target (default: %d, 0 = disabled)", params.itl_target_ms),
+        [](common_params & params, int value) {
+            params.itl_target_ms = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ITL_TARGET"));
+    add_opt(common_arg(
+        {"--defrag-idle"}, "N",
+        string_format("defragment the KV cache in short steps while the server is idle, for up to N ms per idle gap, when the\n"
+            "moves cost less than the gaps are expected to cost the attention of the next requests (default: %d, 0 = disabled)", params.defrag_idle_ms),
+        [](common_params & params, int value) {
+            params.defrag_idle_ms = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DEFRAG_IDLE"));
+    add_opt(common_arg(
+        {"--slot-prefix-share"},
+        string_format("reuse the longest prompt prefix cached in any slot by copying its KV cells instead of recomputing it (default: %s)", params.slot_prefix_share ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.slot_prefix_share = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_PREFIX_SHARE"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -2697,6 +2828,48 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--prompt-cache-dir"}, "PATH",
+        "directory for the on-disk prompt cache: the KV state of cached prompts that are dropped from a slot is written\n"
+        "here and restored for later prompts with the same prefix, also after a restart (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.prompt_cache_dir = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.prompt_cache_dir.empty() && params.prompt_cache_dir[params.prompt_cache_dir.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.prompt_cache_dir += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PROMPT_CACHE_DIR"));
+    add_opt(common_arg(
+        {"--prompt-cache-size"}, "N",
+        string_format("size of the on-disk prompt cache in MiB, least recently used prompts are removed beyond it (default: %d)", params.prompt_cache_size),
+        [](common_params & params, int value) {
+            params.prompt_cache_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PROMPT_CACHE_SIZE"));
+    add_opt(common_arg(
+        {"--prompt-cache-ram"}, "N",
+        string_format("size in MiB of the prompt cache tier in host memory: the KV state of prompts dropped from a slot is kept\n"
+            "here compressed and moved to the on-disk prompt cache (if enabled) when it is full (default: %d, 0 = disabled)", params.prompt_cache_ram),
+        [](common_params & params, int value) {
+            params.prompt_cache_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PROMPT_CACHE_RAM"));
+    add_opt(common_arg(
+        {"--response-cache"}, "N",
+        string_format("size in MiB of the in-memory cache of responses to deterministic requests: non-streamed completions\n"
+            "with greedy sampling, and embeddings (default: %d, 0 = disabled)", params.response_cache_size),
+        [](common_params & params, int value) {
+            params.response_cache_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RESPONSE_CACHE"));
+    add_opt(common_arg(
+        {"--response-cache-ttl"}, "N",
+        string_format("seconds until a cached response expires (default: %d, 0 = never)", params.response_cache_ttl),
+        [](common_params & params, int value) {
+            params.response_cache_ttl = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RESPONSE_CACHE_TTL"));
     add_opt(common_arg(
         {"--jinja"},
         "use jinja template for chat (default: disabled)",
@@ -3002,6 +3175,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.speculative.p_min = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_P_MIN"));
+    add_opt(common_arg(
+        {"--draft-batched"},
+        string_format("create the drafts of all generating slots with batched decodes of one shared draft context and verify them\n"
+            "in a single target decode; the draft length of each slot follows its acceptance rate (default: %s)", params.speculative.batched ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.speculative.batched = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_BATCHED"));
     add_opt(common_arg(
         {"-cd", "--ctx-size-draft"}, "N",
         string_format("size of the prompt context for the draft model (default: %d, 0 = loaded from model)", params.speculative.n_ctx),
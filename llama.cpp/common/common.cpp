@@ -1109,6 +1109,7 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.n_kv_block        = params.kv_block_size;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1123,6 +1124,9 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.type_k = params.cache_type_k;
     cparams.type_v = params.cache_type_v;
 
+    cparams.type_k_layer = params.cache_types_k_layer.empty() ? nullptr : params.cache_types_k_layer.data();
+    cparams.type_v_layer = params.cache_types_v_layer.empty() ? nullptr : params.cache_types_v_layer.data();
+
     return cparams;
 }
 
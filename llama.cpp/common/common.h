@@ -196,6 +196,7 @@ struct common_params_speculative {
     int32_t n_gpu_layers =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
     float   p_split      =  0.1f; // speculative decoding split probability
     float   p_min        = 0.75f; // minimum speculative decoding probability (greedy)
+    bool    batched      = false; // draft and verify for all slots in one batch each, adapting the draft length per slot
 
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
@@ -222,6 +223,7 @@ struct common_params {
     int32_t n_batch               =  2048; // logical batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_ubatch              =   512; // physical batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_keep                =     0; // number of tokens to keep from initial prompt
+    int32_t n_ctx_sinks           =     0; // tokens kept at the start of the context when it is shifted in small steps (0 = shift half)
     int32_t n_chunks              =    -1; // max number of chunks to process (-1 = unlimited)
     int32_t n_parallel            =     1; // number of parallel sequences to decode
     int32_t n_sequences           =     1; // number of sequences to decode
@@ -236,6 +238,7 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // paged KV cache block size (0 = disabled)
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -305,6 +308,9 @@ struct common_params {
 
     bool   kl_divergence    = false; // compute KL divergence
 
+    bool   kv_calibrate     = false; // choose the per-layer KV cache types by their effect on the perplexity
+    float  kv_calibrate_ppl = 1.0f;  // maximum increase of the perplexity in percent allowed by kv_calibrate
+
     bool usage             = false; // print usage
     bool completion        = false; // print source-able completion script
     bool use_color         = false; // use color to distinguish generations and inputs
@@ -338,6 +344,9 @@ struct common_params {
     ggml_type cache_type_k = GGML_TYPE_F16; // KV cache data type for the K
     ggml_type cache_type_v = GGML_TYPE_F16; // KV cache data type for the V
 
+    std::vector<ggml_type> cache_types_k_layer; // per-layer KV cache data types for the K, terminated by GGML_TYPE_COUNT
+    std::vector<ggml_type> cache_types_v_layer; // per-layer KV cache data types for the V, terminated by GGML_TYPE_COUNT
+
     common_conversation_mode conversation_mode = COMMON_CONVERSATION_MODE_AUTO;
 
     // multimodal models (see examples/llava)
@@ -357,6 +366,10 @@ struct common_params {
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t n_ctx_slot     = 0;            // max context per slot when the KV pool is shared (0 = n_ctx)
+    int32_t itl_target_ms  = 0;            // p99 inter-token latency target that bounds the prompt tokens per decode step (0 = disabled)
+    int32_t defrag_idle_ms = 0;            // time budget of the KV cache defragmentation in each idle gap of the server (0 = disabled)
+    bool    kv_pool        = false;        // slots draw KV cells from a shared pool instead of a fixed n_ctx / n_parallel split
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -379,8 +392,15 @@ struct common_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    std::string prompt_cache_dir;              // directory of the on-disk prompt cache (disabled if empty)
+    int32_t     prompt_cache_size      = 4096; // size budget of the on-disk prompt cache in MiB
+    int32_t     prompt_cache_ram       = 0;    // size budget of the compressed prompt cache in host memory in MiB (0 = disabled)
+
+    int32_t response_cache_size = 0;    // size budget of the cache of responses to deterministic requests in MiB (0 = disabled)
+    int32_t response_cache_ttl  = 3600; // seconds until a cached response expires (0 = never)
 
     float slot_prompt_similarity = 0.5f;
+    bool  slot_prefix_share      = false; // copy cached prompt prefixes between slots instead of recomputing them
 
     // batched-bench params
     bool is_pp_shared = false;
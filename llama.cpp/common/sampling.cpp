@@ -119,6 +119,8 @@ struct common_sampler {
 
         const int n_vocab = llama_vocab_n_tokens(vocab);
 
+        GGML_ASSERT(llama_n_logits(ctx) == n_vocab && "sampling needs the logits of the whole vocab, see llama_set_output_tokens");
+
         cur.resize(n_vocab);
 
         for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
@@ -433,6 +435,56 @@ llama_token_data_array * common_sampler_get_candidates(struct common_sampler * g
     return &gsmpl->cur_p;
 }
 
+std::vector<llama_token_data> common_top_n_probs(const float * logits, int32_t n_vocab, int32_t n, llama_token id, float * p_id) {
+    n = std::max(0, std::min(n, n_vocab));
+
+    // min-heap of the highest logits seen so far, at least one to find the maximum
+    const auto cmp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    const int32_t n_heap = std::max(n, 1);
+
+    std::vector<llama_token_data> top;
+    top.reserve(n_heap);
+
+    for (llama_token i = 0; i < n_vocab; i++) {
+        if ((int32_t) top.size() < n_heap) {
+            top.push_back({ i, logits[i], 0.0f });
+            std::push_heap(top.begin(), top.end(), cmp);
+        } else if (logits[i] > top.front().logit) {
+            std::pop_heap(top.begin(), top.end(), cmp);
+            top.back() = { i, logits[i], 0.0f };
+            std::push_heap(top.begin(), top.end(), cmp);
+        }
+    }
+
+    if (top.empty()) {
+        return top;
+    }
+
+    std::sort_heap(top.begin(), top.end(), cmp);
+
+    // log-sum-exp over the whole vocab, shifted by the maximum for stability
+    const float max_l = top[0].logit;
+
+    float sum = 0.0f;
+    for (int32_t i = 0; i < n_vocab; i++) {
+        sum += expf(logits[i] - max_l);
+    }
+
+    top.resize(n);
+    for (auto & cur : top) {
+        cur.p = expf(cur.logit - max_l) / sum;
+    }
+
+    if (p_id != nullptr && id >= 0 && id < n_vocab) {
+        *p_id = expf(logits[id] - max_l) / sum;
+    }
+
+    return top;
+}
+
 llama_token common_sampler_last(const struct common_sampler * gsmpl) {
     return gsmpl->prev.rat(0);
 }
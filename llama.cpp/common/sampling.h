@@ -88,6 +88,11 @@ uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl);
 // access the internal list of current candidate tokens
 llama_token_data_array * common_sampler_get_candidates(struct common_sampler * gsmpl);
 
+// the n tokens with the highest logits and their probabilities, sorted by decreasing probability
+// the top n are selected with a heap and the softmax is normalized in a single pass, the vocab is never sorted
+// if p_id is not null, it receives the probability of token id
+std::vector<llama_token_data> common_top_n_probs(const float * logits, int32_t n_vocab, int32_t n, llama_token id = LLAMA_TOKEN_NULL, float * p_id = nullptr);
+
 // get the last accepted token
 llama_token common_sampler_last(const struct common_sampler * gsmpl);
 
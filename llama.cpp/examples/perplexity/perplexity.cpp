@@ -1966,6 +1966,171 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
     LOG("Same top p: %6.3lf ± %5.3lf %%\n", 100.0*same_top_p, 100.0*sqrt(same_top_p*(1.0 - same_top_p)/(kld.count - 1)));
 }
 
+// comma separated list of FIRST[-LAST]:TYPE for --cache-type-k-layers/--cache-type-v-layers
+static std::string kv_types_to_spec(const std::vector<ggml_type> & types) {
+    std::string spec;
+    for (size_t i0 = 0; i0 < types.size(); ) {
+        size_t i1 = i0;
+        while (i1 + 1 < types.size() && types[i1 + 1] == types[i0]) {
+            ++i1;
+        }
+        spec += spec.empty() ? "" : ",";
+        spec += i1 == i0 ? std::to_string(i0) : std::to_string(i0) + "-" + std::to_string(i1);
+        spec += std::string(":") + ggml_type_name(types[i0]);
+        i0 = i1 + 1;
+    }
+    return spec;
+}
+
+// Choose the per-layer types of the KV cache
+//
+// The baseline is an f16 cache. Then the K and V of one layer at a time are stored in the --cache-type-k/--cache-type-v
+// types and the increase of the perplexity is measured. The least sensitive layers are quantized as long as the sum of
+// their increases stays within the budget, and the combination is checked: the increases of the layers do not add up
+// exactly, so the most sensitive of the quantized layers go back to f16 until the combination fits.
+// Returns false if the types cannot be calibrated or a measurement failed.
+static bool kv_calibrate(llama_model * model, const common_params & params, const int32_t n_ctx) {
+    const int n_layer = llama_model_n_layer(model);
+
+    const ggml_type type_k = params.cache_type_k;
+    const ggml_type type_v = params.cache_type_v;
+
+    if (type_k == GGML_TYPE_F16 && type_v == GGML_TYPE_F16) {
+        LOG_ERR("%s: set the types to try with --cache-type-k and --cache-type-v\n", __func__);
+        return false;
+    }
+
+    if (ggml_is_quantized(type_v) && !params.flash_attn) {
+        LOG_ERR("%s: V cache quantization requires flash attention (-fa)\n", __func__);
+        return false;
+    }
+
+    // perplexity with the layers in quant stored in the quantized types and the others in f16
+    auto eval = [&](const std::vector<bool> & quant) -> double {
+        common_params params_cur = params;
+
+        params_cur.logits_file.clear();
+        params_cur.cache_type_k = GGML_TYPE_F16;
+        params_cur.cache_type_v = GGML_TYPE_F16;
+        params_cur.cache_types_k_layer.clear();
+        params_cur.cache_types_v_layer.clear();
+        for (int il = 0; il < n_layer; ++il) {
+            params_cur.cache_types_k_layer.push_back(quant[il] ? type_k : GGML_TYPE_F16);
+            params_cur.cache_types_v_layer.push_back(quant[il] ? type_v : GGML_TYPE_F16);
+        }
+        params_cur.cache_types_k_layer.push_back(GGML_TYPE_COUNT);
+        params_cur.cache_types_v_layer.push_back(GGML_TYPE_COUNT);
+
+        llama_context * ctx = llama_init_from_model(model, common_context_params_to_llama(params_cur));
+        if (ctx == nullptr) {
+            LOG_ERR("%s: failed to create the context\n", __func__);
+            return -1.0;
+        }
+        if (!params_cur.lora_adapters.empty()) {
+            common_set_adapter_lora(ctx, params_cur.lora_adapters);
+        }
+
+        const double ppl = perplexity(ctx, params_cur, n_ctx).ppl_value;
+
+        llama_free(ctx);
+
+        return ppl;
+    };
+
+    LOG_INF("%s: measuring the perplexity of the f16 cache\n", __func__);
+
+    const double ppl_base = eval(std::vector<bool>(n_layer, false));
+    if (ppl_base <= 0.0) {
+        return false;
+    }
+
+    std::vector<double> delta(n_layer);
+    for (int il = 0; il < n_layer; ++il) {
+        LOG_INF("%s: measuring layer %d of %d in %s/%s\n", __func__, il + 1, n_layer, ggml_type_name(type_k), ggml_type_name(type_v));
+
+        std::vector<bool> quant(n_layer, false);
+        quant[il] = true;
+
+        const double ppl = eval(quant);
+        if (ppl <= 0.0) {
+            return false;
+        }
+        delta[il] = ppl/ppl_base - 1.0;
+    }
+
+    LOG("\n");
+    LOG("layer   delta PPL\n");
+    for (int il = 0; il < n_layer; ++il) {
+        LOG("%5d  %+8.4f%%\n", il, 100.0*delta[il]);
+    }
+    LOG("\n");
+
+    std::vector<int> order(n_layer);
+    for (int il = 0; il < n_layer; ++il) {
+        order[il] = il;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return delta[a] < delta[b]; });
+
+    const double budget = params.kv_calibrate_ppl/100.0;
+
+    std::vector<bool> quant(n_layer, false);
+    int n_quant = 0;
+
+    double sum = 0.0;
+    for (int il : order) {
+        sum += std::max(0.0, delta[il]);
+        if (sum > budget) {
+            break;
+        }
+        quant[il] = true;
+        n_quant++;
+    }
+
+    double ppl = ppl_base;
+    while (n_quant > 0) {
+        LOG_INF("%s: checking %d quantized layers\n", __func__, n_quant);
+
+        ppl = eval(quant);
+        if (ppl <= 0.0) {
+            return false;
+        }
+        if (ppl/ppl_base - 1.0 <= budget) {
+            break;
+        }
+
+        // back to f16 for the most sensitive quantized layer
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            if (quant[*it]) {
+                quant[*it] = false;
+                n_quant--;
+                break;
+            }
+        }
+        ppl = ppl_base;
+    }
+
+    std::vector<ggml_type> types_k(n_layer);
+    std::vector<ggml_type> types_v(n_layer);
+
+    // bytes per element relative to f16, assuming layers of the same size
+    double size_rel = 0.0;
+    for (int il = 0; il < n_layer; ++il) {
+        types_k[il] = quant[il] ? type_k : GGML_TYPE_F16;
+        types_v[il] = quant[il] ? type_v : GGML_TYPE_F16;
+
+        for (ggml_type type : { types_k[il], types_v[il] }) {
+            size_rel += (double) ggml_type_size(type)/ggml_blck_size(type)/ggml_type_size(GGML_TYPE_F16)/(2*n_layer);
+        }
+    }
+
+    LOG("%d of %d layers in %s/%s, PPL = %.4f (f16: %.4f, %+.4f%%), KV cache size %.1f%% of f16\n",
+            n_quant, n_layer, ggml_type_name(type_k), ggml_type_name(type_v), ppl, ppl_base, 100.0*(ppl/ppl_base - 1.0), 100.0*size_rel);
+    LOG("\n");
+    LOG("--cache-type-k-layers %s --cache-type-v-layers %s\n", kv_types_to_spec(types_k).c_str(), kv_types_to_spec(types_v).c_str());
+
+    return true;
+}
+
 int main(int argc, char ** argv) {
     common_params params;
 
@@ -1988,6 +2153,11 @@ int main(int argc, char ** argv) {
 
     const bool ppl = !params.hellaswag && !params.winogrande && !params.multiple_choice && !params.kl_divergence;
 
+    if (params.kv_calibrate && !ppl) {
+        LOG_ERR("%s: --kv-calibrate measures the perplexity and cannot be combined with the other scores\n", __func__);
+        return 1;
+    }
+
     if (ppl) {
         const int32_t n_seq = std::max(1, params.n_batch / n_ctx);
         const int32_t n_kv = n_seq * n_ctx;
@@ -2015,6 +2185,34 @@ int main(int argc, char ** argv) {
     llama_backend_init();
     llama_numa_init(params.numa);
 
+    // the calibration creates a context of its own for each measurement, the main context would only take up memory
+    if (params.kv_calibrate) {
+        llama_model_ptr model(llama_model_load_from_file(params.model.path.c_str(), common_model_params_to_llama(params)));
+        if (!model) {
+            LOG_ERR("%s: unable to load model\n", __func__);
+            return 1;
+        }
+
+        std::vector<llama_adapter_lora_ptr> lora;
+        for (auto & la : params.lora_adapters) {
+            lora.emplace_back(llama_adapter_lora_init(model.get(), la.path.c_str()));
+            if (lora.back() == nullptr) {
+                LOG_ERR("%s: failed to apply lora adapter '%s'\n", __func__, la.path.c_str());
+                return 1;
+            }
+            la.ptr = lora.back().get();
+        }
+
+        const bool ok = kv_calibrate(model.get(), params, n_ctx);
+
+        lora.clear();
+        model.reset();
+
+        llama_backend_free();
+
+        return ok ? 0 : 1;
+    }
+
     // load the model and apply lora adapter, if any
     common_init_result llama_init = common_init_from_params(params);
 
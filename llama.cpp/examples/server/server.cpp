@@ -24,17 +24,33 @@
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <signal.h>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using json = nlohmann::ordered_json;
 
 constexpr int HTTP_POLLING_SECONDS = 1;
 
+// tokens evicted by a context shift with --context-sinks
+constexpr int CONTEXT_SINKS_STEP = 16;
+
 enum stop_type {
     STOP_TYPE_NONE,
     STOP_TYPE_EOS,
@@ -70,6 +86,18 @@ enum server_task_type {
     SERVER_TASK_TYPE_SET_LORA,
 };
 
+// priority classes of the tasks that wait for a slot, they share the released slots in proportion to their weights
+enum server_task_priority {
+    SERVER_TASK_PRIORITY_INTERACTIVE,
+    SERVER_TASK_PRIORITY_NORMAL,
+    SERVER_TASK_PRIORITY_BATCH,
+    SERVER_TASK_PRIORITY_COUNT,
+};
+
+static const char * server_task_priority_names[SERVER_TASK_PRIORITY_COUNT] = { "interactive", "normal", "batch" };
+
+static const double server_task_priority_weights[SERVER_TASK_PRIORITY_COUNT] = { 8.0, 4.0, 1.0 };
+
 enum oaicompat_type {
     OAICOMPAT_TYPE_NONE,
     OAICOMPAT_TYPE_CHAT,
@@ -186,6 +214,39 @@ struct slot_params {
     }
 };
 
+// how a task is scheduled while it waits for a slot
+struct server_task_sched {
+    server_task_priority priority = SERVER_TASK_PRIORITY_NORMAL;
+
+    std::string tenant; // the tenants of a priority class get equal shares of its slots
+
+    int64_t t_queued    = 0; // when the task was posted, in us
+    int32_t deadline_ms = 0; // the task is rejected if its first token cannot be produced in time (0 = no deadline)
+};
+
+// time that the tasks of a priority class waited for a slot, exported as a prometheus histogram
+struct server_queue_wait_histogram {
+    // upper bounds of the buckets in seconds, the last bucket is +Inf
+    static constexpr double buckets[] = { 0.01, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0 };
+    static constexpr size_t n_buckets = sizeof(buckets) / sizeof(buckets[0]);
+
+    uint64_t counts[n_buckets + 1] = {}; // per bucket, not cumulative
+
+    uint64_t count = 0;
+    double   sum   = 0.0;
+
+    void observe(double t_wait_s) {
+        size_t i = 0;
+        while (i < n_buckets && t_wait_s > buckets[i]) {
+            i++;
+        }
+
+        counts[i]++;
+        count++;
+        sum += t_wait_s;
+    }
+};
+
 struct server_task {
     int id    = -1; // to be filled by server_queue
     int index = -1; // used when there are multiple prompts (batch request)
@@ -200,6 +261,8 @@ struct server_task {
     llama_tokens prompt_tokens;
     int id_selected_slot = -1;
 
+    server_task_sched sched;
+
     // used by SERVER_TASK_TYPE_SLOT_SAVE, SERVER_TASK_TYPE_SLOT_RESTORE, SERVER_TASK_TYPE_SLOT_ERASE
     struct slot_action {
         int slot_id;
@@ -470,6 +533,41 @@ struct server_task {
     }
 
     // utility function
+    // the tenant is the API key of the request, or the X-Tenant-Id header if it is set
+    static server_task_sched sched_from_request(
+            const httplib::Request & req,
+            const json & data,
+            server_task_priority priority_default) {
+        server_task_sched sched;
+
+        sched.priority = priority_default;
+        if (data.contains("priority")) {
+            const std::string name = data.at("priority");
+
+            auto it = std::find(std::begin(server_task_priority_names), std::end(server_task_priority_names), name);
+            if (it == std::end(server_task_priority_names)) {
+                throw std::runtime_error("\"priority\" must be one of \"interactive\", \"normal\" or \"batch\"");
+            }
+            sched.priority = (server_task_priority) (it - std::begin(server_task_priority_names));
+        }
+
+        sched.tenant = req.get_header_value("X-Tenant-Id");
+        if (sched.tenant.empty()) {
+            const std::string auth_header = req.get_header_value("Authorization");
+            const std::string prefix      = "Bearer ";
+            if (auth_header.substr(0, prefix.size()) == prefix) {
+                sched.tenant = auth_header.substr(prefix.size());
+            }
+        }
+
+        sched.deadline_ms = json_value(data, "deadline_ms", 0);
+        if (sched.deadline_ms < 0) {
+            throw std::runtime_error("\"deadline_ms\" must be positive");
+        }
+
+        return sched;
+    }
+
     static std::unordered_set<int> get_list_id(const std::vector<server_task> & tasks) {
         std::unordered_set<int> ids(tasks.size());
         for (size_t i = 0; i < tasks.size(); i++) {
@@ -531,6 +629,11 @@ struct server_task_result {
         return -1;
     }
     virtual json to_json() = 0;
+    // append the result to buf as server-sent events without building json
+    // returns false if this result has no such fast path, then the events are created from to_json()
+    virtual bool to_sse(std::string & /* buf */) {
+        return false;
+    }
     virtual ~server_task_result() = default;
 };
 
@@ -891,6 +994,96 @@ struct server_task_result_cmpl_partial : server_task_result {
         }
     }
 
+    // the common chunk that only carries the new text: it has a fixed layout and can be written directly
+    bool is_plain_chunk() const {
+        return prob_output.probs.empty() && timings.prompt_n < 0 && !verbose && !(oaicompat == OAICOMPAT_TYPE_CHAT && n_decoded == 0);
+    }
+
+    // append the text of the next chunk of the same task, used when the client reads slower than the tokens are generated
+    bool merge(const server_task_result_cmpl_partial & next) {
+        if (next.id != id || !is_plain_chunk() || !next.is_plain_chunk()) {
+            return false;
+        }
+
+        content += next.content;
+        tokens.insert(tokens.end(), next.tokens.begin(), next.tokens.end());
+        n_decoded = next.n_decoded;
+
+        return true;
+    }
+
+    // same output as to_json() followed by server_sent_event()
+    virtual bool to_sse(std::string & buf) override {
+        if (!is_plain_chunk()) {
+            return false;
+        }
+
+        const size_t n0 = buf.size();
+        bool ok = true;
+
+        switch (oaicompat) {
+            case OAICOMPAT_TYPE_NONE:
+                {
+                    buf += "data: {\"index\":";
+                    sse_append_int(buf, index);
+                    buf += ",\"content\":";
+                    ok = ok && sse_append_json_string(buf, content);
+                    buf += ",\"tokens\":[";
+                    for (size_t i = 0; i < tokens.size(); ++i) {
+                        if (i > 0) {
+                            buf += ',';
+                        }
+                        sse_append_int(buf, tokens[i]);
+                    }
+                    buf += "],\"stop\":false,\"id_slot\":";
+                    sse_append_int(buf, id_slot);
+                    buf += ",\"tokens_predicted\":";
+                    sse_append_int(buf, n_decoded);
+                    buf += ",\"tokens_evaluated\":";
+                    sse_append_int(buf, n_prompt_tokens);
+                    buf += "}\n\n";
+                } break;
+            case OAICOMPAT_TYPE_COMPLETION:
+                {
+                    buf += "data: {\"choices\":[{\"text\":";
+                    ok = ok && sse_append_json_string(buf, content);
+                    buf += ",\"index\":";
+                    sse_append_int(buf, index);
+                    buf += ",\"logprobs\":null,\"finish_reason\":null}],\"created\":";
+                    sse_append_int(buf, (int64_t) std::time(0));
+                    buf += ",\"model\":";
+                    ok = ok && sse_append_json_string(buf, oaicompat_model);
+                    buf += ",\"system_fingerprint\":";
+                    ok = ok && sse_append_json_string(buf, build_info);
+                    buf += ",\"object\":\"text_completion\",\"id\":";
+                    ok = ok && sse_append_json_string(buf, oaicompat_cmpl_id);
+                    buf += "}\n\n";
+                } break;
+            case OAICOMPAT_TYPE_CHAT:
+                {
+                    buf += "data: {\"choices\":[{\"finish_reason\":null,\"index\":0,\"delta\":{\"content\":";
+                    ok = ok && sse_append_json_string(buf, content);
+                    buf += "}}],\"created\":";
+                    sse_append_int(buf, (int64_t) std::time(0));
+                    buf += ",\"id\":";
+                    ok = ok && sse_append_json_string(buf, oaicompat_cmpl_id);
+                    buf += ",\"model\":";
+                    ok = ok && sse_append_json_string(buf, oaicompat_model);
+                    buf += ",\"system_fingerprint\":";
+                    ok = ok && sse_append_json_string(buf, build_info);
+                    buf += ",\"object\":\"chat.completion.chunk\"}\n\n";
+                } break;
+            default:
+                GGML_ASSERT(false && "Invalid oaicompat_type");
+        }
+
+        if (!ok) {
+            buf.resize(n0);
+        }
+
+        return ok;
+    }
+
     json to_json_non_oaicompat() {
         // non-OAI-compat JSON
         json res = json {
@@ -1152,6 +1345,15 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_defrag_cells_total = 0;
+    uint64_t t_defrag_us_total    = 0;
+
+    float kv_cache_fragmentation = 0.0f;
+
+    server_queue_wait_histogram queue_wait[SERVER_TASK_PRIORITY_COUNT];
+
+    uint64_t n_rejected_deadline[SERVER_TASK_PRIORITY_COUNT] = {};
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -1176,8 +1378,12 @@ struct server_task_result_metrics : server_task_result {
             { "n_decode_total",                  n_decode_total },
             { "n_busy_slots_total",              n_busy_slots_total },
 
+            { "n_defrag_cells_total",            n_defrag_cells_total },
+            { "t_defrag_us_total",               t_defrag_us_total },
+
             { "kv_cache_tokens_count",           kv_cache_tokens_count },
             { "kv_cache_used_cells",             kv_cache_used_cells },
+            { "kv_cache_fragmentation",          kv_cache_fragmentation },
 
             { "slots",                           slots_data },
         };
@@ -1234,444 +1440,1541 @@ struct server_task_result_apply_lora : server_task_result {
     }
 };
 
-struct server_slot {
-    int id;
-    int id_task = -1;
-
-    // only used for completion/embedding/infill/rerank
-    server_task_type task_type = SERVER_TASK_TYPE_COMPLETION;
+// radix tree of the token prefixes that are cached in the KV cache of the slots
+// used to find the slot that holds the longest prefix of a new prompt, so that it can be copied instead of recomputed
+// (also indexes the prompts of the on-disk prompt cache, with the ids of its entries in place of slot ids)
+struct server_prefix_tree {
+    struct node {
+        llama_tokens tokens; // edge from the parent node
 
-    llama_batch batch_spec = {};
+        std::map<llama_token, std::unique_ptr<node>> children; // indexed by the first token of their edge
 
-    llama_context * ctx = nullptr;
-    llama_context * ctx_dft = nullptr;
+        std::set<int> id_slots; // slots that cache at least all tokens up to the end of this node
+    };
 
-    common_speculative * spec = nullptr;
+    node root;
 
-    std::vector<common_adapter_lora_info> lora;
+    // tokens cached by each slot in the tree
+    std::unordered_map<int, llama_tokens> cached;
 
-    // the index relative to completion multi-task request
-    size_t index = 0;
+    void insert(int id_slot, const llama_tokens & tokens) {
+        remove(id_slot);
 
-    struct slot_params params;
+        if (tokens.empty()) {
+            return;
+        }
 
-    slot_state state = SLOT_STATE_IDLE;
+        cached[id_slot] = tokens;
 
-    // used to determine the slot that has been used the longest
-    int64_t t_last_used = -1;
+        node * cur = &root;
+        size_t i   = 0;
 
-    // generation props
-    int32_t n_ctx       = 0;  // context size per slot
-    int32_t n_past      = 0;
-    int32_t n_decoded   = 0;
-    int32_t n_remaining = -1;
-    int32_t i_batch     = -1;
-    int32_t n_predict   = -1; // TODO: disambiguate from params.n_predict
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto child = std::make_unique<node>();
+                child->tokens.assign(tokens.begin() + i, tokens.end());
+                child->id_slots.insert(id_slot);
+                cur->children[tokens[i]] = std::move(child);
+                return;
+            }
 
-    // n_prompt_tokens may not be equal to prompt_tokens.size(), because prompt maybe truncated
-    int32_t n_prompt_tokens           = 0;
-    int32_t n_prompt_tokens_processed = 0;
+            node * child = it->second.get();
 
-    // input prompt tokens
-    llama_tokens prompt_tokens;
+            const size_t n_match = match(*child, tokens, i);
+            if (n_match < child->tokens.size()) {
+                split(*child, n_match);
+            }
 
-    size_t last_nl_pos = 0;
+            child->id_slots.insert(id_slot);
 
-    std::string  generated_text;
-    llama_tokens generated_tokens;
+            i  += n_match;
+            cur = child;
+        }
+    }
 
-    llama_tokens cache_tokens;
+    void remove(int id_slot) {
+        auto it_cached = cached.find(id_slot);
+        if (it_cached == cached.end()) {
+            return;
+        }
 
-    std::vector<completion_token_output> generated_token_probs;
+        const llama_tokens & tokens = it_cached->second;
 
-    bool has_next_token = true;
-    bool has_new_line   = false;
-    bool truncated      = false;
-    stop_type stop;
+        node * cur = &root;
+        size_t i   = 0;
 
-    std::string stopping_word;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            GGML_ASSERT(it != cur->children.end());
 
-    // sampling
-    json json_schema;
+            node * child = it->second.get();
+            child->id_slots.erase(id_slot);
 
-    struct common_sampler * smpl = nullptr;
+            if (child->id_slots.empty()) {
+                // no other slot passes through here, so the whole subtree is unused
+                cur->children.erase(it);
+                break;
+            }
 
-    llama_token sampled;
+            i  += child->tokens.size();
+            cur = child;
+        }
 
-    common_chat_format chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+        cached.erase(it_cached);
+    }
 
-    // stats
-    size_t n_sent_text        = 0; // number of sent text character
+    void clear() {
+        root.children.clear();
+        cached.clear();
+    }
 
-    int64_t t_start_process_prompt;
-    int64_t t_start_generation;
+    // length of the longest prefix of tokens that is cached by a slot accepted by the filter
+    size_t find(const llama_tokens & tokens, const std::function<bool(int)> & filter, int & id_slot) const {
+        size_t n_best = 0;
+        id_slot = -1;
 
-    double t_prompt_processing; // ms
-    double t_token_generation;  // ms
+        const node * cur = &root;
+        size_t i = 0;
 
-    std::function<void(int)> callback_on_release;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
 
-    // Speculative decoding stats
-    int32_t n_draft_total = 0;      // Total draft tokens generated
-    int32_t n_draft_accepted = 0;   // Draft tokens actually accepted
+            const node * child = it->second.get();
 
-    void reset() {
-        SLT_DBG(*this, "%s", "\n");
+            // the slots in a node share all of its tokens, so any of them can be used
+            int id = -1;
+            for (int id_candidate : child->id_slots) {
+                if (filter(id_candidate)) {
+                    id = id_candidate;
+                    break;
+                }
+            }
+            if (id == -1) {
+                break;
+            }
 
-        n_prompt_tokens    = 0;
-        last_nl_pos        = 0;
-        generated_text     = "";
-        has_new_line       = false;
-        truncated          = false;
-        stop               = STOP_TYPE_NONE;
-        stopping_word      = "";
-        n_past             = 0;
-        n_sent_text        = 0;
-        task_type          = SERVER_TASK_TYPE_COMPLETION;
+            const size_t n_match = match(*child, tokens, i);
 
-        generated_tokens.clear();
-        generated_token_probs.clear();
+            i += n_match;
+            n_best  = i;
+            id_slot = id;
 
-        // clear speculative decoding stats
-        n_draft_total = 0;
-        n_draft_accepted = 0;
-    }
+            if (n_match < child->tokens.size()) {
+                break;
+            }
 
-    bool is_non_causal() const {
-        return task_type == SERVER_TASK_TYPE_EMBEDDING || task_type == SERVER_TASK_TYPE_RERANK;
-    }
+            cur = child;
+        }
 
-    bool can_batch_with(server_slot & other_slot) const {
-        return is_non_causal() == other_slot.is_non_causal()
-            && are_lora_equal(lora, other_slot.lora);
+        return n_best;
     }
 
-    bool has_budget(const common_params & global_params) {
-        if (params.n_predict == -1 && global_params.n_predict == -1) {
-            return true; // limitless
+private:
+    static size_t match(const node & nd, const llama_tokens & tokens, size_t i) {
+        size_t n = 0;
+        while (n < nd.tokens.size() && i + n < tokens.size() && nd.tokens[n] == tokens[i + n]) {
+            n++;
         }
+        return n;
+    }
 
-        n_remaining = -1;
-
-        if (params.n_predict != -1) {
-            n_remaining = params.n_predict - n_decoded;
-        } else if (global_params.n_predict != -1) {
-            n_remaining = global_params.n_predict - n_decoded;
-        }
+    // split the edge of a node after n tokens, the rest moves into a new child
+    static void split(node & nd, size_t n) {
+        auto tail = std::make_unique<node>();
+        tail->tokens.assign(nd.tokens.begin() + n, nd.tokens.end());
+        tail->children = std::move(nd.children);
+        tail->id_slots = nd.id_slots;
 
-        return n_remaining > 0; // no budget
+        nd.tokens.resize(n);
+        nd.children.clear();
+        nd.children[tail->tokens[0]] = std::move(tail);
     }
+};
 
-    bool is_processing() const {
-        return state != SLOT_STATE_IDLE;
-    }
+// read-only mapping of a file, so that the KV state in the files of the prompt cache is copied to the KV cache straight
+// from the page cache
+struct server_mapped_file {
+    const uint8_t * data = nullptr;
+    size_t          size = 0;
 
-    bool can_speculate() const {
-        return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
-    }
+    void * addr = nullptr;
 
-    void add_token(const completion_token_output & token) {
-        if (!is_processing()) {
-            SLT_WRN(*this, "%s", "slot is not processing\n");
+#if defined(_WIN32)
+    HANDLE h_file    = INVALID_HANDLE_VALUE;
+    HANDLE h_mapping = NULL;
+#endif
+
+    server_mapped_file(const std::string & fname) {
+#if defined(_WIN32)
+        h_file = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        LARGE_INTEGER n;
+        if (h_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(h_file, &n) || n.QuadPart == 0) {
             return;
         }
-        generated_token_probs.push_back(token);
+        h_mapping = CreateFileMappingA(h_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (h_mapping == NULL) {
+            return;
+        }
+        addr = MapViewOfFile(h_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (addr != NULL) {
+            data = (const uint8_t *) addr;
+            size = (size_t) n.QuadPart;
+        }
+#else
+        const int fd = open(fname.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void * ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED) {
+                addr = ptr;
+                // the state is read once from start to end
+                posix_madvise(addr, st.st_size, POSIX_MADV_SEQUENTIAL);
+                data = (const uint8_t *) addr;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#endif
     }
 
-    void release() {
-        if (is_processing()) {
-            SLT_INF(*this, "stop processing: n_past = %d, truncated = %d\n", n_past, truncated);
-
-            t_last_used = ggml_time_us();
-            t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
-            state = SLOT_STATE_IDLE;
-            callback_on_release(id);
+    ~server_mapped_file() {
+#if defined(_WIN32)
+        if (addr != NULL) {
+            UnmapViewOfFile(addr);
+        }
+        if (h_mapping != NULL) {
+            CloseHandle(h_mapping);
+        }
+        if (h_file != INVALID_HANDLE_VALUE) {
+            CloseHandle(h_file);
+        }
+#else
+        if (addr != nullptr) {
+            munmap(addr, size);
         }
+#endif
     }
 
-    result_timings get_timings() const {
-        result_timings timings;
-        timings.prompt_n = n_prompt_tokens_processed;
-        timings.prompt_ms = t_prompt_processing;
-        timings.prompt_per_token_ms = t_prompt_processing / n_prompt_tokens_processed;
-        timings.prompt_per_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+    server_mapped_file(const server_mapped_file &) = delete;
+    server_mapped_file & operator=(const server_mapped_file &) = delete;
+};
 
-        timings.predicted_n = n_decoded;
-        timings.predicted_ms = t_token_generation;
-        timings.predicted_per_token_ms = t_token_generation / n_decoded;
-        timings.predicted_per_second = 1e3 / t_token_generation * n_decoded;
+// tiers of the prompt cache (--prompt-cache-ram, --prompt-cache-dir)
+// the KV state of a cached prompt that is about to be dropped from a slot is kept compressed in host memory, or written
+// to a file named after a hash of its tokens, and restored when a later prompt shares a long enough prefix with it.
+// the least recently used entries of the memory tier are moved to the disk tier when it grows beyond its size budget.
+// the files outlive the server, the least recently used ones are deleted when the directory grows beyond its budget
+struct server_prompt_cache {
+    // shorter prompts are cheaper to recompute than to read back from disk
+    static constexpr size_t n_tokens_min = 64;
 
-        // Add speculative metrics
-        if (n_draft_total > 0) {
-            timings.draft_n = n_draft_total;
-            timings.draft_n_accepted = n_draft_accepted;
+    struct entry {
+        int    id       = 0; // in the prefix tree
+        size_t n_tokens = 0;
+        size_t n_bytes  = 0;
+
+        std::filesystem::file_time_type t_last_used;
+
+        // packed and compressed KV state of the entries in memory, empty for the ones on disk
+        std::vector<uint8_t> data;
+
+        bool in_ram() const {
+            return !data.empty();
         }
+    };
 
-        return timings;
-    }
+    std::string dir;
 
-    size_t find_stopping_strings(const std::string & text, const size_t last_token_size, bool is_full_stop) {
-        size_t stop_pos = std::string::npos;
+    size_t n_bytes_max = 0;
+    size_t n_bytes     = 0;
 
-        for (const std::string & word : params.antiprompt) {
-            size_t pos;
+    size_t n_bytes_ram_max = 0;
+    size_t n_bytes_ram     = 0;
 
-            if (is_full_stop) {
-                const size_t tmp      = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
+    // hash of the model and the KV cache settings, files written by other configurations never match a prompt
+    uint64_t seed = 0;
 
-                pos = text.find(word, from_pos);
-            } else {
-                // otherwise, partial stop
-                pos = find_partial_stop_string(word, text);
-            }
+    std::unordered_map<uint64_t, entry> entries; // indexed by the hash of their tokens
 
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
-                if (is_full_stop) {
-                    stop           = STOP_TYPE_WORD;
-                    stopping_word  = word;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
+    // the tokens of the entries, to find the one sharing the longest prefix with a prompt
+    server_prefix_tree tree;
+
+    std::unordered_map<int, uint64_t> hash_by_id;
+
+    int id_next = 0;
+
+    bool enabled() const {
+        return !dir.empty() || n_bytes_ram_max > 0;
+    }
+
+    void init_ram(size_t n_bytes_ram_max_, const std::string & fingerprint) {
+        n_bytes_ram_max = n_bytes_ram_max_;
+        seed            = hash_bytes(FNV_OFFSET, fingerprint.data(), fingerprint.size());
+    }
+
+    // index the files left in the directory by previous runs
+    bool init(const std::string & dir_, size_t n_bytes_max_, const std::string & fingerprint) {
+        if (!fs_create_directory_with_parents(dir_)) {
+            return false;
+        }
+
+        dir         = dir_;
+        n_bytes_max = n_bytes_max_;
+        seed        = hash_bytes(FNV_OFFSET, fingerprint.data(), fingerprint.size());
+
+        std::error_code ec;
+        for (const auto & file : std::filesystem::directory_iterator(dir, ec)) {
+            if (!file.is_regular_file(ec) || file.path().extension() != ".bin") {
+                continue;
+            }
+
+            const size_t n_file_bytes = file.file_size(ec);
+
+            llama_tokens tokens;
+            if (ec || !read_tokens(file.path().string(), n_file_bytes, tokens)) {
+                continue;
+            }
+
+            const uint64_t h = hash(tokens.data(), tokens.size());
+            if (file.path().string() != path(h)) {
+                continue;
             }
+
+            add(h, tokens, n_file_bytes, file.last_write_time(ec));
         }
 
-        return stop_pos;
+        evict();
+
+        return true;
     }
 
-    void print_timings() const {
-        const double t_prompt        =       t_prompt_processing / n_prompt_tokens_processed;
-        const double n_prompt_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+    std::string path(uint64_t h) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%016" PRIx64 ".bin", h);
+        return dir + name;
+    }
 
-        const double t_gen        =       t_token_generation / n_decoded;
-        const double n_gen_second = 1e3 / t_token_generation * n_decoded;
+    uint64_t hash(const llama_token * tokens, size_t n) const {
+        return hash_bytes(seed, tokens, n * sizeof(llama_token));
+    }
 
-        SLT_INF(*this,
-                "\n"
-                "prompt eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
-                "       eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
-                "      total time = %10.2f ms / %5d tokens\n",
-                t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
-                t_token_generation, n_decoded, t_gen, n_gen_second,
-                t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+    bool contains(uint64_t h) const {
+        return entries.find(h) != entries.end();
+    }
 
-        if (n_draft_total > 0) {
-            const float draft_ratio = (float) n_draft_accepted / n_draft_total;
-            SLT_INF(*this,
-                    "\n"
-                    "draft acceptance rate = %0.5f (%5d accepted / %5d generated)\n",
-                    draft_ratio, n_draft_accepted, n_draft_total
-            );
+    // length of the longest prefix of tokens that is shared with a cached prompt, and the hash of its file
+    size_t find(const llama_tokens & tokens, uint64_t & h_best) const {
+        int id = -1;
+        const size_t n_best = tree.find(tokens, [](int) { return true; }, id);
+
+        if (n_best > 0) {
+            h_best = hash_by_id.at(id);
         }
-    }
 
-    json to_json() const {
-        return json {
-            {"id",            id},
-            {"id_task",       id_task},
-            {"n_ctx",         n_ctx},
-            {"speculative",   can_speculate()},
-            {"is_processing", is_processing()},
-            {"non_causal",    is_non_causal()},
-            {"params",        params.to_json()},
-            {"prompt",        common_detokenize(ctx, prompt_tokens)},
-            {"next_token",
-                {
-                    {"has_next_token", has_next_token},
-                    {"has_new_line",   has_new_line},
-                    {"n_remain",       n_remaining},
-                    {"n_decoded",      n_decoded},
-                    {"stopping_word",  stopping_word},
-                }
-            },
-        };
+        return n_best;
     }
-};
 
-struct server_metrics {
-    int64_t t_start = 0;
+    // add an entry on disk, or in memory if data is not empty
+    void add(uint64_t h, const llama_tokens & tokens, size_t n_entry_bytes, std::filesystem::file_time_type t_last_used, std::vector<uint8_t> data = {}) {
+        const int id = id_next++;
 
-    uint64_t n_prompt_tokens_processed_total = 0;
-    uint64_t t_prompt_processing_total       = 0;
-    uint64_t n_tokens_predicted_total        = 0;
-    uint64_t t_tokens_generation_total       = 0;
+        entry & e = entries[h];
+        e = { id, tokens.size(), n_entry_bytes, t_last_used, std::move(data) };
+        hash_by_id[id] = h;
+        tree.insert(id, tokens);
+        if (e.in_ram()) {
+            n_bytes_ram += e.data.size();
+        } else {
+            n_bytes += n_entry_bytes;
+        }
+    }
 
-    uint64_t n_prompt_tokens_processed = 0;
-    uint64_t t_prompt_processing       = 0;
+    void remove(uint64_t h) {
+        auto it = entries.find(h);
+        if (it == entries.end()) {
+            return;
+        }
 
-    uint64_t n_tokens_predicted  = 0;
-    uint64_t t_tokens_generation = 0;
+        const bool in_ram = it->second.in_ram();
 
-    uint64_t n_decode_total     = 0;
-    uint64_t n_busy_slots_total = 0;
+        tree.remove(it->second.id);
+        hash_by_id.erase(it->second.id);
+        if (in_ram) {
+            n_bytes_ram -= it->second.data.size();
+        } else {
+            n_bytes -= it->second.n_bytes;
+        }
+        entries.erase(it);
 
-    void init() {
-        t_start = ggml_time_us();
+        if (!in_ram) {
+            std::error_code ec;
+            std::filesystem::remove(path(h), ec);
+        }
     }
 
-    void on_prompt_eval(const server_slot & slot) {
-        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
-        n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
-        t_prompt_processing             += slot.t_prompt_processing;
-        t_prompt_processing_total       += slot.t_prompt_processing;
+    // the modification time of the files keeps the LRU order across restarts
+    void touch(uint64_t h) {
+        auto it = entries.find(h);
+        if (it == entries.end()) {
+            return;
+        }
+
+        it->second.t_last_used = std::filesystem::file_time_type::clock::now();
+
+        if (!it->second.in_ram()) {
+            std::error_code ec;
+            std::filesystem::last_write_time(path(h), it->second.t_last_used, ec);
+        }
     }
 
-    void on_prediction(const server_slot & slot) {
-        n_tokens_predicted_total   += slot.n_decoded;
-        n_tokens_predicted         += slot.n_decoded;
-        t_tokens_generation        += slot.t_token_generation;
-        t_tokens_generation_total  += slot.t_token_generation;
+    // move an entry from memory to disk, in the format of llama_state_seq_save_file
+    // the packed state is written as it is, it stays compressed on disk
+    bool spill(uint64_t h) {
+        entry & e = entries.at(h);
+
+        if (dir.empty()) {
+            return false;
+        }
+
+        const llama_tokens & tokens = tree.cached.at(e.id);
+
+        const size_t n_file_bytes = write_file(path(h), tokens, e.data);
+        if (n_file_bytes == 0) {
+            return false;
+        }
+
+        std::error_code ec;
+        std::filesystem::last_write_time(path(h), e.t_last_used, ec);
+
+        n_bytes_ram -= e.data.size();
+        e.n_bytes = n_file_bytes;
+        e.data    = {};
+        n_bytes  += e.n_bytes;
+
+        return true;
     }
 
-    void on_decoded(const std::vector<server_slot> & slots) {
-        n_decode_total++;
-        for (const auto & slot : slots) {
-            if (slot.is_processing()) {
-                n_busy_slots_total++;
+    // write a packed state in the format of llama_state_seq_save_file, returns the size of the file or 0 on failure
+    // it does not touch the entries, so it can run on the thread of server_prompt_cache_writer
+    static size_t write_file(const std::string & filepath, const llama_tokens & tokens, const std::vector<uint8_t> & data) {
+        // write to a temporary file first, so that an interrupted write never leaves a truncated entry behind
+        const std::string filepath_tmp = filepath + ".tmp";
+
+        {
+            std::ofstream file(filepath_tmp, std::ios::binary);
+
+            const uint32_t header[3] = { LLAMA_STATE_SEQ_MAGIC, LLAMA_STATE_SEQ_VERSION, (uint32_t) tokens.size() };
+            file.write((const char *) header, sizeof(header));
+            file.write((const char *) tokens.data(), tokens.size() * sizeof(llama_token));
+            file.write((const char *) data.data(), data.size());
+
+            if (!file) {
+                file.close();
+                std::error_code ec;
+                std::filesystem::remove(filepath_tmp, ec);
+                return 0;
             }
         }
-    }
 
-    void reset_bucket() {
-        n_prompt_tokens_processed = 0;
-        t_prompt_processing       = 0;
-        n_tokens_predicted        = 0;
-        t_tokens_generation       = 0;
+        std::error_code ec;
+        std::filesystem::rename(filepath_tmp, filepath, ec);
+        if (ec) {
+            std::filesystem::remove(filepath_tmp, ec);
+            return 0;
+        }
+
+        return sizeof(uint32_t) * 3 + tokens.size() * sizeof(llama_token) + data.size();
     }
-};
 
-struct server_queue {
-    int id = 0;
-    bool running;
+    // move the least recently used entries in memory to disk (or drop them without a directory), and delete the least
+    // recently used files, until both tiers fit into their budgets
+    void evict() {
+        while (n_bytes_ram > n_bytes_ram_max) {
+            const auto lru = find_lru(true);
 
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+            if (spill(lru->first)) {
+                SRV_INF("moved %zu tokens (%zu bytes) of the prompt cache from memory to disk\n", lru->second.n_tokens, lru->second.n_bytes);
+            } else {
+                SRV_INF("evicting %zu tokens (%zu bytes) from the prompt cache\n", lru->second.n_tokens, lru->second.data.size());
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+                remove(lru->first);
+            }
+        }
 
-    // callback functions
-    std::function<void(server_task)> callback_new_task;
-    std::function<void(void)>        callback_update_slots;
+        while (n_bytes > n_bytes_max) {
+            const auto lru = find_lru(false);
 
-    // Add a new task to the end of the queue
-    int post(server_task task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        GGML_ASSERT(task.id != -1);
-        // if this is cancel task make sure to clean up pending tasks
-        if (task.type == SERVER_TASK_TYPE_CANCEL) {
-            cleanup_pending_task(task.id_target);
-        }
-        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
+            SRV_INF("evicting %zu tokens (%zu bytes) from the prompt cache\n", lru->second.n_tokens, lru->second.n_bytes);
+
+            remove(lru->first);
         }
-        condition_tasks.notify_one();
-        return task.id;
     }
 
-    // multi-task version of post()
-    int post(std::vector<server_task> & tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
-            }
-            // if this is cancel task make sure to clean up pending tasks
-            if (task.type == SERVER_TASK_TYPE_CANCEL) {
-                cleanup_pending_task(task.id_target);
+    // move all entries in memory to disk, to keep them for the next start of the server
+    void spill_all() {
+        if (dir.empty()) {
+            return;
+        }
+
+        std::vector<uint64_t> hashes;
+        for (const auto & it : entries) {
+            if (it.second.in_ram()) {
+                hashes.push_back(it.first);
             }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
+        }
+
+        for (const uint64_t h : hashes) {
+            if (!spill(h)) {
+                SRV_WRN("failed to move %zu tokens of the prompt cache from memory to disk\n", entries.at(h).n_tokens);
             }
         }
-        condition_tasks.notify_one();
-        return 0;
-    }
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
+        evict();
     }
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
+private:
+    std::unordered_map<uint64_t, entry>::iterator find_lru(bool in_ram) {
+        auto lru = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->second.in_ram() == in_ram && (lru == entries.end() || it->second.t_last_used < lru->second.t_last_used)) {
+                lru = it;
+            }
+        }
+        GGML_ASSERT(lru != entries.end());
+        return lru;
     }
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task)> callback) {
-        callback_new_task = std::move(callback);
-    }
+    static constexpr uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+    static constexpr uint64_t FNV_PRIME  = 0x100000001b3ULL;
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
+    static uint64_t hash_bytes(uint64_t h, const void * data, size_t size) {
+        const uint8_t * bytes = (const uint8_t *) data;
+        for (size_t i = 0; i < size; i++) {
+            h ^= bytes[i];
+            h *= FNV_PRIME;
+        }
+        return h;
     }
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+    // the tokens at the start of a file written by llama_state_seq_save_file
+    static bool read_tokens(const std::string & fname, size_t n_file_bytes, llama_tokens & tokens) {
+        std::ifstream file(fname, std::ios::binary);
+
+        uint32_t header[3];
+        if (!file.read((char *) header, sizeof(header)) ||
+            header[0] != LLAMA_STATE_SEQ_MAGIC || header[1] != LLAMA_STATE_SEQ_VERSION ||
+            header[2] == 0 || sizeof(header) + header[2] * sizeof(llama_token) > n_file_bytes) {
+            return false;
         }
-        condition_tasks.notify_one();
-    }
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
+        tokens.resize(header[2]);
+
+        return (bool) file.read((char *) tokens.data(), tokens.size() * sizeof(llama_token));
     }
+};
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
+// compresses the states saved to the prompt cache, and writes the ones of the disk tier, on a thread of its own
+// the slots only wait for the copy of the packed state out of the KV cache. the finished jobs are added to the prompt
+// cache by the main thread, which owns it (see server_context::prompt_cache_collect)
+struct server_prompt_cache_writer {
+    struct job {
+        uint64_t     h = 0;
+        llama_tokens tokens;
+        size_t       n_state = 0;
 
-        while (true) {
-            QUE_DBG("%s", "processing new tasks\n");
+        std::vector<uint8_t> data; // packed state, compressed by the thread
 
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    lock.unlock();
-                    break;
-                }
-                server_task task = queue_tasks.front();
-                queue_tasks.pop_front();
-                lock.unlock();
+        std::string filepath; // the file of the entry on disk, empty for an entry in memory
 
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(std::move(task));
+        size_t  n_bytes    = 0; // size of the compressed state or of the file, 0 on failure
+        int64_t t_start_us = 0;
+        int64_t t_copy_us  = 0; // time the slots waited for the copy
+    };
+
+    ~server_prompt_cache_writer() {
+        if (worker.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                running = false;
             }
+            condition.notify_all();
+            worker.join();
+        }
+    }
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
+    bool is_pending(uint64_t h) const {
+        return pending.find(h) != pending.end();
+    }
 
-            callback_update_slots();
+    // called by the main thread
+    void post(job && j) {
+        pending.insert(j.h);
+
+        if (!worker.joinable()) {
+            running = true;
+            worker  = std::thread([this]() { run(); });
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queue.push_back(std::move(j));
+        }
+        condition.notify_all();
+    }
+
+    // called by the main thread, returns the finished jobs - all of them with wait, after the queue is empty
+    std::vector<job> collect(bool wait = false) {
+        std::vector<job> res;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (wait) {
+                condition.wait(lock, [this]() { return queue.empty() && n_busy == 0; });
+            }
+            while (!done.empty()) {
+                res.push_back(std::move(done.front()));
+                done.pop_front();
+            }
+        }
+
+        for (const job & j : res) {
+            pending.erase(j.h);
+        }
+
+        return res;
+    }
+
+private:
+    std::thread worker;
+
+    std::mutex              mutex;
+    std::condition_variable condition;
+
+    bool running = false;
+    int  n_busy  = 0;
+
+    std::deque<job> queue;
+    std::deque<job> done;
+
+    // hashes of the posted jobs that have not been collected yet, only used by the main thread
+    std::unordered_set<uint64_t> pending;
+
+    void run() {
+        while (true) {
+            job j;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this]() { return !queue.empty() || !running; });
+                if (queue.empty()) {
+                    return;
+                }
+                j = std::move(queue.front());
+                queue.pop_front();
+                n_busy++;
+            }
+
+            // a single thread, the threads of the context are decoding meanwhile
+            std::vector<uint8_t> packed(j.data.size());
+
+            const size_t n_packed = llama_state_seq_compress(j.data.data(), j.data.size(), packed.data(), 1);
+            if (n_packed > 0) {
+                packed.resize(n_packed);
+                packed.shrink_to_fit();
+
+                j.data    = std::move(packed);
+                j.n_bytes = j.filepath.empty() ? j.data.size() : server_prompt_cache::write_file(j.filepath, j.tokens, j.data);
+            }
+
+            if (!j.filepath.empty()) {
+                j.data = {};
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                done.push_back(std::move(j));
+                n_busy--;
+            }
+            condition.notify_all();
+        }
+    }
+};
+
+// token budget for the prompt tokens that are decoded together with the tokens of generating slots (--itl-target)
+// every such step delays the next token of the generating slots, so its duration is an inter-token latency sample.
+// the budget shrinks in proportion when the p99 of the recent samples is above the target, and grows slowly while it
+// is below and fully used, so that long prompts are processed in chunks between decode steps instead of stalling them
+struct server_prefill_budget {
+    static constexpr int32_t n_min     = 16;  // prompts always make progress
+    static constexpr size_t  n_samples = 128; // window of the latency percentile
+
+    double  t_target_ms = 0.0;
+    int32_t n_max       = 0;
+    int32_t n_budget    = 0;
+
+    std::vector<double> samples;
+    size_t i_sample = 0;
+
+    bool enabled() const {
+        return t_target_ms > 0.0;
+    }
+
+    void init(double t_target_ms_, int32_t n_batch) {
+        t_target_ms = t_target_ms_;
+        n_max       = n_batch;
+        n_budget    = std::max(n_min, n_batch / 4);
+    }
+
+    // p99 of the recent latency samples
+    double p99() const {
+        std::vector<double> sorted = samples;
+        const size_t i = (size_t) (0.99 * (sorted.size() - 1));
+        std::nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+        return sorted[i];
+    }
+
+    void on_step(double t_step_ms, int32_t n_prompt_tokens) {
+        if (samples.size() < n_samples) {
+            samples.push_back(t_step_ms);
+        } else {
+            samples[i_sample] = t_step_ms;
+            i_sample = (i_sample + 1) % n_samples;
+        }
+
+        const double t_p99_ms = p99();
+
+        if (t_p99_ms > t_target_ms && t_step_ms > t_target_ms && n_prompt_tokens > 0) {
+            n_budget = std::max(n_min, (int32_t) (n_prompt_tokens * t_target_ms / t_step_ms));
+        } else if (t_p99_ms <= t_target_ms && n_prompt_tokens >= n_budget) {
+            n_budget = std::min(n_max, n_budget + std::max(1, n_budget / 8));
+        }
+    }
+};
+
+// sampling that always picks the same tokens for the same prompt, i.e. greedy
+// a fixed seed does not count: the draws also depend on the batching of the slots and on the backend
+static bool server_sampling_is_deterministic(const common_params_sampling & params) {
+    if (params.mirostat != 0 || params.temp > 0.0f || params.xtc_probability > 0.0f) {
+        return false;
+    }
+
+    // a non-positive temperature keeps only the most likely token, if the temperature sampler is used
+    return params.top_n_sigma >= 0 ||
+        std::find(params.samplers.begin(), params.samplers.end(), COMMON_SAMPLER_TYPE_TEMPERATURE) != params.samplers.end();
+}
+
+// in-memory cache of complete responses to deterministic requests (--response-cache)
+// the key is the endpoint and response format together with the canonical form of the request body (sorted keys),
+// so an identical request is answered from the cache without queueing any task
+// entries expire after the TTL, and the least recently used ones are dropped beyond the size budget
+// it is used by the HTTP threads concurrently, all access is under the mutex
+struct server_response_cache {
+    struct entry {
+        std::string key;
+        std::string response;
+
+        int64_t t_expires_us;
+
+        std::list<uint64_t>::iterator it_lru;
+
+        size_t n_bytes() const {
+            return key.size() + response.size() + sizeof(entry);
+        }
+    };
+
+    // fields that only affect the scheduling of a request, not its response
+    static constexpr const char * fields_ignored[] = { "priority", "deadline_ms", "id_slot", "cache_prompt" };
+
+    std::string fingerprint;
+
+    size_t  n_bytes_max = 0;
+    int64_t t_ttl_us    = 0;
+
+    std::mutex mutex;
+
+    std::unordered_map<uint64_t, entry> entries; // by hash of the key
+    std::list<uint64_t> lru;                     // most recently used first
+
+    size_t n_bytes = 0;
+
+    uint64_t n_hits    = 0;
+    uint64_t n_misses  = 0;
+    uint64_t n_evicted = 0;
+
+    bool enabled() const {
+        return n_bytes_max > 0;
+    }
+
+    void init(const std::string & fingerprint_, size_t n_bytes_max_, int64_t t_ttl_s) {
+        fingerprint = fingerprint_;
+        n_bytes_max = n_bytes_max_;
+        t_ttl_us    = t_ttl_s*1000000;
+    }
+
+    std::string make_key(const char * endpoint, int format, const json & data) const {
+        nlohmann::json canonical = data;
+        for (const char * field : fields_ignored) {
+            canonical.erase(field);
+        }
+
+        return string_format("%s|%s|%d|", fingerprint.c_str(), endpoint, format) + canonical.dump();
+    }
+
+    static uint64_t hash(const std::string & key) {
+        uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+        for (const char c : key) {
+            h ^= (uint8_t) c;
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    bool get(const std::string & key, std::string & response) {
+        const uint64_t h = hash(key);
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        auto it = entries.find(h);
+        if (it == entries.end() || it->second.key != key) {
+            n_misses++;
+            return false;
+        }
+
+        if (t_ttl_us > 0 && ggml_time_us() > it->second.t_expires_us) {
+            remove(it);
+            n_misses++;
+            return false;
+        }
+
+        lru.splice(lru.begin(), lru, it->second.it_lru);
+        response = it->second.response;
+        n_hits++;
+
+        return true;
+    }
+
+    void put(const std::string & key, const std::string & response) {
+        const uint64_t h = hash(key);
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        auto it = entries.find(h);
+        if (it != entries.end()) {
+            remove(it);
+        }
+
+        entry e;
+        e.key          = key;
+        e.response     = response;
+        e.t_expires_us = ggml_time_us() + t_ttl_us;
+        if (e.n_bytes() > n_bytes_max) {
+            return;
+        }
+
+        lru.push_front(h);
+        e.it_lru = lru.begin();
+        n_bytes += e.n_bytes();
+        entries.emplace(h, std::move(e));
+
+        while (n_bytes > n_bytes_max) {
+            remove(entries.find(lru.back()));
+            n_evicted++;
+        }
+    }
+
+    // a response from the cache is a new response: it gets the id and the creation time of the request that hit it,
+    // and no timings, since nothing was computed for it
+    static json renew(json response, const std::string & id) {
+        if (response.is_array()) {
+            for (auto & r : response) {
+                r = renew(std::move(r), id);
+            }
+            return response;
+        }
+
+        response.erase("timings");
+        if (response.contains("id")) {
+            response["id"] = id;
+        }
+        if (response.contains("created")) {
+            response["created"] = std::time(0);
+        }
+        if (response.contains("__verbose")) {
+            response["__verbose"] = renew(std::move(response["__verbose"]), id);
+        }
+
+        return response;
+    }
+
+    // after the model output changes, e.g. other LoRA adapters
+    void clear() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        entries.clear();
+        lru.clear();
+        n_bytes = 0;
+    }
+
+private:
+    void remove(std::unordered_map<uint64_t, entry>::iterator it) {
+        n_bytes -= it->second.n_bytes();
+        lru.erase(it->second.it_lru);
+        entries.erase(it);
+    }
+};
+
+struct server_slot {
+    int id;
+    int id_task = -1;
+
+    // only used for completion/embedding/infill/rerank
+    server_task_type task_type = SERVER_TASK_TYPE_COMPLETION;
+
+    llama_batch batch_spec = {};
+
+    llama_context * ctx = nullptr;
+    llama_context * ctx_dft = nullptr;
+
+    common_speculative * spec = nullptr;
+
+    // batched speculative decoding (--draft-batched), the draft context is shared by all slots
+    common_sampler * smpl_dft = nullptr;
+    llama_tokens     prompt_dft;      // tokens in the sequence of this slot in the draft context
+    float            p_accept = 0.0f; // estimated probability that the target model accepts a draft token
+
+    std::vector<common_adapter_lora_info> lora;
+
+    // the index relative to completion multi-task request
+    size_t index = 0;
+
+    struct slot_params params;
+
+    slot_state state = SLOT_STATE_IDLE;
+
+    // used to determine the slot that has been used the longest
+    int64_t t_last_used = -1;
+
+    // generation props
+    int32_t n_ctx       = 0;  // context size per slot (max context size when the KV pool is shared)
+    int32_t n_past      = 0;
+    int32_t n_decoded   = 0;
+    int32_t n_remaining = -1;
+    int32_t i_batch     = -1;
+    int32_t n_predict   = -1; // TODO: disambiguate from params.n_predict
+
+    // n_prompt_tokens may not be equal to prompt_tokens.size(), because prompt maybe truncated
+    int32_t n_prompt_tokens           = 0;
+    int32_t n_prompt_tokens_processed = 0;
+
+    // KV cells promised to this slot by the KV pool admission control, until its prompt processing starts
+    int32_t n_kv_reserved = 0;
+
+    // the first n_kv_shared cells of the sequence may be shared with other slots (see server_prefix_tree)
+    // their positions must not be shifted, since that would change them for the other slots too
+    int32_t n_kv_shared = 0;
+
+    // input prompt tokens
+    llama_tokens prompt_tokens;
+
+    size_t last_nl_pos = 0;
+
+    std::string  generated_text;
+    llama_tokens generated_tokens;
+
+    llama_tokens cache_tokens;
+
+    std::vector<completion_token_output> generated_token_probs;
+
+    bool has_next_token = true;
+    bool has_new_line   = false;
+    bool truncated      = false;
+    stop_type stop;
+
+    std::string stopping_word;
+
+    // sampling
+    json json_schema;
+
+    struct common_sampler * smpl = nullptr;
+
+    llama_token sampled;
+
+    common_chat_format chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+
+    // stats
+    size_t n_sent_text        = 0; // number of sent text character
+
+    int64_t t_start_process_prompt = 0;
+    int64_t t_start_generation;
+
+    double t_prompt_processing; // ms
+    double t_token_generation;  // ms
+
+    std::function<void(int)> callback_on_release;
+
+    // Speculative decoding stats
+    int32_t n_draft_total = 0;      // Total draft tokens generated
+    int32_t n_draft_accepted = 0;   // Draft tokens actually accepted
+
+    void reset() {
+        SLT_DBG(*this, "%s", "\n");
+
+        n_prompt_tokens    = 0;
+        last_nl_pos        = 0;
+        generated_text     = "";
+        has_new_line       = false;
+        truncated          = false;
+        stop               = STOP_TYPE_NONE;
+        stopping_word      = "";
+        n_past             = 0;
+        n_sent_text        = 0;
+        task_type          = SERVER_TASK_TYPE_COMPLETION;
+
+        t_start_process_prompt = 0;
+
+        generated_tokens.clear();
+        generated_token_probs.clear();
+
+        // clear speculative decoding stats
+        n_draft_total = 0;
+        n_draft_accepted = 0;
+    }
+
+    bool is_non_causal() const {
+        return task_type == SERVER_TASK_TYPE_EMBEDDING || task_type == SERVER_TASK_TYPE_RERANK;
+    }
+
+    bool can_batch_with(server_slot & other_slot) const {
+        return is_non_causal() == other_slot.is_non_causal()
+            && are_lora_equal(lora, other_slot.lora);
+    }
+
+    bool has_budget(const common_params & global_params) {
+        if (params.n_predict == -1 && global_params.n_predict == -1) {
+            return true; // limitless
+        }
+
+        n_remaining = -1;
+
+        if (params.n_predict != -1) {
+            n_remaining = params.n_predict - n_decoded;
+        } else if (global_params.n_predict != -1) {
+            n_remaining = global_params.n_predict - n_decoded;
+        }
+
+        return n_remaining > 0; // no budget
+    }
+
+    bool is_processing() const {
+        return state != SLOT_STATE_IDLE;
+    }
+
+    bool can_speculate() const {
+        return (ctx_dft || smpl_dft) && params.speculative.n_max > 0 && params.cache_prompt;
+    }
+
+    // with a per-token acceptance probability p, p / (1 - p) draft tokens are accepted on average:
+    // longer drafts are mostly rejected, shorter ones leave accepted tokens undrafted
+    int get_n_draft_adaptive() const {
+        const float n = std::ceil(p_accept / (1.0f - p_accept)) + 1.0f;
+        return std::max(std::max(1, params.speculative.n_min), (int) std::min(n, (float) params.speculative.n_max));
+    }
+
+    void update_p_accept(int n_draft, int n_accepted) {
+        // a fully accepted draft only bounds p from below
+        const float p = n_accepted < n_draft ? (float) n_accepted / (n_accepted + 1) : (float) (n_accepted + 1) / (n_accepted + 2);
+
+        p_accept = 0.7f*p_accept + 0.3f*p;
+    }
+
+    void add_token(const completion_token_output & token) {
+        if (!is_processing()) {
+            SLT_WRN(*this, "%s", "slot is not processing\n");
+            return;
+        }
+        generated_token_probs.push_back(token);
+    }
+
+    void release() {
+        if (is_processing()) {
+            SLT_INF(*this, "stop processing: n_past = %d, truncated = %d\n", n_past, truncated);
+
+            t_last_used = ggml_time_us();
+            t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
+            state = SLOT_STATE_IDLE;
+            callback_on_release(id);
+        }
+    }
+
+    result_timings get_timings() const {
+        result_timings timings;
+        timings.prompt_n = n_prompt_tokens_processed;
+        timings.prompt_ms = t_prompt_processing;
+        timings.prompt_per_token_ms = t_prompt_processing / n_prompt_tokens_processed;
+        timings.prompt_per_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+
+        timings.predicted_n = n_decoded;
+        timings.predicted_ms = t_token_generation;
+        timings.predicted_per_token_ms = t_token_generation / n_decoded;
+        timings.predicted_per_second = 1e3 / t_token_generation * n_decoded;
+
+        // Add speculative metrics
+        if (n_draft_total > 0) {
+            timings.draft_n = n_draft_total;
+            timings.draft_n_accepted = n_draft_accepted;
+        }
+
+        return timings;
+    }
+
+    size_t find_stopping_strings(const std::string & text, const size_t last_token_size, bool is_full_stop) {
+        size_t stop_pos = std::string::npos;
+
+        for (const std::string & word : params.antiprompt) {
+            size_t pos;
+
+            if (is_full_stop) {
+                const size_t tmp      = word.size() + last_token_size;
+                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
+
+                pos = text.find(word, from_pos);
+            } else {
+                // otherwise, partial stop
+                pos = find_partial_stop_string(word, text);
+            }
+
+            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
+                if (is_full_stop) {
+                    stop           = STOP_TYPE_WORD;
+                    stopping_word  = word;
+                    has_next_token = false;
+                }
+                stop_pos = pos;
+            }
+        }
+
+        return stop_pos;
+    }
+
+    void print_timings() const {
+        const double t_prompt        =       t_prompt_processing / n_prompt_tokens_processed;
+        const double n_prompt_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+
+        const double t_gen        =       t_token_generation / n_decoded;
+        const double n_gen_second = 1e3 / t_token_generation * n_decoded;
+
+        SLT_INF(*this,
+                "\n"
+                "prompt eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
+                "       eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
+                "      total time = %10.2f ms / %5d tokens\n",
+                t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
+                t_token_generation, n_decoded, t_gen, n_gen_second,
+                t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+
+        if (n_draft_total > 0) {
+            const float draft_ratio = (float) n_draft_accepted / n_draft_total;
+            SLT_INF(*this,
+                    "\n"
+                    "draft acceptance rate = %0.5f (%5d accepted / %5d generated)\n",
+                    draft_ratio, n_draft_accepted, n_draft_total
+            );
+        }
+    }
+
+    json to_json() const {
+        return json {
+            {"id",            id},
+            {"id_task",       id_task},
+            {"n_ctx",         n_ctx},
+            {"speculative",   can_speculate()},
+            {"is_processing", is_processing()},
+            {"non_causal",    is_non_causal()},
+            {"params",        params.to_json()},
+            {"prompt",        common_detokenize(ctx, prompt_tokens)},
+            {"next_token",
+                {
+                    {"has_next_token", has_next_token},
+                    {"has_new_line",   has_new_line},
+                    {"n_remain",       n_remaining},
+                    {"n_decoded",      n_decoded},
+                    {"stopping_word",  stopping_word},
+                }
+            },
+        };
+    }
+};
+
+struct server_metrics {
+    int64_t t_start = 0;
+
+    uint64_t n_prompt_tokens_processed_total = 0;
+    uint64_t t_prompt_processing_total       = 0;
+    uint64_t n_tokens_predicted_total        = 0;
+    uint64_t t_tokens_generation_total       = 0;
+
+    uint64_t n_prompt_tokens_processed = 0;
+    uint64_t t_prompt_processing       = 0;
+
+    uint64_t n_tokens_predicted  = 0;
+    uint64_t t_tokens_generation = 0;
+
+    uint64_t n_decode_total     = 0;
+    uint64_t n_busy_slots_total = 0;
+
+    server_queue_wait_histogram queue_wait[SERVER_TASK_PRIORITY_COUNT];
+
+    uint64_t n_rejected_deadline[SERVER_TASK_PRIORITY_COUNT] = {};
+
+    // time between the start of prompt processing and the release of the slot, to estimate queue waits
+    uint64_t n_tasks_released    = 0;
+    uint64_t t_tasks_released_us = 0;
+
+    // KV cache defragmentation while idle (--defrag-idle)
+    uint64_t n_defrag_cells_total = 0;
+    uint64_t t_defrag_us_total    = 0;
+
+    void init() {
+        t_start = ggml_time_us();
+    }
+
+    void on_prompt_eval(const server_slot & slot) {
+        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
+        n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
+        t_prompt_processing             += slot.t_prompt_processing;
+        t_prompt_processing_total       += slot.t_prompt_processing;
+    }
+
+    void on_prompt_eval(int32_t n_tokens, double t_ms) {
+        n_prompt_tokens_processed_total += n_tokens;
+        n_prompt_tokens_processed       += n_tokens;
+        t_prompt_processing             += t_ms;
+        t_prompt_processing_total       += t_ms;
+    }
+
+    void on_prediction(const server_slot & slot) {
+        n_tokens_predicted_total   += slot.n_decoded;
+        n_tokens_predicted         += slot.n_decoded;
+        t_tokens_generation        += slot.t_token_generation;
+        t_tokens_generation_total  += slot.t_token_generation;
+    }
+
+    void on_launch(const server_task & task) {
+        queue_wait[task.sched.priority].observe((ggml_time_us() - task.sched.t_queued) / 1e6);
+    }
+
+    void on_release(const server_slot & slot) {
+        if (slot.t_start_process_prompt == 0) {
+            return; // released before its prompt was processed
+        }
+
+        n_tasks_released++;
+        t_tasks_released_us += ggml_time_us() - slot.t_start_process_prompt;
+    }
+
+    void on_decoded(const std::vector<server_slot> & slots) {
+        n_decode_total++;
+        for (const auto & slot : slots) {
+            if (slot.is_processing()) {
+                n_busy_slots_total++;
+            }
+        }
+    }
+
+    void reset_bucket() {
+        n_prompt_tokens_processed = 0;
+        t_prompt_processing       = 0;
+        n_tokens_predicted        = 0;
+        t_tokens_generation       = 0;
+    }
+};
+
+// tasks that wait for a slot, in one FIFO queue per priority class and tenant
+// the classes share the released slots in proportion to their weights and the tenants of a class share its part equally
+// (start-time fair queuing: every class and tenant has a virtual time that advances by 1/weight per dispatched task,
+// the one with the lowest virtual time goes next, and idle ones are brought forward so that they cannot save up credit)
+struct server_task_scheduler {
+    struct tenant_queue {
+        std::deque<server_task> tasks; // ordered by id, i.e. by arrival
+
+        double vtime = 0.0;
+    };
+
+    struct class_queue {
+        std::map<std::string, tenant_queue> tenants; // only the tenants with waiting tasks
+
+        double vtime         = 0.0;
+        double vtime_tenants = 0.0; // virtual time of the tenant that was dispatched last
+
+        size_t n_tasks = 0;
+    };
+
+    class_queue classes[SERVER_TASK_PRIORITY_COUNT];
+
+    double vtime = 0.0; // virtual time of the class that was dispatched last
+
+    size_t size() const {
+        size_t n = 0;
+        for (const auto & cq : classes) {
+            n += cq.n_tasks;
+        }
+        return n;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    void push(server_task && task) {
+        class_queue & cq = classes[task.sched.priority];
+        if (cq.n_tasks == 0) {
+            cq.vtime = std::max(cq.vtime, vtime);
+        }
+
+        auto it = cq.tenants.find(task.sched.tenant);
+        if (it == cq.tenants.end()) {
+            it = cq.tenants.emplace(task.sched.tenant, tenant_queue()).first;
+            it->second.vtime = cq.vtime_tenants;
+        }
+
+        // a task that is deferred again keeps its place
+        auto & tasks = it->second.tasks;
+        auto pos = std::upper_bound(tasks.begin(), tasks.end(), task.id, [](int id, const server_task & other) {
+            return id < other.id;
+        });
+        tasks.insert(pos, std::move(task));
+
+        cq.n_tasks++;
+    }
+
+    bool pop(server_task & task) {
+        int i_class = -1;
+        for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; i++) {
+            if (classes[i].n_tasks > 0 && (i_class == -1 || classes[i].vtime < classes[i_class].vtime)) {
+                i_class = i;
+            }
+        }
+        if (i_class == -1) {
+            return false;
+        }
+
+        class_queue & cq = classes[i_class];
+
+        auto it_tenant = cq.tenants.begin();
+        for (auto it = cq.tenants.begin(); it != cq.tenants.end(); ++it) {
+            if (it->second.vtime < it_tenant->second.vtime) {
+                it_tenant = it;
+            }
+        }
+
+        tenant_queue & tq = it_tenant->second;
+
+        task = std::move(tq.tasks.front());
+        tq.tasks.pop_front();
+        cq.n_tasks--;
+
+        vtime             = cq.vtime;
+        cq.vtime         += 1.0 / server_task_priority_weights[i_class];
+        cq.vtime_tenants  = tq.vtime;
+        tq.vtime         += 1.0;
+
+        if (tq.tasks.empty()) {
+            cq.tenants.erase(it_tenant);
+        }
+
+        return true;
+    }
+
+    // number of waiting tasks of the given class and of the classes with higher priority
+    size_t n_ahead(server_task_priority priority) const {
+        size_t n = 0;
+        for (int i = 0; i <= priority; i++) {
+            n += classes[i].n_tasks;
+        }
+        return n;
+    }
+
+    void remove_if(const std::function<bool(const server_task &)> & pred) {
+        for (auto & cq : classes) {
+            for (auto it = cq.tenants.begin(); it != cq.tenants.end();) {
+                auto & tasks = it->second.tasks;
+
+                const size_t n_before = tasks.size();
+                tasks.erase(std::remove_if(tasks.begin(), tasks.end(), pred), tasks.end());
+                cq.n_tasks -= n_before - tasks.size();
+
+                if (tasks.empty()) {
+                    it = cq.tenants.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+};
+
+struct server_queue {
+    int id = 0;
+    bool running;
+
+    // queues
+    std::deque<server_task> queue_tasks;
+    server_task_scheduler   queue_tasks_deferred;
+
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
+
+    // callback functions
+    std::function<void(server_task)> callback_new_task;
+    std::function<void(void)>        callback_update_slots;
+    std::function<void(void)>        callback_idle;
+
+    // Add a new task to the end of the queue
+    int post(server_task task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        GGML_ASSERT(task.id != -1);
+        // if this is cancel task make sure to clean up pending tasks
+        if (task.type == SERVER_TASK_TYPE_CANCEL) {
+            cleanup_pending_task(task.id_target);
+        }
+        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
+        if (task.sched.t_queued == 0) {
+            task.sched.t_queued = ggml_time_us();
+        }
+        if (front) {
+            queue_tasks.push_front(std::move(task));
+        } else {
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+        return task.id;
+    }
+
+    // multi-task version of post()
+    int post(std::vector<server_task> & tasks, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
+            }
+            // if this is cancel task make sure to clean up pending tasks
+            if (task.type == SERVER_TASK_TYPE_CANCEL) {
+                cleanup_pending_task(task.id_target);
+            }
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
+            if (task.sched.t_queued == 0) {
+                task.sched.t_queued = ggml_time_us();
+            }
+            if (front) {
+                queue_tasks.push_front(std::move(task));
+            } else {
+                queue_tasks.push_back(std::move(task));
+            }
+        }
+        condition_tasks.notify_one();
+        return 0;
+    }
+
+    // Add a new task, but defer until one slot is available
+    void defer(server_task task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        QUE_DBG("defer task, id = %d\n", task.id);
+        queue_tasks_deferred.push(std::move(task));
+        condition_tasks.notify_one();
+    }
+
+    // Get the next id for creating a new task
+    int get_new_id() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int new_id = id++;
+        return new_id;
+    }
+
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task)> callback) {
+        callback_new_task = std::move(callback);
+    }
+
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
+
+    // Register the function to be called when there are no new tasks after updating the slots, before waiting for them
+    // it should return soon after empty() turns false
+    void on_idle(std::function<void(void)> callback) {
+        callback_idle = std::move(callback);
+    }
+
+    bool empty() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        return queue_tasks.empty();
+    }
+
+    // Call when the state of one slot is changed, it will move the next scheduled task from deferred to main queue
+    // the task goes to the front, so that the released slot is not taken by a task that has not waited yet
+    void pop_deferred_task() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        server_task task(SERVER_TASK_TYPE_COMPLETION);
+        if (queue_tasks_deferred.pop(task)) {
+            queue_tasks.emplace_front(std::move(task));
+        }
+        condition_tasks.notify_one();
+    }
+
+    // end the start_loop routine
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        running = false;
+        condition_tasks.notify_all();
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        running = true;
+
+        while (true) {
+            QUE_DBG("%s", "processing new tasks\n");
+
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    lock.unlock();
+                    break;
+                }
+                server_task task = queue_tasks.front();
+                queue_tasks.pop_front();
+                lock.unlock();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(std::move(task));
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            if (callback_idle && empty()) {
+                callback_idle();
+            }
 
             QUE_DBG("%s", "waiting for new tasks\n");
             {
@@ -1680,496 +2983,1110 @@ struct server_queue {
                     QUE_DBG("%s", "terminate\n");
                     return;
                 }
-                if (queue_tasks.empty()) {
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
+                if (queue_tasks.empty()) {
+                    condition_tasks.wait(lock, [&]{
+                        return (!queue_tasks.empty() || !running);
+                    });
+                }
+            }
+        }
+    }
+
+private:
+    void cleanup_pending_task(int id_target) {
+        // no need lock because this is called exclusively by post()
+        auto rm_func = [id_target](const server_task & task) {
+            return task.id_target == id_target;
+        };
+        queue_tasks.erase(
+            std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
+            queue_tasks.end());
+        queue_tasks_deferred.remove_if(rm_func);
+    }
+};
+
+struct server_response {
+    bool running = true;
+
+    // for keeping track of all tasks waiting for the result
+    std::unordered_set<int> waiting_task_ids;
+
+    // the main result queue (using ptr for polymorphism)
+    std::vector<server_task_result_ptr> queue_results;
+
+    std::mutex mutex_results;
+    std::condition_variable condition_results;
+
+    // add the id_task to the list of tasks waiting for response
+    void add_waiting_task_id(int id_task) {
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.insert(id_task);
+    }
+
+    void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & task : tasks) {
+            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
+            waiting_task_ids.insert(task.id);
+        }
+    }
+
+    // when the request is finished, we can remove task associated with it
+    void remove_waiting_task_id(int id_task) {
+        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.erase(id_task);
+        // make sure to clean up all pending results
+        queue_results.erase(
+            std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
+                return res->id == id_task;
+            }),
+            queue_results.end());
+    }
+
+    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & id_task : id_tasks) {
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+            waiting_task_ids.erase(id_task);
+        }
+    }
+
+    // This function blocks the thread until there is a response for one of the id_tasks
+    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            condition_results.wait(lock, [&]{
+                if (!running) {
+                    SRV_DBG("%s : queue result stop\n", __func__);
+                    std::terminate(); // we cannot return here since the caller is HTTP code
+                }
+                return !queue_results.empty();
+            });
+
+            for (size_t i = 0; i < queue_results.size(); i++) {
+                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
+                    server_task_result_ptr res = std::move(queue_results[i]);
+                    queue_results.erase(queue_results.begin() + i);
+                    return res;
+                }
+            }
+        }
+
+        // should never reach here
+    }
+
+    // same as recv(), but have timeout in seconds
+    // if timeout is reached, nullptr is returned
+    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_results);
+
+            for (int i = 0; i < (int) queue_results.size(); i++) {
+                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
+                    server_task_result_ptr res = std::move(queue_results[i]);
+                    queue_results.erase(queue_results.begin() + i);
+                    return res;
+                }
+            }
+
+            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
+            if (!running) {
+                SRV_DBG("%s : queue result stop\n", __func__);
+                std::terminate(); // we cannot return here since the caller is HTTP code
+            }
+            if (cr_res == std::cv_status::timeout) {
+                return nullptr;
+            }
+        }
+
+        // should never reach here
+    }
+
+    // same as recv(), but returns nullptr instead of waiting if there is no result yet
+    server_task_result_ptr try_recv(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (size_t i = 0; i < queue_results.size(); i++) {
+            if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
+                server_task_result_ptr res = std::move(queue_results[i]);
+                queue_results.erase(queue_results.begin() + i);
+                return res;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // single-task version of recv()
+    server_task_result_ptr recv(int id_task) {
+        std::unordered_set<int> id_tasks = {id_task};
+        return recv(id_tasks);
+    }
+
+    // Send a new result to a waiting id_task
+    void send(server_task_result_ptr && result) {
+        SRV_DBG("sending result for task id = %d\n", result->id);
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (const auto & id_task : waiting_task_ids) {
+            if (result->id == id_task) {
+                SRV_DBG("task id = %d pushed to result queue\n", result->id);
+
+                queue_results.emplace_back(std::move(result));
+                condition_results.notify_all();
+                return;
+            }
+        }
+    }
+
+    // terminate the waiting loop
+    void terminate() {
+        running = false;
+        condition_results.notify_all();
+    }
+};
+
+struct server_context {
+    common_params params_base;
+
+    // note: keep these alive - they determine the lifetime of the model, context, etc.
+    common_init_result llama_init;
+    common_init_result llama_init_dft;
+
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+
+    const llama_vocab * vocab = nullptr;
+
+    llama_model * model_dft = nullptr;
+
+    llama_context_params cparams_dft;
+
+    // --draft-batched: one draft context with a sequence per slot, and the batch that verifies the drafts of all slots
+    llama_context * ctx_dft = nullptr;
+
+    llama_batch batch_dft  = {};
+    llama_batch batch_spec = {};
+
+    llama_batch batch = {};
+
+    bool clean_kv_cache = true;
+    bool add_bos_token  = true;
+    bool has_eos_token  = false;
+
+    int32_t n_ctx; // total context for all clients / slots
+
+    // slots / clients
+    std::vector<server_slot> slots;
+    json default_generation_settings_for_props;
+
+    server_queue    queue_tasks;
+    server_response queue_results;
+
+    server_metrics metrics;
+
+    // Necessary similarity of prompt for slot selection
+    float slot_prompt_similarity = 0.0f;
+
+    // prompt prefixes cached in the slots, used to share them between slots (--slot-prefix-share)
+    server_prefix_tree prefix_tree;
+
+    server_prompt_cache prompt_cache;
+
+    server_prompt_cache_writer prompt_cache_writer;
+
+    server_prefill_budget prefill_budget;
+
+    // embedding-only servers pack the inputs of all waiting embedding and rerank tasks into shared batches
+    // as separate sequences instead of giving each input a slot, see process_embd_tasks()
+    bool embd_packing = false;
+
+    std::vector<server_task> embd_tasks;
+
+    server_response_cache response_cache;
+
+    common_chat_templates_ptr chat_templates;
+
+    ~server_context() {
+        // Clear any sampling context
+        for (server_slot & slot : slots) {
+            common_sampler_free(slot.smpl);
+            slot.smpl = nullptr;
+
+            llama_free(slot.ctx_dft);
+            slot.ctx_dft = nullptr;
+
+            common_speculative_free(slot.spec);
+            slot.spec = nullptr;
+
+            common_sampler_free(slot.smpl_dft);
+            slot.smpl_dft = nullptr;
+
+            llama_batch_free(slot.batch_spec);
+        }
+
+        llama_free(ctx_dft);
+        ctx_dft = nullptr;
+
+        llama_batch_free(batch_dft);
+        llama_batch_free(batch_spec);
+
+        llama_batch_free(batch);
+    }
+
+    bool load_model(const common_params & params) {
+        SRV_INF("loading model '%s'\n", params.model.path.c_str());
+
+        params_base = params;
+
+        llama_init = common_init_from_params(params_base);
+
+        model = llama_init.model.get();
+        ctx   = llama_init.context.get();
+
+        if (model == nullptr) {
+            SRV_ERR("failed to load model, '%s'\n", params_base.model.path.c_str());
+            return false;
+        }
+
+        vocab = llama_model_get_vocab(model);
+
+        n_ctx = llama_n_ctx(ctx);
+
+        add_bos_token = llama_vocab_get_add_bos(vocab);
+        has_eos_token = llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL;
+
+        if (!params_base.speculative.model.path.empty() || !params_base.speculative.model.hf_repo.empty()) {
+            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.path.c_str());
+
+            auto params_dft = params_base;
+
+            params_dft.devices      = params_base.speculative.devices;
+            params_dft.model        = params_base.speculative.model;
+            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? get_n_ctx_slot(params_base.n_ctx) : params_base.speculative.n_ctx;
+            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
+            params_dft.n_parallel   = 1;
+
+            // force F16 KV cache for the draft model for extra performance
+            params_dft.cache_type_k = GGML_TYPE_F16;
+            params_dft.cache_type_v = GGML_TYPE_F16;
+            params_dft.cache_types_k_layer.clear();
+            params_dft.cache_types_v_layer.clear();
+
+            llama_init_dft = common_init_from_params(params_dft);
+
+            model_dft = llama_init_dft.model.get();
+
+            if (model_dft == nullptr) {
+                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.path.c_str());
+                return false;
+            }
+
+            if (!common_speculative_are_compatible(ctx, llama_init_dft.context.get())) {
+                SRV_ERR("the draft model '%s' is not compatible with the target model '%s'\n", params_base.speculative.model.path.c_str(), params_base.model.path.c_str());
+
+                return false;
+            }
+
+            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+
+            cparams_dft = common_context_params_to_llama(params_dft);
+            cparams_dft.n_batch = n_ctx_dft;
+
+            // the context is not needed - we will create one for each slot
+            llama_init_dft.context.reset();
+        }
+
+        chat_templates = common_chat_templates_init(model, params_base.chat_template);
+        try {
+            common_chat_format_example(chat_templates.get(), params.use_jinja);
+        } catch (const std::exception & e) {
+            SRV_WRN("%s: Chat template parsing error: %s\n", __func__, e.what());
+            SRV_WRN("%s: The chat template that comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses\n", __func__);
+            chat_templates = common_chat_templates_init(model, "chatml");
+        }
+
+        return true;
+    }
+
+    // context size of a single slot: a fixed share of the context, or with a shared KV pool the per-slot maximum
+    int32_t get_n_ctx_slot(int32_t n_ctx_total) const {
+        if (!params_base.kv_pool) {
+            return n_ctx_total / params_base.n_parallel;
+        }
+        if (params_base.n_ctx_slot > 0 && (n_ctx_total == 0 || params_base.n_ctx_slot < n_ctx_total)) {
+            return params_base.n_ctx_slot;
+        }
+        return n_ctx_total;
+    }
+
+    void init() {
+        const int32_t n_ctx_slot = get_n_ctx_slot(n_ctx);
+
+        SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
+
+        if (params_base.kv_pool) {
+            SRV_INF("slots share a KV pool of %d cells, n_ctx_slot = %d\n", n_ctx, n_ctx_slot);
+        }
+
+        if (params_base.slot_prefix_share && llama_model_is_recurrent(model)) {
+            SRV_WRN("%s", "prompt prefixes cannot be shared between slots for recurrent models, disabling --slot-prefix-share\n");
+            params_base.slot_prefix_share = false;
+        }
+
+        if (!params_base.prompt_cache_dir.empty() || params_base.prompt_cache_ram > 0) {
+            if (llama_model_is_recurrent(model)) {
+                SRV_WRN("%s", "the prompt cache does not support recurrent models, disabling --prompt-cache-dir and --prompt-cache-ram\n");
+            } else {
+                char model_desc[256];
+                llama_model_desc(model, model_desc, sizeof(model_desc));
+
+                // everything that changes the layout of a saved state: the per-layer types and the paged cache,
+                // which does not transpose V
+                const auto types_layer = [](const std::vector<ggml_type> & types) {
+                    std::string res;
+                    for (const ggml_type type : types) {
+                        if (type == GGML_TYPE_COUNT) {
+                            break;
+                        }
+                        res += ggml_type_name(type);
+                        res += ',';
+                    }
+                    return res;
+                };
+
+                const std::string fingerprint = string_format("%s|%s|%" PRIu64 "|%s|%s|%s|%s|%d|%d",
+                        params_base.model.path.c_str(), model_desc, llama_model_n_params(model),
+                        ggml_type_name(params_base.cache_type_k), ggml_type_name(params_base.cache_type_v),
+                        types_layer(params_base.cache_types_k_layer).c_str(), types_layer(params_base.cache_types_v_layer).c_str(),
+                        params_base.kv_block_size, params_base.flash_attn);
+
+                prompt_cache.init_ram((size_t) std::max(params_base.prompt_cache_ram, 0)*1024*1024, fingerprint);
+
+                if (params_base.prompt_cache_ram > 0) {
+                    SRV_INF("prompt cache in memory: %d MiB\n", params_base.prompt_cache_ram);
+                }
+
+                if (params_base.prompt_cache_dir.empty()) {
+                    // nothing to do
+                } else if (prompt_cache.init(params_base.prompt_cache_dir, (size_t) params_base.prompt_cache_size*1024*1024, fingerprint)) {
+                    SRV_INF("prompt cache in '%s': %zu prompts, %.1f MiB of %d MiB\n", prompt_cache.dir.c_str(),
+                            prompt_cache.entries.size(), prompt_cache.n_bytes/1024.0/1024.0, params_base.prompt_cache_size);
+                } else {
+                    SRV_WRN("failed to create prompt cache directory '%s', disabling --prompt-cache-dir\n", params_base.prompt_cache_dir.c_str());
+                }
+            }
+        }
+
+        // completions are disabled in this mode, so the slots and their sequences are never used
+        embd_packing = params_base.embedding && llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE && !llama_model_is_recurrent(model);
+        if (embd_packing) {
+            SRV_INF("%s", "embedding inputs are packed into shared batches instead of slots\n");
+        }
+
+        if (params_base.response_cache_size > 0) {
+            response_cache.init(params_base.model.path, (size_t) params_base.response_cache_size*1024*1024, params_base.response_cache_ttl);
+        }
+
+        if (params_base.itl_target_ms > 0) {
+            prefill_budget.init(params_base.itl_target_ms, llama_n_batch(ctx));
+        }
+
+        if (model_dft && params_base.speculative.batched) {
+            llama_context_params cparams = cparams_dft;
+            cparams.n_ctx     = cparams_dft.n_ctx * params_base.n_parallel;
+            cparams.n_batch   = cparams.n_ctx;
+            cparams.n_seq_max = params_base.n_parallel;
+
+            ctx_dft = llama_init_from_model(model_dft, cparams);
+            if (ctx_dft == nullptr) {
+                SRV_ERR("%s", "failed to create draft context\n");
+                return;
+            }
+
+            batch_dft  = llama_batch_init(cparams.n_ctx, 0, 1);
+            batch_spec = llama_batch_init(params_base.n_parallel * (params_base.speculative.n_max + 1), 0, 1);
+
+            SRV_INF("batched speculative decoding, shared draft context n_ctx = %d\n", (int) cparams.n_ctx);
+        }
+
+        for (int i = 0; i < params_base.n_parallel; i++) {
+            server_slot slot;
+
+            slot.id = i;
+            slot.ctx = ctx;
+            slot.n_ctx = n_ctx_slot;
+            slot.n_predict = params_base.n_predict;
+
+            if (ctx_dft) {
+                // same as the sampler of common_speculative
+                common_params_sampling params_smpl;
+                params_smpl.no_perf  = false;
+                params_smpl.top_k    = 10;
+                params_smpl.samplers = { COMMON_SAMPLER_TYPE_TOP_K };
+
+                slot.smpl_dft = common_sampler_init(model_dft, params_smpl);
+            } else if (model_dft) {
+                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+
+                slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
+                if (slot.ctx_dft == nullptr) {
+                    SRV_ERR("%s", "failed to create draft context\n");
+                    return;
+                }
+
+                slot.spec = common_speculative_init(slot.ctx_dft);
+                if (slot.spec == nullptr) {
+                    SRV_ERR("%s", "failed to create speculator\n");
+                    return;
+                }
+            }
+
+            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+
+            slot.params.sampling = params_base.sampling;
+
+            slot.callback_on_release = [this](int id_slot) {
+                if (params_base.slot_prefix_share) {
+                    prefix_tree_update(slots[id_slot]);
+                }
+                metrics.on_release(slots[id_slot]);
+                queue_tasks.pop_deferred_task();
+            };
+
+            slot.reset();
+
+            slots.push_back(slot);
+        }
+
+        default_generation_settings_for_props = slots[0].to_json();
+
+        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
+        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
+        {
+            const int32_t n_batch = llama_n_batch(ctx);
+
+            // only a single seq_id per token is needed
+            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
+        }
+
+        metrics.init();
+    }
+
+    server_slot * get_slot_by_id(int id) {
+        for (server_slot & slot : slots) {
+            if (slot.id == id) {
+                return &slot;
+            }
+        }
+
+        return nullptr;
+    }
+
+    server_slot * get_available_slot(const server_task & task) {
+        server_slot * ret = nullptr;
+
+        // find the slot that has at least n% prompt similarity
+        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
+            int lcs_len = 0;
+            float similarity = 0;
+
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                // skip the slot if it does not contains cached tokens
+                if (slot.cache_tokens.empty()) {
+                    continue;
+                }
+
+                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
+                int cur_lcs_len = common_lcs(slot.cache_tokens, task.prompt_tokens);
+
+                // fraction of the common subsequence length compared to the current slot's prompt length
+                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+
+                // select the current slot if the criteria match
+                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
+                    lcs_len = cur_lcs_len;
+                    similarity = cur_similarity;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+            }
+        }
+
+        // find the slot that has been least recently used
+        if (ret == nullptr) {
+            int64_t t_last = ggml_time_us();
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                // select the current slot if the criteria match
+                if (slot.t_last_used < t_last) {
+                    t_last = slot.t_last_used;
+                    ret = &slot;
                 }
             }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+            }
+        }
+
+        return ret;
+    }
+
+    bool can_be_detokenized(const struct llama_context * ctx, const std::vector<llama_token> & tokens) {
+        const llama_model * model = llama_get_model(ctx);
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+        const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+        for (const auto & token : tokens) {
+            if (token < 0 || token >= n_vocab) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
+        // the cached tokens of the slot are about to change
+        prefix_tree.remove(slot.id);
+
+        slot.reset();
+        slot.id_task       = task.id;
+        slot.index         = task.index;
+        slot.task_type     = task.type;
+        slot.params        = std::move(task.params);
+        slot.prompt_tokens = std::move(task.prompt_tokens);
+
+        if (!are_lora_equal(task.params.lora, slot.lora)) {
+            // if lora is changed, we cannot reuse cached tokens
+            slot.cache_tokens.clear();
+            slot.lora = task.params.lora;
         }
-    }
 
-private:
-    void cleanup_pending_task(int id_target) {
-        // no need lock because this is called exclusively by post()
-        auto rm_func = [id_target](const server_task & task) {
-            return task.id_target == id_target;
-        };
-        queue_tasks.erase(
-            std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
-            queue_tasks.end());
-        queue_tasks_deferred.erase(
-            std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
-            queue_tasks_deferred.end());
-    }
-};
+        bool can_detokenize = can_be_detokenized(ctx, slot.prompt_tokens);
+        if (!can_detokenize) {
+            send_error(task, "Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST);
+            return false;
+        }
+        SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
 
-struct server_response {
-    bool running = true;
+        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
+            // Might be better to reject the request with a 400 ?
+            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d\n", slot.params.n_predict, slot.n_predict);
+            slot.params.n_predict = slot.n_predict;
+        }
 
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+        if (slot.params.ignore_eos && has_eos_token) {
+            slot.params.sampling.logit_bias.push_back({llama_vocab_eos(vocab), -INFINITY});
+        }
 
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+        {
+            if (slot.smpl != nullptr) {
+                common_sampler_free(slot.smpl);
+            }
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+            slot.smpl = common_sampler_init(model, slot.params.sampling);
+            if (slot.smpl == nullptr) {
+                // for now, the only error that may happen here is invalid grammar
+                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+        }
 
-    // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+        if (slot.ctx_dft) {
+            llama_batch_free(slot.batch_spec);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
-    }
+            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+        }
 
-    void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        if (slot.smpl_dft) {
+            // the shared verification batch has room for --draft-max tokens per slot
+            slot.params.speculative.n_max = std::min(slot.params.speculative.n_max, params_base.speculative.n_max);
 
-        for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+            // start with the longest draft
+            slot.p_accept = 1.0f - 1.0f / std::max(1, slot.params.speculative.n_max);
         }
-    }
 
-    // when the request is finished, we can remove task associated with it
-    void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        slot.state = SLOT_STATE_STARTED;
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
-        // make sure to clean up all pending results
-        queue_results.erase(
-            std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
-                return res->id == id_task;
-            }),
-            queue_results.end());
+        SLT_INF(slot, "%s", "processing task\n");
+
+        return true;
     }
 
-    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+    void kv_cache_clear() {
+        SRV_DBG("%s", "clearing KV cache\n");
 
-        for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+        // clear the entire KV cache
+        llama_kv_self_clear(ctx);
+        clean_kv_cache = false;
+
+        prefix_tree.clear();
+        for (auto & slot : slots) {
+            slot.n_kv_shared = 0;
         }
     }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                if (!running) {
-                    SRV_DBG("%s : queue result stop\n", __func__);
-                    std::terminate(); // we cannot return here since the caller is HTTP code
-                }
-                return !queue_results.empty();
-            });
+    // defragment the KV cache in short steps while the server is idle (--defrag-idle), until there is nothing worth
+    // moving, a new task arrives or the time budget of the gap is used up. the moves pay off if the gaps would cost the
+    // decode steps of the next request more, which are expected to be as many as for the requests so far
+    void kv_defrag_idle() {
+        // cells moved per step, a step is one graph of copies
+        constexpr int32_t n_moves_step = 16;
 
-            for (size_t i = 0; i < queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        if (metrics.n_tasks_released == 0) {
+            return;
         }
 
-        // should never reach here
-    }
+        const int32_t n_ubatch_expected = std::max<uint64_t>(1, metrics.n_decode_total / metrics.n_tasks_released);
 
-    // same as recv(), but have timeout in seconds
-    // if timeout is reached, nullptr is returned
-    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
+        const int64_t t_start = ggml_time_us();
+        const int64_t t_end   = t_start + 1000ll*params_base.defrag_idle_ms;
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        const llama_kv_defrag_stats stats = llama_kv_self_defrag_stats(ctx);
 
-            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
-            if (!running) {
-                SRV_DBG("%s : queue result stop\n", __func__);
-                std::terminate(); // we cannot return here since the caller is HTTP code
-            }
-            if (cr_res == std::cv_status::timeout) {
-                return nullptr;
+        int32_t n_moved = 0;
+        while (queue_tasks.empty() && ggml_time_us() < t_end) {
+            const int32_t n = llama_kv_self_defrag_step(ctx, n_moves_step, n_ubatch_expected);
+            if (n == 0) {
+                break;
             }
+            n_moved += n;
         }
 
-        // should never reach here
-    }
+        if (n_moved == 0) {
+            return;
+        }
 
-    // single-task version of recv()
-    server_task_result_ptr recv(int id_task) {
-        std::unordered_set<int> id_tasks = {id_task};
-        return recv(id_tasks);
-    }
+        const int64_t t_defrag_us = ggml_time_us() - t_start;
 
-    // Send a new result to a waiting id_task
-    void send(server_task_result_ptr && result) {
-        SRV_DBG("sending result for task id = %d\n", result->id);
+        metrics.n_defrag_cells_total += n_moved;
+        metrics.t_defrag_us_total    += t_defrag_us;
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result->id == id_task) {
-                SRV_DBG("task id = %d pushed to result queue\n", result->id);
+        SRV_INF("defragmented the KV cache while idle: moved %d cells in %.2f ms, attended cells %d -> %d\n",
+                n_moved, t_defrag_us/1000.0, stats.n_attended, llama_kv_self_defrag_stats(ctx).n_attended);
+    }
 
-                queue_results.emplace_back(std::move(result));
-                condition_results.notify_all();
-                return;
-            }
+    // make the cached tokens of an idle slot available to the other slots
+    void prefix_tree_update(server_slot & slot) {
+        if (slot.params.cache_prompt && !slot.is_non_causal()) {
+            prefix_tree.insert(slot.id, slot.cache_tokens);
+        } else {
+            prefix_tree.remove(slot.id);
         }
     }
 
-    // terminate the waiting loop
-    void terminate() {
-        running = false;
-        condition_results.notify_all();
-    }
-};
+    // copy the longest prefix of the prompt cached in another slot, if it is longer than the one cached in this slot
+    void prefix_tree_share(server_slot & slot) {
+        const auto & prompt_tokens = slot.prompt_tokens;
 
-struct server_context {
-    common_params params_base;
+        const auto can_share = [&](int id) {
+            const server_slot & other = slots[id];
+            return other.id != slot.id && !other.is_non_causal() && are_lora_equal(other.lora, slot.lora);
+        };
 
-    // note: keep these alive - they determine the lifetime of the model, context, etc.
-    common_init_result llama_init;
-    common_init_result llama_init_dft;
+        int id_src = -1;
+        const int n_shared = prefix_tree.find(prompt_tokens, can_share, id_src);
+        if (n_shared <= slot.n_past) {
+            return;
+        }
 
-    llama_model * model = nullptr;
-    llama_context * ctx = nullptr;
+        server_slot & src = slots[id_src];
 
-    const llama_vocab * vocab = nullptr;
+        SLT_INF(slot, "copying %d cached prompt tokens from slot %d\n", n_shared, src.id);
 
-    llama_model * model_dft = nullptr;
+        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+        llama_kv_self_seq_cp(ctx, src.id, slot.id, 0, n_shared);
 
-    llama_context_params cparams_dft;
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_shared);
+        slot.n_past      = n_shared;
+        slot.n_kv_shared = n_shared;
+        src.n_kv_shared  = std::max(src.n_kv_shared, n_shared);
+    }
 
-    llama_batch batch = {};
+    // write the cached prompt of a slot to the prompt cache, unless it is already there
+    // only the copy of the state out of the KV cache blocks the slots, the compression and the write of the file run on
+    // the thread of prompt_cache_writer, and the entry is added when the job is collected
+    void prompt_cache_save(const server_slot & slot) {
+        if (slot.is_non_causal()) {
+            return;
+        }
 
-    bool clean_kv_cache = true;
-    bool add_bos_token  = true;
-    bool has_eos_token  = false;
+        prompt_cache_collect();
 
-    int32_t n_ctx; // total context for all clients / slots
+        // the last sampled token might not be in the KV cache yet
+        const size_t n_tokens = std::min<size_t>(slot.cache_tokens.size(), llama_kv_self_seq_pos_max(ctx, slot.id) + 1);
+        if (n_tokens < server_prompt_cache::n_tokens_min) {
+            return;
+        }
 
-    // slots / clients
-    std::vector<server_slot> slots;
-    json default_generation_settings_for_props;
+        const uint64_t h = prompt_cache.hash(slot.cache_tokens.data(), n_tokens);
+        if (prompt_cache.contains(h)) {
+            prompt_cache.touch(h);
+            return;
+        }
+        if (prompt_cache_writer.is_pending(h)) {
+            return;
+        }
 
-    server_queue    queue_tasks;
-    server_response queue_results;
+        server_prompt_cache_writer::job j;
+        j.h          = h;
+        j.tokens     = llama_tokens(slot.cache_tokens.begin(), slot.cache_tokens.begin() + n_tokens);
+        j.n_state    = llama_state_seq_get_size(ctx, slot.id);
+        j.t_start_us = ggml_time_us();
 
-    server_metrics metrics;
+        if (prompt_cache.n_bytes_ram_max == 0) {
+            j.filepath = prompt_cache.path(h);
+        }
 
-    // Necessary similarity of prompt for slot selection
-    float slot_prompt_similarity = 0.0f;
+        j.data.resize(llama_state_seq_get_size_ext(ctx, slot.id, LLAMA_STATE_SEQ_FLAGS_PACKED));
 
-    common_chat_templates_ptr chat_templates;
+        const size_t n_data = llama_state_seq_get_data_ext(ctx, j.data.data(), j.data.size(), slot.id, LLAMA_STATE_SEQ_FLAGS_PACKED);
+        if (j.n_state == 0 || n_data == 0) {
+            SLT_WRN(slot, "failed to copy %zu tokens to the prompt cache\n", n_tokens);
+            return;
+        }
 
-    ~server_context() {
-        // Clear any sampling context
-        for (server_slot & slot : slots) {
-            common_sampler_free(slot.smpl);
-            slot.smpl = nullptr;
+        j.data.resize(n_data);
+        j.t_copy_us = ggml_time_us() - j.t_start_us;
 
-            llama_free(slot.ctx_dft);
-            slot.ctx_dft = nullptr;
+        prompt_cache_writer.post(std::move(j));
+    }
 
-            common_speculative_free(slot.spec);
-            slot.spec = nullptr;
+    // add the states compressed (and written) by prompt_cache_writer to the prompt cache, waiting for all of them with wait
+    void prompt_cache_collect(bool wait = false) {
+        for (server_prompt_cache_writer::job & j : prompt_cache_writer.collect(wait)) {
+            if (j.n_bytes == 0) {
+                SRV_WRN("failed to %s %zu tokens to the prompt cache\n", j.filepath.empty() ? "compress" : "write", j.tokens.size());
+                continue;
+            }
 
-            llama_batch_free(slot.batch_spec);
-        }
+            const double t_ms      = (ggml_time_us() - j.t_start_us)/1000.0;
+            const double t_copy_ms = j.t_copy_us/1000.0;
 
-        llama_batch_free(batch);
-    }
+            if (j.filepath.empty()) {
+                SRV_INF("saved %zu tokens (%.1f MiB, %.1f MiB compressed) to the prompt cache in memory in %.2f ms, %.2f ms for the copy\n",
+                        j.tokens.size(), j.n_state/1024.0/1024.0, j.data.size()/1024.0/1024.0, t_ms, t_copy_ms);
 
-    bool load_model(const common_params & params) {
-        SRV_INF("loading model '%s'\n", params.model.path.c_str());
+                prompt_cache.add(j.h, j.tokens, j.n_state, std::filesystem::file_time_type::clock::now(), std::move(j.data));
+            } else {
+                SRV_INF("saved %zu tokens (%.1f MiB) to the prompt cache in %.2f ms, %.2f ms for the copy\n",
+                        j.tokens.size(), j.n_bytes/1024.0/1024.0, t_ms, t_copy_ms);
 
-        params_base = params;
+                prompt_cache.add(j.h, j.tokens, j.n_bytes, std::filesystem::file_time_type::clock::now());
+            }
 
-        llama_init = common_init_from_params(params_base);
+            prompt_cache.evict();
+        }
+    }
 
-        model = llama_init.model.get();
-        ctx   = llama_init.context.get();
+    // restore the cached prompt that shares the longest prefix with the prompt of the slot from the prompt cache, if that
+    // prefix is longer than the one in the slot. the tokens after the common prefix are removed afterwards
+    void prompt_cache_load(server_slot & slot) {
+        prompt_cache_collect();
 
-        if (model == nullptr) {
-            SRV_ERR("failed to load model, '%s'\n", params_base.model.path.c_str());
-            return false;
+        uint64_t h = 0;
+        const size_t n_match = prompt_cache.find(slot.prompt_tokens, h);
+        if (n_match < server_prompt_cache::n_tokens_min || n_match <= (size_t) slot.n_past) {
+            return;
         }
 
-        vocab = llama_model_get_vocab(model);
-
-        n_ctx = llama_n_ctx(ctx);
+        const int64_t t_start = ggml_time_us();
 
-        add_bos_token = llama_vocab_get_add_bos(vocab);
-        has_eos_token = llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL;
+        const server_prompt_cache::entry & e = prompt_cache.entries.at(h);
 
-        if (!params_base.speculative.model.path.empty() || !params_base.speculative.model.hf_repo.empty()) {
-            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.path.c_str());
+        const bool         in_ram   = e.in_ram();
+        const size_t       n_tokens = e.n_tokens;
+        const llama_tokens tokens   = prompt_cache.tree.cached.at(e.id);
 
-            auto params_dft = params_base;
+        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
 
-            params_dft.devices      = params_base.speculative.devices;
-            params_dft.model        = params_base.speculative.model;
-            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
-            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
-            params_dft.n_parallel   = 1;
+        slot.n_kv_shared = 0;
 
-            // force F16 KV cache for the draft model for extra performance
-            params_dft.cache_type_k = GGML_TYPE_F16;
-            params_dft.cache_type_v = GGML_TYPE_F16;
+        // an entry that fails to restore is dropped: the fingerprint matched, so its state is damaged (the checksums of
+        // the packed format fail) or too large for the KV cache, and it would otherwise wipe the slot at every match
+        size_t nread = 0;
 
-            llama_init_dft = common_init_from_params(params_dft);
+        if (in_ram) {
+            nread = llama_state_seq_set_data_ext(ctx, e.data.data(), e.data.size(), slot.id, LLAMA_STATE_SEQ_FLAGS_COMPRESS);
+        } else {
+            const server_mapped_file file(prompt_cache.path(h));
 
-            model_dft = llama_init_dft.model.get();
+            const size_t n_header = sizeof(uint32_t) * 3 + n_tokens * sizeof(llama_token);
 
-            if (model_dft == nullptr) {
-                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.path.c_str());
-                return false;
+            uint32_t header[3] = {};
+            if (file.size >= n_header) {
+                memcpy(header, file.data, sizeof(header));
             }
 
-            if (!common_speculative_are_compatible(ctx, llama_init_dft.context.get())) {
-                SRV_ERR("the draft model '%s' is not compatible with the target model '%s'\n", params_base.speculative.model.path.c_str(), params_base.model.path.c_str());
-
-                return false;
+            if (file.size >= n_header && header[0] == LLAMA_STATE_SEQ_MAGIC && header[1] == LLAMA_STATE_SEQ_VERSION &&
+                header[2] == n_tokens && memcmp(file.data + sizeof(header), tokens.data(), n_tokens * sizeof(llama_token)) == 0) {
+                nread = llama_state_seq_set_data_ext(ctx, file.data + n_header, file.size - n_header, slot.id, LLAMA_STATE_SEQ_FLAGS_PACKED);
             }
+        }
 
-            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+        if (nread == 0) {
+            SLT_WRN(slot, "failed to restore %zu tokens from the prompt cache\n", n_tokens);
 
-            cparams_dft = common_context_params_to_llama(params_dft);
-            cparams_dft.n_batch = n_ctx_dft;
+            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
 
-            // the context is not needed - we will create one for each slot
-            llama_init_dft.context.reset();
+            prompt_cache.remove(h);
+            return;
         }
 
-        chat_templates = common_chat_templates_init(model, params_base.chat_template);
-        try {
-            common_chat_format_example(chat_templates.get(), params.use_jinja);
-        } catch (const std::exception & e) {
-            SRV_WRN("%s: Chat template parsing error: %s\n", __func__, e.what());
-            SRV_WRN("%s: The chat template that comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses\n", __func__);
-            chat_templates = common_chat_templates_init(model, "chatml");
-        }
+        slot.cache_tokens = tokens;
+        slot.n_past       = n_match;
 
-        return true;
+        prompt_cache.touch(h);
+
+        SLT_INF(slot, "restored %zu tokens (%.1f MiB) from the prompt cache %s in %.2f ms, %zu tokens match the prompt\n",
+                n_tokens, nread/1024.0/1024.0, in_ram ? "in memory" : "on disk", (ggml_time_us() - t_start)/1000.0, n_match);
     }
 
-    void init() {
-        const int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
+    // keep the prompts cached in the slots for the next start of the server
+    void prompt_cache_save_all() {
+        if (!prompt_cache.enabled()) {
+            return;
+        }
 
-        SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
+        for (const server_slot & slot : slots) {
+            prompt_cache_save(slot);
+        }
 
-        for (int i = 0; i < params_base.n_parallel; i++) {
-            server_slot slot;
+        prompt_cache_collect(true);
 
-            slot.id = i;
-            slot.ctx = ctx;
-            slot.n_ctx = n_ctx_slot;
-            slot.n_predict = params_base.n_predict;
+        prompt_cache.spill_all();
+    }
 
-            if (model_dft) {
-                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+    //
+    // scheduling of the waiting tasks (see server_task_scheduler)
+    //
 
-                slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
-                if (slot.ctx_dft == nullptr) {
-                    SRV_ERR("%s", "failed to create draft context\n");
-                    return;
-                }
+    // estimated time in ms until the first token of a task: the wait for a slot plus the prompt processing
+    // the wait assumes that the waiting tasks of the same and higher priority classes are served first
+    double sched_estimate_ms(const server_task & task, bool has_slot) const {
+        double t_ms = 0.0;
 
-                slot.spec = common_speculative_init(slot.ctx_dft);
-                if (slot.spec == nullptr) {
-                    SRV_ERR("%s", "failed to create speculator\n");
-                    return;
-                }
-            }
+        if (!has_slot && metrics.n_tasks_released > 0) {
+            const double t_task_ms = metrics.t_tasks_released_us / 1e3 / metrics.n_tasks_released;
+            const size_t n_ahead   = queue_tasks.queue_tasks_deferred.n_ahead(task.sched.priority);
 
-            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+            t_ms += t_task_ms * (n_ahead + 1) / slots.size();
+        }
 
-            slot.params.sampling = params_base.sampling;
+        if (metrics.n_prompt_tokens_processed_total > 0) {
+            t_ms += (double) metrics.t_prompt_processing_total / metrics.n_prompt_tokens_processed_total * task.prompt_tokens.size();
+        }
 
-            slot.callback_on_release = [this](int) {
-                queue_tasks.pop_deferred_task();
-            };
+        return t_ms;
+    }
 
-            slot.reset();
+    // reject a task early if its deadline has passed or cannot be met anymore, instead of letting it wait for nothing
+    bool sched_check_deadline(const server_task & task, bool has_slot) {
+        if (task.sched.deadline_ms <= 0) {
+            return true;
+        }
 
-            slots.push_back(slot);
+        const double t_waited_ms    = (ggml_time_us() - task.sched.t_queued) / 1e3;
+        const double t_estimated_ms = sched_estimate_ms(task, has_slot);
+
+        if (t_waited_ms + t_estimated_ms <= task.sched.deadline_ms) {
+            return true;
         }
 
-        default_generation_settings_for_props = slots[0].to_json();
+        SRV_WRN("rejecting task %d: waited %.1f ms + estimated %.1f ms exceeds its deadline of %d ms\n",
+                task.id, t_waited_ms, t_estimated_ms, task.sched.deadline_ms);
 
-        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
-        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
-        {
-            const int32_t n_batch = llama_n_batch(ctx);
+        metrics.n_rejected_deadline[task.sched.priority]++;
 
-            // only a single seq_id per token is needed
-            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
-        }
+        send_error(task, string_format("the request cannot be served within its deadline of %d ms", task.sched.deadline_ms), ERROR_TYPE_UNAVAILABLE);
 
-        metrics.init();
+        return false;
     }
 
-    server_slot * get_slot_by_id(int id) {
-        for (server_slot & slot : slots) {
-            if (slot.id == id) {
-                return &slot;
+    //
+    // shared KV pool (--kv-pool)
+    //
+    // all slots draw their KV cells from the n_ctx cells of the cache instead of owning n_ctx / n_parallel
+    // each. a slot uses one cell per token and may grow up to slot.n_ctx. the cached tokens of idle slots
+    // are evicted (least recently used first) when the cells are needed, a new task is only admitted if
+    // its prompt fits into the pool, and when generation runs out of cells the longest sequence is shifted
+    //
+
+    // number of cells held by the sequence of an idle slot (the KV cache is kept after release)
+    int32_t kv_pool_n_held(const server_slot & slot) const {
+        return std::max<int32_t>(slot.n_past, slot.cache_tokens.size());
+    }
+
+    // number of cells that are neither used nor still needed by prompts that have been admitted
+    int32_t kv_pool_n_free() const {
+        int32_t n_free = n_ctx - llama_kv_self_used_cells(ctx);
+
+        for (const auto & slot : slots) {
+            if (slot.state == SLOT_STATE_STARTED) {
+                n_free -= slot.n_kv_reserved;
+            } else if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+                // +1 for the first generated token
+                n_free -= slot.n_prompt_tokens - slot.n_past + 1;
             }
         }
 
-        return nullptr;
+        return n_free;
     }
 
-    server_slot * get_available_slot(const server_task & task) {
-        server_slot * ret = nullptr;
-
-        // find the slot that has at least n% prompt similarity
-        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
-            int lcs_len = 0;
-            float similarity = 0;
+    // evict the cached tokens of idle slots until at least n_cells are free
+    bool kv_pool_make_room(int32_t n_cells, const server_slot * keep) {
+        while (kv_pool_n_free() < n_cells) {
+            server_slot * lru = nullptr;
 
             for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
+                if (&slot == keep || slot.is_processing() || kv_pool_n_held(slot) == 0) {
                     continue;
                 }
 
-                // skip the slot if it does not contains cached tokens
-                if (slot.cache_tokens.empty()) {
-                    continue;
+                if (lru == nullptr || slot.t_last_used < lru->t_last_used) {
+                    lru = &slot;
                 }
+            }
 
-                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
-                int cur_lcs_len = common_lcs(slot.cache_tokens, task.prompt_tokens);
+            if (lru == nullptr) {
+                return false;
+            }
 
-                // fraction of the common subsequence length compared to the current slot's prompt length
-                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+            SLT_INF(*lru, "evicting %d cells from the KV pool\n", kv_pool_n_held(*lru));
 
-                // select the current slot if the criteria match
-                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
-                    lcs_len = cur_lcs_len;
-                    similarity = cur_similarity;
-                    ret = &slot;
-                }
+            if (prompt_cache.enabled()) {
+                prompt_cache_save(*lru);
             }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+            llama_kv_self_seq_rm(ctx, lru->id, -1, -1);
+            lru->cache_tokens.clear();
+            lru->n_past      = 0;
+            lru->n_kv_shared = 0;
+
+            prefix_tree.remove(lru->id);
+        }
+
+        return true;
+    }
+
+    // admission control: reserve the cells for the prompt of a task, or return false if the task has to wait
+    bool kv_pool_admit(server_slot & slot, const server_task & task) {
+        // long prompts are truncated to fit into the slot later on
+        const int32_t n_prompt = std::min<int32_t>(task.prompt_tokens.size(), slot.n_ctx - 1);
+
+        // the cells already held by the slot are either reused for the prompt or freed when it is processed
+        const int32_t n_needed = std::max(n_prompt + 1 - kv_pool_n_held(slot), 0);
+
+        if (!kv_pool_make_room(n_needed, &slot)) {
+            SRV_DBG("not enough free cells in the KV pool, n_needed = %d, n_free = %d\n", n_needed, kv_pool_n_free());
+            return false;
+        }
+
+        slot.n_kv_reserved = n_needed;
+
+        return true;
+    }
+
+    // make sure that the generating slots get a new cell each, shifting the context of the longest ones if needed
+    void kv_pool_ensure_generation() {
+        int32_t n_needed = 0;
+        for (const auto & slot : slots) {
+            if (slot.state == SLOT_STATE_GENERATING) {
+                n_needed++;
             }
         }
 
-        // find the slot that has been least recently used
-        if (ret == nullptr) {
-            int64_t t_last = ggml_time_us();
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+        if (n_needed == 0 || kv_pool_make_room(n_needed, nullptr)) {
+            return;
+        }
 
-                // select the current slot if the criteria match
-                if (slot.t_last_used < t_last) {
-                    t_last = slot.t_last_used;
-                    ret = &slot;
+        while (kv_pool_n_free() < n_needed) {
+            server_slot * longest = nullptr;
+
+            for (server_slot & slot : slots) {
+                if (slot.state == SLOT_STATE_GENERATING && (longest == nullptr || slot.n_past > longest->n_past)) {
+                    longest = &slot;
                 }
             }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+            if (longest == nullptr) {
+                break;
             }
-        }
 
-        return ret;
-    }
+            SLT_WRN(*longest, "%s", "shared KV pool is full\n");
 
-    bool can_be_detokenized(const struct llama_context * ctx, const std::vector<llama_token> & tokens) {
-        const llama_model * model = llama_get_model(ctx);
-        const llama_vocab * vocab = llama_model_get_vocab(model);
-        const int32_t n_vocab = llama_vocab_n_tokens(vocab);
-        for (const auto & token : tokens) {
-            if (token < 0 || token >= n_vocab) {
-                return false;
+            if (!params_base.ctx_shift || !context_shift(*longest)) {
+                longest->release();
+                send_error(*longest, "the shared KV pool is full and the context of the slot cannot be shifted", ERROR_TYPE_SERVER);
+                n_needed--;
             }
         }
-        return true;
     }
 
-    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
-        slot.reset();
-        slot.id_task       = task.id;
-        slot.index         = task.index;
-        slot.task_type     = task.type;
-        slot.params        = std::move(task.params);
-        slot.prompt_tokens = std::move(task.prompt_tokens);
+    // returns false if nothing can be discarded
+    bool context_shift(server_slot & slot) {
+        // cells shared with other slots are kept in place
+        int n_keep = std::max(slot.params.n_keep + add_bos_token, slot.n_kv_shared);
+        int n_step = (slot.n_past - n_keep) / 2;
 
-        if (!are_lora_equal(task.params.lora, slot.lora)) {
-            // if lora is changed, we cannot reuse cached tokens
-            slot.cache_tokens.clear();
-            slot.lora = task.params.lora;
+        // with attention sinks, the oldest tokens after them are evicted in small steps - the KV cache shifts the rest of
+        // the context lazily, so that a step only rotates the kept tokens (see llama_kv_cache_unified::seq_pos_offs)
+        if (params_base.n_ctx_sinks > 0) {
+            n_keep = std::max(n_keep, params_base.n_ctx_sinks);
+            n_step = std::min(slot.n_past - n_keep, CONTEXT_SINKS_STEP);
         }
 
-        bool can_detokenize = can_be_detokenized(ctx, slot.prompt_tokens);
-        if (!can_detokenize) {
-            send_error(task, "Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST);
+        const int n_left    = slot.n_past - n_keep;
+        const int n_discard = slot.params.n_discard ? slot.params.n_discard : n_step;
+
+        if (n_discard <= 0 || n_discard > n_left) {
+            SLT_WRN(slot, "cannot shift context, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
             return false;
         }
-        SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
 
-        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
-            // Might be better to reject the request with a 400 ?
-            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d\n", slot.params.n_predict, slot.n_predict);
-            slot.params.n_predict = slot.n_predict;
-        }
+        // the positions of the cached tokens change
+        prefix_tree.remove(slot.id);
 
-        if (slot.params.ignore_eos && has_eos_token) {
-            slot.params.sampling.logit_bias.push_back({llama_vocab_eos(vocab), -INFINITY});
-        }
+        SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
-        {
-            if (slot.smpl != nullptr) {
-                common_sampler_free(slot.smpl);
-            }
+        llama_kv_self_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
+        llama_kv_self_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
 
-            slot.smpl = common_sampler_init(model, slot.params.sampling);
-            if (slot.smpl == nullptr) {
-                // for now, the only error that may happen here is invalid grammar
-                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
-                return false;
+        if (slot.params.cache_prompt) {
+            for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
+                slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
             }
-        }
-
-        if (slot.ctx_dft) {
-            llama_batch_free(slot.batch_spec);
 
-            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+            slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
         }
 
-        slot.state = SLOT_STATE_STARTED;
+        slot.n_past -= n_discard;
 
-        SLT_INF(slot, "%s", "processing task\n");
+        slot.truncated = true;
 
         return true;
     }
 
-    void kv_cache_clear() {
-        SRV_DBG("%s", "clearing KV cache\n");
-
-        // clear the entire KV cache
-        llama_kv_self_clear(ctx);
-        clean_kv_cache = false;
-    }
-
     bool process_token(completion_token_output & result, server_slot & slot) {
         // remember which tokens were sampled - used for repetition penalties during sampling
         const std::string token_str = result.text_to_send;
@@ -2316,7 +4233,6 @@ struct server_context {
 
     void populate_token_probs(const server_slot & slot, completion_token_output & result, bool post_sampling, bool special, int idx) {
         size_t n_probs = slot.params.sampling.n_probs;
-        size_t n_vocab = llama_vocab_n_tokens(vocab);
         if (post_sampling) {
             const auto * cur_p = common_sampler_get_candidates(slot.smpl);
             const size_t max_probs = cur_p->size;
@@ -2339,21 +4255,11 @@ struct server_context {
                 });
             }
         } else {
-            // TODO: optimize this with min-p optimization
-            std::vector<llama_token_data> cur = get_token_probabilities(ctx, idx);
-
-            // set probability for sampled token
-            for (size_t i = 0; i < n_vocab; i++) {
-                // set probability for sampled token
-                if (cur[i].id == result.tok) {
-                    result.prob = cur[i].p;
-                    break;
-                }
-            }
+            std::vector<llama_token_data> cur = get_token_probabilities(ctx, idx, n_probs, result.tok, result.prob);
 
             // set probability for top n_probs tokens
-            result.probs.reserve(n_probs);
-            for (size_t i = 0; i < std::min(n_vocab, n_probs); i++) {
+            result.probs.reserve(cur.size());
+            for (size_t i = 0; i < cur.size(); i++) {
                 result.probs.push_back({
                     cur[i].id,
                     common_token_to_piece(ctx, cur[i].id, special),
@@ -2514,24 +4420,156 @@ struct server_context {
                 continue;
             }
 
-            const float * embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
-            if (embd == NULL) {
-                embd = llama_get_embeddings_ith(ctx, i);
+            const float * embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
+            if (embd == NULL) {
+                embd = llama_get_embeddings_ith(ctx, i);
+            }
+
+            if (embd == NULL) {
+                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+
+                res->score = -1e6;
+                continue;
+            }
+
+            res->score = embd[0];
+        }
+
+        SLT_DBG(slot, "sending rerank result, res.score = %f\n", res->score);
+
+        queue_results.send(std::move(res));
+    }
+
+    void send_embedding(const server_task & task, llama_seq_id seq_id) {
+        auto res = std::make_unique<server_task_result_embd>();
+        res->id        = task.id;
+        res->index     = task.index;
+        res->n_tokens  = task.prompt_tokens.size();
+        res->oaicompat = task.params.oaicompat;
+
+        const int n_embd = llama_model_n_embd(model);
+
+        const float * embd = llama_get_embeddings_seq(ctx, seq_id);
+        if (embd == NULL) {
+            SRV_ERR("failed to get embeddings, id_task = %d, seq_id = %d\n", task.id, seq_id);
+
+            res->embedding.push_back(std::vector<float>(n_embd, 0.0f));
+        } else {
+            std::vector<float> embd_res(n_embd, 0.0f);
+            common_embd_normalize(embd, embd_res.data(), n_embd, 2);
+            res->embedding.push_back(std::move(embd_res));
+        }
+
+        queue_results.send(std::move(res));
+    }
+
+    void send_rerank(const server_task & task, llama_seq_id seq_id) {
+        auto res = std::make_unique<server_task_result_rerank>();
+        res->id       = task.id;
+        res->index    = task.index;
+        res->n_tokens = task.prompt_tokens.size();
+
+        const float * embd = llama_get_embeddings_seq(ctx, seq_id);
+        if (embd == NULL) {
+            SRV_ERR("failed to get embeddings, id_task = %d, seq_id = %d\n", task.id, seq_id);
+
+            res->score = -1e6;
+        } else {
+            res->score = embd[0];
+        }
+
+        queue_results.send(std::move(res));
+    }
+
+    // pack the waiting embedding inputs into batches of up to n_ubatch tokens, one sequence per input
+    // a sequence must not be split between micro-batches because its attention is non-causal
+    // the inputs are placed longest first into the first batch with room (first-fit decreasing),
+    // which leaves little unused space per batch; the results carry the task index, so their order is kept
+    // a batch holds at most llama_max_parallel_sequences() sequences, independent of --parallel, and only inputs with
+    // the same LoRA adapters
+    void process_embd_tasks() {
+        const int32_t n_cap     = std::min<int32_t>(llama_n_ubatch(ctx), n_ctx);
+        const size_t  n_seq_cap = llama_max_parallel_sequences();
+
+        std::vector<size_t> order;
+        order.reserve(embd_tasks.size());
+        for (size_t i = 0; i < embd_tasks.size(); ++i) {
+            const auto & task = embd_tasks[i];
+            if ((int32_t) task.prompt_tokens.size() > n_cap) {
+                send_error(task, "input is too large to process. increase the physical batch size", ERROR_TYPE_SERVER);
+                continue;
+            }
+            order.push_back(i);
+        }
+
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return embd_tasks[a].prompt_tokens.size() > embd_tasks[b].prompt_tokens.size();
+        });
+
+        std::vector<std::vector<size_t>> bins;
+        std::vector<int32_t> bins_free;
+        for (const size_t i : order) {
+            const int32_t n_tokens = embd_tasks[i].prompt_tokens.size();
+
+            const auto & lora = embd_tasks[i].params.lora;
+
+            size_t b = 0;
+            while (b < bins.size() && (bins_free[b] < n_tokens || bins[b].size() >= n_seq_cap ||
+                    !are_lora_equal(embd_tasks[bins[b].front()].params.lora, lora))) {
+                ++b;
+            }
+            if (b == bins.size()) {
+                bins.emplace_back();
+                bins_free.push_back(n_cap);
+            }
+            bins[b].push_back(i);
+            bins_free[b] -= n_tokens;
+        }
+
+        llama_set_embeddings(ctx, true);
+
+        for (const auto & bin : bins) {
+            common_batch_clear(batch);
+            for (size_t s = 0; s < bin.size(); ++s) {
+                const auto & tokens = embd_tasks[bin[s]].prompt_tokens;
+                for (size_t j = 0; j < tokens.size(); ++j) {
+                    common_batch_add(batch, tokens[j], j, { (llama_seq_id) s }, j + 1 == tokens.size());
+                }
             }
 
-            if (embd == NULL) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+            common_set_adapter_lora(ctx, embd_tasks[bin.front()].params.lora);
 
-                res->score = -1e6;
-                continue;
+            const int64_t t_start = ggml_time_us();
+
+            const int ret = llama_decode(ctx, batch);
+            metrics.n_decode_total++;
+
+            if (ret != 0) {
+                SRV_ERR("failed to decode the embedding batch, n_seqs = %zu, n_tokens = %d, ret = %d\n", bin.size(), batch.n_tokens, ret);
+                for (const size_t i : bin) {
+                    send_error(embd_tasks[i], "failed to decode the embedding batch", ERROR_TYPE_SERVER);
+                }
+            } else {
+                for (size_t s = 0; s < bin.size(); ++s) {
+                    const auto & task = embd_tasks[bin[s]];
+                    if (task.type == SERVER_TASK_TYPE_RERANK) {
+                        send_rerank(task, s);
+                    } else {
+                        send_embedding(task, s);
+                    }
+                }
+
+                metrics.on_prompt_eval(batch.n_tokens, (ggml_time_us() - t_start) / 1e3);
             }
 
-            res->score = embd[0];
-        }
+            SRV_DBG("embedding batch: n_seqs = %zu, n_tokens = %d / %d\n", bin.size(), batch.n_tokens, n_cap);
 
-        SLT_DBG(slot, "sending rerank result, res.score = %f\n", res->score);
+            for (size_t s = 0; s < bin.size(); ++s) {
+                llama_kv_self_seq_rm(ctx, s, -1, -1);
+            }
+        }
 
-        queue_results.send(std::move(res));
+        embd_tasks.clear();
     }
 
     //
@@ -2598,8 +4636,9 @@ struct server_context {
             const std::function<void(json)> & error_handler,
             const std::function<bool()> & is_connection_closed) {
         size_t n_finished = 0;
+        server_task_result_ptr next;
         while (true) {
-            server_task_result_ptr result = queue_results.recv_with_timeout(id_tasks, HTTP_POLLING_SECONDS);
+            server_task_result_ptr result = next ? std::move(next) : queue_results.recv_with_timeout(id_tasks, HTTP_POLLING_SECONDS);
 
             if (is_connection_closed()) {
                 cancel_tasks(id_tasks);
@@ -2620,6 +4659,17 @@ struct server_context {
                 dynamic_cast<server_task_result_cmpl_partial*>(result.get()) != nullptr
                 || dynamic_cast<server_task_result_cmpl_final*>(result.get()) != nullptr
             );
+
+            // the chunks that piled up while the client was reading are sent as one
+            auto * partial = dynamic_cast<server_task_result_cmpl_partial*>(result.get());
+            while (partial != nullptr && (next = queue_results.try_recv(id_tasks)) != nullptr) {
+                auto * partial_next = dynamic_cast<server_task_result_cmpl_partial*>(next.get());
+                if (partial_next == nullptr || !partial->merge(*partial_next)) {
+                    break;
+                }
+                next.reset();
+            }
+
             if (!result_handler(result)) {
                 cancel_tasks(id_tasks);
                 break;
@@ -2644,10 +4694,21 @@ struct server_context {
             case SERVER_TASK_TYPE_EMBEDDING:
             case SERVER_TASK_TYPE_RERANK:
                 {
+                    if (embd_packing && (task.type == SERVER_TASK_TYPE_EMBEDDING || task.type == SERVER_TASK_TYPE_RERANK)) {
+                        // processed together with the other waiting inputs in update_slots()
+                        metrics.on_launch(task);
+                        embd_tasks.push_back(std::move(task));
+                        break;
+                    }
+
                     const int id_slot = task.id_selected_slot;
 
                     server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
 
+                    if (!sched_check_deadline(task, slot != nullptr && !slot->is_processing())) {
+                        break;
+                    }
+
                     if (slot == nullptr) {
                         // if no slot is available, we defer this task for processing later
                         SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
@@ -2661,6 +4722,15 @@ struct server_context {
                         break;
                     }
 
+                    if (params_base.kv_pool && !kv_pool_admit(*slot, task)) {
+                        // the prompt does not fit into the shared KV pool yet, wait until a slot is released
+                        SRV_DBG("not enough KV cells for the prompt, defer task, id_task = %d\n", task.id);
+                        queue_tasks.defer(task);
+                        break;
+                    }
+
+                    metrics.on_launch(task);
+
                     if (!launch_slot_with_task(*slot, task)) {
                         SRV_ERR("failed to launch slot with task, id_task = %d\n", task.id);
                         break;
@@ -2706,6 +4776,9 @@ struct server_context {
                     res->n_idle_slots        = n_idle_slots;
                     res->n_processing_slots  = n_processing_slots;
                     res->n_tasks_deferred    = queue_tasks.queue_tasks_deferred.size();
+
+                    std::copy(std::begin(metrics.queue_wait), std::end(metrics.queue_wait), std::begin(res->queue_wait));
+                    std::copy(std::begin(metrics.n_rejected_deadline), std::end(metrics.n_rejected_deadline), std::begin(res->n_rejected_deadline));
                     res->t_start             = metrics.t_start;
 
                     res->kv_cache_tokens_count = llama_kv_self_n_tokens(ctx);
@@ -2724,6 +4797,14 @@ struct server_context {
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
 
+                    res->n_defrag_cells_total    = metrics.n_defrag_cells_total;
+                    res->t_defrag_us_total       = metrics.t_defrag_us_total;
+
+                    {
+                        const llama_kv_defrag_stats stats = llama_kv_self_defrag_stats(ctx);
+                        res->kv_cache_fragmentation = stats.n_attended > 0 ? 1.0f - (float) stats.n_attended_min / stats.n_attended : 0.0f;
+                    }
+
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
                     }
@@ -2794,6 +4875,11 @@ struct server_context {
                         break;
                     }
                     slot->cache_tokens.resize(token_count);
+                    slot->n_kv_shared = 0;
+
+                    if (params_base.slot_prefix_share) {
+                        prefix_tree_update(*slot);
+                    }
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -2827,6 +4913,9 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_self_seq_rm(ctx, slot->id, -1, -1);
                     slot->cache_tokens.clear();
+                    slot->n_kv_shared = 0;
+
+                    prefix_tree.remove(slot->id);
 
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
@@ -2844,7 +4933,255 @@ struct server_context {
         }
     }
 
+    bool accept_special_token(const server_slot & slot, llama_token token) const {
+        return params_base.special || slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
+    }
+
+    // the longest draft that fits the current state of a generating slot
+    int get_n_draft_max(const server_slot & slot) const {
+        int n_draft_max = slot.params.speculative.n_max;
+
+        // note: n_past is not yet increased for the `sampled` token
+        //       also, need to leave space for 1 extra token to allow context shifts
+        n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+
+        if (params_base.kv_pool) {
+            n_draft_max = std::min(n_draft_max, kv_pool_n_free() - 1);
+        }
+
+        if (slot.n_remaining > 0) {
+            n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
+        }
+
+        return n_draft_max;
+    }
+
+    // ids are the tokens sampled by the target model after verifying the draft - all but the last one are in the KV cache
+    void accept_draft(server_slot & slot, const llama_tokens & draft, const llama_tokens & ids) {
+        const llama_token id = slot.sampled;
+
+        slot.n_past    += ids.size();
+        slot.n_decoded += ids.size();
+
+        // update how many tokens out of draft was accepted
+        slot.n_draft_accepted += ids.size() - 1;
+
+        slot.cache_tokens.push_back(id);
+        slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
+
+        llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+
+        for (size_t i = 0; i < ids.size(); ++i) {
+            completion_token_output result;
+
+            result.tok          = ids[i];
+            result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+            result.prob         = 1.0f; // set later
+
+            // TODO: set result.probs
+
+            if (!process_token(result, slot)) {
+                // release slot because of stop condition
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+                break;
+            }
+        }
+
+        SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
+    }
+
+    // --draft-batched: draft for all generating slots at once in the shared draft context, one decode per draft
+    // position, and verify all drafts in a single batch of the target model
+    void speculate_batched() {
+        struct spec_seq {
+            server_slot * slot;
+
+            int n_draft;      // adaptive draft length
+            int i_batch;      // index of the last token in batch_dft
+            bool done = false;
+
+            llama_tokens draft;
+        };
+
+        std::vector<spec_seq> seqs;
+
+        int32_t n_pool_free = params_base.kv_pool ? kv_pool_n_free() : 0;
+
+        common_batch_clear(batch_dft);
+
+        for (auto & slot : slots) {
+            if (!slot.is_processing() || !slot.can_speculate() || slot.state != SLOT_STATE_GENERATING) {
+                continue;
+            }
+
+            int n_draft = std::min(get_n_draft_max(slot), slot.get_n_draft_adaptive());
+
+            // the verification batches of the other slots take cells from the KV pool as well
+            if (params_base.kv_pool) {
+                n_draft = std::min(n_draft, n_pool_free - 1);
+            }
+
+            if (n_draft < std::max(1, slot.params.speculative.n_min)) {
+                continue;
+            }
+
+            // the sequence of a slot cannot outgrow its share of the draft context
+            if ((int) slot.cache_tokens.size() + n_draft + 1 > (int) cparams_dft.n_ctx) {
+                SLT_DBG(slot, "prompt does not fit the draft context (%d tokens) - skipping speculative decoding\n", (int) cparams_dft.n_ctx);
+                continue;
+            }
+
+            // bring the draft sequence up to date, reusing the prefix it shares with the cache of the slot
+            const size_t n_keep = common_lcp(slot.prompt_dft, slot.cache_tokens);
+            if (n_keep < slot.prompt_dft.size()) {
+                llama_kv_self_seq_rm(ctx_dft, slot.id, n_keep, -1);
+                slot.prompt_dft.resize(n_keep);
+            }
+
+            for (size_t i = n_keep; i < slot.cache_tokens.size(); ++i) {
+                common_batch_add(batch_dft, slot.cache_tokens[i], i, { slot.id }, false);
+                slot.prompt_dft.push_back(slot.cache_tokens[i]);
+            }
+
+            common_batch_add(batch_dft, slot.sampled, slot.prompt_dft.size(), { slot.id }, true);
+            slot.prompt_dft.push_back(slot.sampled);
+
+            common_sampler_reset(slot.smpl_dft);
+
+            seqs.push_back({ &slot, n_draft, batch_dft.n_tokens - 1, false, {} });
+
+            n_pool_free -= n_draft + 1;
+        }
+
+        if (seqs.empty()) {
+            return;
+        }
+
+        const auto clear_draft_seqs = [&]() {
+            for (auto & seq : seqs) {
+                llama_kv_self_seq_rm(ctx_dft, seq.slot->id, -1, -1);
+                seq.slot->prompt_dft.clear();
+            }
+        };
+
+        // draft one token per slot and step until every slot reaches its draft length or loses confidence
+        for (size_t n_active = seqs.size(); n_active > 0; ) {
+            if (llama_decode(ctx_dft, batch_dft) != 0) {
+                SRV_WRN("%s", "failed to decode the draft batch - skipping speculative decoding\n");
+                clear_draft_seqs();
+                return;
+            }
+
+            common_batch_clear(batch_dft);
+
+            for (auto & seq : seqs) {
+                if (seq.done) {
+                    continue;
+                }
+
+                server_slot & slot = *seq.slot;
+
+                common_sampler_sample(slot.smpl_dft, ctx_dft, seq.i_batch, true);
+
+                const auto * cur_p = common_sampler_get_candidates(slot.smpl_dft);
+
+                const llama_token id = cur_p->data[0].id;
+
+                // only collect very high-confidence draft tokens
+                if (cur_p->data[0].p < slot.params.speculative.p_min) {
+                    seq.done = true;
+                    n_active--;
+                    continue;
+                }
+
+                common_sampler_accept(slot.smpl_dft, id, true);
+
+                seq.draft.push_back(id);
+
+                if (seq.n_draft <= (int) seq.draft.size()) {
+                    seq.done = true;
+                    n_active--;
+                    continue;
+                }
+
+                common_batch_add(batch_dft, id, slot.prompt_dft.size(), { slot.id }, true);
+                slot.prompt_dft.push_back(id);
+
+                seq.i_batch = batch_dft.n_tokens - 1;
+            }
+        }
+
+        // verify the drafts of all slots in one batch
+        std::vector<std::vector<int>> idxs(seqs.size());
+
+        common_batch_clear(batch_spec);
+
+        for (size_t k = 0; k < seqs.size(); ++k) {
+            auto & seq = seqs[k];
+
+            server_slot & slot = *seq.slot;
+
+            // keep track of total number of tokens generated in the draft
+            slot.n_draft_total += seq.draft.size();
+
+            // ignore small drafts
+            if (slot.params.speculative.n_min > (int) seq.draft.size()) {
+                SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) seq.draft.size(), slot.params.speculative.n_min);
+
+                continue;
+            }
+
+            idxs[k].push_back(batch_spec.n_tokens);
+            common_batch_add(batch_spec, slot.sampled, slot.n_past, { slot.id }, true);
+
+            for (size_t i = 0; i < seq.draft.size(); ++i) {
+                idxs[k].push_back(batch_spec.n_tokens);
+                common_batch_add(batch_spec, seq.draft[i], slot.n_past + 1 + i, { slot.id }, true);
+            }
+        }
+
+        if (batch_spec.n_tokens == 0) {
+            return;
+        }
+
+        SRV_DBG("decoding speculative batch of %d slots, size = %d\n", (int) seqs.size(), batch_spec.n_tokens);
+
+        if (llama_decode(ctx, batch_spec) != 0) {
+            SRV_WRN("%s", "failed to decode the speculative batch - skipping speculative decoding\n");
+            for (const auto & seq : seqs) {
+                llama_kv_self_seq_rm(ctx, seq.slot->id, seq.slot->n_past, -1);
+            }
+            return;
+        }
+
+        for (size_t k = 0; k < seqs.size(); ++k) {
+            if (idxs[k].empty()) {
+                continue;
+            }
+
+            const auto & seq = seqs[k];
+
+            server_slot & slot = *seq.slot;
+
+            // the accepted tokens from the speculation
+            const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, idxs[k], seq.draft);
+
+            slot.update_p_accept(seq.draft.size(), ids.size() - 1);
+
+            accept_draft(slot, seq.draft, ids);
+
+            SLT_DBG(slot, "acceptance estimate = %.3f, next draft length = %d\n", slot.p_accept, slot.get_n_draft_adaptive());
+        }
+    }
+
     void update_slots() {
+        if (!embd_tasks.empty()) {
+            process_embd_tasks();
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -2887,39 +5224,24 @@ struct server_context {
                 }
 
                 // Shift context
-                const int n_keep    = slot.params.n_keep + add_bos_token;
-                const int n_left    = slot.n_past - n_keep;
-                const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
-
-                SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
-
-                llama_kv_self_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
-                llama_kv_self_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
-
-                if (slot.params.cache_prompt) {
-                    for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
-                        slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
-                    }
-
-                    slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+                if (!context_shift(slot)) {
+                    slot.release();
+                    send_error(slot, "the context of the slot cannot be shifted", ERROR_TYPE_SERVER);
+                    continue;
                 }
-
-                slot.n_past -= n_discard;
-
-                slot.truncated = true;
             }
         }
 
+        if (params_base.kv_pool) {
+            kv_pool_ensure_generation();
+        }
+
         // start populating the batch for this iteration
         common_batch_clear(batch);
 
         // track if given slot can be batched with slots already in the batch
         server_slot * slot_batched = nullptr;
 
-        auto accept_special_token = [&](server_slot & slot, llama_token token) {
-            return params_base.special || slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
-        };
-
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
             if (slot.state != SLOT_STATE_GENERATING) {
@@ -2951,6 +5273,14 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
+        // the tokens of the generating slots are in the batch already, limit the prompt tokens that would delay them
+        const int32_t n_decode_tokens = batch.n_tokens;
+
+        int32_t n_batch_prompt = n_batch;
+        if (prefill_budget.enabled() && n_decode_tokens > 0) {
+            n_batch_prompt = std::min(n_batch, n_decode_tokens + prefill_budget.n_budget);
+        }
+
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
@@ -2964,7 +5294,7 @@ struct server_context {
                 }
 
                 // this slot still has a prompt to be processed
-                if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
+                if ((slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) && batch.n_tokens < n_batch_prompt) {
                     auto & prompt_tokens = slot.prompt_tokens;
 
                     // TODO: maybe move branch to outside of this loop in the future
@@ -3059,6 +5389,21 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_lcp(slot.cache_tokens, prompt_tokens);
 
+                                // the rest of the cached prompt is about to be dropped, keep it on disk
+                                if (prompt_cache.enabled() && (size_t) slot.n_past < slot.cache_tokens.size()) {
+                                    prompt_cache_save(slot);
+                                }
+
+                                // or a longer prefix computed by another slot
+                                if (params_base.slot_prefix_share) {
+                                    prefix_tree_share(slot);
+                                }
+
+                                // or a longer prefix from the on-disk prompt cache
+                                if (prompt_cache.enabled()) {
+                                    prompt_cache_load(slot);
+                                }
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
                                 if (params_base.n_cache_reuse > 0) {
                                     size_t head_c = slot.n_past; // cache
@@ -3077,7 +5422,8 @@ struct server_context {
                                             n_match++;
                                         }
 
-                                        if (n_match >= (size_t) params_base.n_cache_reuse) {
+                                        // cells shared with other slots cannot be shifted
+                                        if (n_match >= (size_t) params_base.n_cache_reuse && head_c >= (size_t) slot.n_kv_shared) {
                                             SLT_INF(slot, "reusing chunk with size %zu, shifting KV cache [%zu, %zu) -> [%zu, %zu)\n", n_match, head_c, head_c + n_match, head_p, head_p + n_match);
                                             //for (size_t i = head_p; i < head_p + n_match; i++) {
                                             //    SLT_DBG(slot, "cache token %3zu: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
@@ -3118,7 +5464,7 @@ struct server_context {
                     // non-causal tasks require to fit the entire prompt in the physical batch
                     if (slot.is_non_causal()) {
                         // cannot fit the prompt in the current batch - will try next iter
-                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch) {
+                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch_prompt) {
                             continue;
                         }
                     }
@@ -3132,13 +5478,15 @@ struct server_context {
                         slot.n_past = 0;
                     }
 
+                    slot.n_kv_shared = std::min(slot.n_kv_shared, slot.n_past);
+
                     SLT_INF(slot, "kv cache rm [%d, end)\n", slot.n_past);
 
                     // remove the non-common part from the cache
                     slot.cache_tokens.resize(slot.n_past);
 
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch_prompt) {
                         // without pooling, we want to output the embeddings for all the tokens in the batch
                         const bool need_embd = slot.task_type == SERVER_TASK_TYPE_EMBEDDING && llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
 
@@ -3177,7 +5525,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_prompt) {
                     break;
                 }
             }
@@ -3197,6 +5545,8 @@ struct server_context {
             common_set_adapter_lora(ctx, slot_batched->lora);
         }
 
+        const int64_t t_start_step = ggml_time_us();
+
         // process the created batch of tokens
         for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
@@ -3257,6 +5607,11 @@ struct server_context {
 
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
+
+                    // the prompt is in the KV cache now and can be shared with other slots
+                    if (params_base.slot_prefix_share) {
+                        prefix_tree_update(slot);
+                    }
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
@@ -3301,6 +5656,11 @@ struct server_context {
             }
 
             // do speculative decoding
+            if (ctx_dft) {
+                speculate_batched();
+                continue;
+            }
+
             for (auto & slot : slots) {
                 if (!slot.is_processing() || !slot.can_speculate()) {
                     continue;
@@ -3311,15 +5671,7 @@ struct server_context {
                 }
 
                 // determine the max draft that fits the current slot state
-                int n_draft_max = slot.params.speculative.n_max;
-
-                // note: n_past is not yet increased for the `id` token sampled above
-                //       also, need to leave space for 1 extra token to allow context shifts
-                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
-
-                if (slot.n_remaining > 0) {
-                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
-                }
+                const int n_draft_max = get_n_draft_max(slot);
 
                 SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
 
@@ -3363,38 +5715,17 @@ struct server_context {
                 // the accepted tokens from the speculation
                 const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
 
-                slot.n_past    += ids.size();
-                slot.n_decoded += ids.size();
-
-                // update how many tokens out of draft was accepted
-                slot.n_draft_accepted += ids.size() - 1;
-
-                slot.cache_tokens.push_back(id);
-                slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
-
-                llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
-
-                for (size_t i = 0; i < ids.size(); ++i) {
-                    completion_token_output result;
-
-                    result.tok          = ids[i];
-                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
-                    result.prob         = 1.0f; // set later
+                accept_draft(slot, draft, ids);
+            }
+        }
 
-                    // TODO: set result.probs
+        // only steps with generating slots delay a next token
+        if (prefill_budget.enabled() && n_decode_tokens > 0) {
+            const int32_t n_prompt_tokens = batch.n_tokens - n_decode_tokens;
 
-                    if (!process_token(result, slot)) {
-                        // release slot because of stop condition
-                        slot.release();
-                        slot.print_timings();
-                        send_final_response(slot);
-                        metrics.on_prediction(slot);
-                        break;
-                    }
-                }
+            prefill_budget.on_step((ggml_time_us() - t_start_step) / 1e3, n_prompt_tokens);
 
-                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
-            }
+            SRV_DBG("step with %d decode and %d prompt tokens, prefill budget = %d\n", n_decode_tokens, n_prompt_tokens, prefill_budget.n_budget);
         }
 
         SRV_DBG("%s", "run slots completed\n");
@@ -3711,6 +6042,14 @@ int main(int argc, char ** argv) {
                     {"name",  "n_decode_total"},
                     {"help",  "Total number of llama_decode() calls"},
                     {"value",  res_metrics->n_decode_total}
+            }, {
+                    {"name",  "kv_defrag_cells_total"},
+                    {"help",  "Number of KV cache cells moved by the defragmentation while idle."},
+                    {"value",  res_metrics->n_defrag_cells_total}
+            }, {
+                    {"name",  "kv_defrag_seconds_total"},
+                    {"help",  "Time spent in the defragmentation of the KV cache while idle."},
+                    {"value",  res_metrics->t_defrag_us_total / 1.e6}
             }, {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
@@ -3732,6 +6071,10 @@ int main(int argc, char ** argv) {
                     {"name",  "kv_cache_tokens"},
                     {"help",  "KV-cache tokens."},
                     {"value",  (uint64_t) res_metrics->kv_cache_tokens_count}
+            },{
+                    {"name",  "kv_cache_fragmentation"},
+                    {"help",  "Share of the KV-cache cells visited by the attention that a full defragmentation would save."},
+                    {"value",  res_metrics->kv_cache_fragmentation}
             },{
                     {"name",  "requests_processing"},
                     {"help",  "Number of requests processing."},
@@ -3760,6 +6103,56 @@ int main(int argc, char ** argv) {
             }
         }
 
+        // queue wait histograms and deadline rejections per priority class
+        prometheus << "# HELP llamacpp:queue_wait_seconds Time that requests waited for a slot, per priority class.\n"
+                   << "# TYPE llamacpp:queue_wait_seconds histogram\n";
+        for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; i++) {
+            const auto & hist = res_metrics->queue_wait[i];
+            const std::string label = string_format("priority=\"%s\"", server_task_priority_names[i]);
+
+            uint64_t n_cumulative = 0;
+            for (size_t b = 0; b < server_queue_wait_histogram::n_buckets; b++) {
+                n_cumulative += hist.counts[b];
+                prometheus << "llamacpp:queue_wait_seconds_bucket{" << label << ",le=\"" << server_queue_wait_histogram::buckets[b] << "\"} " << n_cumulative << "\n";
+            }
+            prometheus << "llamacpp:queue_wait_seconds_bucket{" << label << ",le=\"+Inf\"} " << hist.count << "\n"
+                       << "llamacpp:queue_wait_seconds_sum{"    << label << "} " << hist.sum   << "\n"
+                       << "llamacpp:queue_wait_seconds_count{"  << label << "} " << hist.count << "\n";
+        }
+
+        prometheus << "# HELP llamacpp:requests_rejected_deadline_total Number of requests rejected because their deadline could not be met, per priority class.\n"
+                   << "# TYPE llamacpp:requests_rejected_deadline_total counter\n";
+        for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; i++) {
+            prometheus << "llamacpp:requests_rejected_deadline_total{priority=\"" << server_task_priority_names[i] << "\"} "
+                       << res_metrics->n_rejected_deadline[i] << "\n";
+        }
+
+        if (ctx_server.response_cache.enabled()) {
+            auto & cache = ctx_server.response_cache;
+            std::unique_lock<std::mutex> lock(cache.mutex);
+
+            const uint64_t n_lookups = cache.n_hits + cache.n_misses;
+
+            prometheus << "# HELP llamacpp:response_cache_hits_total Number of requests answered from the response cache.\n"
+                       << "# TYPE llamacpp:response_cache_hits_total counter\n"
+                       << "llamacpp:response_cache_hits_total " << cache.n_hits << "\n"
+                       << "# HELP llamacpp:response_cache_misses_total Number of deterministic requests not found in the response cache.\n"
+                       << "# TYPE llamacpp:response_cache_misses_total counter\n"
+                       << "llamacpp:response_cache_misses_total " << cache.n_misses << "\n"
+                       << "# HELP llamacpp:response_cache_hit_ratio Fraction of the deterministic requests answered from the response cache.\n"
+                       << "# TYPE llamacpp:response_cache_hit_ratio gauge\n"
+                       << "llamacpp:response_cache_hit_ratio " << (n_lookups ? (double) cache.n_hits / n_lookups : 0.0) << "\n"
+                       << "# HELP llamacpp:response_cache_evicted_total Number of responses dropped from the cache to stay within its size.\n"
+                       << "# TYPE llamacpp:response_cache_evicted_total counter\n"
+                       << "llamacpp:response_cache_evicted_total " << cache.n_evicted << "\n"
+                       << "# HELP llamacpp:response_cache_bytes Memory used by the response cache.\n"
+                       << "# TYPE llamacpp:response_cache_bytes gauge\n"
+                       << "llamacpp:response_cache_bytes " << cache.n_bytes << "\n"
+                       << "# HELP llamacpp:response_cache_entries Number of responses in the cache.\n"
+                       << "# TYPE llamacpp:response_cache_entries gauge\n"
+                       << "llamacpp:response_cache_entries " << cache.entries.size() << "\n";
+        }
+
         res.set_header("Process-Start-Time-Unix", std::to_string(res_metrics->t_start));
 
         res.set_content(prometheus.str(), "text/plain; version=0.0.4");
@@ -3927,7 +6320,7 @@ int main(int argc, char ** argv) {
     const auto handle_completions_impl = [&ctx_server, &res_error, &res_ok](
             server_task_type type,
             json & data,
-            std::function<bool()> is_connection_closed,
+            const httplib::Request & req,
             httplib::Response & res,
             oaicompat_type oaicompat) {
         GGML_ASSERT(type == SERVER_TASK_TYPE_COMPLETION || type == SERVER_TASK_TYPE_INFILL);
@@ -3945,6 +6338,8 @@ int main(int argc, char ** argv) {
             // TODO: this log can become very long, put it behind a flag or think about a more compact format
             //SRV_DBG("Prompt: %s\n", prompt.is_string() ? prompt.get<std::string>().c_str() : prompt.dump(2).c_str());
 
+            const server_task_sched sched = server_task::sched_from_request(req, data, SERVER_TASK_PRIORITY_NORMAL);
+
             std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
             tasks.reserve(tokenized_prompts.size());
             for (size_t i = 0; i < tokenized_prompts.size(); i++) {
@@ -3959,6 +6354,7 @@ int main(int argc, char ** argv) {
                                             ctx_server.params_base,
                                             data);
                 task.id_selected_slot = json_value(data, "id_slot", -1);
+                task.sched            = sched;
 
                 // OAI-compat
                 task.params.oaicompat                 = oaicompat;
@@ -3972,10 +6368,25 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        bool stream = json_value(data, "stream", false);
+
+        // the same request gets the same response if the sampling is deterministic
+        std::string cache_key;
+        if (ctx_server.response_cache.enabled() && !stream && std::all_of(tasks.begin(), tasks.end(), [](const server_task & task) {
+                return server_sampling_is_deterministic(task.params.sampling);
+            })) {
+            cache_key = ctx_server.response_cache.make_key(type == SERVER_TASK_TYPE_INFILL ? "infill" : "completion", oaicompat, data);
+
+            std::string response;
+            if (ctx_server.response_cache.get(cache_key, response)) {
+                res_ok(res, server_response_cache::renew(json::parse(response), completion_id));
+                return;
+            }
+        }
+
         ctx_server.queue_results.add_waiting_tasks(tasks);
         ctx_server.queue_tasks.post(tasks);
 
-        bool stream = json_value(data, "stream", false);
         const auto task_ids = server_task::get_list_id(tasks);
 
         if (!stream) {
@@ -3993,12 +6404,24 @@ int main(int argc, char ** argv) {
                 }
             }, [&](const json & error_data) {
                 res_error(res, error_data);
-            }, is_connection_closed);
+            }, req.is_connection_closed);
 
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+
+            if (!cache_key.empty() && res.status == 200) {
+                ctx_server.response_cache.put(cache_key, res.body);
+            }
         } else {
             const auto chunked_content_provider = [task_ids, &ctx_server, oaicompat](size_t, httplib::DataSink & sink) {
+                // reused for the events of this connection
+                std::string buf;
+
                 ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
+                    buf.clear();
+                    if (result->to_sse(buf)) {
+                        return server_sent_event(sink, buf);
+                    }
+
                     json res_json = result->to_json();
                     if (res_json.is_array()) {
                         for (const auto & res : res_json) {
@@ -4038,7 +6461,7 @@ int main(int argc, char ** argv) {
         return handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
             data,
-            req.is_connection_closed,
+            req,
             res,
             OAICOMPAT_TYPE_NONE);
     };
@@ -4048,7 +6471,7 @@ int main(int argc, char ** argv) {
         return handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
             data,
-            req.is_connection_closed,
+            req,
             res,
             OAICOMPAT_TYPE_COMPLETION);
     };
@@ -4125,7 +6548,7 @@ int main(int argc, char ** argv) {
         return handle_completions_impl(
             SERVER_TASK_TYPE_INFILL,
             data,
-            req.is_connection_closed,
+            req,
             res,
             OAICOMPAT_TYPE_NONE); // infill is not OAI compatible
     };
@@ -4143,7 +6566,7 @@ int main(int argc, char ** argv) {
         return handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
             data,
-            req.is_connection_closed,
+            req,
             res,
             OAICOMPAT_TYPE_CHAT);
     };
@@ -4256,6 +6679,14 @@ int main(int argc, char ** argv) {
             }
         }
 
+        server_task_sched sched;
+        try {
+            sched = server_task::sched_from_request(req, body, SERVER_TASK_PRIORITY_BATCH);
+        } catch (const std::exception & e) {
+            res_error(res, format_error_response(e.what(), ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
         std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
         for (const auto & tokens : tokenized_prompts) {
             // this check is necessary for models that do not add BOS token to the input
@@ -4265,6 +6696,19 @@ int main(int argc, char ** argv) {
             }
         }
 
+        // embeddings do not depend on sampling, the same input always gets the same response
+        std::string cache_key;
+        if (ctx_server.response_cache.enabled()) {
+            cache_key = ctx_server.response_cache.make_key("embeddings", oaicompat, body);
+
+            std::string response;
+            if (ctx_server.response_cache.get(cache_key, response)) {
+                res.set_content(response, MIMETYPE_JSON);
+                res.status = 200;
+                return;
+            }
+        }
+
         // create and queue the task
         json responses = json::array();
         bool error = false;
@@ -4276,6 +6720,7 @@ int main(int argc, char ** argv) {
                 task.id            = ctx_server.queue_tasks.get_new_id();
                 task.index         = i;
                 task.prompt_tokens = std::move(tokenized_prompts[i]);
+                task.sched         = sched;
 
                 // OAI-compat
                 task.params.oaicompat = oaicompat;
@@ -4311,6 +6756,10 @@ int main(int argc, char ** argv) {
             ? format_embeddings_response_oaicompat(body, responses, use_base64)
             : json(responses);
         res_ok(res, root);
+
+        if (!cache_key.empty()) {
+            ctx_server.response_cache.put(cache_key, res.body);
+        }
     };
 
     const auto handle_embeddings = [&handle_embeddings_impl](const httplib::Request & req, httplib::Response & res) {
@@ -4362,6 +6811,14 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        server_task_sched sched;
+        try {
+            sched = server_task::sched_from_request(req, body, SERVER_TASK_PRIORITY_BATCH);
+        } catch (const std::exception & e) {
+            res_error(res, format_error_response(e.what(), ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
         llama_tokens tokenized_query = tokenize_input_prompts(ctx_server.vocab, query, /* add_special */ false, true)[0];
 
         // create and queue the task
@@ -4376,6 +6833,7 @@ int main(int argc, char ** argv) {
                 task.id            = ctx_server.queue_tasks.get_new_id();
                 task.index         = i;
                 task.prompt_tokens = format_rerank(ctx_server.vocab, tokenized_query, tokenized_docs[i]);
+                task.sched         = sched;
                 tasks.push_back(task);
             }
 
@@ -4446,6 +6904,10 @@ int main(int argc, char ** argv) {
         }
 
         GGML_ASSERT(dynamic_cast<server_task_result_apply_lora*>(result.get()) != nullptr);
+
+        // the cached responses were generated with the previous adapters
+        ctx_server.response_cache.clear();
+
         res_ok(res, result->to_json());
     };
 
@@ -4590,6 +7052,12 @@ int main(int argc, char ** argv) {
         ctx_server.update_slots();
     });
 
+    if (ctx_server.params_base.defrag_idle_ms > 0) {
+        ctx_server.queue_tasks.on_idle([&ctx_server]() {
+            ctx_server.kv_defrag_idle();
+        });
+    }
+
     shutdown_handler = [&](int) {
         // this will unblock start_loop()
         ctx_server.queue_tasks.terminate();
@@ -4614,6 +7082,8 @@ int main(int argc, char ** argv) {
     // this call blocks the main thread until queue_tasks.terminate() is called
     ctx_server.queue_tasks.start_loop();
 
+    ctx_server.prompt_cache_save_all();
+
     clean_up();
     t.join();
 
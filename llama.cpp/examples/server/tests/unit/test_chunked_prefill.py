@@ -0,0 +1,60 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+LONG_TEXT = """
+Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.
+Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.
+""".strip()
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_ctx = 1024
+    server.n_slots = 2
+    server.n_batch = 256
+    server.itl_target = 1
+
+
+def test_chunked_prefill_with_generating_slot():
+    # a long prompt that arrives while another slot is generating is processed in chunks between its decode steps
+    global server
+    server.start()
+    tasks = [
+        (server.make_request, ("POST", "/completion", {
+            "n_predict": 64,
+            "prompt": "I believe the meaning of life is",
+            "temperature": 0.0,
+            "id_slot": 0,
+        })),
+        (server.make_request, ("POST", "/completion", {
+            "n_predict": 16,
+            "prompt": LONG_TEXT,
+            "temperature": 0.0,
+            "id_slot": 1,
+        })),
+    ]
+    results = parallel_function_calls(tasks)
+    assert results[0].status_code == 200
+    assert results[0].body["timings"]["predicted_n"] == 64
+    assert results[1].status_code == 200
+    assert results[1].body["timings"]["prompt_n"] == 301
+    assert results[1].body["timings"]["predicted_n"] == 16
+
+
+def test_chunked_prefill_embeddings():
+    # prompts of non-causal slots can't be split, they are not affected by the budget
+    global server
+    server = ServerPreset.bert_bge_small()
+    server.itl_target = 1
+    server.start()
+    res = server.make_request("POST", "/embeddings", data={
+        "input": LONG_TEXT,
+    })
+    assert res.status_code == 200
+    assert len(res.body[0]["embedding"]) > 0
@@ -36,6 +36,24 @@ def test_ctx_shift_enabled():
     assert res.body["truncated"] is True
 
 
+def test_ctx_shift_sinks():
+    # the slot context is 128 tokens, the first 4 tokens are kept and the oldest ones after them are evicted in small
+    # steps, so that the generation continues past the context size
+    global server
+    server.context_sinks = 4
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 300,
+        "prompt": "Hi how are you",
+        "ignore_eos": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["predicted_n"] == 300
+    assert res.body["truncated"] is True
+    server.stop()
+    server.context_sinks = None
+
+
 @pytest.mark.parametrize("n_predict,n_token_output,truncated", [
     (64, 64, False),
     (-1, 120, True),
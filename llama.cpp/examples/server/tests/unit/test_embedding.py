@@ -1,6 +1,7 @@
 import base64
 import struct
 import pytest
+import requests
 from openai import OpenAI
 from utils import *
 
@@ -188,6 +189,49 @@ def test_same_prompt_give_same_result():
             assert abs(x - y) < EPSILON
 
 
+def test_embedding_packed_inputs_keep_order():
+    # the inputs are packed into shared batches sorted by length, the results must still follow the input order
+    global server
+    server.pooling = 'mean'
+    server.start()
+    inputs = [("word " * n).strip() for n in [3, 40, 1, 17, 60, 5, 25, 2, 33, 8] * 4]
+    res = server.make_request("POST", "/v1/embeddings", data={"input": inputs})
+    assert res.status_code == 200
+    assert len(res.body['data']) == len(inputs)
+    for i, d in enumerate(res.body['data']):
+        assert d['index'] == i
+    for i in [0, 1, 4, 7]:
+        res_single = server.make_request("POST", "/v1/embeddings", data={"input": inputs[i]})
+        assert res_single.status_code == 200
+        for x, y in zip(res.body['data'][i]['embedding'], res_single.body['data'][0]['embedding']):
+            assert abs(x - y) < EPSILON
+
+
+def get_n_decode_total() -> int:
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    for line in res.text.splitlines():
+        if line.startswith("llamacpp:n_decode_total "):
+            return int(float(line.split(" ")[1]))
+    assert False, "n_decode_total is missing from /metrics"
+
+
+def test_embedding_packed_inputs_share_decode():
+    # the number of inputs in a batch does not depend on --parallel, with one slot they are still decoded together
+    global server
+    server.pooling = 'mean'
+    server.n_slots = 1
+    server.server_metrics = True
+    server.start()
+    inputs = [f"This is test number {i}" for i in range(12)]
+    n_decode = get_n_decode_total()
+    res = server.make_request("POST", "/v1/embeddings", data={"input": inputs})
+    assert res.status_code == 200
+    assert len(res.body['data']) == len(inputs)
+    # all inputs fit into one ubatch of 128 tokens
+    assert get_n_decode_total() - n_decode == 1
+
+
 @pytest.mark.parametrize(
     "content,n_tokens",
     [
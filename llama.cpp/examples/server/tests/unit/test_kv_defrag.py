@@ -0,0 +1,63 @@
+import pytest
+import requests
+import time
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+PROMPT_A = "Once upon a time, there was a little girl who loved to play in the garden with her friends. " * 6
+PROMPT_B = "The quick brown fox jumps over the lazy dog, again and again, until the sun goes down. " * 6
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.server_metrics = True
+    server.n_slots = 2
+    server.n_ctx = 1024
+    server.temperature = 0.0
+
+
+def get_defrag_metrics() -> dict[str, float]:
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    metrics = {}
+    for line in res.text.splitlines():
+        if line.startswith("llamacpp:kv_defrag_") or line.startswith("llamacpp:kv_cache_fragmentation"):
+            name, value = line.split(" ")
+            metrics[name.removeprefix("llamacpp:")] = float(value)
+    return metrics
+
+
+def run_requests() -> list[str]:
+    # the short prompt replaces the cells of the first one in slot 0, which leaves a gap before the cells of slot 1
+    contents = []
+    for prompt, id_slot in [(PROMPT_A, 0), (PROMPT_B, 1), ("Hello there", 0), (PROMPT_B + " And then", 1)]:
+        res = server.make_request("POST", "/completion", data={
+            "prompt": prompt,
+            "n_predict": 8,
+            "id_slot": id_slot,
+        })
+        assert res.status_code == 200
+        contents.append(res.body["content"])
+        time.sleep(0.2)
+    return contents
+
+
+def test_defrag_idle():
+    global server
+    server.start()
+    expected = run_requests()
+    metrics = get_defrag_metrics()
+    assert metrics["kv_defrag_cells_total"] == 0
+    assert metrics["kv_cache_fragmentation"] > 0
+    server.stop()
+
+    server.defrag_idle = 50
+    server.start()
+    assert run_requests() == expected
+    metrics = get_defrag_metrics()
+    assert metrics["kv_defrag_cells_total"] > 0
+    assert metrics["kv_cache_fragmentation"] == 0
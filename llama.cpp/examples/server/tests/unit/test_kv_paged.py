@@ -0,0 +1,132 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+SYSTEM_PROMPT = "Once upon a time, there was a little girl who loved to play in the garden with her friends. " * 4
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 4
+    server.n_ctx = 1024
+    server.temperature = 0.0
+
+
+def run_parallel(prompts: list[str]) -> list[str]:
+    tasks = [(server.make_request, ("POST", "/completion", {
+        "prompt": prompt,
+        "n_predict": 16,
+        "id_slot": i,
+    })) for i, prompt in enumerate(prompts)]
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+    return [res.body["content"] for res in results]
+
+
+PROMPTS = [
+    SYSTEM_PROMPT + "What is the capital of France?",
+    "I believe the meaning of life is",
+    SYSTEM_PROMPT + "What is the capital of Germany?",
+    "Write a joke about AI",
+]
+
+
+@pytest.mark.parametrize("fa", [False, True])
+def test_paged_matches_contiguous(fa: bool):
+    global server
+    server.fa = True if fa else None
+    server.start()
+    expected = run_parallel(PROMPTS)
+    server.stop()
+
+    server.kv_block_size = 16
+    server.start()
+    # run twice so that the second round reuses the cached prompts of the first one
+    assert run_parallel(PROMPTS) == expected
+    assert run_parallel(PROMPTS) == expected
+
+
+def test_paged_shared_prefix_blocks():
+    global server
+    server.kv_block_size = 16
+    server.slot_prefix_share = True
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 8,
+        "prompt": PROMPTS[0],
+        "id_slot": 0,
+    })
+    assert res.status_code == 200
+
+    # the prefix blocks of slot 0 are shared with slot 1 instead of being recomputed
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 8,
+        "prompt": PROMPTS[2],
+        "id_slot": 1,
+    })
+    assert res.status_code == 200
+    content_shared = res.body["content"]
+
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 8,
+        "prompt": PROMPTS[2],
+        "id_slot": 2,
+        "cache_prompt": False,
+    })
+    assert res.status_code == 200
+    assert res.body["content"] == content_shared
+
+
+def test_paged_context_shift_reuses_freed_cells():
+    global server
+    server.n_ctx = 256
+    server.kv_block_size = 16
+    server.start()
+    # the slot context of 64 tokens is shifted several times, the cells freed in the middle of the blocks of the
+    # sequence have to be handed out again for the cache not to run full
+    for _ in range(2):
+        tasks = [(server.make_request, ("POST", "/completion", {
+            "prompt": "Hello " * 40,
+            "n_predict": 120,
+            "id_slot": i,
+        })) for i in range(4)]
+        for res in parallel_function_calls(tasks):
+            assert res.status_code == 200
+            assert res.body["timings"]["predicted_n"] == 120
+
+
+def test_paged_restore_into_fragmented_cache():
+    global server
+    server.kv_block_size = 16
+    server.slot_save_path = "./tmp"
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPTS[0],
+        "n_predict": 8,
+        "id_slot": 0,
+    })
+    assert res.status_code == 200
+    expected = res.body["content"]
+    res = server.make_request("POST", "/slots/0?action=save", data={"filename": "paged.bin"})
+    assert res.status_code == 200
+
+    # the blocks of the other slots are interleaved, erasing two of them leaves free blocks between used ones
+    run_parallel(PROMPTS)
+    for id_slot in [1, 3]:
+        res = server.make_request("POST", f"/slots/{id_slot}?action=erase")
+        assert res.status_code == 200
+
+    res = server.make_request("POST", "/slots/2?action=restore", data={"filename": "paged.bin"})
+    assert res.status_code == 200
+    res = server.make_request("POST", "/completion", data={
+        "prompt": PROMPTS[0],
+        "n_predict": 8,
+        "id_slot": 2,
+    })
+    assert res.status_code == 200
+    assert res.body["content"] == expected
+    assert res.body["timings"]["prompt_n"] == 1
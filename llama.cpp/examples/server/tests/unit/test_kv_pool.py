@@ -0,0 +1,67 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+LONG_TEXT = """
+Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.
+Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.
+""".strip()
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_ctx = 512
+    server.n_slots = 4
+    server.kv_pool = True
+
+
+def test_kv_pool_long_prompt_uses_spare_capacity():
+    # the prompt is 301 tokens
+    # with a fixed split each slot would only get 512/4 = 128 tokens and the prompt would be truncated
+    # with the shared pool the idle slots leave enough cells for the whole prompt
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 16,
+        "prompt": LONG_TEXT,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 301
+    assert res.body["timings"]["predicted_n"] == 16
+    assert res.body["truncated"] is False
+
+
+def test_kv_pool_slot_max():
+    global server
+    server.n_ctx_slot = 128
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 16,
+        "prompt": LONG_TEXT,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 109
+    assert res.body["truncated"] is True
+
+
+def test_kv_pool_parallel_requests():
+    # more requests than fit into the pool at once: the late ones are admitted when a slot is released
+    global server
+    server.n_slots = 4
+    server.start()
+    tasks = []
+    for _ in range(6):
+        tasks.append((server.make_request, ("POST", "/completion", {
+            "n_predict": 32,
+            "prompt": LONG_TEXT,
+        })))
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+        assert res.body["timings"]["prompt_n"] == 301
+        assert res.body["timings"]["predicted_n"] == 32
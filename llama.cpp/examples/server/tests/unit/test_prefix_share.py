@@ -0,0 +1,83 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+SYSTEM_PROMPT = "Once upon a time, there was a little girl who loved to play in the garden with her friends. " * 4
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 4
+    server.temperature = 0.0
+    server.slot_prefix_share = True
+
+
+def test_prefix_shared_between_slots():
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 8,
+        "prompt": SYSTEM_PROMPT + "What is the capital of France?",
+        "id_slot": 0,
+    })
+    assert res.status_code == 200
+    n_prompt_full = res.body["timings"]["prompt_n"]
+
+    # the common prefix is copied from slot 0, only the suffix is processed
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 8,
+        "prompt": SYSTEM_PROMPT + "What is the capital of Germany?",
+        "id_slot": 1,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] < n_prompt_full / 4
+    content_shared = res.body["content"]
+
+    # the result is the same as when the whole prompt is processed in a fresh slot
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 8,
+        "prompt": SYSTEM_PROMPT + "What is the capital of Germany?",
+        "id_slot": 2,
+        "cache_prompt": False,
+    })
+    assert res.status_code == 200
+    assert res.body["content"] == content_shared
+
+
+def test_prefix_not_shared_without_cache_prompt():
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 8,
+        "prompt": SYSTEM_PROMPT + "What is the capital of France?",
+        "id_slot": 0,
+        "cache_prompt": False,
+    })
+    assert res.status_code == 200
+    n_prompt_full = res.body["timings"]["prompt_n"]
+
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 8,
+        "prompt": SYSTEM_PROMPT + "What is the capital of Germany?",
+        "id_slot": 1,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] > n_prompt_full / 2
+
+
+def test_prefix_shared_parallel_requests():
+    global server
+    server.start()
+    tasks = []
+    for i in range(8):
+        tasks.append((server.make_request, ("POST", "/completion", {
+            "n_predict": 16,
+            "prompt": SYSTEM_PROMPT + f"Question number {i}?",
+        })))
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+        assert res.body["timings"]["predicted_n"] == 16
@@ -0,0 +1,130 @@
+import os
+import shutil
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+PROMPT_CACHE_DIR = "./tmp/prompt_cache"
+
+PROMPT_A = "Once upon a time, there was a little girl who loved to play in the garden with her friends. " * 4 + "What happened next?"
+PROMPT_B = "The quick brown fox jumps over the lazy dog, again and again, until the sun goes down. " * 4
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.temperature = 0.0
+    server.prompt_cache_dir = PROMPT_CACHE_DIR
+
+
+@pytest.fixture(autouse=True)
+def clear_prompt_cache():
+    shutil.rmtree(PROMPT_CACHE_DIR, ignore_errors=True)
+
+
+def complete(prompt: str):
+    res = server.make_request("POST", "/completion", data={
+        "n_predict": 8,
+        "prompt": prompt,
+    })
+    assert res.status_code == 200
+    return res.body
+
+
+def test_prompt_cache_restores_evicted_prompt():
+    global server
+    server.start()
+    res_a = complete(PROMPT_A)
+    n_prompt_a = res_a["timings"]["prompt_n"]
+
+    # the cached prompt A is replaced by prompt B, so it is written to disk
+    complete(PROMPT_B)
+    assert len(os.listdir(PROMPT_CACHE_DIR)) == 1
+
+    # prompt A is restored from disk instead of being processed again
+    res = complete(PROMPT_A)
+    assert res["timings"]["prompt_n"] < n_prompt_a / 4
+    assert res["content"] == res_a["content"]
+
+
+def test_prompt_cache_survives_restart():
+    global server
+    server.start()
+    res_a = complete(PROMPT_A)
+    n_prompt_a = res_a["timings"]["prompt_n"]
+    complete(PROMPT_B)
+
+    server.stop()
+    server.start()
+
+    res = complete(PROMPT_A)
+    assert res["timings"]["prompt_n"] < n_prompt_a / 4
+    assert res["content"] == res_a["content"]
+
+
+def test_prompt_cache_ignores_other_kv_layout():
+    global server
+    server.start()
+    res_a = complete(PROMPT_A)
+    complete(PROMPT_B)
+
+    # the paged cache stores V untransposed, so the prompts cached without it cannot be restored
+    server.stop()
+    server.kv_block_size = 16
+    server.start()
+
+    res = complete(PROMPT_A)
+    assert res["timings"]["prompt_n"] == res_a["timings"]["prompt_n"]
+    assert res["content"] == res_a["content"]
+
+
+def test_prompt_cache_size_budget():
+    global server
+    server.prompt_cache_size = 0
+    server.start()
+    res_a = complete(PROMPT_A)
+    complete(PROMPT_B)
+
+    # nothing fits into the budget, so the prompt has to be processed again
+    assert len(os.listdir(PROMPT_CACHE_DIR)) == 0
+    res = complete(PROMPT_A)
+    assert res["timings"]["prompt_n"] == res_a["timings"]["prompt_n"]
+
+
+def test_prompt_cache_ram_restores_evicted_prompt():
+    global server
+    server.prompt_cache_dir = None
+    server.prompt_cache_ram = 64
+    server.start()
+    res_a = complete(PROMPT_A)
+    n_prompt_a = res_a["timings"]["prompt_n"]
+
+    # prompt A is kept in memory, nothing is written to disk
+    complete(PROMPT_B)
+    assert not os.path.exists(PROMPT_CACHE_DIR)
+
+    res = complete(PROMPT_A)
+    assert res["timings"]["prompt_n"] < n_prompt_a / 4
+    assert res["content"] == res_a["content"]
+
+
+def test_prompt_cache_ram_moves_to_disk():
+    global server
+    server.prompt_cache_dir = PROMPT_CACHE_DIR
+    server.prompt_cache_size = None
+    server.prompt_cache_ram = 1
+    server.start()
+
+    # more prompts than fit into 1 MiB of memory, the least recently used ones are moved to disk
+    prompts = [f"Story number {i}. " + PROMPT_A * 2 for i in range(24)]
+    res_first = complete(prompts[0])
+    for prompt in prompts[1:]:
+        complete(prompt)
+    assert len(os.listdir(PROMPT_CACHE_DIR)) > 0
+
+    res = complete(prompts[0])
+    assert res["timings"]["prompt_n"] < res_first["timings"]["prompt_n"] / 4
+    assert res["content"] == res_first["content"]
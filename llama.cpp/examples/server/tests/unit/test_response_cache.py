@@ -0,0 +1,122 @@
+import pytest
+import requests
+import time
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.server_metrics = True
+    server.response_cache = 16
+
+
+def get_cache_metrics() -> dict[str, float]:
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    metrics = {}
+    for line in res.text.splitlines():
+        if line.startswith("llamacpp:response_cache_"):
+            name, value = line.split(" ")
+            metrics[name.removeprefix("llamacpp:")] = float(value)
+    return metrics
+
+
+def test_greedy_completion_is_cached():
+    global server
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 8,
+        "temperature": 0.0,
+    }
+    res1 = server.make_request("POST", "/completion", data=data)
+    assert res1.status_code == 200
+    # scheduling fields are not part of the key
+    res2 = server.make_request("POST", "/completion", data={**data, "priority": "batch"})
+    assert res2.status_code == 200
+    assert res2.body["content"] == res1.body["content"]
+    # nothing was computed for the cached response
+    assert "timings" not in res2.body
+    metrics = get_cache_metrics()
+    assert metrics["response_cache_hits_total"] == 1
+    assert metrics["response_cache_misses_total"] == 1
+    assert metrics["response_cache_entries"] == 1
+
+
+def test_random_sampling_is_not_cached():
+    global server
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 8,
+        "temperature": 0.8,
+    }
+    for _ in range(2):
+        res = server.make_request("POST", "/completion", data=data)
+        assert res.status_code == 200
+    metrics = get_cache_metrics()
+    assert metrics["response_cache_hits_total"] == 0
+    assert metrics["response_cache_misses_total"] == 0
+    assert metrics["response_cache_entries"] == 0
+
+    # a fixed seed does not make the sampling deterministic
+    for _ in range(2):
+        res = server.make_request("POST", "/completion", data={**data, "seed": 42})
+        assert res.status_code == 200
+    assert get_cache_metrics()["response_cache_entries"] == 0
+
+
+def test_cached_chat_completion_is_a_new_response():
+    global server
+    server.start()
+    data = {
+        "max_tokens": 8,
+        "messages": [{"role": "user", "content": "What is the best book"}],
+        "temperature": 0.0,
+    }
+    res1 = server.make_request("POST", "/chat/completions", data=data)
+    assert res1.status_code == 200
+    time.sleep(1.1)
+    res2 = server.make_request("POST", "/chat/completions", data=data)
+    assert res2.status_code == 200
+    assert res2.body["choices"] == res1.body["choices"]
+    assert res2.body["id"] != res1.body["id"]
+    assert res2.body["created"] > res1.body["created"]
+    assert "timings" not in res2.body
+    assert get_cache_metrics()["response_cache_hits_total"] == 1
+
+
+def test_stream_is_not_cached():
+    global server
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 8,
+        "temperature": 0.0,
+        "stream": True,
+    }
+    for _ in range(2):
+        for _ in server.make_stream_request("POST", "/completion", data=data):
+            pass
+    assert get_cache_metrics()["response_cache_entries"] == 0
+
+
+def test_cache_ttl():
+    global server
+    server.response_cache_ttl = 1
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 8,
+        "temperature": 0.0,
+    }
+    server.make_request("POST", "/completion", data=data)
+    time.sleep(1.5)
+    server.make_request("POST", "/completion", data=data)
+    metrics = get_cache_metrics()
+    assert metrics["response_cache_hits_total"] == 0
+    assert metrics["response_cache_misses_total"] == 2
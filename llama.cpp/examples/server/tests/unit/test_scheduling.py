@@ -0,0 +1,167 @@
+import pytest
+import requests
+import time
+from concurrent.futures import ThreadPoolExecutor
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.n_ctx = 4096
+    server.n_predict = None # occupy_slot generates more than the 64 tokens of the preset
+    server.n_threads_http = 32 # all requests of a test wait for the slot in the server, not for an HTTP thread
+    server.server_metrics = True
+
+
+def get_metrics() -> str:
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    return res.text
+
+
+def test_invalid_priority():
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 4,
+        "priority": "urgent",
+    })
+    assert res.status_code == 400
+    assert "priority" in res.body["error"]["message"]
+
+
+@pytest.mark.parametrize("priority", ["interactive", "normal", "batch"])
+def test_queue_wait_histogram(priority: str):
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 4,
+        "priority": priority,
+    })
+    assert res.status_code == 200
+    metrics = get_metrics()
+    assert "# TYPE llamacpp:queue_wait_seconds histogram" in metrics
+    assert f'llamacpp:queue_wait_seconds_count{{priority="{priority}"}} 1' in metrics
+    assert f'llamacpp:queue_wait_seconds_bucket{{priority="{priority}",le="+Inf"}} 1' in metrics
+
+
+def test_deadline_rejected_while_slot_busy():
+    global server
+    server.start()
+    # history for the estimate of the queue wait
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+
+    def occupy_slot():
+        return server.make_request("POST", "/completion", data={
+            "prompt": "I believe the meaning of life is",
+            "n_predict": 2000,
+            "ignore_eos": True,
+        })
+
+    def with_deadline():
+        time.sleep(0.2) # make sure that the slot is taken
+        return server.make_request("POST", "/completion", data={
+            "prompt": "Write a joke about AI",
+            "n_predict": 8,
+            "deadline_ms": 1,
+        })
+
+    res_busy, res_deadline = parallel_function_calls([(occupy_slot, ()), (with_deadline, ())])
+    assert res_busy.status_code == 200
+    assert res_deadline.status_code == 503
+    assert "deadline" in res_deadline.body["error"]["message"]
+    assert 'llamacpp:requests_rejected_deadline_total{priority="normal"} 1' in get_metrics()
+
+
+def test_deadline_met():
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 8,
+        "deadline_ms": 60000,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["predicted_n"] == 8
+
+
+def occupy_slot():
+    return server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 4000,
+        "ignore_eos": True,
+    })
+
+
+def run_while_slot_busy(tasks: list) -> list:
+    """
+    Runs occupy_slot and the requests, each on its own thread so that all of them wait for the slot at once.
+    Returns the values of the requests, in the order they completed.
+    """
+    done = []
+
+    def run(func, args):
+        done.append(func(*args))
+
+    with ThreadPoolExecutor(max_workers=len(tasks) + 1) as executor:
+        futures = [executor.submit(occupy_slot)]
+        futures += [executor.submit(run, func, args) for func, args in tasks]
+        for future in futures:
+            future.result()
+    return done
+
+
+def test_tenant_flood_fair_share():
+    global server
+    server.start()
+    n_flood = 8
+
+    def request(tenant: str, delay: float):
+        time.sleep(delay) # the slot is taken and the flood is queued first
+        res = server.make_request("POST", "/completion", headers={"X-Tenant-Id": tenant}, data={
+            "prompt": "Write a joke about AI",
+            "n_predict": 64,
+            "ignore_eos": True,
+        })
+        assert res.status_code == 200
+        return tenant
+
+    done = run_while_slot_busy([(request, ("flood", 0.1)) for _ in range(n_flood)] + [(request, ("other", 0.3))])
+    # the tenants share the slot equally: the other tenant is served first or second, not after the flood
+    assert len(done) == n_flood + 1
+    assert done.index("other") <= 1
+
+
+def test_priority_classes_share_8_4_1():
+    global server
+    server.start()
+
+    def request(priority: str):
+        time.sleep(0.1) # make sure that the slot is taken
+        res = server.make_request("POST", "/completion", data={
+            "prompt": "Write a joke about AI",
+            "n_predict": 64,
+            "ignore_eos": True,
+            "priority": priority,
+        })
+        assert res.status_code == 200
+        return priority
+
+    n_tasks = {"interactive": 9, "normal": 5, "batch": 2}
+    done = run_while_slot_busy([(request, (priority,)) for priority, n in n_tasks.items() for _ in range(n)])
+    # every class has tasks left after the first 13 released slots, which go 8:4:1 to interactive, normal and batch
+    first = done[:13]
+    assert first.count("interactive") == 8
+    assert first.count("normal") == 4
+    assert first.count("batch") == 1
@@ -96,3 +96,41 @@ def test_slot_erase():
     assert res.status_code == 200
     assert match_regex("(Whiskers|Flana)+", res.body["content"])
     assert res.body["timings"]["prompt_n"] == 21  # all tokens are processed
+
+
+def test_slot_save_restore_per_layer_types():
+    global server
+    # the heads of the model are too small for the quantized types
+    server.ctk_layers = "0:f32,2-3:bf16"
+    server.ctv_layers = "1:f32"
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France?",
+        "id_slot": 1,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    content = res.body["content"]
+
+    res = server.make_request("POST", "/slots/1?action=save", data={
+        "filename": "slot1_layers.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_saved"] == 84
+
+    res = server.make_request("POST", "/slots/0?action=restore", data={
+        "filename": "slot1_layers.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_restored"] == 84
+
+    # the restored cache gives the same completion
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France?",
+        "id_slot": 0,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 1
+    assert res.body["content"] == content
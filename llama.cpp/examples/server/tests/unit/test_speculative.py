@@ -124,3 +124,29 @@ def test_multi_requests_parallel(n_slots: int, n_requests: int):
     for res in results:
         assert res.status_code == 200
         assert match_regex("(wise|kind|owl|answer)+", res.body["content"])
+
+
+@pytest.mark.parametrize("n_slots,n_requests", [
+    (2, 2),
+    (2, 4),
+])
+def test_multi_requests_parallel_batched_draft(n_slots: int, n_requests: int):
+    global server
+    server.n_slots = n_slots
+    server.draft_batched = True
+    server.start()
+    tasks = []
+    for _ in range(n_requests):
+        tasks.append((server.make_request, ("POST", "/completion", {
+            "prompt": "I believe the meaning of life is",
+            "temperature": 0.0,
+            "top_k": 1,
+        })))
+    results = parallel_function_calls(tasks)
+    contents = [res.body["content"] for res in results]
+    for res in results:
+        assert res.status_code == 200
+        assert res.body["timings"]["draft_n"] > 0
+    # drafts are verified by the target model, the output does not depend on them
+    assert all(content == contents[0] for content in contents)
+    assert match_regex("(wise|kind|owl|answer)+", contents[0])
@@ -0,0 +1,43 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+
+
+@pytest.mark.parametrize("path,data,get_text", [
+    ("/completion",          {"prompt": "I believe the meaning of life is"},                lambda d: d["content"]),
+    ("/v1/completions",      {"prompt": "I believe the meaning of life is"},                lambda d: d["choices"][0]["text"]),
+    ("/v1/chat/completions", {"messages": [{"role": "user", "content": "What is life?"}]}, lambda d: d["choices"][0]["delta"].get("content") or ""),
+])
+def test_stream_chunks_match_non_stream(path: str, data: dict, get_text):
+    # the plain text chunks are written without building json, they must carry the same text as the full response
+    global server
+    server.start()
+    data = {**data, "n_predict": 32, "temperature": 0.0}
+    res = server.make_request("POST", path, data=data)
+    assert res.status_code == 200
+    if path == "/completion":
+        expected = res.body["content"]
+    elif path == "/v1/completions":
+        expected = res.body["choices"][0]["text"]
+    else:
+        expected = res.body["choices"][0]["message"]["content"]
+
+    content = ""
+    n_tokens = 0
+    for chunk in server.make_stream_request("POST", path, data={**data, "stream": True}):
+        content += get_text(chunk)
+        if path == "/completion" and not chunk["stop"]:
+            assert chunk["id_slot"] == -1
+            n_tokens += len(chunk["tokens"])
+    assert content == expected
+    if path == "/completion":
+        # several tokens can be sent in one chunk when the client reads slower than they are generated
+        assert n_tokens <= 32
+
@@ -55,6 +55,7 @@ class ServerProcess:
     model_file: str | None = None
     model_draft: str | None = None
     n_threads: int | None = None
+    n_threads_http: int | None = None
     n_gpu_layer: int | None = None
     n_batch: int | None = None
     n_ubatch: int | None = None
@@ -67,8 +68,21 @@ class ServerProcess:
     id_slot: int | None = None
     cache_prompt: bool | None = None
     n_slots: int | None = None
+    kv_pool: bool | None = None
+    n_ctx_slot: int | None = None
+    itl_target: int | None = None
+    defrag_idle: int | None = None
+    slot_prefix_share: bool | None = None
+    prompt_cache_dir: str | None = None
+    prompt_cache_size: int | None = None
+    prompt_cache_ram: int | None = None
+    response_cache: int | None = None
+    response_cache_ttl: int | None = None
     ctk: str | None = None
+    kv_block_size: int | None = None
     ctv: str | None = None
+    ctk_layers: str | None = None
+    ctv_layers: str | None = None
     fa: bool | None = None
     server_continuous_batching: bool | None = False
     server_embeddings: bool | None = False
@@ -80,8 +94,10 @@ class ServerProcess:
     api_key: str | None = None
     lora_files: List[str] | None = None
     disable_ctx_shift: int | None = False
+    context_sinks: int | None = None
     draft_min: int | None = None
     draft_max: int | None = None
+    draft_batched: bool | None = None
     no_webui: bool | None = None
     jinja: bool | None = None
     reasoning_format: Literal['deepseek', 'none'] | None = None
@@ -135,6 +151,8 @@ class ServerProcess:
             server_args.extend(["--ubatch-size", self.n_ubatch])
         if self.n_threads:
             server_args.extend(["--threads", self.n_threads])
+        if self.n_threads_http:
+            server_args.extend(["--threads-http", self.n_threads_http])
         if self.n_gpu_layer:
             server_args.extend(["--n-gpu-layers", self.n_gpu_layer])
         if self.draft is not None:
@@ -157,10 +175,36 @@ class ServerProcess:
             server_args.extend(["--ctx-size", self.n_ctx])
         if self.n_slots:
             server_args.extend(["--parallel", self.n_slots])
+        if self.kv_pool:
+            server_args.append("--kv-pool")
+        if self.n_ctx_slot:
+            server_args.extend(["--ctx-size-slot", self.n_ctx_slot])
+        if self.itl_target:
+            server_args.extend(["--itl-target", self.itl_target])
+        if self.defrag_idle:
+            server_args.extend(["--defrag-idle", self.defrag_idle])
+        if self.slot_prefix_share:
+            server_args.append("--slot-prefix-share")
+        if self.prompt_cache_dir:
+            server_args.extend(["--prompt-cache-dir", self.prompt_cache_dir])
+        if self.prompt_cache_size is not None:
+            server_args.extend(["--prompt-cache-size", self.prompt_cache_size])
+        if self.prompt_cache_ram is not None:
+            server_args.extend(["--prompt-cache-ram", self.prompt_cache_ram])
+        if self.response_cache:
+            server_args.extend(["--response-cache", self.response_cache])
+        if self.response_cache_ttl is not None:
+            server_args.extend(["--response-cache-ttl", self.response_cache_ttl])
         if self.ctk:
             server_args.extend(["-ctk", self.ctk])
         if self.ctv:
             server_args.extend(["-ctv", self.ctv])
+        if self.ctk_layers:
+            server_args.extend(["--cache-type-k-layers", self.ctk_layers])
+        if self.ctv_layers:
+            server_args.extend(["--cache-type-v-layers", self.ctv_layers])
+        if self.kv_block_size:
+            server_args.extend(["--kv-block-size", self.kv_block_size])
         if self.fa is not None:
             server_args.append("-fa")
         if self.n_predict:
@@ -178,12 +222,16 @@ class ServerProcess:
                 server_args.extend(["--lora", lora_file])
         if self.disable_ctx_shift:
             server_args.extend(["--no-context-shift"])
+        if self.context_sinks is not None:
+            server_args.extend(["--context-sinks", self.context_sinks])
         if self.api_key:
             server_args.extend(["--api-key", self.api_key])
         if self.draft_max:
             server_args.extend(["--draft-max", self.draft_max])
         if self.draft_min:
             server_args.extend(["--draft-min", self.draft_min])
+        if self.draft_batched:
+            server_args.append("--draft-batched")
         if self.no_webui:
             server_args.append("--no-webui")
         if self.jinja:
@@ -3,6 +3,7 @@
 #include "common.h"
 #include "log.h"
 #include "llama.h"
+#include "sampling.h"
 #include "base64.hpp"
 
 // increase max payload length to allow use of larger context size
@@ -16,6 +17,7 @@
 #include "json.hpp"
 #include "chat.h"
 
+#include <charconv>
 #include <random>
 #include <sstream>
 #include <string>
@@ -516,6 +518,80 @@ static std::string tokens_to_output_formatted_string(const llama_context * ctx,
     return out;
 }
 
+//
+// streaming utils, append server-sent events to a reusable buffer without building json objects
+//
+
+// append str as a JSON string literal, escaped the same way as json::dump()
+// returns false for invalid utf8, which json::dump() replaces: the caller has to fall back to it
+static bool sse_append_json_string(std::string & out, const std::string & str) {
+    static const char * hex = "0123456789abcdef";
+
+    out.push_back('"');
+    const size_t n = str.size();
+    for (size_t i = 0; i < n; ) {
+        const unsigned char c = str[i];
+        if (c >= 0x80) {
+            // strict utf8 as in the json parser: no overlong forms, no surrogates, max U+10FFFF
+            size_t len = 0;
+            unsigned char lo = 0x80;
+            unsigned char hi = 0xBF;
+            if (c >= 0xC2 && c <= 0xDF) {
+                len = 2;
+            } else if (c >= 0xE0 && c <= 0xEF) {
+                len = 3;
+                lo = c == 0xE0 ? 0xA0 : 0x80;
+                hi = c == 0xED ? 0x9F : 0xBF;
+            } else if (c >= 0xF0 && c <= 0xF4) {
+                len = 4;
+                lo = c == 0xF0 ? 0x90 : 0x80;
+                hi = c == 0xF4 ? 0x8F : 0xBF;
+            } else {
+                return false;
+            }
+            if (i + len > n) {
+                return false;
+            }
+            for (size_t j = 1; j < len; ++j) {
+                const unsigned char cc = str[i + j];
+                if (cc < (j == 1 ? lo : 0x80) || cc > (j == 1 ? hi : 0xBF)) {
+                    return false;
+                }
+            }
+            out.append(str, i, len);
+            i += len;
+            continue;
+        }
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b";  break;
+            case '\f': out += "\\f";  break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:
+                if (c < 0x20) {
+                    const char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+                    out.append(esc, sizeof(esc));
+                } else {
+                    out.push_back((char) c);
+                }
+        }
+        ++i;
+    }
+    out.push_back('"');
+
+    return true;
+}
+
+template <typename T>
+static void sse_append_int(std::string & out, T value) {
+    char buf[24];
+    const auto res = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, res.ptr);
+}
+
 static bool server_sent_event(httplib::DataSink & sink, const char * event, const json & data) {
     const std::string str =
         std::string(event) + ": " +
@@ -527,6 +603,13 @@ static bool server_sent_event(httplib::DataSink & sink, const char * event, cons
     return sink.write(str.c_str(), str.size());
 }
 
+// write the events that were appended to buf
+static bool server_sent_event(httplib::DataSink & sink, const std::string & buf) {
+    LOG_DBG("data stream, to_send: %s", buf.c_str());
+
+    return sink.write(buf.data(), buf.size());
+}
+
 //
 // OAI utils
 //
@@ -839,8 +922,8 @@ static std::string safe_json_to_str(const json & data) {
     return data.dump(-1, ' ', false, json::error_handler_t::replace);
 }
 
-static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx, int idx) {
-    std::vector<llama_token_data> cur;
+// the n most likely tokens at output idx with their probabilities, sorted, and the probability of token tok
+static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx, int idx, size_t n, llama_token tok, float & prob_tok) {
     const auto * logits = llama_get_logits_ith(ctx, idx);
 
     const llama_model * model = llama_get_model(ctx);
@@ -848,29 +931,7 @@ static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx
 
     const int n_vocab = llama_vocab_n_tokens(vocab);
 
-    cur.resize(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
-    }
-
-    // sort tokens by logits
-    std::sort(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
-        return a.logit > b.logit;
-    });
-
-    // apply softmax
-    float max_l = cur[0].logit;
-    float cum_sum = 0.0f;
-    for (size_t i = 0; i < cur.size(); ++i) {
-        float p = expf(cur[i].logit - max_l);
-        cur[i].p = p;
-        cum_sum += p;
-    }
-    for (size_t i = 0; i < cur.size(); ++i) {
-        cur[i].p /= cum_sum;
-    }
-
-    return cur;
+    return common_top_n_probs(logits, n_vocab, (int32_t) std::min<size_t>(n, n_vocab), tok, &prob_tok);
 }
 
 static bool are_lora_equal(
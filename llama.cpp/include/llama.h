@@ -41,10 +41,10 @@
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 9
+#define LLAMA_SESSION_VERSION 10
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 2
+#define LLAMA_STATE_SEQ_VERSION 3
 
 #ifdef __cplusplus
 extern "C" {
@@ -343,6 +343,7 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t n_kv_block;       // paged KV cache with blocks of n_kv_block cells, 0 = disabled (default) [EXPERIMENTAL]
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -350,6 +351,11 @@ extern "C" {
         enum ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        // per-layer data types for the K and V cache, terminated by GGML_TYPE_COUNT [EXPERIMENTAL]
+        // the layers past the end of the array use type_k/type_v, NULL = all layers
+        const enum ggml_type * type_k_layer;
+        const enum ggml_type * type_v_layer;
+
         // Keep the booleans together and at the end of the struct to avoid misalignment during copy-by-value.
         // TODO: move at the end of the struct
         bool logits_all;  // the llama_decode() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
@@ -464,6 +470,7 @@ extern "C" {
     LLAMA_API int64_t llama_time_us(void);
 
     LLAMA_API size_t llama_max_devices(void);
+    LLAMA_API size_t llama_max_parallel_sequences(void); // seq ids accepted by llama_decode are in [0, llama_max_parallel_sequences())
 
     LLAMA_API bool llama_supports_mmap       (void);
     LLAMA_API bool llama_supports_mlock      (void);
@@ -735,6 +742,28 @@ extern "C" {
     //   - explicitly with llama_kv_self_update()
     LLAMA_API void llama_kv_self_defrag(struct llama_context * ctx);
 
+    // Fragmentation of the KV cache
+    // the attention of each ubatch visits the cells [0, n_attended), the gaps in between included
+    struct llama_kv_defrag_stats {
+        int32_t n_attended;     // cells visited by the attention of the next ubatch
+        int32_t n_attended_min; // cells that it would visit after a full defragmentation
+        int32_t n_move;         // cells that a full defragmentation moves
+    };
+
+    LLAMA_API struct llama_kv_defrag_stats llama_kv_self_defrag_stats(const struct llama_context * ctx);
+
+    // Defragment a part of the KV cache right away, instead of with the next llama_decode()
+    // at most n_max_moves blocks of consecutive cells are moved (<= 0 - as many as fit in one graph), and only if the
+    // full defragmentation pays off: moving a cell costs about as much as reading it twice, while the gaps are read by
+    // every ubatch - so the gaps read by the next n_ubatch_expected ubatches must be more than twice the cells to move
+    // can be called repeatedly, e.g. while the application is idle, to spread the moves over short steps
+    // unlike llama_kv_self_update(), it does not reserve the worst case compute buffers again after the moves
+    // returns the number of cells moved, 0 if none were worth moving
+    LLAMA_API int32_t llama_kv_self_defrag_step(
+            struct llama_context * ctx,
+                         int32_t   n_max_moves,
+                         int32_t   n_ubatch_expected);
+
     // Check if the context supports KV cache shifting
     LLAMA_API bool llama_kv_self_can_shift(const struct llama_context * ctx);
 
@@ -894,6 +923,55 @@ extern "C" {
                           size_t   n_token_capacity,
                           size_t * n_token_count_out);
 
+    typedef uint32_t llama_state_seq_flags;
+
+    // the state is packed: split in sections, the K and V of each layer apart, each with a checksum
+    // this is the format of the state in the files of llama_state_save_file and llama_state_seq_save_file
+    #define LLAMA_STATE_SEQ_FLAGS_PACKED   1
+
+    // the state is packed, and its sections are compressed (lossless) where that makes them smaller
+    #define LLAMA_STATE_SEQ_FLAGS_COMPRESS 2
+
+    // same as the functions above, with flags
+    // with LLAMA_STATE_SEQ_FLAGS_COMPRESS, llama_state_seq_get_size_ext returns an upper bound of the size, and
+    // llama_state_seq_get_data_ext the size of the data
+    // llama_state_seq_set_data_ext reads packed states with either flag, and fails if a checksum does not match
+    LLAMA_API size_t llama_state_seq_get_size_ext(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+           llama_state_seq_flags   flags);
+
+    LLAMA_API size_t llama_state_seq_get_data_ext(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                          size_t   size,
+                    llama_seq_id   seq_id,
+           llama_state_seq_flags   flags);
+
+    LLAMA_API size_t llama_state_seq_set_data_ext(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id,
+           llama_state_seq_flags   flags);
+
+    LLAMA_API size_t llama_state_seq_save_file_ext(
+            struct llama_context * ctx,
+                      const char * filepath,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                          size_t   n_token_count,
+           llama_state_seq_flags   flags);
+
+    // compress a state written with LLAMA_STATE_SEQ_FLAGS_PACKED, as LLAMA_STATE_SEQ_FLAGS_COMPRESS would have written it
+    // it does not use a context, so it can run on another thread while the context decodes
+    // dst must hold size bytes, returns the size of the compressed state, or 0 if src is not a packed state
+    LLAMA_API size_t llama_state_seq_compress(
+                   const uint8_t * src,
+                          size_t   size,
+                         uint8_t * dst,
+                         int32_t   n_threads);
+
     //
     // Decoding
     //
@@ -962,6 +1040,19 @@ extern "C" {
     // If true, all model tensors are activated during llama_decode() to load and cache their weights.
     LLAMA_API void llama_set_warmup(struct llama_context * ctx, bool warmup);
 
+    // Set the tokens whose logits are computed by the next calls to llama_decode(), instead of the whole vocabulary
+    // only these rows of the output projection are computed, and the logits of each output are n_tokens floats in the
+    // order of the given tokens (llama_get_logits_ith etc.) - outputs that need different tokens share their union
+    // tokens = NULL or n_tokens = 0 restores the logits of the whole vocabulary
+    // returns false, without changing the current tokens, if a token is not in the vocabulary
+    // while tokens are set, the samplers (llama_sampler_sample, common_sampler), which read n_vocab logits, cannot be
+    // used, and a state saved with llama_state_* can only be loaded while the same number of tokens is set
+    LLAMA_API bool llama_set_output_tokens(struct llama_context * ctx, const llama_token * tokens, int32_t n_tokens);
+
+    // Number of logits of each output of the last call to llama_decode(): n_vocab, or the number of tokens set with
+    // llama_set_output_tokens()
+    LLAMA_API int32_t llama_n_logits(const struct llama_context * ctx);
+
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, ggml_abort_callback abort_callback, void * abort_callback_data);
 
@@ -974,11 +1065,11 @@ extern "C" {
     // The logits for which llama_batch.logits[i] != 0 are stored contiguously
     // in the order they have appeared in the batch.
     // Rows: number of tokens for which llama_batch.logits[i] != 0
-    // Cols: n_vocab
+    // Cols: llama_n_logits(ctx) - n_vocab, unless tokens are set with llama_set_output_tokens()
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
     // Logits for the ith token. For positive indices, Equivalent to:
-    // llama_get_logits(ctx) + ctx->output_ids[i]*n_vocab
+    // llama_get_logits(ctx) + ctx->output_ids[i]*llama_n_logits(ctx)
     // Negative indicies can be used to access logits in reverse order, -1 is the last logit.
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
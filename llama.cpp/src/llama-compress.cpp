@@ -0,0 +1,320 @@
+#include "llama-compress.h"
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+
+// format:
+//   u32 magic, u64 size of the data
+//   per block of up to COMPRESS_BLOCK bytes, for each of the 2 planes:
+//     u8 mode, u32 size of the payload
+//     mode 0: the plane as is
+//     mode 1: 256 code lengths as 4-bit nibbles, then the Huffman coded plane (LSB first)
+
+static constexpr uint32_t COMPRESS_MAGIC   = 0x315a564b; // 'KVZ1'
+static constexpr size_t   COMPRESS_BLOCK   = 1 << 18;
+static constexpr int      COMPRESS_MAX_LEN = 12;
+
+enum compress_mode : uint8_t {
+    COMPRESS_MODE_RAW     = 0,
+    COMPRESS_MODE_HUFFMAN = 1,
+};
+
+template <typename T>
+static void write_val(std::vector<uint8_t> & out, T val) {
+    const size_t n = out.size();
+    out.resize(n + sizeof(T));
+    memcpy(out.data() + n, &val, sizeof(T));
+}
+
+template <typename T>
+static bool read_val(const uint8_t * & p, const uint8_t * end, T & val) {
+    if ((size_t) (end - p) < sizeof(T)) {
+        return false;
+    }
+    memcpy(&val, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+// Huffman code lengths of the symbols with non-zero frequency, at most COMPRESS_MAX_LEN bits
+// the frequencies are flattened until the longest code fits
+static void huffman_lengths(const uint32_t * freq_in, uint8_t * len) {
+    uint64_t freq[256];
+    for (int i = 0; i < 256; ++i) {
+        freq[i] = freq_in[i];
+    }
+
+    while (true) {
+        std::fill(len, len + 256, 0);
+
+        // nodes 0..255 are the symbols, the rest are internal
+        std::vector<int> parent(512, -1);
+        using node = std::pair<uint64_t, int>;
+        std::priority_queue<node, std::vector<node>, std::greater<node>> queue;
+        for (int i = 0; i < 256; ++i) {
+            if (freq[i] > 0) {
+                queue.emplace(freq[i], i);
+            }
+        }
+
+        if (queue.empty()) {
+            return;
+        }
+        if (queue.size() == 1) {
+            len[queue.top().second] = 1;
+            return;
+        }
+
+        int n_nodes = 256;
+        while (queue.size() > 1) {
+            const node a = queue.top(); queue.pop();
+            const node b = queue.top(); queue.pop();
+            parent[a.second] = n_nodes;
+            parent[b.second] = n_nodes;
+            queue.emplace(a.first + b.first, n_nodes++);
+        }
+
+        int max_len = 0;
+        for (int i = 0; i < 256; ++i) {
+            if (freq[i] == 0) {
+                continue;
+            }
+            int l = 0;
+            for (int j = i; parent[j] >= 0; j = parent[j]) {
+                ++l;
+            }
+            len[i] = l;
+            max_len = std::max(max_len, l);
+        }
+
+        if (max_len <= COMPRESS_MAX_LEN) {
+            return;
+        }
+
+        for (int i = 0; i < 256; ++i) {
+            if (freq[i] > 0) {
+                freq[i] = (freq[i] + 1)/2;
+            }
+        }
+    }
+}
+
+// canonical codes for the lengths, bit-reversed for the LSB first bit stream
+// returns false if the lengths do not form a valid prefix code
+static bool huffman_codes(const uint8_t * len, uint16_t * code) {
+    int count[COMPRESS_MAX_LEN + 1] = {};
+    for (int i = 0; i < 256; ++i) {
+        if (len[i] > COMPRESS_MAX_LEN) {
+            return false;
+        }
+        count[len[i]]++;
+    }
+    count[0] = 0;
+
+    int next[COMPRESS_MAX_LEN + 2] = {};
+    int c = 0;
+    for (int l = 1; l <= COMPRESS_MAX_LEN; ++l) {
+        c = (c + count[l - 1]) << 1;
+        next[l] = c;
+        if (next[l] + count[l] > (1 << l)) {
+            return false;
+        }
+    }
+
+    for (int i = 0; i < 256; ++i) {
+        const int l = len[i];
+        code[i] = 0;
+        if (l == 0) {
+            continue;
+        }
+        const int v = next[l]++;
+        uint16_t r = 0;
+        for (int b = 0; b < l; ++b) {
+            r |= ((v >> b) & 1) << (l - 1 - b);
+        }
+        code[i] = r;
+    }
+
+    return true;
+}
+
+static void compress_plane(const uint8_t * src, size_t n, std::vector<uint8_t> & out) {
+    uint32_t freq[256] = {};
+    for (size_t i = 0; i < n; ++i) {
+        freq[src[i]]++;
+    }
+
+    uint8_t  len[256];
+    uint16_t code[256];
+    huffman_lengths(freq, len);
+    huffman_codes(len, code);
+
+    uint64_t n_bits = 0;
+    for (int i = 0; i < 256; ++i) {
+        n_bits += (uint64_t) freq[i]*len[i];
+    }
+
+    const size_t n_coded = 128 + (n_bits + 7)/8;
+    if (n == 0 || n_coded >= n) {
+        write_val<uint8_t>(out, COMPRESS_MODE_RAW);
+        write_val<uint32_t>(out, n);
+        out.insert(out.end(), src, src + n);
+        return;
+    }
+
+    write_val<uint8_t>(out, COMPRESS_MODE_HUFFMAN);
+    write_val<uint32_t>(out, n_coded);
+    for (int i = 0; i < 256; i += 2) {
+        out.push_back(len[i] | (len[i + 1] << 4));
+    }
+
+    const size_t start = out.size();
+    out.resize(start + n_coded - 128 + 8);
+    uint8_t * dst = out.data() + start;
+
+    uint64_t buf = 0;
+    int      cnt = 0;
+    for (size_t i = 0; i < n; ++i) {
+        buf |= (uint64_t) code[src[i]] << cnt;
+        cnt += len[src[i]];
+        if (cnt >= 32) {
+            memcpy(dst, &buf, 4);
+            dst += 4;
+            buf >>= 32;
+            cnt -= 32;
+        }
+    }
+    while (cnt > 0) {
+        *dst++ = buf & 0xff;
+        buf >>= 8;
+        cnt -= 8;
+    }
+
+    out.resize(start + n_coded - 128);
+}
+
+static bool decompress_plane(const uint8_t * & p, const uint8_t * end, uint8_t * dst, size_t n, size_t stride) {
+    uint8_t  mode;
+    uint32_t size;
+    if (!read_val(p, end, mode) || !read_val(p, end, size) || (size_t) (end - p) < size) {
+        return false;
+    }
+
+    if (mode == COMPRESS_MODE_RAW) {
+        if (size != n) {
+            return false;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            dst[i*stride] = p[i];
+        }
+        p += size;
+        return true;
+    }
+
+    if (mode != COMPRESS_MODE_HUFFMAN || size < 128) {
+        return false;
+    }
+
+    uint8_t  len[256];
+    uint16_t code[256];
+    for (int i = 0; i < 128; ++i) {
+        len[2*i + 0] = p[i] & 0xf;
+        len[2*i + 1] = p[i] >> 4;
+    }
+    if (!huffman_codes(len, code)) {
+        return false;
+    }
+
+    // (symbol << 4) | length for every COMPRESS_MAX_LEN bit prefix, 0 for prefixes that are not in the code
+    std::vector<uint16_t> table(1 << COMPRESS_MAX_LEN, 0);
+    for (int i = 0; i < 256; ++i) {
+        for (uint32_t j = code[i]; len[i] > 0 && j < table.size(); j += 1u << len[i]) {
+            table[j] = (i << 4) | len[i];
+        }
+    }
+
+    const uint8_t * src     = p + 128;
+    const uint8_t * src_end = p + size;
+
+    uint64_t buf = 0;
+    int      cnt = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (cnt < COMPRESS_MAX_LEN) {
+            if (src_end - src >= 8) {
+                // refill the whole word at once, the bytes that do not fit are read again next time
+                uint64_t v;
+                memcpy(&v, src, sizeof(v));
+                buf |= v << cnt;
+                src += (63 - cnt) >> 3;
+                cnt |= 56;
+            } else {
+                while (cnt <= 56 && src < src_end) {
+                    buf |= (uint64_t) *src++ << cnt;
+                    cnt += 8;
+                }
+            }
+        }
+        const uint16_t e = table[buf & ((1 << COMPRESS_MAX_LEN) - 1)];
+        const int      l = e & 0xf;
+        if (l == 0 || l > cnt) {
+            return false;
+        }
+        dst[i*stride] = e >> 4;
+        buf >>= l;
+        cnt  -= l;
+    }
+
+    p += size;
+    return true;
+}
+
+std::vector<uint8_t> llama_kv_compress(const uint8_t * data, size_t n) {
+    std::vector<uint8_t> out;
+    out.reserve(n/2 + 64);
+
+    write_val<uint32_t>(out, COMPRESS_MAGIC);
+    write_val<uint64_t>(out, n);
+
+    std::vector<uint8_t> plane(COMPRESS_BLOCK/2);
+    for (size_t i0 = 0; i0 < n; i0 += COMPRESS_BLOCK) {
+        const size_t n_block = std::min(COMPRESS_BLOCK, n - i0);
+        for (size_t ip = 0; ip < 2; ++ip) {
+            const size_t n_plane = (n_block + 1 - ip)/2;
+            for (size_t i = 0; i < n_plane; ++i) {
+                plane[i] = data[i0 + 2*i + ip];
+            }
+            compress_plane(plane.data(), n_plane, out);
+        }
+    }
+
+    return out;
+}
+
+bool llama_kv_decompress(const uint8_t * data, size_t n, std::vector<uint8_t> & dst) {
+    const uint8_t * p   = data;
+    const uint8_t * end = data + n;
+
+    uint32_t magic;
+    uint64_t size;
+    if (!read_val(p, end, magic) || !read_val(p, end, size) || magic != COMPRESS_MAGIC) {
+        return false;
+    }
+
+    // every block of the data takes at least 2 plane headers
+    if (size/COMPRESS_BLOCK > n) {
+        return false;
+    }
+
+    dst.resize(size);
+    for (size_t i0 = 0; i0 < size; i0 += COMPRESS_BLOCK) {
+        const size_t n_block = std::min<size_t>(COMPRESS_BLOCK, size - i0);
+        for (size_t ip = 0; ip < 2; ++ip) {
+            if (!decompress_plane(p, end, dst.data() + i0 + ip, (n_block + 1 - ip)/2, 2)) {
+                return false;
+            }
+        }
+    }
+
+    return p == end;
+}
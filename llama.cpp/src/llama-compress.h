@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Lossless compression of KV cache state, used for the sections of the packed state (see llama_io_write_packed)
+//
+// The bytes are split into two planes by their position in 2-byte words, so that the high bytes of the f16 values of
+// the KV cache (sign, exponent and the top mantissa bits - few distinct values) are coded apart from the noisy low
+// bytes. Each plane of each block is Huffman coded, or stored as is when coding does not make it smaller.
+
+// compress n bytes of data
+std::vector<uint8_t> llama_kv_compress(const uint8_t * data, size_t n);
+
+// decompress the output of llama_kv_compress into dst, returns false if the data is not valid
+bool llama_kv_decompress(const uint8_t * data, size_t n, std::vector<uint8_t> & dst);
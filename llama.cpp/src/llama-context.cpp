@@ -11,6 +11,7 @@
 #include <stdexcept>
 #include <cinttypes>
 #include <cmath>
+#include <memory>
 
 //
 // llama_context
@@ -28,6 +29,10 @@ llama_context::llama_context(
     const auto & hparams = model.hparams;
 
     cparams.n_seq_max        = std::max(1u, params.n_seq_max);
+    if (cparams.n_seq_max > LLAMA_MAX_PARALLEL_SEQUENCES) {
+        throw std::runtime_error(format("n_seq_max must be <= %d", LLAMA_MAX_PARALLEL_SEQUENCES));
+    }
+
     cparams.n_threads        = params.n_threads;
     cparams.n_threads_batch  = params.n_threads_batch;
     cparams.yarn_ext_factor  = params.yarn_ext_factor;
@@ -35,6 +40,7 @@ llama_context::llama_context(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.n_kv_block       = params.n_kv_block;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
@@ -188,19 +194,33 @@ llama_context::llama_context(
         LLAMA_LOG_DEBUG("%s: n_ctx = %u (padded)\n", __func__, cparams.n_ctx);
 
         uint32_t kv_size = cparams.n_ctx;
-        ggml_type type_k = params.type_k;
-        ggml_type type_v = params.type_v;
+
+        // per-layer types of the cache
+        std::vector<ggml_type> type_k(hparams.n_layer, params.type_k);
+        std::vector<ggml_type> type_v(hparams.n_layer, params.type_v);
+
+        for (uint32_t il = 0; params.type_k_layer && il < hparams.n_layer && params.type_k_layer[il] != GGML_TYPE_COUNT; ++il) {
+            type_k[il] = params.type_k_layer[il];
+        }
+        for (uint32_t il = 0; params.type_v_layer && il < hparams.n_layer && params.type_v_layer[il] != GGML_TYPE_COUNT; ++il) {
+            type_v[il] = params.type_v_layer[il];
+        }
 
         if (llama_model_is_recurrent(&model)) {
             // Mamba needs at least as many KV cells as there are sequences kept at any time
             kv_size = std::max((uint32_t) 1, params.n_seq_max);
             // it's probably best to keep as much precision as possible for the states
-            type_k = GGML_TYPE_F32; // required by ggml_ssm_conv for Mamba's conv_states
-            type_v = GGML_TYPE_F32; // required by ggml_ssm_scan for Mamba's ssm_states
+            std::fill(type_k.begin(), type_k.end(), GGML_TYPE_F32); // required by ggml_ssm_conv for Mamba's conv_states
+            std::fill(type_v.begin(), type_v.end(), GGML_TYPE_F32); // required by ggml_ssm_scan for Mamba's ssm_states
         }
 
-        GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k) == 0);
-        GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(type_v) == 0);
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            if (hparams.n_embd_head_k % ggml_blck_size(type_k[il]) != 0 ||
+                hparams.n_embd_head_v % ggml_blck_size(type_v[il]) != 0) {
+                throw std::runtime_error(format("the head size of the model is not a multiple of the block size of the KV cache types of layer %u (%s, %s)",
+                            il, ggml_type_name(type_k[il]), ggml_type_name(type_v[il])));
+            }
+        }
 
         if (!kv_self->init(model, cparams, type_k, type_v, kv_size, cparams.offload_kqv)) {
             throw std::runtime_error("failed to initialize self-attention cache");
@@ -210,10 +230,15 @@ llama_context::llama_context(
             const size_t memory_size_k = kv_self->size_k_bytes();
             const size_t memory_size_v = kv_self->size_v_bytes();
 
+            auto type_name = [](const std::vector<ggml_type> & types) {
+                const bool mixed = std::any_of(types.begin(), types.end(), [&](ggml_type t) { return t != types[0]; });
+                return types.empty() ? "none" : mixed ? "mixed" : ggml_type_name(types[0]);
+            };
+
             LLAMA_LOG_INFO("%s: KV self size  = %7.2f MiB, K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
                     (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f),
-                    ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
-                    ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+                    type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
+                    type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
         }
     }
 
@@ -283,6 +308,9 @@ llama_context::llama_context(
         if (pipeline_parallel) {
             LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(sched.get()));
         }
+
+        // with pipeline parallelism the scheduler cycles through copies of the split inputs between computations
+        graph_reuse = !pipeline_parallel && !kv_self->recurrent && !kv_self->is_paged() && getenv("LLAMA_GRAPH_REUSE_DISABLE") == nullptr;
     }
 
     // reserve worst-case graph
@@ -306,6 +334,8 @@ llama_context::llama_context(
 
         // simulate full KV cache
         kv_self->n = kv_self->size;
+        kv_self->gather.clear();
+        kv_self->runs.clear();
 
         cross.v_embd.clear();
 
@@ -524,7 +554,11 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
-    ggml_tensor * k_shift; // I32 [kv_size]
+    ggml_tensor * k_shift; // I32 [c1 - c0]
+
+    // the cells with a pending shift
+    uint32_t c0 = 0;
+    uint32_t c1 = 0;
 
     const llama_kv_cache_unified * kv_self;
 };
@@ -537,8 +571,8 @@ void llm_graph_input_k_shift::set_input(const llama_ubatch * ubatch) {
 
         int32_t * data = (int32_t *) k_shift->data;
 
-        for (uint32_t i = 0; i < kv_self->size; ++i) {
-            data[i] = kv_self->cells[i].delta;
+        for (uint32_t i = c0; i < c1; ++i) {
+            data[i - c0] = kv_self->cells[i].delta;
         }
     }
 }
@@ -559,7 +593,23 @@ llm_graph_result_ptr llama_context::build_kv_self_shift(
 
     auto inp = std::make_unique<llm_graph_input_k_shift>(kv_self.get());
 
-    inp->k_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, cparams.n_ctx);
+    // only the cells with a pending shift are rotated, e.g. just the kept prefix after a lazy shift
+    inp->c0 = kv_self->size;
+    inp->c1 = 0;
+    for (uint32_t i = 0; i < kv_self->size; ++i) {
+        if (kv_self->cells[i].delta != 0) {
+            inp->c0 = std::min(inp->c0, i);
+            inp->c1 = i + 1;
+        }
+    }
+    if (inp->c0 >= inp->c1) {
+        inp->c0 = 0;
+        inp->c1 = 1;
+    }
+
+    const uint32_t n_shift = inp->c1 - inp->c0;
+
+    inp->k_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_shift);
     ggml_set_input(inp->k_shift);
 
     for (uint32_t il = 0; il < n_layer; ++il) {
@@ -577,10 +627,10 @@ llm_graph_result_ptr llama_context::build_kv_self_shift(
 
         ggml_tensor * k =
             ggml_view_3d(ctx0, kv_self->k_l[il],
-                n_embd_head_k, n_head_kv, kv_self->size,
+                n_embd_head_k, n_head_kv, n_shift,
                 ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
                 ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
-                0);
+                ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*inp->c0);
 
         ggml_tensor * cur = build_rope_shift(ctx0, k, inp->k_shift, rope_factors, freq_base_l, freq_scale_l, kv_self->k_l[il]->buffer);
 
@@ -738,7 +788,7 @@ llm_graph_result_ptr llama_context::build_kv_self_defrag(
     return res;
 }
 
-void llama_context::kv_self_update() {
+void llama_context::kv_self_update(bool reserve) {
     auto & kv = kv_self;
 
     bool need_reserve = false;
@@ -800,7 +850,7 @@ void llama_context::kv_self_update() {
     }
 
     // reserve a worst case graph if needed
-    if (need_reserve) {
+    if (need_reserve && reserve) {
         LLAMA_LOG_DEBUG("%s: reserving a worst case graph\n", __func__);
 
         // build worst-case graph
@@ -809,6 +859,8 @@ void llama_context::kv_self_update() {
 
         // simulate full KV cache
         kv_self->n = kv_self->size;
+        kv_self->gather.clear();
+        kv_self->runs.clear();
 
         llama_token token = model.vocab.token_bos(); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
         llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
@@ -824,6 +876,41 @@ void llama_context::kv_self_update() {
     }
 }
 
+llama_kv_defrag_stats llama_context::kv_self_defrag_stats() const {
+    if (!kv_self) {
+        return {};
+    }
+
+    return kv_self->defrag_stats(kv_self->get_padding(cparams));
+}
+
+int32_t llama_context::kv_self_defrag_step(int32_t n_max_moves, int32_t n_ubatch_expected) {
+    if (!kv_self || !cparams.causal_attn) {
+        return 0;
+    }
+
+    const llama_kv_defrag_stats stats = kv_self_defrag_stats();
+
+    // moving a cell reads and writes its K and V once, while each ubatch reads the K and V of all attended cells
+    const int64_t n_saved = stats.n_attended - stats.n_attended_min;
+    if (stats.n_move == 0 || n_saved*std::max(0, n_ubatch_expected) <= 2*(int64_t) stats.n_move) {
+        return 0;
+    }
+
+    LLAMA_LOG_DEBUG("%s: attended cells %d -> %d, moving %d cells\n", __func__, stats.n_attended, stats.n_attended_min, stats.n_move);
+
+    kv_self->defrag();
+    kv_self->defrag_info.n_max_moves = std::max(0, n_max_moves);
+    kv_self->defrag_info.n_moved     = 0;
+
+    // the steps are meant to be short, the graph of the next decode is allocated by the scheduler as needed
+    kv_self_update(false);
+
+    kv_self->defrag_info.n_max_moves = 0;
+
+    return kv_self->defrag_info.n_moved;
+}
+
 enum llama_pooling_type llama_context::pooling_type() const {
     return cparams.pooling_type;
 }
@@ -862,7 +949,7 @@ float * llama_context::get_logits_ith(int32_t i) {
             throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, n_outputs));
         }
 
-        return logits + j*model.vocab.n_tokens();
+        return logits + j*n_logits;
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
 #ifndef NDEBUG
@@ -983,6 +1070,32 @@ void llama_context::set_warmup(bool value) {
     cparams.warmup = value;
 }
 
+bool llama_context::set_output_tokens(const llama_token * tokens, int32_t n_tokens) {
+    LLAMA_LOG_DEBUG("%s: n_tokens = %d\n", __func__, n_tokens);
+
+    const int32_t n_vocab = model.vocab.n_tokens();
+
+    if (tokens == nullptr || n_tokens <= 0) {
+        output_tokens.clear();
+        return true;
+    }
+
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+            LLAMA_LOG_ERROR("%s: invalid token[%d] = %d\n", __func__, i, tokens[i]);
+            return false;
+        }
+    }
+
+    output_tokens.assign(tokens, tokens + n_tokens);
+
+    return true;
+}
+
+int32_t llama_context::get_n_logits() const {
+    return n_logits;
+}
+
 void llama_context::set_adapter_lora(
             llama_adapter_lora * adapter,
             float scale) {
@@ -1018,6 +1131,8 @@ bool llama_context::apply_adapter_cvec(
                 int32_t   il_end) {
     LLAMA_LOG_DEBUG("%s: il_start = %d, il_end = %d\n", __func__, il_start, il_end);
 
+    graph_reuse_reset();
+
     return cvec.apply(model, data, len, n_embd, il_start, il_end);
 }
 
@@ -1198,11 +1313,8 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     const llama_batch & batch = batch_allocr.batch;
 
-    const auto & vocab   = model.vocab;
     const auto & hparams = model.hparams;
 
-    const int32_t n_vocab = vocab.n_tokens();
-
     const int64_t n_tokens_all = batch.n_tokens;
     const int64_t n_embd       = hparams.n_embd;
 
@@ -1219,6 +1331,15 @@ int llama_context::decode(llama_batch & inp_batch) {
         }
     }
 
+    for (int64_t i = 0; i < n_tokens_all; ++i) {
+        for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+            if (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+                LLAMA_LOG_ERROR("%s: invalid seq_id[%" PRId64 "][%d] = %d, must be in [0, %d)\n", __func__, i, s, batch.seq_id[i][s], LLAMA_MAX_PARALLEL_SEQUENCES);
+                return -1;
+            }
+        }
+    }
+
     GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -1259,6 +1380,17 @@ int llama_context::decode(llama_batch & inp_batch) {
         return -2;
     };
 
+    // the cells of tokens shared by several sequences are rotated for their positions, see llama_kv_cache_unified::seq_pos_offs
+    if (kv_self->has_pos_offs()) {
+        for (int64_t i = 0; i < n_tokens_all; ++i) {
+            if (batch.n_seq_id[i] > 1) {
+                for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+                    kv_self->seq_pos_offs_apply(batch.seq_id[i][s]);
+                }
+            }
+        }
+    }
+
     // handle any pending defrags/shifts
     kv_self_update();
 
@@ -1313,25 +1445,57 @@ int llama_context::decode(llama_batch & inp_batch) {
                 // if we start defragmenting the cache, the benefit from this will be more important
                 const uint32_t pad = kv_self->get_padding(cparams);
                 kv_self->n = std::min(kv_self->size, std::max(pad, GGML_PAD(kv_self->cell_max(), pad)));
+
+                // paged mode: attend only the blocks of the sequences in the ubatch if they are few
+                kv_self->gather_prepare(ubatch, pad);
             }
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self->n, kv_self->used, kv_self->head);
 
-        ggml_backend_sched_reset(sched.get());
-        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+        const graph_reuse_key key = {
+            /*.n_tokens     =*/ ubatch.n_tokens,
+            /*.n_seq_tokens =*/ ubatch.n_seq_tokens,
+            /*.n_seqs       =*/ ubatch.n_seqs,
+            /*.n_kv         =*/ kv_self->n,
+            /*.n_outputs    =*/ n_outputs,
+            /*.n_out_tokens =*/ (uint32_t) output_tokens.size(),
+            /*.n_enc        =*/ cross.n_enc,
+            /*.equal_seqs   =*/ ubatch.equal_seqs,
+            /*.embd         =*/ ubatch.embd != nullptr,
+            /*.embeddings   =*/ cparams.embeddings,
+            /*.causal_attn  =*/ cparams.causal_attn,
+            /*.warmup       =*/ cparams.warmup,
+            /*.loras        =*/ loras,
+        };
+
+        if (!graph_prev_res || !(graph_prev_key == key)) {
+            ggml_backend_sched_reset(sched.get());
+            ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
 
-        auto * gf = graph_init();
-        auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
+            auto * gf = graph_init();
+            auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
 
-        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+            // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
-        ggml_backend_sched_alloc_graph(sched.get(), gf);
+            ggml_backend_sched_alloc_graph(sched.get(), gf);
+
+            graph_prev_res = std::move(res);
+            graph_prev_gf  = gf;
+            graph_prev_key = key;
+        } else {
+            graph_prev_res->set_kv_head(kv_self->head);
+        }
+
+        auto * gf  = graph_prev_gf;
+        auto & res = graph_prev_res;
 
         res->set_inputs(&ubatch);
 
         const auto compute_status = graph_compute(gf, ubatch.n_tokens > 1);
         if (compute_status != GGML_STATUS_SUCCESS) {
+            graph_reuse_reset();
+
             switch (compute_status) {
                 case GGML_STATUS_ABORTED:
                     return 2;
@@ -1361,12 +1525,14 @@ int llama_context::decode(llama_batch & inp_batch) {
             GGML_ASSERT(backend_res != nullptr);
             GGML_ASSERT(logits != nullptr);
 
-            float * logits_out = logits + n_outputs_prev*n_vocab;
+            GGML_ASSERT(t_logits->ne[0] == n_logits);
+
+            float * logits_out = logits + n_outputs_prev*n_logits;
 
             if (n_outputs) {
                 GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
-                GGML_ASSERT((n_outputs_prev + n_outputs)*n_vocab <= (int64_t) logits_size);
-                ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
+                GGML_ASSERT((n_outputs_prev + n_outputs)*n_logits <= (int64_t) logits_size);
+                ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_logits*sizeof(float));
             }
         }
 
@@ -1470,9 +1636,15 @@ int llama_context::decode(llama_batch & inp_batch) {
         }
     }
 
+    if (!graph_reuse) {
+        graph_reuse_reset();
+    }
+
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
-    // overlap with device computation.
-    ggml_backend_sched_reset(sched.get());
+    // overlap with device computation - unless the graph is kept for the next ubatch
+    if (!graph_prev_res) {
+        ggml_backend_sched_reset(sched.get());
+    }
 
     return 0;
 }
@@ -1501,7 +1673,9 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
         has_embd   = true;
     }
 
-    logits_size = has_logits ? n_vocab*n_outputs_max : 0;
+    n_logits = output_tokens.empty() ? n_vocab : output_tokens.size();
+
+    logits_size = has_logits ? n_logits*n_outputs_max : 0;
     embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
 
     if (output_ids.empty()) {
@@ -1558,7 +1732,6 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
 void llama_context::output_reorder() {
     auto & out_ids = sbatch.out_ids;
     if (!out_ids.empty()) {
-        const uint32_t n_vocab = model.vocab.n_tokens();
         const uint32_t n_embd  = model.hparams.n_embd;
 
         GGML_ASSERT((size_t) n_outputs == out_ids.size());
@@ -1575,8 +1748,8 @@ void llama_context::output_reorder() {
             if (j_min == i) { continue; }
             std::swap(out_ids[i], out_ids[j_min]);
             if (logits_size > 0) {
-                for (uint32_t k = 0; k < n_vocab; k++) {
-                    std::swap(logits[i*n_vocab + k], logits[j_min*n_vocab + k]);
+                for (int32_t k = 0; k < n_logits; k++) {
+                    std::swap(logits[i*n_logits + k], logits[j_min*n_logits + k]);
                 }
             }
             if (embd_size > 0) {
@@ -1602,6 +1775,9 @@ int32_t llama_context::graph_max_nodes() const {
 }
 
 ggml_cgraph * llama_context::graph_init() {
+    // the kept graph lives in the compute context
+    graph_reuse_reset();
+
     ggml_init_params params = {
         /*.mem_size   =*/ buf_compute_meta.size(),
         /*.mem_buffer =*/ buf_compute_meta.data(),
@@ -1631,6 +1807,7 @@ llm_graph_result_ptr llama_context::graph_build(
                 /*.loras       =*/ &loras,
                 /*.memory      =*/ kv_self.get(),
                 /*.cross       =*/ &cross,
+                /*.out_tokens  =*/ &output_tokens,
                 /*.n_outputs   =*/ n_outputs,
                 /*.cb          =*/ graph_get_cb(),
             }, gf, gtype);
@@ -1663,6 +1840,11 @@ ggml_status llama_context::graph_compute(
     return status;
 }
 
+void llama_context::graph_reuse_reset() {
+    graph_prev_res.reset();
+    graph_prev_gf = nullptr;
+}
+
 llm_graph_cb llama_context::graph_get_cb() const {
     return [&](const llama_ubatch & ubatch, ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
@@ -1834,6 +2016,35 @@ private:
     std::vector<uint8_t> temp_buffer;
 };
 
+// the state files before the packed format
+static constexpr uint32_t LLAMA_SESSION_VERSION_UNPACKED   = 9;
+static constexpr uint32_t LLAMA_STATE_SEQ_VERSION_UNPACKED = 2;
+
+// the rest of a state file, mapped where the platform supports it, so that the tensor data is copied to the KV cache
+// straight from the page cache
+struct llama_state_file_tail {
+    const uint8_t * data = nullptr;
+    size_t          size = 0;
+
+    std::unique_ptr<llama_mmap> mapping;
+    std::vector<uint8_t>        buf;
+
+    llama_state_file_tail(llama_file & file) {
+        const size_t offset = file.tell();
+
+        size = file.size() - offset;
+
+        if (llama_mmap::SUPPORTED && size > 0) {
+            mapping = std::make_unique<llama_mmap>(&file);
+            data = (const uint8_t *) mapping->addr() + offset;
+        } else {
+            buf.resize(size);
+            file.read_raw(buf.data(), size);
+            data = buf.data();
+        }
+    }
+};
+
 size_t llama_context::state_get_size() {
     llama_io_write_dummy io;
     try {
@@ -1864,9 +2075,16 @@ size_t llama_context::state_set_data(const uint8_t * src, size_t size) {
     }
 }
 
-size_t llama_context::state_seq_get_size(llama_seq_id seq_id) {
-    llama_io_write_dummy io;
+size_t llama_context::state_seq_get_size(llama_seq_id seq_id, llama_state_seq_flags flags) {
     try {
+        if (flags & (LLAMA_STATE_SEQ_FLAGS_PACKED | LLAMA_STATE_SEQ_FLAGS_COMPRESS)) {
+            // the tensor data is not read until the state is packed
+            llama_io_write_packed io(false, cparams.n_threads);
+            state_seq_write_data(io, seq_id);
+            return io.n_bytes_max();
+        }
+
+        llama_io_write_dummy io;
         return state_seq_write_data(io, seq_id);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error getting state size: %s\n", __func__, err.what());
@@ -1874,9 +2092,15 @@ size_t llama_context::state_seq_get_size(llama_seq_id seq_id) {
     }
 }
 
-size_t llama_context::state_seq_get_data(llama_seq_id seq_id, uint8_t * dst, size_t size) {
-    llama_io_write_buffer io(dst, size);
+size_t llama_context::state_seq_get_data(llama_seq_id seq_id, uint8_t * dst, size_t size, llama_state_seq_flags flags) {
     try {
+        if (flags & (LLAMA_STATE_SEQ_FLAGS_PACKED | LLAMA_STATE_SEQ_FLAGS_COMPRESS)) {
+            llama_io_write_packed io(flags & LLAMA_STATE_SEQ_FLAGS_COMPRESS, cparams.n_threads);
+            state_seq_write_data(io, seq_id);
+            return io.write_to(dst, size);
+        }
+
+        llama_io_write_buffer io(dst, size);
         return state_seq_write_data(io, seq_id);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error saving state: %s\n", __func__, err.what());
@@ -1884,9 +2108,18 @@ size_t llama_context::state_seq_get_data(llama_seq_id seq_id, uint8_t * dst, siz
     }
 }
 
-size_t llama_context::state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size) {
-    llama_io_read_buffer io(src, size);
+size_t llama_context::state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size, llama_state_seq_flags flags) {
     try {
+        if (flags & (LLAMA_STATE_SEQ_FLAGS_PACKED | LLAMA_STATE_SEQ_FLAGS_COMPRESS)) {
+            llama_io_read_packed io(src, size, cparams.n_threads);
+            state_seq_read_data(io, seq_id);
+            if (!io.at_end()) {
+                throw std::runtime_error("did not read all of the packed state");
+            }
+            return io.n_bytes_packed();
+        }
+
+        llama_io_read_buffer io(src, size);
         return state_seq_read_data(io, seq_id);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error loading state: %s\n", __func__, err.what());
@@ -1898,11 +2131,13 @@ bool llama_context::state_load_file(const char * filepath, llama_token * tokens_
     llama_file file(filepath, "rb");
 
     // sanity checks
+    uint32_t version;
     {
-        const uint32_t magic   = file.read_u32();
-        const uint32_t version = file.read_u32();
+        const uint32_t magic = file.read_u32();
+
+        version = file.read_u32();
 
-        if (magic != LLAMA_SESSION_MAGIC || version != LLAMA_SESSION_VERSION) {
+        if (magic != LLAMA_SESSION_MAGIC || (version != LLAMA_SESSION_VERSION && version != LLAMA_SESSION_VERSION_UNPACKED)) {
             LLAMA_LOG_ERROR("%s: unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
             return false;
         }
@@ -1922,7 +2157,17 @@ bool llama_context::state_load_file(const char * filepath, llama_token * tokens_
     }
 
     // restore the context state
-    {
+    if (version == LLAMA_SESSION_VERSION) {
+        const llama_state_file_tail tail(file);
+
+        llama_io_read_packed io(tail.data, tail.size, cparams.n_threads);
+        state_read_data(io);
+
+        if (!io.at_end() || io.n_bytes_packed() != tail.size) {
+            LLAMA_LOG_ERROR("%s: did not read all of the session file data! size %zu, got %zu\n", __func__, tail.size, io.n_bytes_packed());
+            return false;
+        }
+    } else {
         const size_t n_state_size_cur = file.size() - file.tell();
 
         llama_io_read_file io( &file);
@@ -1947,9 +2192,10 @@ bool llama_context::state_save_file(const char * filepath, const llama_token * t
     file.write_u32((uint32_t) n_token_count);
     file.write_raw(tokens, sizeof(llama_token) * n_token_count);
 
-    // save the context state using stream saving
-    llama_io_write_file io(&file);
+    // save the context state, packed
+    llama_io_write_packed io(false, cparams.n_threads);
     state_write_data(io);
+    io.write_to(file);
 
     return true;
 }
@@ -1958,11 +2204,13 @@ size_t llama_context::state_seq_load_file(llama_seq_id seq_id, const char * file
     llama_file file(filepath, "rb");
 
     // version checks
+    uint32_t version;
     {
-        const uint32_t magic   = file.read_u32();
-        const uint32_t version = file.read_u32();
+        const uint32_t magic = file.read_u32();
+
+        version = file.read_u32();
 
-        if (magic != LLAMA_STATE_SEQ_MAGIC || version != LLAMA_STATE_SEQ_VERSION) {
+        if (magic != LLAMA_STATE_SEQ_MAGIC || (version != LLAMA_STATE_SEQ_VERSION && version != LLAMA_STATE_SEQ_VERSION_UNPACKED)) {
             LLAMA_LOG_ERROR("%s: unknown (magic, version) for sequence state file: %08x, %08x\n", __func__, magic, version);
             return 0;
         }
@@ -1982,6 +2230,26 @@ size_t llama_context::state_seq_load_file(llama_seq_id seq_id, const char * file
     }
 
     // restore the context state
+    if (version == LLAMA_STATE_SEQ_VERSION) {
+        const size_t n_header = file.tell();
+
+        const llama_state_file_tail tail(file);
+
+        llama_io_read_packed io(tail.data, tail.size, cparams.n_threads);
+        const size_t nread = state_seq_read_data(io, seq_id);
+        if (!nread) {
+            LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
+            return 0;
+        }
+
+        if (!io.at_end() || io.n_bytes_packed() != tail.size) {
+            LLAMA_LOG_ERROR("%s: did not read all of the sequence state file data! size %zu, got %zu\n", __func__, tail.size, io.n_bytes_packed());
+            return 0;
+        }
+
+        return n_header + io.n_bytes_packed();
+    }
+
     {
         const size_t state_size = file.size() - file.tell();
         llama_io_read_file io(&file);
@@ -1997,7 +2265,7 @@ size_t llama_context::state_seq_load_file(llama_seq_id seq_id, const char * file
     return file.tell();
 }
 
-size_t llama_context::state_seq_save_file(llama_seq_id seq_id, const char * filepath, const llama_token * tokens, size_t n_token_count) {
+size_t llama_context::state_seq_save_file(llama_seq_id seq_id, const char * filepath, const llama_token * tokens, size_t n_token_count, llama_state_seq_flags flags) {
     llama_file file(filepath, "wb");
 
     file.write_u32(LLAMA_STATE_SEQ_MAGIC);
@@ -2007,14 +2275,11 @@ size_t llama_context::state_seq_save_file(llama_seq_id seq_id, const char * file
     file.write_u32((uint32_t) n_token_count);
     file.write_raw(tokens, sizeof(llama_token) * n_token_count);
 
-    // save the context state using stream saving
-    llama_io_write_file io(&file);
+    // save the context state, packed
+    llama_io_write_packed io(flags & LLAMA_STATE_SEQ_FLAGS_COMPRESS, cparams.n_threads);
     state_seq_write_data(io, seq_id);
 
-    const size_t res = file.tell();
-    GGML_ASSERT(res == sizeof(uint32_t) * 3 + sizeof(llama_token) * n_token_count + io.n_bytes());
-
-    return res;
+    return sizeof(uint32_t) * 3 + sizeof(llama_token) * n_token_count + io.write_to(file);
 }
 
 size_t llama_context::state_write_data(llama_io_write_i & io) {
@@ -2065,7 +2330,7 @@ size_t llama_context::state_write_data(llama_io_write_i & io) {
     {
         LLAMA_LOG_DEBUG("%s: - writing logits\n", __func__);
 
-        const uint64_t logits_size = std::min((uint64_t) this->logits_size, (uint64_t) n_outputs * model.vocab.n_tokens());
+        const uint64_t logits_size = std::min((uint64_t) this->logits_size, (uint64_t) n_outputs * n_logits);
 
         io.write(&logits_size, sizeof(logits_size));
 
@@ -2088,6 +2353,11 @@ size_t llama_context::state_write_data(llama_io_write_i & io) {
     }
 
     LLAMA_LOG_DEBUG("%s: - writing KV self\n", __func__);
+
+    // the state holds the K of the cells rotated for their positions
+    kv_self->seq_pos_offs_apply(-1);
+    kv_self_update();
+
     kv_self->state_write(io);
 
     return io.n_bytes();
@@ -2150,6 +2420,11 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
             throw std::runtime_error("logits buffer too small");
         }
 
+        // the width of the logits is not stored, it follows from the tokens set with llama_set_output_tokens
+        if (logits_size && logits_size != (uint64_t) n_outputs * n_logits) {
+            throw std::runtime_error(format("logits of the state do not have %d values per output, see llama_set_output_tokens", n_logits));
+        }
+
         if (logits_size) {
             io.read_to(this->logits, logits_size * sizeof(float));
         }
@@ -2178,7 +2453,9 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
 }
 
 size_t llama_context::state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id) {
-    GGML_UNUSED(seq_id);
+    // the state holds the K of the cells rotated for their positions
+    kv_self->seq_pos_offs_apply(seq_id);
+    kv_self_update();
 
     kv_self->state_write(io, seq_id);
 
@@ -2239,10 +2516,13 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.n_kv_block                  =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.type_k_layer                =*/ nullptr,
+        /*.type_v_layer                =*/ nullptr,
         /*.logits_all                  =*/ false,
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
@@ -2283,9 +2563,19 @@ llama_context * llama_init_from_model(
         params.flash_attn = false;
     }
 
-    if (ggml_is_quantized(params.type_v) && !params.flash_attn) {
-        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
-        return nullptr;
+    if (!params.flash_attn) {
+        // the layers past the end of type_v_layer use type_v
+        uint32_t n_layer_v = 0;
+        bool quantized_v = false;
+        for (; params.type_v_layer && params.type_v_layer[n_layer_v] != GGML_TYPE_COUNT; ++n_layer_v) {
+            quantized_v = quantized_v || (n_layer_v < model->hparams.n_layer && ggml_is_quantized(params.type_v_layer[n_layer_v]));
+        }
+        quantized_v = quantized_v || (n_layer_v < model->hparams.n_layer && ggml_is_quantized(params.type_v));
+
+        if (quantized_v) {
+            LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+            return nullptr;
+        }
     }
 
     try {
@@ -2380,6 +2670,14 @@ void llama_set_warmup(llama_context * ctx, bool warmup) {
     ctx->set_warmup(warmup);
 }
 
+bool llama_set_output_tokens(llama_context * ctx, const llama_token * tokens, int32_t n_tokens) {
+    return ctx->set_output_tokens(tokens, n_tokens);
+}
+
+int32_t llama_n_logits(const llama_context * ctx) {
+    return ctx->get_n_logits();
+}
+
 void llama_synchronize(llama_context * ctx) {
     ctx->synchronize();
 }
@@ -2657,6 +2955,14 @@ void llama_kv_self_defrag(llama_context * ctx) {
     return kv->defrag();
 }
 
+llama_kv_defrag_stats llama_kv_self_defrag_stats(const llama_context * ctx) {
+    return ctx->kv_self_defrag_stats();
+}
+
+int32_t llama_kv_self_defrag_step(llama_context * ctx, int32_t n_max_moves, int32_t n_ubatch_expected) {
+    return ctx->kv_self_defrag_step(n_max_moves, n_ubatch_expected);
+}
+
 // deprecated
 bool llama_kv_cache_can_shift(const llama_context * ctx) {
     return llama_kv_self_can_shift(ctx);
@@ -2771,6 +3077,42 @@ size_t llama_state_seq_save_file(llama_context * ctx, const char * filepath, lla
     }
 }
 
+size_t llama_state_seq_get_size_ext(llama_context * ctx, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    return ctx->state_seq_get_size(seq_id, flags);
+}
+
+size_t llama_state_seq_get_data_ext(llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    ctx->synchronize();
+
+    return ctx->state_seq_get_data(seq_id, dst, size, flags);
+}
+
+size_t llama_state_seq_set_data_ext(llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    ctx->synchronize();
+
+    return ctx->state_seq_set_data(seq_id, src, size, flags);
+}
+
+size_t llama_state_seq_save_file_ext(llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count, llama_state_seq_flags flags) {
+    ctx->synchronize();
+
+    try {
+        return ctx->state_seq_save_file(seq_id, filepath, tokens, n_token_count, flags);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error saving sequence state file: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
+size_t llama_state_seq_compress(const uint8_t * src, size_t size, uint8_t * dst, int32_t n_threads) {
+    try {
+        return llama_io_packed_compress(src, size, dst, n_threads);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error compressing sequence state: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
 size_t llama_state_seq_load_file(llama_context * ctx, const char * filepath, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     ctx->synchronize();
 
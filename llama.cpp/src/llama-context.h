@@ -41,7 +41,13 @@ struct llama_context {
           llama_kv_cache * get_kv_self();
     const llama_kv_cache * get_kv_self() const;
 
-    void kv_self_update();
+    // reserve - reserve the worst case graph again after the cache was shifted or defragmented
+    void kv_self_update(bool reserve = true);
+
+    llama_kv_defrag_stats kv_self_defrag_stats() const;
+
+    // returns the number of cells moved
+    int32_t kv_self_defrag_step(int32_t n_max_moves, int32_t n_ubatch_expected);
 
     enum llama_pooling_type pooling_type() const;
 
@@ -66,6 +72,10 @@ struct llama_context {
     void set_causal_attn(bool value);
     void set_warmup(bool value);
 
+    bool set_output_tokens(const llama_token * tokens, int32_t n_tokens);
+
+    int32_t get_n_logits() const;
+
     void set_adapter_lora(
             llama_adapter_lora * adapter,
             float scale);
@@ -93,9 +103,9 @@ struct llama_context {
     size_t state_get_data(      uint8_t * dst, size_t size);
     size_t state_set_data(const uint8_t * src, size_t size);
 
-    size_t state_seq_get_size(llama_seq_id seq_id);
-    size_t state_seq_get_data(llama_seq_id seq_id,       uint8_t * dst, size_t size);
-    size_t state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size);
+    size_t state_seq_get_size(llama_seq_id seq_id,                                   llama_state_seq_flags flags = 0);
+    size_t state_seq_get_data(llama_seq_id seq_id,       uint8_t * dst, size_t size, llama_state_seq_flags flags = 0);
+    size_t state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size, llama_state_seq_flags flags = 0);
 
     bool state_load_file(
             const char * filepath,
@@ -119,7 +129,8 @@ struct llama_context {
           llama_seq_id   seq_id,
             const char * filepath,
      const llama_token * tokens,
-                size_t   n_token_count);
+                size_t   n_token_count,
+ llama_state_seq_flags   flags = 0);
 
     //
     // perf
@@ -163,6 +174,44 @@ private:
 
     llm_graph_cb graph_get_cb() const;
 
+    // graph reuse
+    //
+    // the graph of the last decoded ubatch is kept together with its allocation in the scheduler, and computed again
+    // for the next ubatch when nothing that shapes the graph has changed - only the inputs are set and the K/V stores
+    // are moved to the new head of the KV cache (the usual case when generating one token per sequence at a time)
+
+    struct graph_reuse_key {
+        uint32_t n_tokens     = 0;
+        uint32_t n_seq_tokens = 0;
+        uint32_t n_seqs       = 0;
+        uint32_t n_kv         = 0;
+        int32_t  n_outputs    = 0;
+        uint32_t n_out_tokens = 0; // see llama_set_output_tokens
+        int64_t  n_enc        = 0;
+        bool     equal_seqs   = false;
+        bool     embd         = false; // the ubatch has embeddings instead of tokens
+
+        // parameters read while building the graph
+        bool embeddings  = false;
+        bool causal_attn = false;
+        bool warmup      = false;
+
+        llama_adapter_loras loras;
+
+        bool operator==(const graph_reuse_key & other) const {
+            return n_tokens   == other.n_tokens   && n_seq_tokens == other.n_seq_tokens && n_seqs == other.n_seqs &&
+                   n_kv       == other.n_kv       && n_outputs    == other.n_outputs    && n_enc  == other.n_enc  &&
+                   n_out_tokens == other.n_out_tokens &&
+                   equal_seqs == other.equal_seqs && embd         == other.embd         &&
+                   embeddings == other.embeddings && causal_attn  == other.causal_attn  && warmup == other.warmup &&
+                   loras      == other.loras;
+        }
+    };
+
+    // forget the kept graph - when the compute context or the scheduler is used for another graph, or when the
+    // control vector changes
+    void graph_reuse_reset();
+
     // used by kv_self_update()
     ggml_tensor * build_rope_shift(
         ggml_context * ctx0,
@@ -206,10 +255,15 @@ private:
     // TODO: remove
     bool logits_all = false;
 
-    // decode output (2-dimensional array: [n_outputs][n_vocab])
+    // decode output (2-dimensional array: [n_outputs][n_logits])
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // the tokens whose logits are computed (see llama_set_output_tokens), empty - the whole vocab
+    std::vector<llama_token> output_tokens;
+
+    int32_t n_logits = 0; // logits per output in the output buffer, set by output_reserve
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -246,6 +300,12 @@ private:
     // memory buffers used to evaluate the model
     std::vector<uint8_t> buf_compute_meta;
 
+    // the kept graph of the last decoded ubatch, see graph_reuse_key
+    bool                 graph_reuse = false;
+    llm_graph_result_ptr graph_prev_res;
+    ggml_cgraph *        graph_prev_gf = nullptr;
+    graph_reuse_key      graph_prev_key;
+
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_ptr buf_output;
 
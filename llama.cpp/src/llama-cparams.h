@@ -4,6 +4,9 @@
 
 #include <cstdint>
 
+// maximum number of sequences the KV cache can track - the sequence ids of a batch must be smaller
+#define LLAMA_MAX_PARALLEL_SEQUENCES 256
+
 struct llama_cparams {
     uint32_t n_ctx;           // context size used during inference
     uint32_t n_batch;
@@ -24,6 +27,8 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t n_kv_block; // paged KV cache block size, 0 = disabled
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
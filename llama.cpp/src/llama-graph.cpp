@@ -5,6 +5,7 @@
 #include "llama-cparams.h"
 #include "llama-kv-cache.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
@@ -55,6 +56,18 @@ void llm_graph_input_pos::set_input(const llama_ubatch * ubatch) {
     if (ubatch->pos && pos) {
         const int64_t n_tokens = ubatch->n_tokens;
 
+        if (kv_self && ubatch->seq_id && kv_self->has_pos_offs()) {
+            GGML_ASSERT(n_pos_per_token == 1);
+
+            std::vector<llama_pos> pos_data(n_tokens);
+            for (int64_t i = 0; i < n_tokens; ++i) {
+                pos_data[i] = ubatch->pos[i] + kv_self->seq_pos_offs(ubatch->seq_id[i / ubatch->n_seq_tokens][0]);
+            }
+
+            ggml_backend_tensor_set(pos, pos_data.data(), 0, n_tokens*ggml_element_size(pos));
+            return;
+        }
+
         ggml_backend_tensor_set(pos, ubatch->pos, 0, n_tokens*n_pos_per_token*ggml_element_size(pos));
     }
 }
@@ -105,10 +118,15 @@ void llm_graph_input_pos_bucket_kv::set_input(const llama_ubatch * ubatch) {
 
         const int64_t n_kv = kv_self->n;
 
+        // paged KV cache: column i is the gathered cell gather[i], the padding columns are masked
+        const auto & gather = kv_self->gather;
+
         for (int h = 0; h < 1; ++h) {
             for (int j = 0; j < n_tokens; ++j) {
                 for (int i = 0; i < n_kv; ++i) {
-                    data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(kv_self->cells[i].pos, ubatch->pos[j], hparams.n_rel_attn_bkts, false);
+                    const int32_t cell = gather.empty() ? i : gather[std::min<int64_t>(i, gather.size() - 1)];
+
+                    data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(kv_self->cells[cell].pos, ubatch->pos[j], hparams.n_rel_attn_bkts, false);
                 }
             }
         }
@@ -150,6 +168,17 @@ void llm_graph_input_out_ids::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+void llm_graph_input_out_tokens::set_input(const llama_ubatch * ubatch) {
+    GGML_UNUSED(ubatch);
+
+    GGML_ASSERT(out_tokens && out_tokens->ne[0] == (int64_t) tokens.size());
+
+    // the same tokens for each column
+    for (int64_t i = 0; i < out_tokens->ne[1]; ++i) {
+        ggml_backend_tensor_set(out_tokens, tokens.data(), i*out_tokens->nb[1], tokens.size()*ggml_element_size(out_tokens));
+    }
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -416,7 +445,69 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+// update the kept KQ mask row of a sequence for its next token at position pos
+// only the changed cells are recomputed, unless the token comes before the previous one of the row or a masked future
+// cell of the sequence becomes visible - then the row is rebuilt from the cells of the sequence
+// with keep_dirty the changed cells stay dirty, to be recomputed for the next token of the sequence in the same ubatch
+static void kq_mask_row_update(
+        llama_kv_cache_unified::kq_mask_row & row,
+        const llama_kv_cache_unified & kv_self,
+        llama_seq_id seq_id,
+        llama_pos pos,
+        uint32_t n_kv,
+        bool keep_dirty) {
+    uint32_t c0 = row.dirty.c0;
+    uint32_t c1 = row.dirty.c1;
+
+    if (row.data.empty() || pos < row.pos || pos >= row.pos_future) {
+        const auto range = kv_self.seq_cells(seq_id);
+
+        row.data.assign(n_kv, -INFINITY);
+        row.pos_future = std::numeric_limits<llama_pos>::max();
+
+        c0 = range.c0;
+        c1 = range.c1;
+    } else {
+        // the cells past the previous n were empty then, the ones used since are dirty
+        row.data.resize(n_kv, -INFINITY);
+    }
+
+    for (uint32_t i = c0; i < std::min(c1, n_kv); ++i) {
+        const llama_kv_cell & cell = kv_self.cells[i];
+
+        float f = -INFINITY;
+
+        if (cell.has_seq_id(seq_id)) {
+            if (cell.pos <= pos) {
+                f = 0.0f;
+            } else if (!keep_dirty || i < row.dirty.c0 || i >= row.dirty.c1) {
+                row.pos_future = std::min(row.pos_future, cell.pos);
+            }
+        }
+
+        row.data[i] = f;
+    }
+
+    row.pos = pos;
+
+    if (!keep_dirty) {
+        row.dirty = {};
+    }
+}
+
 void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
+    if (self_kv_idxs) {
+        GGML_ASSERT(ggml_backend_buffer_is_host(self_kv_idxs->buffer));
+        int32_t * data = (int32_t *) self_kv_idxs->data;
+
+        const auto & gather = kv_self->gather;
+
+        // the padding columns are masked, any cell will do
+        for (int64_t i = 0; i < self_kv_idxs->ne[0]; ++i) {
+            data[i] = i < (int64_t) gather.size() ? gather[i] : 0;
+        }
+    }
+
     if (self_kq_mask || self_kq_mask_swa) {
         const int64_t n_kv         = kv_self->n;
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -448,45 +539,101 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
         //      xxxxx-----
         //      xxxxx-----
         // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
+        //
+        // Each row starts out fully masked, then only the cells of the sequence are visited. They are collected
+        // once per sequence of the ubatch, within the cell range of the sequence - or among the cells gathered
+        // from a paged KV cache, where column c of the mask is cell gather[c].
+        //
+        // Without ALiBi and gathering, a row only depends on which cells of the sequence come before the token. The
+        // row of the last token of each sequence is kept in the KV cache and only its changed cells are updated for
+        // the next token - during generation that is the cell of the previous token instead of the whole row.
+        const auto & gather = kv_self->gather;
+
+        const bool incremental = data && kv_self->kq_mask_incremental && gather.empty() && !hparams.use_alibi && cparams.causal_attn;
+
+        // the last token of each sequence in the ubatch
+        std::vector<int32_t> seq_last;
+        if (incremental) {
+            seq_last.assign(LLAMA_MAX_PARALLEL_SEQUENCES, -1);
+            for (int s = 0; s < n_seqs; ++s) {
+                seq_last[ubatch->seq_id[s][0]] = s*n_seq_tokens + n_seq_tokens - 1;
+            }
+        }
+
+        std::vector<std::pair<int32_t, int32_t>> seq_cells; // (column, cell)
+
         for (int h = 0; h < 1; ++h) {
             for (int s = 0; s < n_seqs; ++s) {
                 const llama_seq_id seq_id = ubatch->seq_id[s][0];
 
+                seq_cells.clear();
+                if (incremental && !data_swa) {
+                    // the cells are only needed to build the rows from scratch
+                } else if (gather.empty()) {
+                    const auto range = kv_self->seq_cells(seq_id);
+
+                    for (uint32_t i = range.c0; i < std::min<uint32_t>(range.c1, n_kv); ++i) {
+                        if (kv_self->cells[i].has_seq_id(seq_id)) {
+                            seq_cells.emplace_back(i, i);
+                        }
+                    }
+                } else {
+                    for (size_t c = 0; c < gather.size(); ++c) {
+                        if (kv_self->cells[gather[c]].has_seq_id(seq_id)) {
+                            seq_cells.emplace_back(c, gather[c]);
+                        }
+                    }
+                }
+
                 for (int j = 0; j < n_seq_tokens; ++j) {
                     const llama_pos pos = ubatch->pos[s*n_seq_tokens + j];
-                    for (int i = 0; i < n_kv; ++i) {
-                        float f;
-                        // mask the token if:
-                        if (!kv_self->cells[i].has_seq_id(seq_id) // not the correct sequence
-                            || (cparams.causal_attn && kv_self->cells[i].pos > pos) // for causal, mask future tokens
-                        ) {
-                            f = -INFINITY;
-                        } else {
-                            if (hparams.use_alibi) {
-                                f = -std::abs(kv_self->cells[i].pos - pos);
-                            } else {
-                                f = 0.0f;
-                            }
+
+                    float * row     = data     ? data     + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv : nullptr;
+                    float * row_swa = data_swa ? data_swa + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv : nullptr;
+
+                    // mask the token if not the correct sequence
+                    if (row && incremental) {
+                        auto & kept = kv_self->kq_mask_rows[seq_id];
+
+                        kq_mask_row_update(kept, *kv_self, seq_id, pos, n_kv, s*n_seq_tokens + j < seq_last[seq_id]);
+
+                        std::copy(kept.data.begin(), kept.data.end(), row);
+                    } else if (row) {
+                        std::fill(row, row + n_kv, -INFINITY);
+                    }
+                    if (row_swa) {
+                        std::fill(row_swa, row_swa + n_kv, -INFINITY);
+                    }
+
+                    for (const auto & sc : seq_cells) {
+                        const int32_t   i        = sc.first;
+                        const llama_pos pos_cell = kv_self->cells[sc.second].pos;
+
+                        // for causal, mask future tokens
+                        if (cparams.causal_attn && pos_cell > pos) {
+                            continue;
                         }
 
-                        if (data) {
-                            data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+                        const float f = hparams.use_alibi ? -std::abs(pos_cell - pos) : 0.0f;
+
+                        if (row && !incremental) {
+                            row[i] = f;
                         }
 
                         // may need to cut off old tokens for sliding window
                         // TODO @ngxson : we are currently re-using the swa logic to store the chunked mask, we should rename SWA to something more generic like "aux mask"
-                        if (data_swa) {
+                        if (row_swa) {
                             if (hparams.n_attn_chunk) {
                                 llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
-                                if (kv_self->cells[i].pos < pos_chunk_start || pos < pos_chunk_start) {
-                                    f = -INFINITY;
+                                if (pos_cell < pos_chunk_start || pos < pos_chunk_start) {
+                                    continue;
                                 }
                             } else {
-                                if (pos - kv_self->cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
+                                if (pos - pos_cell >= (int32_t)hparams.n_swa) {
+                                    continue;
                                 }
                             }
-                            data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+                            row_swa[i] = f;
                         }
                     }
                 }
@@ -588,6 +735,7 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     loras            (params.loras),
     memory           (params.memory),
     cross            (params.cross),
+    out_tokens       (params.out_tokens),
     cb_func          (params.cb),
     res              (std::make_unique<llm_graph_result>()) {
     }
@@ -634,6 +782,76 @@ ggml_tensor * llm_graph_context::build_lora_mm(
     return res;
 }
 
+ggml_tensor * llm_graph_context::build_lm_head_select(ggml_tensor * cur) const {
+    if (out_tokens == nullptr || out_tokens->empty()) {
+        return cur;
+    }
+
+    ggml_tensor * ids = build_inp_out_tokens(cur->ne[1]);
+
+    // [1, n_vocab, n_outputs] -> [1, n_out_tokens, n_outputs]
+    cur = ggml_get_rows(ctx0, ggml_reshape_3d(ctx0, cur, 1, cur->ne[0], cur->ne[1]), ids);
+
+    return ggml_reshape_2d(ctx0, cur, cur->ne[1], cur->ne[2]);
+}
+
+ggml_tensor * llm_graph_context::build_lm_head(
+          ggml_tensor * w,
+          ggml_tensor * cur,
+          ggml_tensor * b) const {
+    bool gather = out_tokens != nullptr && !out_tokens->empty();
+
+    // the rows cannot be gathered from weights in a buffer that only supports matrix multiplications (e.g. repacked
+    // for AMX) - then the logits of the whole vocab are computed, and the selected ones are picked from them
+    if (gather && w->buffer) {
+        ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(w->buffer));
+        gather = !dev || ggml_backend_dev_supports_op(dev, ggml_get_rows(ctx0, w, ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, out_tokens->size())));
+    }
+
+    if (!gather) {
+        cur = build_lora_mm(w, cur);
+
+        if (b) {
+            cur = ggml_add(ctx0, cur, b);
+        }
+
+        return build_lm_head_select(cur);
+    }
+
+    ggml_tensor * ids = build_inp_out_tokens(1);
+
+    ggml_tensor * w_rows = ggml_get_rows(ctx0, w, ids);
+
+    // only the rows of the selected tokens are multiplied - a [n_out_tokens, n_outputs] matrix instead of [n_vocab, n_outputs]
+    ggml_tensor * res_cur = ggml_mul_mat(ctx0, w_rows, cur);
+
+    for (const auto & lora : *loras) {
+        llama_adapter_lora_weight * lw = lora.first->get_weight(w);
+        if (lw == nullptr) {
+            continue;
+        }
+
+        const float adapter_scale = lora.second;
+        const float scale = lw->get_scale(lora.first->alpha, adapter_scale);
+
+        ggml_tensor * ab_cur = ggml_mul_mat(
+                ctx0, ggml_get_rows(ctx0, lw->b, ids),
+                ggml_mul_mat(ctx0, lw->a, cur)
+                );
+
+        ab_cur = ggml_scale(ctx0, ab_cur, scale);
+        res_cur = ggml_add(ctx0, res_cur, ab_cur);
+    }
+
+    if (b) {
+        ggml_tensor * b_rows = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, b, 1, b->ne[0]), ids);
+
+        res_cur = ggml_add(ctx0, res_cur, ggml_reshape_1d(ctx0, b_rows, b_rows->ne[1]));
+    }
+
+    return res_cur;
+}
+
 ggml_tensor * llm_graph_context::build_lora_mm_id(
           ggml_tensor * w,   // ggml_tensor * as
           ggml_tensor * cur, // ggml_tensor * b
@@ -1016,6 +1234,10 @@ ggml_tensor * llm_graph_context::build_inp_embd(ggml_tensor * tok_embd) const {
 ggml_tensor * llm_graph_context::build_inp_pos() const {
     auto inp = std::make_unique<llm_graph_input_pos>(n_pos_per_token());
 
+    if (n_pos_per_token() == 1) {
+        inp->kv_self = static_cast<const llama_kv_cache_unified *>(memory);
+    }
+
     auto & cur = inp->pos;
 
     cur = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens*n_pos_per_token());
@@ -1052,6 +1274,19 @@ ggml_tensor * llm_graph_context::build_inp_out_ids() const {
     return cur;
 }
 
+ggml_tensor * llm_graph_context::build_inp_out_tokens(int64_t n_rows) const {
+    auto inp = std::make_unique<llm_graph_input_out_tokens>(*out_tokens);
+
+    auto & cur = inp->out_tokens;
+
+    cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_I32, out_tokens->size(), n_rows);
+    ggml_set_input(cur);
+
+    res->add_input(std::move(inp));
+
+    return cur;
+}
+
 ggml_tensor * llm_graph_context::build_inp_mean() const {
     auto inp = std::make_unique<llm_graph_input_mean>(cparams);
 
@@ -1375,6 +1610,11 @@ llm_graph_input_attn_kv_unified * llm_graph_context::build_attn_inp_kv_unified()
         inp->self_kq_mask_swa_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask_swa, GGML_TYPE_F16) : inp->self_kq_mask_swa;
     }
 
+    if (!kv_self->gather.empty()) {
+        inp->self_kv_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv);
+        ggml_set_input(inp->self_kv_idxs);
+    }
+
     return (llm_graph_input_attn_kv_unified *) res->add_input(std::move(inp));
 }
 
@@ -1404,10 +1644,24 @@ ggml_tensor * llm_graph_context::build_attn(
 
     const auto n_tokens = q_cur->ne[2];
 
-    const bool v_trans = !cparams.flash_attn;
+    const bool v_trans = kv_self->v_trans;
 
     // store to KV cache
-    {
+    if (kv_self->is_paged()) {
+        // the tokens of the ubatch are spread over the blocks of their sequences, store each run of consecutive cells
+        v_cur = ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
+
+        for (const auto & run : kv_self->runs) {
+            ggml_tensor * k_run = ggml_view_3d(ctx0, k_cur, k_cur->ne[0], k_cur->ne[1], run.n, k_cur->nb[1], k_cur->nb[2], run.i0*k_cur->nb[2]);
+            ggml_tensor * v_run = ggml_view_2d(ctx0, v_cur, n_embd_v_gqa, run.n, v_cur->nb[1], run.i0*v_cur->nb[1]);
+
+            ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], run.n*n_embd_k_gqa, ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*run.c0);
+            ggml_tensor * v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], run.n*n_embd_v_gqa, ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa)*run.c0);
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_run, k_cache_view));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_run, v_cache_view));
+        }
+    } else {
         GGML_ASSERT(!kv_self->recurrent);
 
         const auto kv_head = kv_self->head;
@@ -1418,7 +1672,8 @@ ggml_tensor * llm_graph_context::build_attn(
         //cb(k_cache_view, "k_cache_view", il);
 
         // note: storing RoPE-ed version of K in the KV cache
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_cur, k_cache_view));
+        ggml_tensor * k_store = ggml_cpy(ctx0, k_cur, k_cache_view);
+        ggml_build_forward_expand(gf, k_store);
 
         v_cur = ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
 
@@ -1436,7 +1691,17 @@ ggml_tensor * llm_graph_context::build_attn(
         }
         //cb(v_cache_view, "v_cache_view", il);
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_cur, v_cache_view));
+        ggml_tensor * v_store = ggml_cpy(ctx0, v_cur, v_cache_view);
+        ggml_build_forward_expand(gf, v_store);
+
+        // the cpy results are views of the cache as well
+        const size_t nb_k = ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa);
+        const size_t nb_v = v_trans ? ggml_element_size(kv_self->v_l[il]) : ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa);
+
+        res->kv_store.emplace_back(k_cache_view, nb_k);
+        res->kv_store.emplace_back(k_store,      nb_k);
+        res->kv_store.emplace_back(v_cache_view, nb_v);
+        res->kv_store.emplace_back(v_store,      nb_v);
     }
 
     const bool is_swa = hparams.is_swa(il);
@@ -1453,25 +1718,36 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * q = ggml_permute(ctx0, q_cur, 0, 2, 1, 3);
     //cb(q, "q", il);
 
-    ggml_tensor * k =
-        ggml_view_3d(ctx0, kv_self->k_l[il],
-                n_embd_head_k, n_kv, n_head_kv,
-                ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
-                ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
-                0);
-    //cb(k, "k", il);
+    ggml_tensor * k = nullptr;
+    ggml_tensor * v = nullptr;
 
-    ggml_tensor * v = !v_trans ?
-        ggml_view_3d(ctx0, kv_self->v_l[il],
-                n_embd_head_v, n_kv, n_head_kv,
-                ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
-                ggml_row_size(kv_self->v_l[il]->type, n_embd_head_v),
-                0) :
-        ggml_view_3d(ctx0, kv_self->v_l[il],
-                n_kv, n_embd_head_v, n_head_kv,
-                ggml_element_size(kv_self->v_l[il])*n_ctx,
-                ggml_element_size(kv_self->v_l[il])*n_ctx*n_embd_head_v,
-                0);
+    if (inp->self_kv_idxs) {
+        // paged KV cache: gather the cells of the blocks of the sequences in the ubatch (V is not transposed)
+        ggml_tensor * k_rows = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, kv_self->k_l[il], n_embd_k_gqa, kv_self->size), inp->self_kv_idxs);
+        ggml_tensor * v_rows = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, kv_self->v_l[il], n_embd_v_gqa, kv_self->size), inp->self_kv_idxs);
+
+        k = ggml_view_3d(ctx0, k_rows, n_embd_head_k, n_kv, n_head_kv, k_rows->nb[1], ggml_row_size(k_rows->type, n_embd_head_k), 0);
+        v = ggml_view_3d(ctx0, v_rows, n_embd_head_v, n_kv, n_head_kv, v_rows->nb[1], ggml_row_size(v_rows->type, n_embd_head_v), 0);
+    } else {
+        k = ggml_view_3d(ctx0, kv_self->k_l[il],
+                    n_embd_head_k, n_kv, n_head_kv,
+                    ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
+                    0);
+        //cb(k, "k", il);
+
+        v = !v_trans ?
+            ggml_view_3d(ctx0, kv_self->v_l[il],
+                    n_embd_head_v, n_kv, n_head_kv,
+                    ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
+                    ggml_row_size(kv_self->v_l[il]->type, n_embd_head_v),
+                    0) :
+            ggml_view_3d(ctx0, kv_self->v_l[il],
+                    n_kv, n_embd_head_v, n_head_kv,
+                    ggml_element_size(kv_self->v_l[il])*n_ctx,
+                    ggml_element_size(kv_self->v_l[il])*n_ctx*n_embd_head_v,
+                    0);
+    }
 
     ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, v_trans, kq_scale);
     cb(cur, "kqv_out", il);
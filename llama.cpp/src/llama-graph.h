@@ -98,6 +98,9 @@ public:
     ggml_tensor * pos = nullptr; // I32 [n_batch]
 
     const int64_t n_pos_per_token = 1;
+
+    // adds the position offsets of the sequences after a lazy shift, see llama_kv_cache_unified::seq_pos_offs
+    const llama_kv_cache_unified * kv_self = nullptr;
 };
 
 // temperature tuning, used by llama4
@@ -162,6 +165,19 @@ public:
     const int32_t n_outputs;
 };
 
+// the tokens whose logits are computed, see llama_set_output_tokens
+class llm_graph_input_out_tokens : public llm_graph_input_i {
+public:
+    llm_graph_input_out_tokens(const std::vector<llama_token> & tokens) : tokens(tokens) {}
+    virtual ~llm_graph_input_out_tokens() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    ggml_tensor * out_tokens; // I32 [n_out_tokens, 1] or [n_out_tokens, n_outputs]
+
+    const std::vector<llama_token> & tokens;
+};
+
 class llm_graph_input_mean : public llm_graph_input_i {
 public:
     llm_graph_input_mean(const llama_cparams & cparams) : cparams(cparams) {}
@@ -264,6 +280,8 @@ public:
     ggml_tensor * self_kq_mask_swa     = nullptr; // F32 [n_kv, n_batch]
     ggml_tensor * self_kq_mask_swa_cnv = nullptr; //     [n_kv, n_batch]
 
+    ggml_tensor * self_kv_idxs = nullptr; // I32 [n_kv], paged KV cache: cells gathered by the attention
+
     const llama_hparams & hparams;
     const llama_cparams & cparams;
 
@@ -304,6 +322,9 @@ public:
     virtual ggml_tensor * get_embd_pooled() = 0;
 
     virtual void set_inputs(const llama_ubatch * ubatch) = 0;
+
+    // move the stores of the K/V of the ubatch to the cells starting at head, when the graph is reused
+    virtual void set_kv_head(uint32_t head) = 0;
 };
 
 using llm_graph_result_ptr = std::unique_ptr<llm_graph_result_i>;
@@ -323,6 +344,13 @@ public:
         }
     }
 
+    void set_kv_head(uint32_t head) override {
+        for (const auto & [t, nb_cell] : kv_store) {
+            t->view_offs = nb_cell*head;
+            t->data      = (char *) t->view_src->data + t->view_offs;
+        }
+    }
+
     llm_graph_input_i * add_input(llm_graph_input_ptr input) {
         inputs.emplace_back(std::move(input));
         return inputs.back().get();
@@ -334,6 +362,9 @@ public:
     ggml_tensor * t_embd_pooled = nullptr;
 
     std::vector<llm_graph_input_ptr> inputs;
+
+    // the views of the KV cache written by the K/V store of the ubatch, and their offset per cell of the head
+    std::vector<std::pair<ggml_tensor *, size_t>> kv_store;
 };
 
 //
@@ -360,6 +391,8 @@ struct llm_graph_params {
     const llama_memory_i      * memory;
     const llama_cross         * cross;
 
+    const std::vector<llama_token> * out_tokens; // empty - the logits of the whole vocab
+
     int32_t n_outputs;
 
     const llm_graph_cb & cb;
@@ -413,6 +446,8 @@ struct llm_graph_context {
     const llama_memory_i      * memory;
     const llama_cross         * cross;
 
+    const std::vector<llama_token> * out_tokens;
+
     const llm_graph_cb & cb_func;
 
     std::unique_ptr<llm_graph_result> res;
@@ -436,6 +471,17 @@ struct llm_graph_context {
               ggml_tensor * w,
               ggml_tensor * cur) const;
 
+    // the output projection (lm_head) with an optional bias: the logits of the whole vocab, or only the rows of the
+    // tokens set with llama_set_output_tokens
+    ggml_tensor * build_lm_head(
+              ggml_tensor * w,
+              ggml_tensor * cur,
+              ggml_tensor * b = nullptr) const;
+
+    // picks the logits of the tokens set with llama_set_output_tokens from the logits of the whole vocab
+    // for models that post-process the whole vocab after the projection
+    ggml_tensor * build_lm_head_select(ggml_tensor * cur) const;
+
     // do mat_mul_id, while optionally apply lora
     ggml_tensor * build_lora_mm_id(
               ggml_tensor * w,   // ggml_tensor * as
@@ -489,6 +535,7 @@ struct llm_graph_context {
     ggml_tensor * build_inp_pos() const;
     ggml_tensor * build_inp_attn_scale() const;
     ggml_tensor * build_inp_out_ids() const;
+    ggml_tensor * build_inp_out_tokens(int64_t n_rows) const; // the ids of llama_set_output_tokens, repeated n_rows times
     ggml_tensor * build_inp_mean() const;
     ggml_tensor * build_inp_cls() const;
     ggml_tensor * build_inp_s_copy() const;
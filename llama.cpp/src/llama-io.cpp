@@ -1,5 +1,19 @@
 #include "llama-io.h"
 
+#include "llama-compress.h"
+#include "llama-impl.h"
+#include "llama-mmap.h"
+
+#include "ggml-backend.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
 void llama_io_write_i::write_string(const std::string & str) {
     uint32_t str_size = str.size();
 
@@ -13,3 +27,496 @@ void llama_io_read_i::read_string(std::string & str) {
 
     str.assign((const char *) read(str_size), str_size);
 }
+
+//
+// packed state
+//
+
+static constexpr uint32_t PACKED_MAGIC        = 0x4b504c4c; // 'LLPK'
+static constexpr size_t   PACKED_SECTION_SIZE = 32;
+static constexpr size_t   PACKED_MIN_COMPRESS = 4096;       // smaller sections are stored as they are
+
+enum packed_mode : uint32_t {
+    PACKED_MODE_RAW        = 0,
+    PACKED_MODE_COMPRESSED = 1,
+};
+
+static constexpr uint64_t CHECKSUM_P1 = 0x9e3779b185ebca87ULL;
+static constexpr uint64_t CHECKSUM_P2 = 0xc2b2ae3d27d4eb4fULL;
+static constexpr uint64_t CHECKSUM_P3 = 0x165667b19e3779f9ULL;
+
+static inline uint64_t checksum_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// 64-bit checksum of a stream of bytes, 4 lanes of 8-byte words with the round of xxHash64
+struct packed_checksum {
+    uint64_t lane[4] = { CHECKSUM_P1 + CHECKSUM_P2, CHECKSUM_P2, 0, 0 - CHECKSUM_P1 };
+
+    uint8_t  tail[32];
+    size_t   n_tail = 0;
+    uint64_t n      = 0;
+
+    void round(const uint8_t * p) {
+        for (int l = 0; l < 4; ++l) {
+            uint64_t w;
+            memcpy(&w, p + 8*l, sizeof(w));
+            lane[l] = checksum_rotl(lane[l] + w*CHECKSUM_P2, 31)*CHECKSUM_P1;
+        }
+    }
+
+    void update(const uint8_t * p, size_t size) {
+        n += size;
+
+        if (n_tail > 0) {
+            const size_t k = std::min(size, sizeof(tail) - n_tail);
+            memcpy(tail + n_tail, p, k);
+            n_tail += k;
+            p      += k;
+            size   -= k;
+            if (n_tail < sizeof(tail)) {
+                return;
+            }
+            round(tail);
+            n_tail = 0;
+        }
+
+        for (; size >= sizeof(tail); p += sizeof(tail), size -= sizeof(tail)) {
+            round(p);
+        }
+
+        memcpy(tail, p, size);
+        n_tail = size;
+    }
+
+    uint64_t digest() const {
+        uint64_t h = n*CHECKSUM_P3;
+        for (int l = 0; l < 4; ++l) {
+            h = checksum_rotl(h ^ lane[l], 27)*CHECKSUM_P1 + CHECKSUM_P2;
+        }
+        for (size_t i = 0; i < n_tail; ++i) {
+            h = checksum_rotl(h ^ (tail[i]*CHECKSUM_P3), 11)*CHECKSUM_P1;
+        }
+
+        h ^= h >> 33;
+        h *= CHECKSUM_P2;
+        h ^= h >> 29;
+        h *= CHECKSUM_P3;
+        h ^= h >> 32;
+
+        return h;
+    }
+};
+
+// fn(i) for i in [0, n), on up to n_threads threads
+// an exception thrown by fn (e.g. std::bad_alloc) stops the remaining work and is rethrown on the calling thread
+template <typename F>
+static void packed_parallel_for(int n_threads, size_t n, const F & fn) {
+    std::atomic<size_t> next(0);
+
+    std::mutex         err_mutex;
+    std::exception_ptr err;
+
+    auto worker = [&]() {
+        try {
+            for (size_t i = next++; i < n; i = next++) {
+                fn(i);
+            }
+        } catch (...) {
+            next = n;
+
+            std::lock_guard<std::mutex> lock(err_mutex);
+            if (!err) {
+                err = std::current_exception();
+            }
+        }
+    };
+
+    const size_t n_workers = std::min<size_t>(std::max(1, n_threads), n);
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < n_workers; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    if (err) {
+        std::rethrow_exception(err);
+    }
+}
+
+llama_io_write_packed::llama_io_write_packed(bool compress, int n_threads) : compress(compress), n_threads(n_threads) {}
+
+void llama_io_write_packed::write(const void * src, size_t size) {
+    if (sections.empty() || sections.back().tensor != nullptr) {
+        sections.emplace_back();
+    }
+
+    section & sec = sections.back();
+    sec.data.insert(sec.data.end(), (const uint8_t *) src, (const uint8_t *) src + size);
+    sec.size += size;
+
+    size_written += size;
+}
+
+void llama_io_write_packed::write_tensor(const ggml_tensor * tensor, size_t offset, size_t size) {
+    if (sections.empty() || sections.back().tensor != tensor) {
+        sections.emplace_back();
+        sections.back().tensor = tensor;
+    }
+
+    section & sec = sections.back();
+    if (!sec.segs.empty() && sec.segs.back().offset + sec.segs.back().size == offset) {
+        sec.segs.back().size += size;
+    } else {
+        sec.segs.push_back({ offset, size });
+    }
+    sec.size += size;
+
+    size_written += size;
+}
+
+size_t llama_io_write_packed::n_bytes() {
+    return size_written;
+}
+
+size_t llama_io_write_packed::n_bytes_max() const {
+    // a section is only stored compressed if that makes it smaller
+    return 2*sizeof(uint32_t) + sections.size()*PACKED_SECTION_SIZE + size_written;
+}
+
+std::vector<std::pair<const void *, size_t>> llama_io_write_packed::pack() {
+    // the tensors that are not in host memory are copied first, on this thread
+    for (auto & sec : sections) {
+        if (sec.tensor != nullptr && !ggml_backend_buffer_is_host(sec.tensor->buffer)) {
+            sec.data.resize(sec.size);
+
+            size_t offset = 0;
+            for (const auto & seg : sec.segs) {
+                ggml_backend_tensor_get(sec.tensor, sec.data.data() + offset, seg.offset, seg.size);
+                offset += seg.size;
+            }
+            sec.segs.clear();
+        }
+    }
+
+    auto in_host = [](const section & sec) {
+        return sec.tensor != nullptr && !sec.segs.empty();
+    };
+
+    packed_parallel_for(n_threads, sections.size(), [&](size_t i) {
+        section & sec = sections[i];
+
+        const bool try_compress = compress && sec.size >= PACKED_MIN_COMPRESS;
+
+        packed_checksum checksum;
+
+        const uint8_t * src = sec.data.data();
+
+        std::vector<uint8_t> gathered;
+        if (in_host(sec)) {
+            const uint8_t * base = (const uint8_t *) sec.tensor->data;
+
+            for (const auto & seg : sec.segs) {
+                checksum.update(base + seg.offset, seg.size);
+            }
+
+            if (try_compress) {
+                if (sec.segs.size() == 1) {
+                    src = base + sec.segs[0].offset;
+                } else {
+                    gathered.reserve(sec.size);
+                    for (const auto & seg : sec.segs) {
+                        gathered.insert(gathered.end(), base + seg.offset, base + seg.offset + seg.size);
+                    }
+                    src = gathered.data();
+                }
+            }
+        } else {
+            checksum.update(sec.data.data(), sec.size);
+        }
+
+        sec.checksum = checksum.digest();
+
+        if (try_compress) {
+            std::vector<uint8_t> packed = llama_kv_compress(src, sec.size);
+            if (packed.size() < sec.size) {
+                sec.mode   = PACKED_MODE_COMPRESSED;
+                sec.packed = std::move(packed);
+            }
+        }
+    });
+
+    header.clear();
+
+    auto write_header = [&](const void * src, size_t size) {
+        header.insert(header.end(), (const uint8_t *) src, (const uint8_t *) src + size);
+    };
+
+    const uint32_t magic      = PACKED_MAGIC;
+    const uint32_t n_sections = sections.size();
+
+    write_header(&magic,      sizeof(magic));
+    write_header(&n_sections, sizeof(n_sections));
+
+    for (const auto & sec : sections) {
+        const uint32_t unused = 0;
+        const uint64_t size   = sec.size;
+        const uint64_t stored = sec.mode == PACKED_MODE_COMPRESSED ? sec.packed.size() : sec.size;
+
+        write_header(&sec.mode,     sizeof(sec.mode));
+        write_header(&unused,       sizeof(unused));
+        write_header(&sec.checksum, sizeof(sec.checksum));
+        write_header(&size,         sizeof(size));
+        write_header(&stored,       sizeof(stored));
+    }
+
+    std::vector<std::pair<const void *, size_t>> bufs;
+    bufs.emplace_back(header.data(), header.size());
+
+    for (const auto & sec : sections) {
+        if (sec.mode == PACKED_MODE_COMPRESSED) {
+            bufs.emplace_back(sec.packed.data(), sec.packed.size());
+        } else if (in_host(sec)) {
+            for (const auto & seg : sec.segs) {
+                bufs.emplace_back((const uint8_t *) sec.tensor->data + seg.offset, seg.size);
+            }
+        } else {
+            bufs.emplace_back(sec.data.data(), sec.data.size());
+        }
+    }
+
+    return bufs;
+}
+
+size_t llama_io_write_packed::write_to(uint8_t * dst, size_t size) {
+    const auto bufs = pack();
+
+    size_t n = 0;
+    for (const auto & buf : bufs) {
+        if (buf.second > size - n) {
+            throw std::runtime_error("unexpectedly reached end of buffer");
+        }
+        memcpy(dst + n, buf.first, buf.second);
+        n += buf.second;
+    }
+
+    return n;
+}
+
+size_t llama_io_write_packed::write_to(const llama_file & file) {
+    const auto bufs = pack();
+
+    file.write_raw_gather(bufs);
+
+    size_t n = 0;
+    for (const auto & buf : bufs) {
+        n += buf.second;
+    }
+
+    return n;
+}
+
+llama_io_read_packed::llama_io_read_packed(const uint8_t * data, size_t size, int n_threads) {
+    const uint8_t * p   = data;
+    const uint8_t * end = data + size;
+
+    uint32_t magic      = 0;
+    uint32_t n_sections = 0;
+    if (size >= 2*sizeof(uint32_t)) {
+        memcpy(&magic,      p,                    sizeof(magic));
+        memcpy(&n_sections, p + sizeof(uint32_t), sizeof(n_sections));
+        p += 2*sizeof(uint32_t);
+    }
+    if (magic != PACKED_MAGIC || n_sections > (size_t) (end - p)/PACKED_SECTION_SIZE) {
+        throw std::runtime_error("invalid packed state");
+    }
+
+    struct entry {
+        uint32_t mode;
+        uint64_t checksum;
+        uint64_t size;
+        uint64_t stored;
+    };
+
+    std::vector<entry> entries(n_sections);
+    for (auto & e : entries) {
+        memcpy(&e.mode,     p,      sizeof(e.mode));
+        memcpy(&e.checksum, p +  8, sizeof(e.checksum));
+        memcpy(&e.size,     p + 16, sizeof(e.size));
+        memcpy(&e.stored,   p + 24, sizeof(e.stored));
+        p += PACKED_SECTION_SIZE;
+    }
+
+    sections.resize(n_sections);
+    for (uint32_t i = 0; i < n_sections; ++i) {
+        const entry & e = entries[i];
+        if (e.stored > (uint64_t) (end - p) || e.mode > PACKED_MODE_COMPRESSED || (e.mode == PACKED_MODE_RAW && e.stored != e.size)) {
+            throw std::runtime_error(format("invalid section %u of the packed state", i));
+        }
+        sections[i].data = p;
+        sections[i].size = e.size;
+        p += e.stored;
+    }
+
+    size_packed = p - data;
+
+    std::vector<uint8_t> damaged(n_sections, 0);
+
+    packed_parallel_for(n_threads, n_sections, [&](size_t i) {
+        section & sec = sections[i];
+
+        if (entries[i].mode == PACKED_MODE_COMPRESSED) {
+            if (!llama_kv_decompress(sec.data, entries[i].stored, sec.buf) || sec.buf.size() != sec.size) {
+                damaged[i] = 1;
+                return;
+            }
+            sec.data = sec.buf.data();
+        }
+
+        packed_checksum checksum;
+        checksum.update(sec.data, sec.size);
+        damaged[i] = checksum.digest() != entries[i].checksum;
+    });
+
+    const auto it = std::find(damaged.begin(), damaged.end(), 1);
+    if (it != damaged.end()) {
+        throw std::runtime_error(format("damaged section %zu of the packed state", (size_t) (it - damaged.begin())));
+    }
+}
+
+const uint8_t * llama_io_read_packed::read(size_t size) {
+    while (i_section < sections.size() && offset == sections[i_section].size) {
+        ++i_section;
+        offset = 0;
+    }
+
+    size_read += size;
+
+    if (i_section < sections.size() && sections[i_section].size - offset >= size) {
+        const uint8_t * res = sections[i_section].data + offset;
+        offset += size;
+        return res;
+    }
+
+    // the read spans sections
+    temp_buffer.resize(size);
+    for (size_t n = 0; n < size; ) {
+        if (i_section >= sections.size()) {
+            throw std::runtime_error("unexpectedly reached end of buffer");
+        }
+
+        const section & sec = sections[i_section];
+
+        const size_t k = std::min(size - n, sec.size - offset);
+        memcpy(temp_buffer.data() + n, sec.data + offset, k);
+        n      += k;
+        offset += k;
+
+        if (offset == sec.size) {
+            ++i_section;
+            offset = 0;
+        }
+    }
+
+    return temp_buffer.data();
+}
+
+void llama_io_read_packed::read_to(void * dst, size_t size) {
+    memcpy(dst, read(size), size);
+}
+
+size_t llama_io_read_packed::n_bytes() {
+    return size_read;
+}
+
+size_t llama_io_read_packed::n_bytes_packed() const {
+    return size_packed;
+}
+
+bool llama_io_read_packed::at_end() const {
+    for (size_t i = i_section; i < sections.size(); ++i) {
+        if (sections[i].size > (i == i_section ? offset : 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t llama_io_packed_compress(const uint8_t * src, size_t size, uint8_t * dst, int n_threads) {
+    uint32_t magic      = 0;
+    uint32_t n_sections = 0;
+    if (size >= 2*sizeof(uint32_t)) {
+        memcpy(&magic,      src,                    sizeof(magic));
+        memcpy(&n_sections, src + sizeof(uint32_t), sizeof(n_sections));
+    }
+    if (magic != PACKED_MAGIC || n_sections > (size - 2*sizeof(uint32_t))/PACKED_SECTION_SIZE) {
+        throw std::runtime_error("invalid packed state");
+    }
+
+    const size_t n_header = 2*sizeof(uint32_t) + n_sections*PACKED_SECTION_SIZE;
+
+    struct section {
+        uint32_t        mode;
+        uint64_t        stored;
+        const uint8_t * data;
+
+        std::vector<uint8_t> packed;
+    };
+
+    // the checksums are of the data before compression, they stay as they are
+    std::vector<section> sections(n_sections);
+
+    const uint8_t * p = src + n_header;
+    for (uint32_t i = 0; i < n_sections; ++i) {
+        section & sec = sections[i];
+
+        const uint8_t * e = src + 2*sizeof(uint32_t) + i*PACKED_SECTION_SIZE;
+        memcpy(&sec.mode,   e,      sizeof(sec.mode));
+        memcpy(&sec.stored, e + 24, sizeof(sec.stored));
+
+        if (sec.stored > (uint64_t) (src + size - p)) {
+            throw std::runtime_error(format("invalid section %u of the packed state", i));
+        }
+        sec.data = p;
+        p += sec.stored;
+    }
+
+    packed_parallel_for(n_threads, n_sections, [&](size_t i) {
+        section & sec = sections[i];
+
+        if (sec.mode == PACKED_MODE_RAW && sec.stored >= PACKED_MIN_COMPRESS) {
+            std::vector<uint8_t> packed = llama_kv_compress(sec.data, sec.stored);
+            if (packed.size() < sec.stored) {
+                sec.packed = std::move(packed);
+            }
+        }
+    });
+
+    memcpy(dst, src, n_header);
+
+    size_t n = n_header;
+    for (uint32_t i = 0; i < n_sections; ++i) {
+        const section & sec = sections[i];
+
+        uint8_t * e = dst + 2*sizeof(uint32_t) + i*PACKED_SECTION_SIZE;
+
+        if (sec.packed.empty()) {
+            memcpy(dst + n, sec.data, sec.stored);
+            n += sec.stored;
+        } else {
+            const uint32_t mode   = PACKED_MODE_COMPRESSED;
+            const uint64_t stored = sec.packed.size();
+            memcpy(e,      &mode,   sizeof(mode));
+            memcpy(e + 24, &stored, sizeof(stored));
+
+            memcpy(dst + n, sec.packed.data(), sec.packed.size());
+            n += sec.packed.size();
+        }
+    }
+
+    return n;
+}
@@ -3,8 +3,10 @@
 #include <cstddef>
 #include <cstdint>
 #include <string>
+#include <vector>
 
 struct ggml_tensor;
+struct llama_file;
 
 class llama_io_write_i {
 public:
@@ -33,3 +35,105 @@ public:
 
     void read_string(std::string & str);
 };
+
+// packed state: the stream of the state split in sections - each run of write_tensor() on the same tensor (the K or V of
+// a layer) and each run of write() in between - with a checksum per section, and the larger sections compressed when
+// that makes them smaller (see llama-compress.h)
+//
+//   u32 magic, u32 n_sections
+//   per section: u32 mode, u32 unused, u64 checksum, u64 size, u64 size stored
+//   the stored sections, in order
+//
+// the tensor data is only read when the state is packed, in parallel and straight from the tensors that are in host
+// memory, and written to files without an intermediate copy where it is not compressed
+class llama_io_write_packed : public llama_io_write_i {
+public:
+    llama_io_write_packed(bool compress, int n_threads);
+
+    void write(const void * src, size_t size) override;
+    void write_tensor(const ggml_tensor * tensor, size_t offset, size_t size) override;
+
+    // bytes of the stream so far, before packing
+    size_t n_bytes() override;
+
+    // upper bound of the size of the packed state
+    size_t n_bytes_max() const;
+
+    // pack the state into dst, returns the size of the packed state
+    size_t write_to(uint8_t * dst, size_t size);
+
+    // pack the state into the file, returns the number of bytes written
+    size_t write_to(const llama_file & file);
+
+private:
+    struct segment {
+        size_t offset;
+        size_t size;
+    };
+
+    struct section {
+        const ggml_tensor * tensor = nullptr; // nullptr for the data of write()
+
+        std::vector<segment> segs; // the ranges of the tensor
+        std::vector<uint8_t> data; // the data of write(), or of the tensor if it is not in host memory
+
+        size_t size = 0;
+
+        uint32_t mode     = 0;
+        uint64_t checksum = 0;
+
+        std::vector<uint8_t> packed;
+    };
+
+    // compress and checksum the sections, returns the buffers to write in order
+    std::vector<std::pair<const void *, size_t>> pack();
+
+    bool compress;
+    int  n_threads;
+
+    size_t size_written = 0;
+
+    std::vector<section> sections;
+    std::vector<uint8_t> header;
+};
+
+class llama_io_read_packed : public llama_io_read_i {
+public:
+    // the sections are checked and decompressed up front, throws if the data is damaged
+    // the data must outlive the reader, the sections that are not compressed are read from it in place
+    llama_io_read_packed(const uint8_t * data, size_t size, int n_threads);
+
+    const uint8_t * read(size_t size) override;
+    void read_to(void * dst, size_t size) override;
+
+    // bytes of the stream read so far
+    size_t n_bytes() override;
+
+    // size of the packed state
+    size_t n_bytes_packed() const;
+
+    // all of the stream has been read
+    bool at_end() const;
+
+private:
+    struct section {
+        const uint8_t * data = nullptr;
+        size_t          size = 0;
+
+        std::vector<uint8_t> buf; // the decompressed data
+    };
+
+    std::vector<section> sections;
+
+    size_t i_section = 0;
+    size_t offset    = 0;
+
+    size_t size_read   = 0;
+    size_t size_packed = 0;
+
+    std::vector<uint8_t> temp_buffer; // reads that span sections
+};
+
+// compress the sections of a packed state that are stored as they are, into dst of the same size
+// returns the size of the compressed state, throws if src is not a packed state
+size_t llama_io_packed_compress(const uint8_t * src, size_t size, uint8_t * dst, int n_threads);
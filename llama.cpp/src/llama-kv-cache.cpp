@@ -7,6 +7,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstdlib>
 #include <limits>
 #include <map>
 #include <stdexcept>
@@ -17,8 +18,8 @@ llama_kv_cache_unified::llama_kv_cache_unified(const llama_hparams & hparams, ca
 bool llama_kv_cache_unified::init(
         const llama_model & model,
       const llama_cparams & cparams,
-                ggml_type   type_k,
-                ggml_type   type_v,
+  const std::vector<ggml_type> & type_k,
+  const std::vector<ggml_type> & type_v,
                  uint32_t   kv_size,
                      bool   offload) {
     const int32_t n_layer = hparams.n_layer;
@@ -26,22 +27,40 @@ bool llama_kv_cache_unified::init(
     has_shift = false;
 
     recurrent = llama_model_is_recurrent(&model);
-    v_trans   = !recurrent && !cparams.flash_attn;
+    n_block   = recurrent ? 0 : std::min(cparams.n_kv_block, kv_size);
+    v_trans   = !recurrent && !cparams.flash_attn && n_block == 0; // paged mode gathers V by rows
     can_shift = !recurrent;
 
+    // the positions of the tokens are only used for RoPE, and with a single position per token
+    lazy_shift = can_shift && hparams.rope_type != LLAMA_ROPE_TYPE_NONE &&
+        hparams.rope_type != LLAMA_ROPE_TYPE_MROPE && hparams.rope_type != LLAMA_ROPE_TYPE_VISION;
+
+    kq_mask_incremental = !recurrent && getenv("LLAMA_KQ_MASK_INCREMENTAL_DISABLE") == nullptr;
+
+    if (recurrent && cparams.n_kv_block > 0) {
+        LLAMA_LOG_WARN("%s: paged KV cache is not supported by recurrent models - disabling\n", __func__);
+    }
+
+    GGML_ASSERT((int32_t) type_k.size() == n_layer && (int32_t) type_v.size() == n_layer);
+
     LLAMA_LOG_INFO("%s: kv_size = %d, offload = %d, type_k = '%s', type_v = '%s', n_layer = %d, can_shift = %d\n",
-            __func__, kv_size, offload, ggml_type_name(type_k), ggml_type_name(type_v), n_layer, can_shift);
+            __func__, kv_size, offload, ggml_type_name(type_k[0]), ggml_type_name(type_v[0]), n_layer, can_shift);
 
     head = 0;
     size = kv_size;
     used = 0;
 
-    this->type_k = type_k;
-    this->type_v = type_v;
-
     cells.clear();
     cells.resize(kv_size);
 
+    seq_cells_reset();
+    blocks_reset();
+    kq_mask_rows_reset();
+
+    if (is_paged()) {
+        LLAMA_LOG_INFO("%s: paged KV cache, %zu blocks of %u cells\n", __func__, blocks.size(), n_block);
+    }
+
     // create a context for each buffer type
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
     auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
@@ -86,6 +105,10 @@ bool llama_kv_cache_unified::init(
             buft = ggml_backend_cpu_buffer_type();
         }
 
+        if (type_k[i] != type_k[0] || type_v[i] != type_v[0]) {
+            LLAMA_LOG_INFO("%s: layer %3d: type_k = '%s', type_v = '%s'\n", __func__, i, ggml_type_name(type_k[i]), ggml_type_name(type_v[i]));
+        }
+
         LLAMA_LOG_DEBUG("%s: layer %3d: n_embd_k_gqa = %d, n_embd_v_gqa = %d, dev = %s\n", __func__,
                 i, n_embd_k_gqa, n_embd_v_gqa, dev_name);
 
@@ -95,8 +118,8 @@ bool llama_kv_cache_unified::init(
             return false;
         }
 
-        ggml_tensor * k = ggml_new_tensor_1d(ctx, type_k, n_embd_k_gqa*kv_size);
-        ggml_tensor * v = ggml_new_tensor_1d(ctx, type_v, n_embd_v_gqa*kv_size);
+        ggml_tensor * k = ggml_new_tensor_1d(ctx, type_k[i], n_embd_k_gqa*kv_size);
+        ggml_tensor * v = ggml_new_tensor_1d(ctx, type_v[i], n_embd_v_gqa*kv_size);
         ggml_format_name(k, "cache_k_l%d", i);
         ggml_format_name(v, "cache_v_l%d", i);
         k_l.push_back(k);
@@ -125,7 +148,7 @@ int32_t llama_kv_cache_unified::get_n_tokens() const {
     int32_t result = 0;
 
     for (uint32_t i = 0; i < size; i++) {
-        result += cells[i].seq_id.size();
+        result += cells[i].n_seq_id();
     }
 
     return result;
@@ -156,13 +179,17 @@ llama_pos llama_kv_cache_unified::pos_max() const {
 void llama_kv_cache_unified::clear() {
     for (int32_t i = 0; i < (int32_t) size; ++i) {
         cells[i].pos = -1;
-        cells[i].seq_id.clear();
+        cells[i].seq_id.reset();
         cells[i].src = -1;
         cells[i].tail = -1;
     }
     head = 0;
     used = 0;
 
+    seq_cells_reset();
+    blocks_reset();
+    kq_mask_rows_reset();
+
     for (auto & buf : bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -208,12 +235,14 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         return true;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
+    const slot_range range = seq_id < 0 ? slot_range { 0, size } : seq_cells(seq_id);
+
+    for (uint32_t i = range.c0; i < range.c1; ++i) {
         if (cells[i].pos >= p0 && cells[i].pos < p1) {
             if (seq_id < 0) {
-                cells[i].seq_id.clear();
+                cells[i].seq_id.reset();
             } else if (cells[i].has_seq_id(seq_id)) {
-                cells[i].seq_id.erase(seq_id);
+                cells[i].seq_id.reset(seq_id);
             } else {
                 continue;
             }
@@ -233,6 +262,15 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         }
     }
 
+    blocks_sync(range.c0, range.c1);
+    cells_dirty(range.c0, range.c1);
+
+    if (seq_id >= 0) {
+        seq_cells_trim(seq_id);
+    } else if (p0 == 0 && p1 == std::numeric_limits<llama_pos>::max()) {
+        seq_cells_reset();
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != size && new_head < head) {
         head = new_head;
@@ -262,9 +300,9 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
                 // clear destination seq_id if it wasn't empty
                 llama_kv_cell & cell_dst = cells[tail_dst.tail];
 
-                cell_dst.seq_id.erase(seq_id_dst);
+                cell_dst.seq_id.reset(seq_id_dst);
                 tail_dst.tail = -1;
-                if (cell_dst.seq_id.empty()) {
+                if (cell_dst.is_empty()) {
                     cell_dst.pos = -1;
                     cell_dst.delta = -1;
                     cell_dst.src = -1;
@@ -274,7 +312,7 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
             if (tail_src.tail >= 0) {
                 llama_kv_cell & cell_src = cells[tail_src.tail];
 
-                cell_src.seq_id.insert(seq_id_dst);
+                cell_src.seq_id.set(seq_id_dst);
                 tail_dst.tail = tail_src.tail;
             }
         }
@@ -283,18 +321,36 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
     }
 
     // otherwise, this is the KV of a Transformer-like model
+    if (seq_id_dst < 0 || seq_id_dst >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id_dst = %d, must be in [0, %d)\n", __func__, seq_id_dst, LLAMA_MAX_PARALLEL_SEQUENCES);
+        return;
+    }
+
     head = 0;
 
-    for (uint32_t i = 0; i < size; ++i) {
+    // the shared cells are rotated for their positions
+    seq_pos_offs_apply(seq_id_src);
+    seq_pos_offs_apply(seq_id_dst);
+
+    const slot_range range = seq_cells(seq_id_src);
+
+    for (uint32_t i = range.c0; i < range.c1; ++i) {
         if (cells[i].has_seq_id(seq_id_src) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            cells[i].seq_id.insert(seq_id_dst);
+            cells[i].seq_id.set(seq_id_dst);
+            seq_cells_add(seq_id_dst, i);
         }
     }
+
+    // the blocks of the copied range are now shared
+    blocks_sync(range.c0, range.c1);
+    cells_dirty(range.c0, range.c1);
 }
 
 void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     uint32_t new_head = size;
 
+    const slot_range range = seq_cells(seq_id);
+
     for (uint32_t i = 0; i < size; ++i) {
         if (recurrent && (llama_seq_id) i != seq_id) {
             cells[i].tail = -1;
@@ -307,17 +363,29 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
 
             cells[i].pos = -1;
             cells[i].src = -1;
-            cells[i].seq_id.clear();
+            cells[i].seq_id.reset();
 
             if (new_head == size){
                 new_head = i;
             }
         } else {
-            cells[i].seq_id.clear();
-            cells[i].seq_id.insert(seq_id);
+            cells[i].seq_id.reset();
+            cells[i].seq_id.set(seq_id);
         }
     }
 
+    const llama_pos offs = seq_pos_offs(seq_id);
+
+    seq_cells_reset();
+
+    if (!recurrent && range.c0 < range.c1) {
+        seq_ranges[seq_id] = range;
+        pos_offs[seq_id]   = offs;
+    }
+
+    blocks_sync(0, size);
+    cells_dirty(0, size);
+
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != size && new_head < head) {
         head = new_head;
@@ -358,18 +426,50 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
+    const slot_range range = seq_cells(seq_id);
+
+    // shift the tail lazily if it has more cells than the part before it, see seq_pos_offs()
+    bool lazy = lazy_shift && seq_id >= 0;
+    {
+        uint32_t n_before = 0;
+        uint32_t n_range  = 0;
+
+        for (uint32_t i = range.c0; lazy && i < range.c1; ++i) {
+            if (!cells[i].has_seq_id(seq_id)) {
+                continue;
+            }
+            if (cells[i].n_seq_id() > 1 || cells[i].pos >= p1) {
+                lazy = false;
+            } else if (cells[i].pos < p0) {
+                n_before++;
+            } else {
+                n_range++;
+            }
+        }
+
+        lazy = lazy && n_before < n_range;
+    }
+
+    for (uint32_t i = range.c0; i < range.c1; ++i) {
+        if (lazy && cells[i].has_seq_id(seq_id) && cells[i].pos < p0) {
             has_shift = true;
-            cells[i].pos   += delta;
-            cells[i].delta += delta;
+            cells[i].delta -= delta;
+            continue;
+        }
+
+        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
+            if (!lazy) {
+                has_shift = true;
+                cells[i].delta += delta;
+            }
+            cells[i].pos += delta;
 
             if (cells[i].pos < 0) {
                 if (!cells[i].is_empty()) {
                     used--;
                 }
                 cells[i].pos = -1;
-                cells[i].seq_id.clear();
+                cells[i].seq_id.reset();
                 if (new_head == size) {
                     new_head = i;
                 }
@@ -377,6 +477,22 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
         }
     }
 
+    cells_dirty(range.c0, range.c1);
+
+    if (lazy) {
+        pos_offs[seq_id] -= delta;
+
+        // keep the positions for RoPE in the range where the angles are precise
+        if (std::abs(pos_offs[seq_id]) > (llama_pos) std::max(hparams.n_ctx_train, size)) {
+            seq_pos_offs_apply(seq_id);
+        }
+    }
+
+    if (new_head != size) {
+        blocks_sync(range.c0, range.c1);
+        seq_cells_trim(seq_id);
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     head = new_head != size ? new_head : 0;
@@ -415,7 +531,11 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
+    seq_pos_offs_apply(seq_id);
+
+    const slot_range range = seq_cells(seq_id);
+
+    for (uint32_t i = range.c0; i < range.c1; ++i) {
         if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
             has_shift = true;
 
@@ -426,12 +546,16 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
             }
         }
     }
+
+    cells_dirty(range.c0, range.c1);
 }
 
 llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
     llama_pos result = 0;
 
-    for (uint32_t i = 0; i < size; ++i) {
+    const slot_range range = seq_cells(seq_id);
+
+    for (uint32_t i = range.c0; i < range.c1; ++i) {
         if (cells[i].has_seq_id(seq_id)) {
             result = std::max(result, cells[i].pos);
         }
@@ -440,8 +564,319 @@ llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
     return result;
 }
 
+llama_kv_cache_unified::slot_range llama_kv_cache_unified::seq_cells(llama_seq_id seq_id) const {
+    if (recurrent) {
+        return { 0, size };
+    }
+
+    if (seq_id < 0 || seq_id >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+        return { 0, 0 };
+    }
+
+    return seq_ranges[seq_id];
+}
+
+void llama_kv_cache_unified::seq_cells_add(llama_seq_id seq_id, uint32_t i) {
+    slot_range & range = seq_ranges[seq_id];
+
+    if (range.c0 >= range.c1) {
+        range = { i, i + 1 };
+    } else {
+        range.c0 = std::min(range.c0, i);
+        range.c1 = std::max(range.c1, i + 1);
+    }
+}
+
+void llama_kv_cache_unified::seq_cells_trim(llama_seq_id seq_id) {
+    if (recurrent || seq_id < 0 || seq_id >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+        return;
+    }
+
+    slot_range & range = seq_ranges[seq_id];
+
+    while (range.c0 < range.c1 && !cells[range.c0].seq_id.test(seq_id)) {
+        range.c0++;
+    }
+
+    while (range.c1 > range.c0 && !cells[range.c1 - 1].seq_id.test(seq_id)) {
+        range.c1--;
+    }
+
+    if (range.c0 == range.c1) {
+        range = { 0, 0 };
+
+        pos_offs[seq_id] = 0;
+    }
+}
+
+void llama_kv_cache_unified::seq_cells_reset() {
+    seq_ranges.assign(LLAMA_MAX_PARALLEL_SEQUENCES, { 0, 0 });
+    pos_offs  .assign(LLAMA_MAX_PARALLEL_SEQUENCES, 0);
+}
+
+llama_pos llama_kv_cache_unified::seq_pos_offs(llama_seq_id seq_id) const {
+    if (seq_id < 0 || seq_id >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+        return 0;
+    }
+
+    return pos_offs[seq_id];
+}
+
+bool llama_kv_cache_unified::has_pos_offs() const {
+    return std::any_of(pos_offs.begin(), pos_offs.end(), [](llama_pos offs) { return offs != 0; });
+}
+
+void llama_kv_cache_unified::seq_pos_offs_apply(llama_seq_id seq_id) {
+    if (seq_id < 0) {
+        for (llama_seq_id s = 0; s < LLAMA_MAX_PARALLEL_SEQUENCES; ++s) {
+            seq_pos_offs_apply(s);
+        }
+        return;
+    }
+
+    if (seq_id >= LLAMA_MAX_PARALLEL_SEQUENCES || pos_offs[seq_id] == 0) {
+        return;
+    }
+
+    const slot_range range = seq_cells(seq_id);
+
+    for (uint32_t i = range.c0; i < range.c1; ++i) {
+        if (cells[i].has_seq_id(seq_id)) {
+            has_shift = true;
+            cells[i].delta -= pos_offs[seq_id];
+        }
+    }
+
+    pos_offs[seq_id] = 0;
+}
+
+void llama_kv_cache_unified::gather_prepare(const llama_ubatch & ubatch, uint32_t pad) {
+    gather.clear();
+
+    if (!is_paged()) {
+        return;
+    }
+
+    std::vector<bool> gathered(blocks.size(), false);
+
+    uint32_t n_cells = 0;
+
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        for (const uint32_t b : block_tables[ubatch.seq_id[s][0]]) {
+            if (!gathered[b]) {
+                gathered[b] = true;
+                n_cells += blocks[b].n_fill;
+            }
+        }
+    }
+
+    // copying most of the used cells costs more than attending them in place
+    if (2*GGML_PAD(n_cells, pad) > n) {
+        return;
+    }
+
+    gather.reserve(n_cells);
+
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+        if (gathered[b]) {
+            for (uint32_t i = b*n_block; i < b*n_block + blocks[b].n_fill; ++i) {
+                gather.push_back(i);
+            }
+        }
+    }
+
+    n = std::max(pad, GGML_PAD(n_cells, pad));
+}
+
+bool llama_kv_cache_unified::find_slot_paged(const llama_ubatch & ubatch) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    runs.clear();
+
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> seq_id;
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            seq_id.set(ubatch.seq_id[s][j]);
+        }
+
+        const auto & table = block_tables[ubatch.seq_id[s][0]];
+
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k = s*n_seq_tokens + i;
+
+            int32_t cell = -1;
+
+            // continue in the last block of the sequence, unless it is shared with other sequences or full
+            int32_t b = table.empty() ? -1 : (int32_t) table.back();
+
+            if (b >= 0 && blocks[b].seq_id == seq_id && b*n_block + blocks[b].n_fill < std::min(size, (b + 1)*n_block)) {
+                cell = b*n_block + blocks[b].n_fill++;
+                blocks[b].n_used++;
+            }
+
+            if (cell < 0) {
+                cell = block_reuse(table, seq_id);
+            }
+
+            if (cell < 0 && (b = block_alloc(seq_id)) >= 0) {
+                cell = b*n_block + blocks[b].n_fill++;
+                blocks[b].n_used++;
+            }
+
+            if (cell < 0) {
+                // return the cells handed out so far
+                for (const auto & run : runs) {
+                    for (uint32_t c = run.c0; c < run.c0 + run.n; ++c) {
+                        cells[c].pos = -1;
+                        cells[c].seq_id.reset();
+                    }
+                    blocks_sync(run.c0, run.c0 + run.n);
+                }
+                runs.clear();
+
+                return false;
+            }
+
+            if (!runs.empty() && runs.back().i0 + runs.back().n == k && runs.back().c0 + runs.back().n == (uint32_t) cell) {
+                runs.back().n++;
+            } else {
+                runs.push_back({ k, (uint32_t) cell, 1 });
+            }
+
+            // the cell is taken right away, so that block_reuse does not hand it out twice
+            cells[cell].pos = ubatch.pos[k];
+
+            for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+                cells[cell].seq_id.set(ubatch.seq_id[s][j]);
+                seq_cells_add(ubatch.seq_id[s][j], cell);
+            }
+        }
+    }
+
+    for (const auto & run : runs) {
+        pending.ranges.push_back({ run.c0, run.c0 + run.n });
+        cells_dirty(run.c0, run.c0 + run.n);
+    }
+
+    used += n_tokens;
+    head  = runs.front().c0;
+
+    return true;
+}
+
+int32_t llama_kv_cache_unified::block_alloc(const std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> & seq_id) {
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+        if (blocks[b].seq_id.none()) {
+            blocks[b].seq_id = seq_id;
+            blocks[b].n_fill = 0;
+            blocks[b].n_used = 0;
+
+            for (llama_seq_id s = 0; s < LLAMA_MAX_PARALLEL_SEQUENCES; ++s) {
+                if (seq_id.test(s)) {
+                    block_tables[s].push_back(b);
+                }
+            }
+
+            return b;
+        }
+    }
+
+    return -1;
+}
+
+int32_t llama_kv_cache_unified::block_reuse(const std::vector<uint32_t> & table, const std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> & seq_id) {
+    for (const uint32_t b : table) {
+        if (blocks[b].seq_id != seq_id || blocks[b].n_used >= blocks[b].n_fill) {
+            continue;
+        }
+
+        for (uint32_t i = b*n_block; i < b*n_block + blocks[b].n_fill; ++i) {
+            if (cells[i].is_empty()) {
+                blocks[b].n_used++;
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+void llama_kv_cache_unified::blocks_sync(uint32_t c0, uint32_t c1) {
+    if (!is_paged() || c0 >= c1) {
+        return;
+    }
+
+    for (uint32_t b = c0/n_block; b <= (c1 - 1)/n_block; ++b) {
+        const uint32_t i0 = b*n_block;
+        const uint32_t i1 = std::min(i0 + n_block, size);
+
+        std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> seq_id;
+
+        uint32_t n_fill = 0;
+        uint32_t n_used = 0;
+
+        for (uint32_t i = i0; i < i1; ++i) {
+            if (!cells[i].is_empty()) {
+                seq_id |= cells[i].seq_id;
+                n_fill = i - i0 + 1;
+                n_used++;
+            }
+        }
+
+        kv_block & block = blocks[b];
+
+        if (block.seq_id != seq_id) {
+            for (llama_seq_id s = 0; s < LLAMA_MAX_PARALLEL_SEQUENCES; ++s) {
+                if (block.seq_id.test(s) && !seq_id.test(s)) {
+                    auto & table = block_tables[s];
+                    table.erase(std::find(table.begin(), table.end(), b));
+                } else if (!block.seq_id.test(s) && seq_id.test(s)) {
+                    block_tables[s].push_back(b);
+                }
+            }
+        }
+
+        block.seq_id = seq_id;
+        block.n_fill = n_fill;
+        block.n_used = n_used;
+    }
+}
+
+void llama_kv_cache_unified::blocks_reset() {
+    blocks.assign(is_paged() ? (size + n_block - 1)/n_block : 0, {});
+    block_tables.assign(is_paged() ? LLAMA_MAX_PARALLEL_SEQUENCES : 0, {});
+}
+
+void llama_kv_cache_unified::cells_dirty(uint32_t c0, uint32_t c1) {
+    if (c0 >= c1) {
+        return;
+    }
+
+    for (auto & row : kq_mask_rows) {
+        if (row.data.empty()) {
+            continue;
+        }
+
+        slot_range & dirty = row.dirty;
+
+        if (dirty.c0 >= dirty.c1) {
+            dirty = { c0, c1 };
+        } else {
+            dirty.c0 = std::min(dirty.c0, c0);
+            dirty.c1 = std::max(dirty.c1, c1);
+        }
+    }
+}
+
+void llama_kv_cache_unified::kq_mask_rows_reset() {
+    kq_mask_rows.assign(kq_mask_incremental ? LLAMA_MAX_PARALLEL_SEQUENCES : 0, {});
+}
+
 void llama_kv_cache_unified::defrag() {
-    if (!recurrent) {
+    // paged mode frees whole blocks, there is nothing to compact
+    if (!recurrent && !is_paged()) {
         do_defrag = true;
     }
 }
@@ -461,7 +896,7 @@ void llama_kv_cache_unified::restore() {
 
     for (auto & range : pending.ranges) {
         for (uint32_t i = range.c0; i < range.c1; ++i) {
-            cells[i].seq_id.clear();
+            cells[i].seq_id.reset();
 
             // keep count of the number of used cells
             if (cells[i].pos >= 0) {
@@ -472,6 +907,9 @@ void llama_kv_cache_unified::restore() {
             cells[i].src = -1;
         }
 
+        blocks_sync(range.c0, range.c1);
+        cells_dirty(range.c0, range.c1);
+
         new_head = std::min(new_head, range.c0);
     }
 
@@ -540,9 +978,9 @@ bool llama_kv_cache_unified::find_slot(
                         llama_kv_cell & cell = cells[seq.tail];
                         // clear cells from seq_ids that become shared
                         // (should not normally happen, but let's handle it anyway)
-                        cell.seq_id.erase(seq_id);
+                        cell.seq_id.reset(seq_id);
                         seq.tail = -1;
-                        if (cell.seq_id.empty()) {
+                        if (cell.is_empty()) {
                             cell.pos = -1;
                             cell.src = -1;
                             used -= 1;
@@ -558,12 +996,12 @@ bool llama_kv_cache_unified::find_slot(
             tails_verif.assign(size, -1);
             for (uint32_t i = 0; i < size; ++i) {
                 llama_kv_cell & cell = cells[i];
-                for (llama_seq_id seq_id : cell.seq_id) {
+                cell.for_each_seq_id([&](llama_seq_id seq_id) {
                     if (tails_verif[seq_id] != -1) {
                         LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tails_verif[seq_id]);
                     }
                     tails_verif[seq_id] = i;
-                }
+                });
             }
             for (uint32_t i = 0; i < size; ++i) {
                 if (tails_verif[i] != cells[i].tail) {
@@ -592,7 +1030,7 @@ bool llama_kv_cache_unified::find_slot(
                 llama_kv_cell & cell = cells[seq_meta.tail];
                 GGML_ASSERT(cell.has_seq_id(seq_id));
                 // does this seq_id "own" the cell?
-                if (cell.seq_id.size() == 1) { has_cell = true; }
+                if (cell.n_seq_id() == 1) { has_cell = true; }
             }
             if (!has_cell) {
                 llama_kv_cell & empty_cell = cells[next_empty_cell];
@@ -602,8 +1040,8 @@ bool llama_kv_cache_unified::find_slot(
                     llama_kv_cell & orig_cell = cells[seq_meta.tail];
                     empty_cell.pos = orig_cell.pos;
                     empty_cell.src = orig_cell.src;
-                    orig_cell.seq_id.erase(seq_id);
-                    empty_cell.seq_id.insert(seq_id); // will be overwritten
+                    orig_cell.seq_id.reset(seq_id);
+                    empty_cell.seq_id.set(seq_id); // will be overwritten
                 }
                 seq_meta.tail = next_empty_cell;
                 // find next empty cell
@@ -634,12 +1072,12 @@ bool llama_kv_cache_unified::find_slot(
                 std::swap(dst_cell.seq_id, src_cell.seq_id);
 
                 // swap tails (assuming they NEVER overlap)
-                for (const llama_seq_id seq_id : src_cell.seq_id) {
+                src_cell.for_each_seq_id([&](llama_seq_id seq_id) {
                     cells[seq_id].tail = src_id;
-                }
-                for (const llama_seq_id seq_id : dst_cell.seq_id) {
+                });
+                dst_cell.for_each_seq_id([&](llama_seq_id seq_id) {
                     cells[seq_id].tail = dst_id;
-                }
+                });
             }
         }
 
@@ -656,10 +1094,10 @@ bool llama_kv_cache_unified::find_slot(
                     __func__, last_pos, cell.pos, ubatch.seq_id[s][0], n_seq_tokens);
             }
             cell.pos = last_pos;
-            cell.seq_id.clear();
+            cell.seq_id.reset();
             for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
                 const llama_seq_id seq_id = ubatch.seq_id[s][j];
-                cell.seq_id.insert(seq_id);
+                cell.seq_id.set(seq_id);
                 cells[seq_id].tail = cell_id;
             }
         }
@@ -674,6 +1112,10 @@ bool llama_kv_cache_unified::find_slot(
         return n >= n_seqs;
     }
 
+    if (is_paged()) {
+        return find_slot_paged(ubatch);
+    }
+
     // otherwise, one cell per token.
 
     if (n_tokens > size) {
@@ -716,7 +1158,8 @@ bool llama_kv_cache_unified::find_slot(
             cells[head + k].pos = ubatch.pos[k];
 
             for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
-                cells[head + k].seq_id.insert(ubatch.seq_id[s][j]);
+                cells[head + k].seq_id.set(ubatch.seq_id[s][j]);
+                seq_cells_add(ubatch.seq_id[s][j], head + k);
             }
         }
     }
@@ -725,6 +1168,8 @@ bool llama_kv_cache_unified::find_slot(
 
     pending.ranges.push_back({head, head + n_tokens});
 
+    cells_dirty(head, head + n_tokens);
+
     return true;
 }
 
@@ -783,7 +1228,12 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
     //   - x2 for keys and values
     //const uint32_t max_moves = max_nodes()/(6*n_layer);
     // TODO: tmp fix https://github.com/ggerganov/llama.cpp/issues/6685#issuecomment-2057579516
-    const uint32_t max_moves = (n_max_nodes - 2*n_layer)/(6*n_layer);
+    uint32_t max_moves = (n_max_nodes - 2*n_layer)/(6*n_layer);
+    if (defrag_info.n_max_moves > 0) {
+        max_moves = std::min(max_moves, defrag_info.n_max_moves);
+    }
+
+    defrag_info.n_moved = 0;
 
     // determine which KV cells to move where
     //
@@ -863,8 +1313,13 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
             // this cell goes to (i0 + nf)
             ids[i1] = i0 + nf;
 
+            defrag_info.n_moved++;
+
             // move the cell meta data
             cells[i0 + nf] = cell1;
+            cells[i0 + nf].for_each_seq_id([&](llama_seq_id seq_id) {
+                seq_cells_add(seq_id, i0 + nf);
+            });
 
             // clear the old cell and move the head there
             cell1 = llama_kv_cell();
@@ -895,6 +1350,13 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
         return false;
     }
 
+    // the cells moved to lower indices, the ranges still cover their old place
+    for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_PARALLEL_SEQUENCES; ++seq_id) {
+        seq_cells_trim(seq_id);
+    }
+
+    cells_dirty(0, size);
+
     LLAMA_LOG_DEBUG("(tmp log) KV defrag cell moves: %u\n", n_moves);
 
     LLAMA_LOG_DEBUG("expected gf nodes: %u\n", 6*n_moves*n_layer);
@@ -902,6 +1364,29 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
     return true;
 }
 
+llama_kv_defrag_stats llama_kv_cache_unified::defrag_stats(uint32_t pad) const {
+    llama_kv_defrag_stats res = {};
+
+    // paged mode frees whole blocks, there is nothing to compact
+    if (recurrent || is_paged()) {
+        return res;
+    }
+
+    const uint32_t n_max = cell_max();
+
+    res.n_attended     = std::min(size, std::max(pad, GGML_PAD(n_max, pad)));
+    res.n_attended_min = std::min(size, std::max(pad, GGML_PAD(used,  pad)));
+
+    // the full defragmentation moves the cells after the first `used` ones into the gaps before them
+    for (uint32_t i = used; i < n_max; ++i) {
+        if (!cells[i].is_empty()) {
+            res.n_move++;
+        }
+    }
+
+    return res;
+}
+
 void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
     std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
     uint32_t cell_count = 0;
@@ -963,15 +1448,15 @@ void llama_kv_cache_unified::state_write_meta(llama_io_write_i & io, const std::
         for (uint32_t i = range.first; i < range.second; ++i) {
             const auto & cell = cells[i];
             const llama_pos pos      = cell.pos;
-            const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+            const uint32_t  n_seq_id = seq_id == -1 ? cell.n_seq_id() : 0;
 
             io.write(&pos,      sizeof(pos));
             io.write(&n_seq_id, sizeof(n_seq_id));
 
             if (n_seq_id) {
-                for (auto seq_id : cell.seq_id) {
+                cell.for_each_seq_id([&](llama_seq_id seq_id) {
                     io.write(&seq_id, sizeof(seq_id));
-                }
+                });
             }
         }
     }
@@ -1061,8 +1546,19 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
     if (dest_seq_id != -1) {
         // single sequence
 
+        if (dest_seq_id < 0 || dest_seq_id >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+            LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %d)\n", __func__, dest_seq_id, LLAMA_MAX_PARALLEL_SEQUENCES);
+            return false;
+        }
+
         seq_rm(dest_seq_id, -1, -1);
 
+        runs.clear();
+
+        if (cell_count == 0) {
+            return true;
+        }
+
         llama_sbatch sbatch;
         llama_ubatch batch = sbatch.reserve_ubatch(cell_count, /* has_embd */ false);
 
@@ -1090,15 +1586,22 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
             return false;
         }
+
         commit();
 
-        // DEBUG CHECK: kv.head should be our first cell, kv.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-        // Assume that this is one contiguous block of cells
-        GGML_ASSERT(head + cell_count <= size);
-        GGML_ASSERT(cells[head].pos == batch.pos[0]);
-        GGML_ASSERT(cells[head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-        GGML_ASSERT(cells[head].has_seq_id(dest_seq_id));
-        GGML_ASSERT(cells[head + cell_count - 1].has_seq_id(dest_seq_id));
+        // the paged cache may have placed the cells in several runs, the contiguous one in a single run at head
+        if (!is_paged()) {
+            runs = { { 0, head, cell_count } };
+        }
+
+        // DEBUG CHECK: the first and the last cell of each run hold the expected tokens (verify seq_id and pos values)
+        for (const auto & run : runs) {
+            GGML_ASSERT(run.c0 + run.n <= size);
+            GGML_ASSERT(cells[run.c0].pos == batch.pos[run.i0]);
+            GGML_ASSERT(cells[run.c0 + run.n - 1].pos == batch.pos[run.i0 + run.n - 1]);
+            GGML_ASSERT(cells[run.c0].has_seq_id(dest_seq_id));
+            GGML_ASSERT(cells[run.c0 + run.n - 1].has_seq_id(dest_seq_id));
+        }
     } else {
         // whole KV cache restore
 
@@ -1124,15 +1627,13 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
                 llama_seq_id seq_id;
                 io.read_to(&seq_id, sizeof(seq_id));
 
-                // TODO: llama_kv_cache_unified should have a notion of max sequences
-                //if (seq_id < 0 || (uint32_t) seq_id >= llama_n_seq_max(ctx)) {
-                if (seq_id < 0) {
-                    //LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %u)\n", __func__, seq_id, llama_n_seq_max(ctx));
-                    LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, inf)\n", __func__, seq_id);
+                if (seq_id < 0 || seq_id >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %d)\n", __func__, seq_id, LLAMA_MAX_PARALLEL_SEQUENCES);
                     return false;
                 }
 
-                cell.seq_id.insert(seq_id);
+                cell.seq_id.set(seq_id);
+                seq_cells_add(seq_id, i);
 
                 if (recurrent) {
                     int32_t & tail = cells[seq_id].tail;
@@ -1147,6 +1648,13 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
 
         head = 0;
         used = cell_count;
+
+        runs.clear();
+        if (cell_count > 0) {
+            runs.push_back({ 0, 0, cell_count });
+        }
+
+        blocks_sync(0, size);
     }
 
     if (recurrent) {
@@ -1201,9 +1709,9 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
             return false;
         }
 
-        if (cell_count) {
-            // Read and set the keys for the whole cell range
-            ggml_backend_tensor_set(k_l[il], io.read(cell_count * k_size_row), head * k_size_row, cell_count * k_size_row);
+        // Read and set the keys of each run of cells, one row is one cell
+        for (const auto & run : runs) {
+            ggml_backend_tensor_set(k_l[il], io.read(run.n * k_size_row), run.c0 * k_size_row, run.n * k_size_row);
         }
     }
 
@@ -1229,9 +1737,9 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
                 return false;
             }
 
-            if (cell_count) {
-                // Read and set the values for the whole cell range
-                ggml_backend_tensor_set(v_l[il], io.read(cell_count * v_size_row), head * v_size_row, cell_count * v_size_row);
+            // Read and set the values of each run of cells
+            for (const auto & run : runs) {
+                ggml_backend_tensor_set(v_l[il], io.read(run.n * v_size_row), run.c0 * v_size_row, run.n * v_size_row);
             }
         }
     } else {
@@ -1265,11 +1773,11 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
                 return false;
             }
 
-            if (cell_count) {
-                // For each row in the transposed matrix, read the values for the whole cell range
-                for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                    const size_t dst_offset = (head + j * size) * v_size_el;
-                    ggml_backend_tensor_set(v_l[il], io.read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+            // For each row in the transposed matrix, read the values of each run of cells
+            for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
+                for (const auto & run : runs) {
+                    const size_t dst_offset = (run.c0 + j * size) * v_size_el;
+                    ggml_backend_tensor_set(v_l[il], io.read(run.n * v_size_el), dst_offset, run.n * v_size_el);
                 }
             }
         }
@@ -1336,7 +1844,7 @@ void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache
     int32_t max_contig_idx = -1;
 
     for (int32_t i = 0; i < int32_t(kvu->size); i++, c_curr++, cs_curr += view->n_seq_max) {
-        const size_t curr_size = kv_cells[i].seq_id.size();
+        const size_t curr_size = kv_cells[i].n_seq_id();
         token_count += curr_size;
         c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
 
@@ -1351,13 +1859,12 @@ void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
-            if (seq_idx >= view->n_seq_max) {
-                break;
+        kv_cells[i].for_each_seq_id([&](llama_seq_id it) {
+            if (seq_idx < view->n_seq_max) {
+                cs_curr[seq_idx] = it;
+                seq_idx++;
             }
-            cs_curr[seq_idx] = it;
-            seq_idx++;
-        }
+        });
         if (seq_idx != 0) {
             used_cells++;
         }
@@ -3,11 +3,13 @@
 #include "llama.h"
 #include "llama-io.h"
 #include "llama-memory.h"
+#include "llama-cparams.h"
 
 #include "ggml-cpp.h"
 
+#include <bitset>
 #include <functional>
-#include <set>
+#include <limits>
 #include <vector>
 
 struct llama_cparams;
@@ -49,19 +51,35 @@ struct llama_kv_cell {
     int32_t   src   = -1; // used by recurrent state models to copy states
     int32_t   tail  = -1;
 
-    std::set<llama_seq_id> seq_id;
+    // the sequences of the cell, one bit per sequence id
+    // membership tests need no pointer chasing and the set operations of seq_rm/seq_cp/seq_keep work on whole words
+    std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return id >= 0 && id < LLAMA_MAX_PARALLEL_SEQUENCES && seq_id.test(id);
     }
 
     bool is_empty() const {
-        return seq_id.empty();
+        return seq_id.none();
     }
 
     bool is_same_seq(const llama_kv_cell & other) const {
         return seq_id == other.seq_id;
     }
+
+    uint32_t n_seq_id() const {
+        return seq_id.count();
+    }
+
+    // call f(seq_id) for each sequence of the cell, in increasing order
+    template <typename F>
+    void for_each_seq_id(F && f) const {
+        for (llama_seq_id s = 0; s < LLAMA_MAX_PARALLEL_SEQUENCES; ++s) {
+            if (seq_id.test(s)) {
+                f(s);
+            }
+        }
+    }
 };
 
 // ring-buffer of cached KV data
@@ -84,8 +102,8 @@ public:
     bool init(
             const llama_model & model,   // TODO: do not reference the model
           const llama_cparams & cparams,
-                    ggml_type   type_k,
-                    ggml_type   type_v,
+   const std::vector<ggml_type> & type_k,  // per layer
+   const std::vector<ggml_type> & type_v,
                      uint32_t   kv_size,
                          bool   offload);
 
@@ -132,11 +150,17 @@ public:
 
     struct {
         std::vector<uint32_t> ids;
+
+        uint32_t n_max_moves = 0; // limit of the moves of the next pass, 0 - as many as fit in the graph
+        uint32_t n_moved     = 0; // cells moved by the last pass
     } defrag_info;
 
     // return true if cells have been moved
     bool defrag_prepare(int32_t n_max_nodes);
 
+    // cells attended now and after a full defragmentation with the given padding, and the cells it moves
+    llama_kv_defrag_stats defrag_stats(uint32_t pad) const;
+
     // commit/restore cache
 
     struct slot_range {
@@ -149,6 +173,88 @@ public:
         std::vector<slot_range> ranges;
     } pending;
 
+    // cells [c0, c1) outside of which a sequence has no cells
+    // the ranges can be wider than needed, but never narrower - they bound the loops of the per-sequence
+    // operations and of the KQ mask construction, with recurrent models they always span the whole cache
+    slot_range seq_cells(llama_seq_id seq_id) const;
+
+    // lazy shift
+    //
+    // shifting the tail of a sequence (e.g. the tokens after the kept prefix in a context shift) does not rotate the K
+    // of the shifted cells - the difference is kept as an offset of the sequence, which is added to the positions of its
+    // new tokens for RoPE, and only the cells before the shifted range are rotated. RoPE encodes relative positions, so
+    // the attention is the same as with a full shift, while evicting the context in small steps stays cheap
+    // the cells of a sequence with an offset are never shared with other sequences
+
+    // offset of the positions of the new tokens of the sequence for RoPE
+    llama_pos seq_pos_offs(llama_seq_id seq_id) const;
+
+    bool has_pos_offs() const;
+
+    // rotate the cells of the sequence (at the next update) so that its offset becomes 0, for all sequences if seq_id < 0
+    void seq_pos_offs_apply(llama_seq_id seq_id);
+
+    // paged mode
+    //
+    // the cells are split into blocks of n_block cells, and each block is handed out to one set of sequences
+    // each sequence has a table of the blocks that hold its cells
+    // a block of a shared prefix is referenced by every sequence of the prefix and is read-only: a sequence that
+    // continues past it starts a block of its own (copy-on-write, without a copy since the cells stay shared)
+    // blocks are returned whole when their last cell is freed, so the cache never needs defragmentation
+
+    struct kv_block {
+        std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> seq_id; // sequences with the block in their table
+
+        uint32_t n_fill = 0; // cells [0, n_fill) of the block are handed out
+        uint32_t n_used = 0; // cells of [0, n_fill) still in use, the others can be handed out again
+    };
+
+    // consecutive tokens of the ubatch stored in consecutive cells
+    struct kv_run {
+        uint32_t i0; // first token in the ubatch
+        uint32_t c0; // first cell
+        uint32_t n;
+    };
+
+    uint32_t n_block = 0; // 0 - paged mode disabled
+
+    std::vector<kv_block>              blocks;
+    std::vector<std::vector<uint32_t>> block_tables; // per sequence, in allocation order
+
+    // where find_slot stored the tokens of the ubatch, also where state_read_meta placed the restored cells
+    std::vector<kv_run> runs;
+
+    // the cells the attention of the ubatch gathers instead of attending [0, n), set by gather_prepare
+    std::vector<int32_t> gather;
+
+    bool is_paged() const {
+        return n_block > 0;
+    }
+
+    // gather the blocks of the sequences in the ubatch when they are a small part of the used cache
+    void gather_prepare(const llama_ubatch & ubatch, uint32_t pad);
+
+    // incremental KQ mask
+    //
+    // the KQ mask row of the last token of each sequence is kept, together with the cells that changed since it was
+    // computed (cells that got or lost a sequence, or moved to another position) - as long as the next token of the
+    // sequence does not come before it, only these cells of the row have to be recomputed
+
+    struct kq_mask_row {
+        std::vector<float> data; // one value per cell, sized to n of the last ubatch of the sequence
+
+        llama_pos pos        = -1;                                    // position of the token of the row
+        llama_pos pos_future = std::numeric_limits<llama_pos>::max(); // lower bound of the masked future cells
+
+        slot_range dirty; // cells that changed since the row was computed
+    };
+
+    // false with recurrent models and with LLAMA_KQ_MASK_INCREMENTAL_DISABLE - then every row is computed from scratch
+    bool kq_mask_incremental = false;
+
+    // per sequence, updated while setting the graph inputs - an empty row is computed from scratch
+    mutable std::vector<kq_mask_row> kq_mask_rows;
+
     // state write/load
 
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const;
@@ -166,8 +272,9 @@ public:
     // TODO: remove this and implement llama_kv_cache_recurrent instead
     bool recurrent = false; // with recurrent state models, a cell can hold the state for more than one past token
 
-    bool v_trans   = true;  // the value tensor is transposed
-    bool can_shift = false;
+    bool v_trans    = true;  // the value tensor is transposed
+    bool can_shift  = false;
+    bool lazy_shift = false; // see seq_pos_offs
 
     // Note: The value of head isn't only used to optimize searching
     // for a free KV slot. llama_decode_impl also uses it, so it
@@ -185,12 +292,41 @@ public:
     std::vector<ggml_tensor *> v_l;
 
 private:
-    ggml_type type_k = GGML_TYPE_F16;
-    ggml_type type_v = GGML_TYPE_F16;
-
     std::vector<ggml_context_ptr>        ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
+    // per-sequence cell ranges, see seq_cells()
+    std::vector<slot_range> seq_ranges;
+
+    // per-sequence offsets of the positions for RoPE, see seq_pos_offs()
+    std::vector<llama_pos> pos_offs;
+
+    // extend the range of seq_id to cover cell i
+    void seq_cells_add(llama_seq_id seq_id, uint32_t i);
+
+    // narrow the range of seq_id to its first and last cell
+    void seq_cells_trim(llama_seq_id seq_id);
+
+    void seq_cells_reset();
+
+    bool find_slot_paged(const llama_ubatch & ubatch);
+
+    // hand out the lowest free block to the sequences, returns -1 if the cache is full
+    int32_t block_alloc(const std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> & seq_id);
+
+    // hand out a cell freed in one of the blocks of exactly these sequences (e.g. by a context shift), or -1
+    int32_t block_reuse(const std::vector<uint32_t> & table, const std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> & seq_id);
+
+    // update the sequences and the fill of the blocks of cells [c0, c1) after their cells changed
+    void blocks_sync(uint32_t c0, uint32_t c1);
+
+    void blocks_reset();
+
+    // mark cells [c0, c1) as changed in the kept KQ mask rows
+    void cells_dirty(uint32_t c0, uint32_t c1);
+
+    void kq_mask_rows_reset();
+
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
@@ -13,6 +13,10 @@
 #ifdef __has_include
     #if __has_include(<unistd.h>)
         #include <unistd.h>
+        #if __has_include(<sys/uio.h>)
+            #include <sys/uio.h>
+            #define LLAMA_HAS_WRITEV
+        #endif
         #if defined(_POSIX_MAPPED_FILES)
             #include <sys/mman.h>
             #include <fcntl.h>
@@ -149,6 +153,12 @@ struct llama_file::impl {
         }
     }
 
+    void write_raw_gather(const std::vector<std::pair<const void *, size_t>> & bufs) const {
+        for (const auto & buf : bufs) {
+            write_raw(buf.first, buf.second);
+        }
+    }
+
     void write_u32(uint32_t val) const {
         write_raw(&val, sizeof(val));
     }
@@ -226,6 +236,51 @@ struct llama_file::impl {
         }
     }
 
+#ifdef LLAMA_HAS_WRITEV
+    void write_raw_gather(const std::vector<std::pair<const void *, size_t>> & bufs) const {
+        // the data buffered by the stream goes first
+        if (std::fflush(fp) != 0) {
+            throw std::runtime_error(format("write error: %s", strerror(errno)));
+        }
+
+        const int fd = fileno(fp);
+
+        std::vector<iovec> iov;
+        iov.reserve(bufs.size());
+        for (const auto & buf : bufs) {
+            if (buf.second > 0) {
+                iov.push_back({ const_cast<void *>(buf.first), buf.second });
+            }
+        }
+
+        // at most 1024 buffers per call (IOV_MAX on Linux), partial writes continue where they stopped
+        for (size_t i = 0; i < iov.size(); ) {
+            const int n_iov = (int) std::min<size_t>(iov.size() - i, 1024);
+            const ssize_t ret = writev(fd, iov.data() + i, n_iov);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("write error: %s", strerror(errno)));
+            }
+            size_t n = ret;
+            while (i < iov.size() && n >= iov[i].iov_len) {
+                n -= iov[i++].iov_len;
+            }
+            if (n > 0) {
+                iov[i].iov_base = (char *) iov[i].iov_base + n;
+                iov[i].iov_len -= n;
+            }
+        }
+    }
+#else
+    void write_raw_gather(const std::vector<std::pair<const void *, size_t>> & bufs) const {
+        for (const auto & buf : bufs) {
+            write_raw(buf.first, buf.second);
+        }
+    }
+#endif
+
     void write_u32(uint32_t val) const {
         write_raw(&val, sizeof(val));
     }
@@ -266,6 +321,7 @@ uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
 void llama_file::write_raw(const void * ptr, size_t len) const { pimpl->write_raw(ptr, len); }
 void llama_file::write_u32(uint32_t val) const { pimpl->write_u32(val); }
+void llama_file::write_raw_gather(const std::vector<std::pair<const void *, size_t>> & bufs) const { pimpl->write_raw_gather(bufs); }
 
 // llama_mmap
 
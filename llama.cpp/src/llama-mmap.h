@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <memory>
+#include <utility>
 #include <vector>
 
 struct llama_file;
@@ -29,6 +30,9 @@ struct llama_file {
     void write_raw(const void * ptr, size_t len) const;
     void write_u32(uint32_t val) const;
 
+    // write the buffers in order, without copying them where the platform allows (writev)
+    void write_raw_gather(const std::vector<std::pair<const void *, size_t>> & bufs) const;
+
 private:
     struct impl;
     std::unique_ptr<impl> pimpl;
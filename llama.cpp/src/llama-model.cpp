@@ -4626,7 +4626,7 @@ struct llm_build_llama : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         // For Granite architecture
         if (hparams.f_logit_scale) {
@@ -4790,7 +4790,7 @@ struct llm_build_deci : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         // For Granite architecture
         if (hparams.f_logit_scale) {
@@ -4917,7 +4917,7 @@ struct llm_build_baichuan : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5030,7 +5030,7 @@ struct llm_build_xverse : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5154,7 +5154,7 @@ struct llm_build_falcon : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5311,7 +5311,7 @@ struct llm_build_grok : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         // Grok
         // multiply logits by output_multiplier_scale of 0.5773502691896257
@@ -5443,7 +5443,7 @@ struct llm_build_dbrx : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5552,7 +5552,7 @@ struct llm_build_starcoder : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5651,7 +5651,7 @@ struct llm_build_refact : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -5922,7 +5922,7 @@ struct llm_build_bloom : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6064,7 +6064,7 @@ struct llm_build_mpt : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6216,7 +6216,7 @@ struct llm_build_stablelm : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6332,7 +6332,7 @@ struct llm_build_qwen : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6450,7 +6450,7 @@ struct llm_build_qwen2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6571,7 +6571,7 @@ struct llm_build_qwen2vl : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6730,7 +6730,7 @@ struct llm_build_qwen2moe : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6851,7 +6851,7 @@ struct llm_build_qwen3 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -6979,7 +6979,7 @@ struct llm_build_qwen3moe : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -7106,10 +7106,7 @@ struct llm_build_phi2 : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
-        cb(cur, "result_output_no_bias", -1);
-
-        cur = ggml_add(ctx0, cur, model.output_b);
+        cur = build_lm_head(model.output, cur, model.output_b);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -7255,12 +7252,7 @@ struct llm_build_phi3 : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
-
-        if (model.output_b != nullptr) {
-            cb(cur, "result_output_no_bias", -1);
-            cur = ggml_add(ctx0, cur, model.output_b);
-        }
+        cur = build_lm_head(model.output, cur, model.output_b);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -7375,7 +7367,7 @@ struct llm_build_plamo : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -7485,7 +7477,7 @@ struct llm_build_gpt2 : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -7601,7 +7593,7 @@ struct llm_build_codeshell : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -7728,7 +7720,7 @@ struct llm_build_orion : public llm_graph_context {
     res->t_embd = cur;
 
     // lm_head
-    cur = build_lora_mm(model.output, cur);
+    cur = build_lm_head(model.output, cur);
 
     cb(cur, "result_output", -1);
     res->t_logits = cur;
@@ -7855,7 +7847,7 @@ struct llm_build_internlm2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8068,7 +8060,7 @@ struct llm_build_minicpm3 : public llm_graph_context {
         cb(cur, "lmhead_scaling", -1);
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8184,7 +8176,7 @@ struct llm_build_gemma : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8316,7 +8308,7 @@ struct llm_build_gemma2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         // final logit soft-capping
         cur = ggml_scale(ctx0, cur, 1.0f / hparams.f_final_logit_softcapping);
@@ -8457,7 +8449,7 @@ struct llm_build_gemma3 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8586,7 +8578,7 @@ struct llm_build_starcoder2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8644,7 +8636,7 @@ struct llm_build_mamba : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -8919,7 +8911,7 @@ struct llm_build_command_r : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         if (f_logit_scale) {
             cur = ggml_scale(ctx0, cur, f_logit_scale);
@@ -9049,7 +9041,7 @@ struct llm_build_cohere2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         if (f_logit_scale) {
             cur = ggml_scale(ctx0, cur, f_logit_scale);
@@ -9187,7 +9179,7 @@ struct llm_build_olmo : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -9312,7 +9304,7 @@ struct llm_build_olmo2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -9444,7 +9436,7 @@ struct llm_build_olmoe : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -9573,7 +9565,7 @@ struct llm_build_openelm : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -9721,7 +9713,7 @@ struct llm_build_gptneox : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -9859,7 +9851,7 @@ struct llm_build_arctic : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -10022,7 +10014,7 @@ struct llm_build_deepseek : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -10285,7 +10277,7 @@ struct llm_build_deepseek2 : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -10445,7 +10437,7 @@ struct llm_build_bitnet : public llm_graph_context {
 
         // lm_head
         // FIXME: do not use model.tok_embd directly, duplicate as model.output
-        cur = build_lora_mm(model.tok_embd, cur);
+        cur = build_lm_head(model.tok_embd, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -10717,7 +10709,7 @@ struct llm_build_t5_dec : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -10812,7 +10804,7 @@ struct llm_build_jais : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -10945,7 +10937,7 @@ struct llm_build_chatglm : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -11096,7 +11088,7 @@ struct llm_build_glm4 : public llm_graph_context {
         res->t_embd = cur;
 
         // Output projection
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -11225,7 +11217,7 @@ struct llm_build_nemotron : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -11356,7 +11348,7 @@ struct llm_build_exaone : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -11664,7 +11656,7 @@ struct llm_build_rwkv6 : public llm_build_rwkv6_base {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -11752,7 +11744,7 @@ struct llm_build_rwkv6qwen2 : public llm_build_rwkv6_base {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -12015,7 +12007,7 @@ struct llm_build_rwkv7 : public llm_build_rwkv7_base {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -12104,7 +12096,7 @@ struct llm_build_arwkv7 : public llm_build_rwkv7_base {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -12273,6 +12265,8 @@ struct llm_build_chameleon : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
+        // the image tokens are masked at their positions in the whole vocab, so a subset set with
+        // llama_set_output_tokens is picked after the projection of the whole vocab
         cur = build_lora_mm(model.output, cur);
         cb(cur, "result_output_with_img_logits", -1);
 
@@ -12289,6 +12283,8 @@ struct llm_build_chameleon : public llm_graph_context {
 
         cur = ggml_set_1d(ctx0, cur, img_logits, ggml_element_size(cur) * img_token_start_idx);
 
+        cur = build_lm_head_select(cur);
+
         cb(cur, "result_output", -1);
         res->t_logits = cur;
 
@@ -12611,7 +12607,7 @@ struct llm_build_plm : public llm_graph_context {
         cb(cur, "result_norm", -1);
         res->t_embd = cur;
 
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -12755,7 +12751,7 @@ struct llm_build_bailingmoe : public llm_graph_context {
         res->t_embd = cur;
 
         // lm_head
-        cur = build_lora_mm(model.output, cur);
+        cur = build_lm_head(model.output, cur);
 
         cb(cur, "result_output", -1);
         res->t_logits = cur;
@@ -383,6 +383,8 @@ llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_conte
 
     const int n_vocab = llama_vocab_n_tokens(vocab);
 
+    GGML_ASSERT(llama_n_logits(ctx) == n_vocab && "sampling needs the logits of the whole vocab, see llama_set_output_tokens");
+
     // TODO: do not allocate each time
     std::vector<llama_token_data> cur;
     cur.reserve(n_vocab);
@@ -1,6 +1,7 @@
 #include "llama-impl.h"
 
 #include "llama-chat.h"
+#include "llama-cparams.h"
 #include "llama-mmap.h"
 #include "llama-vocab.h"
 #include "llama-model-loader.h"
@@ -36,6 +37,10 @@ size_t llama_max_devices(void) {
     return 16;
 }
 
+size_t llama_max_parallel_sequences(void) {
+    return LLAMA_MAX_PARALLEL_SEQUENCES;
+}
+
 bool llama_supports_mmap(void) {
     return llama_mmap::SUPPORTED;
 }
@@ -1,8 +1,11 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <random>
 
 #include "get-model.h"
+#include "ggml.h"
+#include "gguf.h"
 
 char * get_model_or_exit(int argc, char *argv[]) {
     char * model_path;
@@ -19,3 +22,92 @@ char * get_model_or_exit(int argc, char *argv[]) {
 
     return model_path;
 }
+
+// writes a model of the architecture llama or chameleon with random F16 weights and the tokenizer of vocab_path
+bool make_random_model(const std::string & arch, const char * vocab_path, const std::string & path) {
+    const int64_t n_embd  = 64;
+    const int64_t n_head  = 4;
+    const int64_t n_ff    = 128;
+    const int     n_layer = 2;
+
+    gguf_init_params vparams = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+    gguf_context * vocab = gguf_init_from_file(vocab_path, vparams);
+    if (vocab == nullptr) {
+        fprintf(stderr, "failed to load the vocab '%s'\n", vocab_path);
+        return false;
+    }
+
+    const int64_t n_vocab = gguf_get_arr_n(vocab, gguf_find_key(vocab, "tokenizer.ggml.tokens"));
+
+    gguf_context * gguf = gguf_init_empty();
+    gguf_set_kv(gguf, vocab);
+    gguf_free(vocab);
+
+    const char * a = arch.c_str();
+    gguf_set_val_str(gguf, "general.architecture", a);
+    gguf_set_val_u32(gguf, (arch + ".context_length").c_str(),                 256);
+    gguf_set_val_u32(gguf, (arch + ".embedding_length").c_str(),               n_embd);
+    gguf_set_val_u32(gguf, (arch + ".block_count").c_str(),                    n_layer);
+    gguf_set_val_u32(gguf, (arch + ".feed_forward_length").c_str(),            n_ff);
+    gguf_set_val_u32(gguf, (arch + ".attention.head_count").c_str(),           n_head);
+    gguf_set_val_u32(gguf, (arch + ".attention.head_count_kv").c_str(),        n_head);
+    gguf_set_val_f32(gguf, (arch + ".attention.layer_norm_rms_epsilon").c_str(), 1e-5f);
+    gguf_set_val_u32(gguf, (arch + ".rope.dimension_count").c_str(),           n_embd/n_head);
+    if (arch == "chameleon") {
+        gguf_set_val_bool(gguf, (arch + ".swin_norm").c_str(), false);
+    }
+
+    const size_t n_elements = 2*n_vocab*n_embd + n_layer*(4*n_embd*n_embd + 3*n_embd*n_ff + 4*n_embd) + n_embd;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ n_elements*sizeof(float) + (11*n_layer + 3)*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 0.2f);
+
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1, bool norm) {
+        const ggml_type type = norm ? GGML_TYPE_F32 : GGML_TYPE_F16;
+
+        ggml_tensor * t = ne1 == 1 ? ggml_new_tensor_1d(ctx, type, ne0) : ggml_new_tensor_2d(ctx, type, ne0, ne1);
+        ggml_set_name(t, name.c_str());
+        for (int64_t i = 0; i < ggml_nelements(t); i++) {
+            if (norm) {
+                ((float *) t->data)[i] = 1.0f;
+            } else {
+                ((ggml_fp16_t *) t->data)[i] = ggml_fp32_to_fp16(dist(rng));
+            }
+        }
+        gguf_add_tensor(gguf, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab, false);
+    add("output_norm.weight", n_embd, 1,       true);
+    add("output.weight",      n_embd, n_vocab, false);
+    for (int il = 0; il < n_layer; il++) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+        add(blk + "attn_norm.weight",   n_embd, 1,      true);
+        add(blk + "attn_q.weight",      n_embd, n_embd, false);
+        add(blk + "attn_k.weight",      n_embd, n_embd, false);
+        add(blk + "attn_v.weight",      n_embd, n_embd, false);
+        add(blk + "attn_output.weight", n_embd, n_embd, false);
+        if (arch == "chameleon") {
+            add(blk + "attn_q_norm.weight", n_embd/n_head, n_head, true);
+            add(blk + "attn_k_norm.weight", n_embd/n_head, n_head, true);
+        }
+        add(blk + "ffn_norm.weight",    n_embd, 1,      true);
+        add(blk + "ffn_gate.weight",    n_embd, n_ff,   false);
+        add(blk + "ffn_down.weight",    n_ff,   n_embd, false);
+        add(blk + "ffn_up.weight",      n_embd, n_ff,   false);
+    }
+
+    const bool ok = gguf_write_to_file(gguf, path.c_str(), false);
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+
+    return ok;
+}
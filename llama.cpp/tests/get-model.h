@@ -1,2 +1,8 @@
 #pragma once
+
+#include <string>
+
 char * get_model_or_exit(int, char*[]);
+
+// writes a model of the architecture llama or chameleon with random F16 weights and the tokenizer of vocab_path
+bool make_random_model(const std::string & arch, const char * vocab_path, const std::string & path);
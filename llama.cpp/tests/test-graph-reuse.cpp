@@ -0,0 +1,143 @@
+// checks that reusing the graph of the previous ubatch does not change the logits: the same sequences are generated
+// with and without LLAMA_GRAPH_REUSE_DISABLE, with a small model of random weights, and the logits must be identical
+//
+// usage: test-graph-reuse <vocab.gguf>
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static void set_env(const char * name, const char * value) {
+#ifdef _WIN32
+    _putenv_s(name, value);
+#else
+    setenv(name, value, 1);
+#endif
+}
+
+// greedy generation of n_seq sequences in lockstep, one token per sequence per decode - the case the graph is reused
+// in - with a rollback of one sequence (the KV head moves back) and a sequence that ends (the ubatch shrinks)
+// returns the logits of all outputs
+static std::vector<float> generate(llama_context * ctx, int32_t n_vocab) {
+    const int n_seq  = 4;
+    const int n_gen  = 48;
+
+    llama_kv_self_clear(ctx);
+
+    std::vector<float> res;
+
+    llama_batch batch = llama_batch_init(256, 0, 1);
+
+    std::vector<llama_pos>   n_past(n_seq, 0);
+    std::vector<llama_token> last  (n_seq, 0);
+    std::vector<bool>        active(n_seq, true);
+
+    auto decode = [&]() {
+        assert(llama_decode(ctx, batch) == 0);
+
+        for (int i = 0; i < batch.n_tokens; i++) {
+            if (!batch.logits[i]) {
+                continue;
+            }
+            const float * logits = llama_get_logits_ith(ctx, i);
+            res.insert(res.end(), logits, logits + n_vocab);
+
+            last[batch.seq_id[i][0]] = std::max_element(logits, logits + n_vocab) - logits;
+        }
+    };
+
+    // prompts of different lengths
+    common_batch_clear(batch);
+    for (int s = 0; s < n_seq; s++) {
+        const int n_prompt = 8 + 5*s;
+        for (int i = 0; i < n_prompt; i++) {
+            common_batch_add(batch, (i*7919 + 13*s + 1) % n_vocab, n_past[s]++, { s }, i + 1 == n_prompt);
+        }
+    }
+    decode();
+
+    for (int k = 0; k < n_gen; k++) {
+        if (k == n_gen/3) {
+            n_past[1] -= 6;
+            assert(llama_kv_self_seq_rm(ctx, 1, n_past[1], -1));
+        }
+        if (k == 2*n_gen/3) {
+            active[3] = false;
+            assert(llama_kv_self_seq_rm(ctx, 3, -1, -1));
+        }
+
+        common_batch_clear(batch);
+        for (int s = 0; s < n_seq; s++) {
+            if (active[s]) {
+                common_batch_add(batch, last[s], n_past[s]++, { s }, true);
+            }
+        }
+        decode();
+    }
+
+    llama_batch_free(batch);
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <vocab.gguf>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const std::string model_path = "test-graph-reuse.gguf";
+    if (!make_random_model("llama", argv[1], model_path)) {
+        return EXIT_FAILURE;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), llama_model_default_params());
+    assert(model != nullptr);
+
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 512;
+    cparams.n_batch   = 256;
+    cparams.n_seq_max = 4;
+
+    // the variable is read when the context is created
+    llama_context * ctx_reuse = llama_init_from_model(model, cparams);
+    set_env("LLAMA_GRAPH_REUSE_DISABLE", "1");
+    llama_context * ctx_build = llama_init_from_model(model, cparams);
+    assert(ctx_reuse != nullptr && ctx_build != nullptr);
+
+    const std::vector<float> logits_reuse = generate(ctx_reuse, n_vocab);
+    const std::vector<float> logits_build = generate(ctx_build, n_vocab);
+
+    int ret = EXIT_SUCCESS;
+
+    assert(logits_reuse.size() == logits_build.size());
+    for (size_t i = 0; i < logits_reuse.size(); i++) {
+        if (logits_reuse[i] != logits_build[i]) {
+            fprintf(stderr, "output %zu, token %zu: %f with graph reuse, %f without\n",
+                    i / n_vocab, i % n_vocab, logits_reuse[i], logits_build[i]);
+            ret = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    llama_free(ctx_reuse);
+    llama_free(ctx_build);
+    llama_model_free(model);
+    llama_backend_free();
+
+    std::remove(model_path.c_str());
+
+    return ret;
+}
@@ -0,0 +1,177 @@
+// checks that the KQ mask rows kept and updated incrementally in the KV cache match the rows built from scratch: the
+// same sequences are generated with and without LLAMA_KQ_MASK_INCREMENTAL_DISABLE, with a small model of random
+// weights, after each of seq_rm, seq_cp and a shift, and the logits must be identical
+//
+// usage: test-kq-mask <vocab.gguf>
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static void set_env(const char * name, const char * value) {
+#ifdef _WIN32
+    _putenv_s(name, value);
+#else
+    setenv(name, value, 1);
+#endif
+}
+
+struct generator {
+    static constexpr int n_seq = 4;
+
+    llama_context * ctx;
+    int32_t         n_vocab;
+
+    llama_batch batch = llama_batch_init(256, 0, 1);
+
+    std::vector<llama_pos>   n_past = std::vector<llama_pos>  (n_seq, 0);
+    std::vector<llama_token> last   = std::vector<llama_token>(n_seq, 0);
+
+    std::vector<float> logits; // of all outputs so far
+
+    generator(llama_context * ctx, int32_t n_vocab) : ctx(ctx), n_vocab(n_vocab) {}
+
+    ~generator() {
+        llama_batch_free(batch);
+    }
+
+    void decode() {
+        assert(llama_decode(ctx, batch) == 0);
+
+        for (int i = 0; i < batch.n_tokens; i++) {
+            if (!batch.logits[i]) {
+                continue;
+            }
+            const float * out = llama_get_logits_ith(ctx, i);
+            logits.insert(logits.end(), out, out + n_vocab);
+
+            last[batch.seq_id[i][0]] = std::max_element(out, out + n_vocab) - out;
+        }
+    }
+
+    // prompts of different lengths
+    void prompt() {
+        common_batch_clear(batch);
+        for (int s = 0; s < n_seq; s++) {
+            const int n_prompt = 12 + 5*s;
+            for (int i = 0; i < n_prompt; i++) {
+                common_batch_add(batch, (i*7919 + 13*s + 1) % n_vocab, n_past[s]++, { s }, i + 1 == n_prompt);
+            }
+        }
+        decode();
+    }
+
+    // greedy generation, one token per sequence per decode - the kept rows are updated from the previous token
+    void generate(int n_gen) {
+        for (int k = 0; k < n_gen; k++) {
+            common_batch_clear(batch);
+            for (int s = 0; s < n_seq; s++) {
+                common_batch_add(batch, last[s], n_past[s]++, { s }, true);
+            }
+            decode();
+        }
+    }
+};
+
+static std::vector<float> run(llama_context * ctx, int32_t n_vocab) {
+    llama_kv_self_clear(ctx);
+
+    generator gen(ctx, n_vocab);
+
+    gen.prompt();
+    gen.generate(8);
+
+    // seq_rm: a hole in the middle of sequence 0, and the tail of sequence 1 (its next token comes before the kept row)
+    assert(llama_kv_self_seq_rm(ctx, 0, 4, 9));
+    assert(llama_kv_self_seq_rm(ctx, 1, gen.n_past[1] - 5, -1));
+    gen.n_past[1] -= 5;
+    gen.generate(8);
+
+    // seq_cp: sequence 2 becomes a copy of sequence 0, and the start of sequence 3 joins sequence 1
+    assert(llama_kv_self_seq_rm(ctx, 2, -1, -1));
+    llama_kv_self_seq_cp(ctx, 0, 2, -1, -1);
+    gen.n_past[2] = gen.n_past[0];
+    gen.last[2]   = gen.last[0];
+    llama_kv_self_seq_cp(ctx, 3, 1, 0, 6);
+    gen.generate(8);
+
+    // seq_cp of cells ahead of the sequence: masked as future tokens first, visible once the sequence has passed them
+    llama_kv_self_seq_cp(ctx, 0, 1, gen.n_past[1] - 8, gen.n_past[1] - 4);
+    llama_kv_self_seq_cp(ctx, 3, 1, gen.n_past[1] + 2, gen.n_past[1] + 4);
+    gen.generate(8);
+
+    // shift: discard the start of sequence 3 and move the rest back, as in a context shift
+    assert(llama_kv_self_seq_rm(ctx, 3, 2, 10));
+    llama_kv_self_seq_add(ctx, 3, 10, gen.n_past[3], -8);
+    gen.n_past[3] -= 8;
+    gen.generate(8);
+
+    // shift ahead: cells from the middle of sequence 0 move past its next tokens - the kept row is not rebuilt, as the
+    // next token does not come before it, so only the changed cells make the moved ones masked until they are passed
+    llama_kv_self_seq_add(ctx, 0, 10, 14, gen.n_past[0] + 4 - 10);
+    gen.generate(12);
+
+    return gen.logits;
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <vocab.gguf>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const std::string model_path = "test-kq-mask.gguf";
+    if (!make_random_model("llama", argv[1], model_path)) {
+        return EXIT_FAILURE;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), llama_model_default_params());
+    assert(model != nullptr);
+
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 512;
+    cparams.n_batch   = 256;
+    cparams.n_seq_max = generator::n_seq;
+
+    // the variable is read when the context is created
+    llama_context * ctx_incr = llama_init_from_model(model, cparams);
+    set_env("LLAMA_KQ_MASK_INCREMENTAL_DISABLE", "1");
+    llama_context * ctx_full = llama_init_from_model(model, cparams);
+    assert(ctx_incr != nullptr && ctx_full != nullptr);
+
+    const std::vector<float> logits_incr = run(ctx_incr, n_vocab);
+    const std::vector<float> logits_full = run(ctx_full, n_vocab);
+
+    int ret = EXIT_SUCCESS;
+
+    assert(logits_incr.size() == logits_full.size());
+    for (size_t i = 0; i < logits_incr.size(); i++) {
+        if (logits_incr[i] != logits_full[i]) {
+            fprintf(stderr, "output %zu, token %zu: %f with the incremental mask, %f with the full one\n",
+                    i / n_vocab, i % n_vocab, logits_incr[i], logits_full[i]);
+            ret = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    llama_free(ctx_incr);
+    llama_free(ctx_full);
+    llama_model_free(model);
+    llama_backend_free();
+
+    std::remove(model_path.c_str());
+
+    return ret;
+}
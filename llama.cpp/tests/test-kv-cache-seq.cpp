@@ -0,0 +1,233 @@
+// checks the sequence operations of the unified KV cache against a reference of the positions of each sequence: random
+// decodes, seq_rm, seq_cp and seq_keep on many sequences - with ids around the words of the bitset of the cells and at
+// its end - must keep the cells, seq_pos_max, the count of used cells and the cell range of each sequence consistent
+//
+// usage: test-kv-cache-seq <vocab.gguf>
+
+#include "llama.h"
+#include "llama-kv-cache.h"
+#include "common.h"
+#include "get-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+static const std::vector<llama_seq_id> seq_ids = { 0, 1, 62, 63, 64, 65, 127, 128, 191, 192, 253, 254, 255 };
+
+// the positions of each sequence
+using reference = std::vector<std::set<llama_pos>>;
+
+static llama_pos ref_pos_max(const reference & ref, llama_seq_id s) {
+    return ref[s].empty() ? -1 : *ref[s].rbegin();
+}
+
+static void ref_rm(reference & ref, llama_seq_id s, llama_pos p0, llama_pos p1) {
+    for (llama_seq_id t = 0; t < (llama_seq_id) ref.size(); t++) {
+        if (s >= 0 && s != t) {
+            continue;
+        }
+        for (auto it = ref[t].begin(); it != ref[t].end(); ) {
+            it = (p0 < 0 || *it >= p0) && (p1 < 0 || *it < p1) ? ref[t].erase(it) : std::next(it);
+        }
+    }
+}
+
+static bool check(const llama_kv_cache_unified & kv, llama_context * ctx, const reference & ref, const char * op) {
+    uint32_t n_used = 0;
+    for (const auto & cell : kv.cells) {
+        n_used += !cell.is_empty();
+    }
+    if (n_used != kv.used || (int32_t) n_used != llama_kv_self_used_cells(ctx)) {
+        fprintf(stderr, "after %s: %u cells in use, counted %u\n", op, n_used, kv.used);
+        return false;
+    }
+
+    for (llama_seq_id s = 0; s < LLAMA_MAX_PARALLEL_SEQUENCES; s++) {
+        const auto range = kv.seq_cells(s);
+
+        std::multiset<llama_pos> pos;
+        for (uint32_t i = 0; i < kv.size; i++) {
+            if (!kv.cells[i].has_seq_id(s)) {
+                continue;
+            }
+            if (i < range.c0 || i >= range.c1) {
+                fprintf(stderr, "after %s: cell %u of sequence %d is outside of its range [%u, %u)\n", op, i, s, range.c0, range.c1);
+                return false;
+            }
+            pos.insert(kv.cells[i].pos);
+        }
+
+        if (pos != std::multiset<llama_pos>(ref[s].begin(), ref[s].end())) {
+            fprintf(stderr, "after %s: sequence %d has %zu cells, expected %zu\n", op, s, pos.size(), ref[s].size());
+            return false;
+        }
+
+        // 0 for an empty sequence
+        const llama_pos pos_max = std::max(ref_pos_max(ref, s), 0);
+        if (llama_kv_self_seq_pos_max(ctx, s) != pos_max) {
+            fprintf(stderr, "after %s: seq_pos_max(%d) = %d, expected %d\n", op, s, llama_kv_self_seq_pos_max(ctx, s), pos_max);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <vocab.gguf>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const std::string model_path = "test-kv-cache-seq.gguf";
+    if (!make_random_model("llama", argv[1], model_path)) {
+        return EXIT_FAILURE;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), llama_model_default_params());
+    assert(model != nullptr);
+
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 512;
+    cparams.n_batch   = 64;
+    cparams.n_seq_max = LLAMA_MAX_PARALLEL_SEQUENCES;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    const auto * kv = dynamic_cast<const llama_kv_cache_unified *>(llama_get_kv_self(ctx));
+    assert(kv != nullptr);
+
+    llama_batch batch = llama_batch_init(64, 0, 2);
+
+    // seq ids past the bitset are rejected
+    common_batch_add(batch, 1, 0, { LLAMA_MAX_PARALLEL_SEQUENCES }, true);
+    assert(llama_decode(ctx, batch) < 0);
+
+    reference ref(LLAMA_MAX_PARALLEL_SEQUENCES);
+
+    std::mt19937 rng(42);
+
+    auto pick = [&]() {
+        return seq_ids[rng() % seq_ids.size()];
+    };
+    auto pick_pos = [&](llama_seq_id s) {
+        return (llama_pos) (rng() % (ref_pos_max(ref, s) + 2));
+    };
+
+    int ret = EXIT_SUCCESS;
+
+    for (int k = 0; k < 300 && ret == EXIT_SUCCESS; k++) {
+        const int op = rng() % 10;
+
+        const char * name = nullptr;
+
+        if (op < 4 && kv->used + 3*8 < kv->size) {
+            name = "decode";
+
+            // up to 8 new tokens for each of up to 3 sequences, the first one shared with another sequence
+            common_batch_clear(batch);
+            for (int n = 1 + rng() % 3; n > 0; n--) {
+                const llama_seq_id s = pick();
+                const llama_seq_id t = pick();
+
+                bool added = false;
+                for (int i = 0; i < batch.n_tokens; i++) {
+                    added = added || batch.seq_id[i][0] == s || batch.seq_id[i][0] == t ||
+                        (batch.n_seq_id[i] > 1 && (batch.seq_id[i][1] == s || batch.seq_id[i][1] == t));
+                }
+                if (added) {
+                    continue;
+                }
+
+                llama_pos pos = std::max(ref_pos_max(ref, s), ref_pos_max(ref, t)) + 1;
+                if (s != t) {
+                    common_batch_add(batch, pos % n_vocab, pos, { s, t }, false);
+                    ref[s].insert(pos);
+                    ref[t].insert(pos);
+                    pos++;
+                }
+                for (int i = rng() % 8; i > 0; i--) {
+                    common_batch_add(batch, pos % n_vocab, pos, { s }, false);
+                    ref[s].insert(pos);
+                    pos++;
+                }
+            }
+            if (batch.n_tokens == 0) {
+                continue;
+            }
+            batch.logits[batch.n_tokens - 1] = true;
+            assert(llama_decode(ctx, batch) == 0);
+        } else if (op < 7) {
+            name = "seq_rm";
+
+            // a range, a tail, or all of a sequence - and rarely a range of all sequences
+            const llama_seq_id s  = rng() % 16 == 0 ? -1 : pick();
+            const llama_pos    p0 = s < 0 || rng() % 4 == 0 ? -1 : pick_pos(s);
+            const llama_pos    p1 = s < 0 ? 8 : rng() % 2 == 0 ? -1 : p0 + 1 + rng() % 8;
+
+            assert(llama_kv_self_seq_rm(ctx, s, p0, p1));
+            ref_rm(ref, s, p0, p1);
+        } else if (op < 9) {
+            name = "seq_cp";
+
+            const llama_seq_id src = pick();
+            const llama_seq_id dst = pick();
+            if (src == dst) {
+                continue;
+            }
+            const llama_pos p0 = rng() % 4 == 0 ? -1 : pick_pos(src);
+            const llama_pos p1 = rng() % 2 == 0 ? -1 : std::max(p0, 0) + 1 + rng() % 16;
+
+            // the positions of dst in the range are replaced
+            assert(llama_kv_self_seq_rm(ctx, dst, p0, p1));
+            ref_rm(ref, dst, p0, p1);
+
+            llama_kv_self_seq_cp(ctx, src, dst, p0, p1);
+            for (const llama_pos p : ref[src]) {
+                if ((p0 < 0 || p >= p0) && (p1 < 0 || p < p1)) {
+                    ref[dst].insert(p);
+                }
+            }
+        } else if (rng() % 4 == 0) {
+            name = "seq_keep";
+
+            const llama_seq_id s = pick();
+
+            llama_kv_self_seq_keep(ctx, s);
+            for (llama_seq_id t = 0; t < (llama_seq_id) ref.size(); t++) {
+                if (t != s) {
+                    ref[t].clear();
+                }
+            }
+        } else {
+            continue;
+        }
+
+        if (!check(*kv, ctx, ref, name)) {
+            fprintf(stderr, "step %d\n", k);
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    llama_batch_free(batch);
+
+    llama_free(ctx);
+    llama_model_free(model);
+    llama_backend_free();
+
+    std::remove(model_path.c_str());
+
+    return ret;
+}
@@ -0,0 +1,269 @@
+// checks that llama_kv_compress round trips and rejects damaged input, and measures its ratio and speed on f16 data
+// with a vocab, also checks the files of llama_state_seq_save_file with a small model of random weights
+//
+// usage: test-kv-compress [vocab.gguf]
+
+#include "llama-compress.h"
+#include "llama.h"
+#include "ggml.h"
+#include "get-model.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// f16 values with a spread similar to the K and V of a KV cache
+static std::vector<uint8_t> random_f16(std::mt19937 & rng, size_t n_bytes) {
+    std::normal_distribution<float> dist(0.0f, 2.0f);
+
+    std::vector<uint8_t> data(n_bytes);
+    for (size_t i = 0; i + 1 < n_bytes; i += 2) {
+        const ggml_fp16_t v = ggml_fp32_to_fp16(dist(rng));
+        memcpy(data.data() + i, &v, sizeof(v));
+    }
+    return data;
+}
+
+static std::vector<uint8_t> random_bytes(std::mt19937 & rng, size_t n_bytes) {
+    std::vector<uint8_t> data(n_bytes);
+    for (auto & b : data) {
+        b = rng() & 0xff;
+    }
+    return data;
+}
+
+static void test_round_trip(const std::vector<uint8_t> & data) {
+    const std::vector<uint8_t> packed = llama_kv_compress(data.data(), data.size());
+
+    std::vector<uint8_t> unpacked;
+    assert(llama_kv_decompress(packed.data(), packed.size(), unpacked));
+    assert(unpacked == data);
+
+    // truncated input
+    if (!packed.empty()) {
+        assert(!llama_kv_decompress(packed.data(), packed.size() - 1, unpacked));
+    }
+}
+
+static std::vector<uint8_t> read_file(const std::string & path) {
+    std::vector<uint8_t> data;
+
+    FILE * f = fopen(path.c_str(), "rb");
+    assert(f != nullptr);
+    uint8_t buf[4096];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0; ) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(f);
+
+    return data;
+}
+
+static void write_file(const std::string & path, const std::vector<uint8_t> & data) {
+    FILE * f = fopen(path.c_str(), "wb");
+    assert(f != nullptr);
+    assert(fwrite(data.data(), 1, data.size(), f) == data.size());
+    fclose(f);
+}
+
+// decodes the tokens in sequence 0 from position pos0, returns the logits of the last one
+static std::vector<float> decode(llama_context * ctx, const std::vector<llama_token> & tokens, llama_pos pos0) {
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        batch.token   [i]    = tokens[i];
+        batch.pos     [i]    = pos0 + i;
+        batch.n_seq_id[i]    = 1;
+        batch.seq_id  [i][0] = 0;
+        batch.logits  [i]    = i + 1 == tokens.size();
+    }
+    batch.n_tokens = tokens.size();
+
+    assert(llama_decode(ctx, batch) == 0);
+
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    std::vector<float> res(logits, logits + llama_n_logits(ctx));
+
+    llama_batch_free(batch);
+
+    return res;
+}
+
+// a sequence saved to a file, packed or compressed, loads back, a damaged file or one with trailing data is rejected,
+// and a file of the format before the packed one still loads
+static void test_state_seq_file(const char * vocab_path) {
+    const std::string model_path = "test-kv-compress.gguf";
+    assert(make_random_model("llama", vocab_path, model_path));
+
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), llama_model_default_params());
+    assert(model != nullptr);
+
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx   = 256;
+    cparams.n_batch = 256;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    std::vector<llama_token> prompt;
+    for (int i = 0; i < 64; i++) {
+        prompt.push_back((i*7919 + 13) % n_vocab);
+    }
+    const std::vector<llama_token> next = { 42 % n_vocab };
+
+    // the logits of the token after the prompt
+    decode(ctx, prompt, 0);
+    const std::vector<float> ref = decode(ctx, next, prompt.size());
+    assert(llama_kv_self_seq_rm(ctx, 0, prompt.size(), -1));
+
+    const std::string path_packed     = "test-kv-compress-packed.bin";
+    const std::string path_compressed = "test-kv-compress-compressed.bin";
+    const std::string path_unpacked   = "test-kv-compress-unpacked.bin";
+
+    assert(llama_state_seq_save_file(ctx, path_packed.c_str(), 0, prompt.data(), prompt.size()) > 0);
+    assert(llama_state_seq_save_file_ext(ctx, path_compressed.c_str(), 0, prompt.data(), prompt.size(), LLAMA_STATE_SEQ_FLAGS_COMPRESS) > 0);
+    assert(read_file(path_compressed).size() < read_file(path_packed).size());
+
+    // the file of version 2: the header and the prompt, followed by the state as llama_state_seq_get_data writes it
+    {
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, 0));
+        assert(llama_state_seq_get_data(ctx, state.data(), state.size(), 0) == state.size());
+
+        std::vector<uint8_t> data;
+        auto append = [&](const void * src, size_t size) {
+            data.insert(data.end(), (const uint8_t *) src, (const uint8_t *) src + size);
+        };
+        const uint32_t magic    = LLAMA_STATE_SEQ_MAGIC;
+        const uint32_t version  = 2;
+        const uint32_t n_prompt = prompt.size();
+        append(&magic,        sizeof(magic));
+        append(&version,      sizeof(version));
+        append(&n_prompt,     sizeof(n_prompt));
+        append(prompt.data(), prompt.size()*sizeof(llama_token));
+        append(state.data(),  state.size());
+        write_file(path_unpacked, data);
+    }
+
+    // loads the file into an empty cache, returns the logits of the token after the prompt, or nothing if it fails
+    auto load = [&](const std::string & path) {
+        llama_kv_self_clear(ctx);
+
+        std::vector<llama_token> tokens(prompt.size());
+        size_t n_tokens = 0;
+        if (llama_state_seq_load_file(ctx, path.c_str(), 0, tokens.data(), tokens.size(), &n_tokens) == 0) {
+            return std::vector<float>();
+        }
+        assert(n_tokens == prompt.size() && tokens == prompt);
+
+        return decode(ctx, next, prompt.size());
+    };
+
+    assert(load(path_packed)     == ref);
+    assert(load(path_compressed) == ref);
+    assert(load(path_unpacked)   == ref);
+
+    for (const std::string & path : { path_packed, path_compressed }) {
+        const std::vector<uint8_t> data = read_file(path);
+
+        // a flipped byte in the state fails its checksum (or the decompression)
+        std::vector<uint8_t> bad = data;
+        bad.back() ^= 0x10;
+        write_file(path, bad);
+        assert(load(path).empty());
+
+        // trailing data is rejected
+        bad = data;
+        bad.push_back(0);
+        write_file(path, bad);
+        assert(load(path).empty());
+
+        write_file(path, data);
+        assert(load(path) == ref);
+    }
+
+    llama_free(ctx);
+    llama_model_free(model);
+
+    for (const std::string & path : { model_path, path_packed, path_compressed, path_unpacked }) {
+        std::remove(path.c_str());
+    }
+}
+
+int main(int argc, char ** argv) {
+    std::mt19937 rng(42);
+
+    for (size_t n : { 0, 1, 2, 3, 255, 4096, 4097, (1 << 18) - 1, 1 << 18, (1 << 18) + 1, 3 << 19 }) {
+        test_round_trip(random_f16(rng, n));
+        test_round_trip(random_bytes(rng, n));
+        test_round_trip(std::vector<uint8_t>(n, 0x3c));
+    }
+
+    // a single distinct value in one plane, many in the other
+    {
+        std::vector<uint8_t> data = random_bytes(rng, 10000);
+        for (size_t i = 0; i < data.size(); i += 2) {
+            data[i] = 7;
+        }
+        test_round_trip(data);
+    }
+
+    // damaged input is rejected, or at least decoded to the right size
+    {
+        const std::vector<uint8_t> data   = random_f16(rng, 100000);
+        const std::vector<uint8_t> packed = llama_kv_compress(data.data(), data.size());
+
+        std::vector<uint8_t> unpacked;
+
+        std::vector<uint8_t> bad = packed;
+        bad[0] ^= 1;
+        assert(!llama_kv_decompress(bad.data(), bad.size(), unpacked));
+
+        for (int i = 0; i < 100; i++) {
+            bad = packed;
+            bad[rng() % bad.size()] ^= 1 << (rng() % 8);
+            if (llama_kv_decompress(bad.data(), bad.size(), unpacked)) {
+                assert(unpacked.size() == data.size());
+            }
+        }
+    }
+
+    if (argc > 1) {
+        llama_backend_init();
+        test_state_seq_file(argv[1]);
+        llama_backend_free();
+    }
+
+    // ratio and speed on f16 data
+    const size_t n_bytes = 64u << 20;
+    const int    n_iter  = 3;
+
+    const std::vector<uint8_t> data = random_f16(rng, n_bytes);
+
+    std::vector<uint8_t> packed;
+    std::vector<uint8_t> unpacked;
+
+    const auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_iter; i++) {
+        packed = llama_kv_compress(data.data(), data.size());
+    }
+    const auto t1 = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_iter; i++) {
+        assert(llama_kv_decompress(packed.data(), packed.size(), unpacked));
+    }
+    const auto t2 = std::chrono::steady_clock::now();
+
+    const double t_compress   = std::chrono::duration<double>(t1 - t0).count() / n_iter;
+    const double t_decompress = std::chrono::duration<double>(t2 - t1).count() / n_iter;
+
+    printf("f16: %zu MiB -> %.1f MiB (%.1f%%), compress %.0f MiB/s, decompress %.0f MiB/s\n",
+            n_bytes >> 20, packed.size()/1024.0/1024.0, 100.0*packed.size()/n_bytes,
+            (n_bytes >> 20)/t_compress, (n_bytes >> 20)/t_decompress);
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+// checks that the logits computed for a subset of the vocab (llama_set_output_tokens) match the logits of the same
+// tokens computed for the whole vocab
+//
+// usage: test-output-tokens <model.gguf>
+//        test-output-tokens --random <arch> <vocab.gguf> - with a small model of random weights
+
+#include "llama.h"
+#include "get-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static std::vector<float> decode(llama_context * ctx, const std::vector<llama_token> & prompt, int32_t n_out) {
+    llama_kv_self_clear(ctx);
+
+    llama_batch batch = llama_batch_init(prompt.size(), 0, 1);
+    for (size_t i = 0; i < prompt.size(); i++) {
+        batch.token   [i]    = prompt[i];
+        batch.pos     [i]    = i;
+        batch.n_seq_id[i]    = 1;
+        batch.seq_id  [i][0] = 0;
+        batch.logits  [i]    = i % 3 == 0 || i + 1 == prompt.size();
+    }
+    batch.n_tokens = prompt.size();
+
+    assert(llama_decode(ctx, batch) == 0);
+    assert(llama_n_logits(ctx) == n_out);
+
+    std::vector<float> res;
+    for (size_t i = 0; i < prompt.size(); i++) {
+        if (batch.logits[i]) {
+            const float * logits = llama_get_logits_ith(ctx, i);
+            res.insert(res.end(), logits, logits + n_out);
+        }
+    }
+
+    llama_batch_free(batch);
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    std::string model_path;
+    std::string model_random;
+
+    if (argc == 4 && strcmp(argv[1], "--random") == 0) {
+        model_random = std::string("test-output-tokens-") + argv[2] + ".gguf";
+        if (!make_random_model(argv[2], argv[3], model_random)) {
+            return EXIT_FAILURE;
+        }
+        model_path = model_random;
+    } else {
+        model_path = get_model_or_exit(argc, argv);
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), llama_model_default_params());
+    if (model == nullptr) {
+        fprintf(stderr, "failed to load '%s'\n", model_path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx   = 256;
+    cparams.n_batch = 256;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    std::vector<llama_token> prompt;
+    for (int i = 0; i < 32; i++) {
+        prompt.push_back((i*7919 + 13) % n_vocab);
+    }
+
+    const std::vector<llama_token> subset = { n_vocab - 1, 0, 42 % n_vocab, (n_vocab/2), 42 % n_vocab };
+
+    const std::vector<float> full = decode(ctx, prompt, n_vocab);
+
+    assert(llama_set_output_tokens(ctx, subset.data(), subset.size()));
+
+    // twice, the second time with the graph of the first one
+    for (int k = 0; k < 2; k++) {
+        const std::vector<float> part = decode(ctx, prompt, subset.size());
+
+        const size_t n_outputs = full.size() / n_vocab;
+        assert(part.size() == n_outputs*subset.size());
+
+        for (size_t i = 0; i < n_outputs; i++) {
+            // with quantized weights, the whole vocab is multiplied with quantized activations, while the gathered
+            // rows are dequantized and multiplied in F32 - the error scales with the largest logits
+            // logits set to -FLT_MAX are masked tokens (e.g. the image tokens of chameleon) and must match exactly
+            float scale = 1.0f;
+            for (int32_t t = 0; t < n_vocab; t++) {
+                if (full[i*n_vocab + t] != -FLT_MAX) {
+                    scale = std::max(scale, std::fabs(full[i*n_vocab + t]));
+                }
+            }
+
+            for (size_t j = 0; j < subset.size(); j++) {
+                const float a = full[i*n_vocab + subset[j]];
+                const float b = part[i*subset.size() + j];
+                if ((a == -FLT_MAX) != (b == -FLT_MAX) || std::fabs(a - b) > 2e-2f*scale) {
+                    fprintf(stderr, "output %zu, token %d: %f != %f\n", i, subset[j], a, b);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    // invalid tokens are rejected and leave the subset as it is
+    const llama_token bad = n_vocab;
+    assert(!llama_set_output_tokens(ctx, &bad, 1));
+    const std::vector<float> part = decode(ctx, prompt, subset.size());
+    assert(part.size() == full.size() / n_vocab * subset.size());
+
+    // the state holds the narrowed logits
+    std::vector<uint8_t> state(llama_state_get_size(ctx));
+    assert(llama_state_get_data(ctx, state.data(), state.size()) == state.size());
+
+    // back to the whole vocab
+    assert(llama_set_output_tokens(ctx, nullptr, 0));
+    assert(decode(ctx, prompt, n_vocab) == full);
+
+    // the state can only be loaded with logits of the same width
+    assert(llama_state_set_data(ctx, state.data(), state.size()) == 0);
+
+    assert(llama_set_output_tokens(ctx, subset.data(), subset.size()));
+    assert(llama_state_set_data(ctx, state.data(), state.size()) == state.size());
+    {
+        const float * logits = llama_get_logits_ith(ctx, -1);
+        assert(std::equal(logits, logits + subset.size(), part.end() - subset.size()));
+    }
+    assert(llama_set_output_tokens(ctx, nullptr, 0));
+
+    llama_free(ctx);
+    llama_model_free(model);
+    llama_backend_free();
+
+    if (!model_random.empty()) {
+        std::remove(model_random.c_str());
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+// checks common_top_n_probs against a full sort of the vocab and measures the per-token cost of both as n_probs varies
+
+#include "llama.h"
+#include "sampling.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// the previous implementation of the server: sort the whole vocab and normalize it
+static std::vector<llama_token_data> top_n_probs_sort(const float * logits, int32_t n_vocab, int32_t n) {
+    std::vector<llama_token_data> cur(n_vocab);
+    for (llama_token i = 0; i < n_vocab; i++) {
+        cur[i] = llama_token_data{i, logits[i], 0.0f};
+    }
+
+    std::sort(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    const float max_l = cur[0].logit;
+    float cum_sum = 0.0f;
+    for (auto & c : cur) {
+        c.p = expf(c.logit - max_l);
+        cum_sum += c.p;
+    }
+    for (auto & c : cur) {
+        c.p /= cum_sum;
+    }
+
+    cur.resize(n);
+    return cur;
+}
+
+static std::vector<float> random_logits(std::mt19937 & rng, int32_t n_vocab) {
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    std::vector<float> logits(n_vocab);
+    for (auto & l : logits) {
+        l = dist(rng);
+    }
+    return logits;
+}
+
+static void test_correctness(std::mt19937 & rng, int32_t n_vocab, int32_t n) {
+    const std::vector<float> logits = random_logits(rng, n_vocab);
+
+    const auto expected = top_n_probs_sort(logits.data(), n_vocab, std::min(n, n_vocab));
+
+    const llama_token id = expected.empty() ? n_vocab / 2 : expected.back().id;
+
+    float p_id = -1.0f;
+    const auto actual = common_top_n_probs(logits.data(), n_vocab, n, id, &p_id);
+
+    assert(actual.size() == expected.size());
+    for (size_t i = 0; i < actual.size(); i++) {
+        // the logits are random floats, so ties are practically impossible
+        assert(actual[i].id == expected[i].id);
+        assert(std::fabs(actual[i].p - expected[i].p) <= 1e-3f * expected[i].p);
+    }
+    assert(p_id >= 0.0f && p_id <= 1.0f);
+    if (!expected.empty()) {
+        assert(std::fabs(p_id - expected.back().p) <= 1e-3f * p_id);
+    }
+}
+
+template <typename F>
+static double time_us_per_token(int n_iter, F && f) {
+    const auto t_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_iter; i++) {
+        f();
+    }
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t_start).count() / n_iter;
+}
+
+int main(void) {
+    std::mt19937 rng(42);
+
+    for (int32_t n_vocab : { 1, 7, 32000, 151936 }) {
+        for (int32_t n : { 0, 1, 5, 20, 100, 1000 }) {
+            test_correctness(rng, n_vocab, n);
+        }
+    }
+
+    // equal logits
+    {
+        const std::vector<float> logits = { 1.0f, 3.0f, 3.0f, 2.0f };
+        const auto top = common_top_n_probs(logits.data(), logits.size(), 2);
+        assert(top.size() == 2 && top[0].id + top[1].id == 3);
+        assert(std::fabs(top[0].p - top[1].p) < 1e-7f);
+    }
+
+    // per-token overhead with a large vocab
+    const int32_t n_vocab = 151936;
+    const int     n_iter  = 20;
+
+    const std::vector<float> logits = random_logits(rng, n_vocab);
+
+    printf("n_vocab = %d\n", n_vocab);
+    printf("%8s %14s %14s %8s\n", "n_probs", "sort [us]", "top-n [us]", "speedup");
+
+    for (int32_t n : { 1, 5, 10, 20, 50, 100 }) {
+        float sink = 0.0f;
+
+        const double t_sort = time_us_per_token(n_iter, [&]() {
+            sink += top_n_probs_sort(logits.data(), n_vocab, n)[0].p;
+        });
+        const double t_top_n = time_us_per_token(n_iter, [&]() {
+            sink += common_top_n_probs(logits.data(), n_vocab, n)[0].p;
+        });
+
+        printf("%8d %14.1f %14.1f %7.1fx\n", n, t_sort, t_top_n, t_sort / t_top_n);
+
+        assert(sink > 0.0f);
+    }
+
+    return 0;
+}
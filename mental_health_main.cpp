@@ -5,12 +5,35 @@
 #include <cmath>
 #include <stdexcept> // Für std::runtime_error
 #include <cstring>   // Für strcpy (zum Kopieren von Strings)
+#include <algorithm> // Für std::fill und std::copy
+#include <atomic>    // Für die lock-freie Queue der Async-API
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+
+#ifndef _WIN32
+#include <fcntl.h>   // Für nicht-blockierende Pipes
+#include <unistd.h>  // Für read/write/close auf dem Benachrichtigungs-Deskriptor
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 // Externe Bibliothek für JSON
 // Du musst sicherstellen, dass 'json.hpp' im selben Verzeichnis liegt
 // oder in einem vom Compiler gefundenen Include-Pfad.
 #include "json.hpp"
 
+// Such-Index mit Scoring-Kernels (float32, optional FP16/BF16 über ggml).
+#include "quote_index.h"
+// String-Arena mit Interning für die Zitat-Metadaten.
+#include "string_arena.h"
+// Zitat-Korpus, Snapshot-Dateien (mmap) und Index-Verzeichnis mit MANIFEST.
+#include "quote_snapshot.h"
+
 // Makro für den Export von Funktionen aus der dynamischen Bibliothek.
 // Ermöglicht es anderen Programmen (wie Python über ctypes), diese Funktionen aufzurufen.
 #ifdef _WIN32
@@ -26,79 +49,203 @@ using namespace std;
 
 // --- Datenstrukturen und Globale Variablen ---
 
-// Struktur zum Speichern der Details eines Zitats und seines Embeddings.
-struct QuoteData {
-    string quote;
-    string author;
-    string book;
-    vector<float> embedding;
-};
+// Der aktuelle Zitat-Korpus (Zitate, Metadaten und Index, siehe quote_snapshot.h).
+// Er wird nur einmal geladen und danach nur noch gelesen. Bei einem
+// Index-Verzeichnis wird er ersetzt, sobald das MANIFEST auf einen neuen Snapshot
+// zeigt: Zugriffe laufen über atomic_load/atomic_store, jede Suche hält ihren
+// Korpus per shared_ptr fest, sodass laufende Suchen den alten Korpus zu Ende
+// benutzen, während neue schon den neuen sehen (kein Neustart, keine Pause).
+shared_ptr<const QuoteCorpus> current_corpus;
+// Speicherformat der Embeddings beim Laden aus JSON (siehe 'set_embedding_storage').
+// Snapshots bringen ihr Format selbst mit.
+EmbeddingType embedding_storage = EmbeddingType::F32;
+// Pfad, aus dem geladen wurde (JSON-Datei oder Index-Verzeichnis).
+string corpus_path;
+bool corpus_from_index_dir = false;
+// Serialisiert das Laden; beim Nachladen wird nur try_lock benutzt, damit
+// Suchen nie auf einen laufenden Ladevorgang warten.
+mutex corpus_load_mutex;
+// Frühester Zeitpunkt (steady_clock, ms) für die nächste Prüfung des MANIFEST.
+atomic<long long> next_manifest_check_ms{0};
+// Abstand zwischen zwei Prüfungen des MANIFEST.
+const long long MANIFEST_CHECK_INTERVAL_MS = 1000;
 
-// Eine globale Liste, die alle Zitate und ihre Embeddings im Speicher hält.
-// Sie wird nur einmal geladen, um die Performance zu optimieren.
-vector<QuoteData> all_quotes;
-// Ein Flag, das anzeigt, ob die Zitate bereits in 'all_quotes' geladen wurden.
-bool quotes_loaded = false;
+// --- Funktionen für die Bibliotheks-Schnittstelle ---
 
-// --- Cosine Similarity Funktion ---
+// Lädt einen Korpus aus einer JSON-Datei oder aus dem aktuellen Snapshot eines
+// Index-Verzeichnisses. Fehler werden ausgegeben.
+bool load_corpus(const string& path, QuoteCorpus& corpus) {
+    string error;
+    if (!is_index_dir(path)) {
+        // 'set_embedding_storage' nimmt nur Formate an, für die es einen Kernel gibt.
+        if (!load_corpus_from_json(path, embedding_storage, corpus, &error)) {
+            cerr << "C++: Fehler: " << error << endl;
+            return false;
+        }
+        return true;
+    }
 
-// Diese Funktion bleibt unverändert, da sie bereits korrekt implementiert ist.
-float cosine_similarity(const vector<float>& a, const vector<float>& b) {
-    float dot = 0.0, normA = 0.0, normB = 0.0;
-    for (size_t i = 0; i < a.size(); i++) {
-        dot += a[i] * b[i];
-        normA += a[i] * a[i];
-        normB += b[i] * b[i];
+    IndexManifest manifest;
+    if (!read_manifest(path, manifest, &error) ||
+        !load_snapshot((filesystem::path(path) / manifest.current.file).string(), corpus, &error)) {
+        cerr << "C++: Fehler: " << error << endl;
+        return false;
     }
-    // Kleiner Wert (1e-10) im Nenner, um Division durch Null zu verhindern,
-    // falls Vektornormen sehr klein oder Null sind.
-    return dot / (sqrt(normA) * sqrt(normB) + 1e-10);
+    // Der Dateiname enthält zwar schon die Prüfsumme, aber erst der Vergleich mit
+    // dem MANIFEST stellt sicher, dass genau der veröffentlichte Snapshot geladen wurde.
+    if (corpus.checksum != manifest.current.checksum) {
+        cerr << "C++: Fehler: Snapshot '" << manifest.current.file << "' passt nicht zur Pruefsumme im MANIFEST." << endl;
+        return false;
+    }
+    return true;
 }
 
-// --- Funktionen für die Bibliotheks-Schnittstelle ---
+// Gibt die Kennzahlen eines geladenen Korpus aus.
+void log_corpus(const char* action, const QuoteCorpus& corpus) {
+    cout << "C++: " << action << " " << corpus.quotes.size() << " Zitate (Dimension " << corpus.index.dim
+         << ", " << embedding_type_name(corpus.index.type) << ", Kernel "
+         << score_kernel_name(corpus.index.dim, corpus.index.type) << ", " << corpus.strings.size()
+         << " Bytes Metadaten";
+    if (corpus.checksum != 0) {
+        cout << ", Snapshot " << checksum_hex(corpus.checksum);
+    }
+    cout << ")." << endl;
+}
 
-// Funktion, die die Zitate aus einer JSON-Datei lädt.
-// Sie wird nur einmal aufgerufen, wenn die Bibliothek das erste Mal verwendet wird.
-bool load_quotes_from_json(const char* filename) {
-    if (quotes_loaded) {
+// Funktion, die die Zitate aus einer JSON-Datei oder einem Index-Verzeichnis lädt.
+// Sie lädt nur beim ersten Aufruf wirklich. Danach kehrt sie ohne Lock zurück,
+// sonst würde jede Suche auf ein laufendes 'quote_reload' warten.
+bool load_quotes(const char* path) {
+    if (atomic_load(&current_corpus) != nullptr) {
         return true; // Zitate sind bereits geladen, es ist nichts zu tun.
     }
-    try {
-        ifstream quotes_file(filename);
-        if (!quotes_file.is_open()) {
-            // Fehlermeldung, wenn die Datei nicht gefunden oder geöffnet werden kann.
-            cerr << "C++: Fehler: Zitatendatei '" << filename << "' konnte nicht geoeffnet werden." << endl;
-            return false;
-        }
-        json quotes_json;
-        quotes_file >> quotes_json; // JSON-Daten aus der Datei in das 'quotes_json'-Objekt lesen.
+    lock_guard<mutex> lock(corpus_load_mutex);
+    if (atomic_load(&current_corpus) != nullptr) {
+        return true; // Ein anderer Thread hat inzwischen geladen.
+    }
+    auto corpus = make_shared<QuoteCorpus>();
+    if (!load_corpus(path, *corpus)) {
+        return false;
+    }
+    corpus_path = path;
+    corpus_from_index_dir = is_index_dir(path);
+    log_corpus("Erfolgreich", *corpus);
+    atomic_store(&current_corpus, shared_ptr<const QuoteCorpus>(std::move(corpus)));
+    return true;
+}
 
-        // Überprüfen, ob das gelesene JSON ein Array ist (wie erwartet).
-        if (!quotes_json.is_array()) {
-            cerr << "C++: Fehler: Zitatendatei ist kein JSON-Array. Erwartet wurde eine Liste von Zitaten." << endl;
-            return false;
+// Prüft, ob das MANIFEST auf einen anderen Snapshot zeigt, und lädt ihn dann.
+// Der neue Korpus ersetzt den alten erst, wenn er vollständig geladen und
+// geprüft ist; bei Fehlern bleibt der alte aktiv.
+// Rückgabe: 1 = ausgetauscht, 0 = unverändert (oder gerade von einem anderen
+// Thread geladen), -1 = Fehler.
+int reload_if_changed(bool wait_for_lock) {
+    if (!corpus_from_index_dir) {
+        return 0;
+    }
+    unique_lock<mutex> lock(corpus_load_mutex, defer_lock);
+    if (wait_for_lock) {
+        lock.lock();
+    } else if (!lock.try_lock()) {
+        return 0;
+    }
+    shared_ptr<const QuoteCorpus> active = atomic_load(&current_corpus);
+    IndexManifest manifest;
+    string error;
+    if (!read_manifest(corpus_path, manifest, &error)) {
+        cerr << "C++: Fehler: " << error << endl;
+        return -1;
+    }
+    if (active != nullptr && manifest.current.checksum == active->checksum) {
+        return 0;
+    }
+    auto corpus = make_shared<QuoteCorpus>();
+    if (!load_corpus(corpus_path, *corpus)) {
+        return -1;
+    }
+    log_corpus("Snapshot gewechselt:", *corpus);
+    atomic_store(&current_corpus, shared_ptr<const QuoteCorpus>(std::move(corpus)));
+    return 1;
+}
+
+// Liefert den aktuellen Korpus (nullptr, wenn noch nichts geladen ist). Bei einem
+// Index-Verzeichnis wird höchstens einmal pro MANIFEST_CHECK_INTERVAL_MS geprüft,
+// ob ein neuer Snapshot veröffentlicht wurde.
+shared_ptr<const QuoteCorpus> acquire_corpus() {
+    if (corpus_from_index_dir) {
+        long long now = chrono::duration_cast<chrono::milliseconds>(
+                            chrono::steady_clock::now().time_since_epoch()).count();
+        long long due = next_manifest_check_ms.load();
+        if (now >= due && next_manifest_check_ms.compare_exchange_strong(due, now + MANIFEST_CHECK_INTERVAL_MS)) {
+            reload_if_changed(false);
         }
+    }
+    return atomic_load(&current_corpus);
+}
+
+// Sucht das passendste Zitat für ein User-Embedding und formatiert das Ergebnis.
+// Der Korpus wird nach dem Laden nur noch gelesen, daher kann diese Funktion aus
+// mehreren Threads gleichzeitig aufgerufen werden (siehe Async-API weiter unten).
+string search_best_quote(const QuoteCorpus& corpus, const float* user_embedding_arr, int embedding_dim) {
+    float best_score = -1.0;
+    string best_quote_str = "Kein passendes Zitat gefunden."; // Standardmeldung
+    string best_author_str = "";
+    string best_book_str = "";
 
-        // Iteriere über jedes JSON-Objekt (Zitat) im Array.
-        for (const auto& item : quotes_json) {
-            QuoteData qd;
-            // Greife auf die Zitat-, Autor- und Buchinformationen zu.
-            // '.value()' bietet einen Standardwert, falls ein Schlüssel im JSON fehlt, um Abstürze zu vermeiden.
-            qd.quote = item.value("quote", "Unbekanntes Zitat");
-            qd.author = item.value("author", "Unbekannter Autor");
-            qd.book = item.value("book", "Unbekanntes Buch");
-            // Hole das Embedding; '.get<vector<float>>()' konvertiert das JSON-Array in einen C++-Vektor.
-            qd.embedding = item["embedding"].get<vector<float>>();
-            all_quotes.push_back(qd); // Füge das Zitat zur globalen Liste hinzu.
+    // Sicherstellen, dass die Dimension des User-Embeddings zum Index passt.
+    // (Einmal pro Anfrage statt einmal pro Zitat.)
+    if ((size_t) embedding_dim != corpus.index.dim) {
+        cerr << "C++: Warnung: Embedding-Dimensionen stimmen nicht ueberein (" << embedding_dim
+             << " statt " << corpus.index.dim << ")." << endl;
+    } else {
+        // Alle Zitate mit dem beim Laden gewählten Kernel durchsuchen. Das User-Embedding
+        // wird dafür in einen ausgerichteten, mit 0 aufgefüllten Puffer im Speicherformat
+        // des Index kopiert, damit der Kernel auch für die Query ausgerichtete Loads verwenden kann.
+        size_t best_row = corpus.index.search(user_embedding_arr, &best_score);
+        if (best_row < corpus.quotes.size()) {
+            best_quote_str = corpus.strings.view(corpus.quotes[best_row].quote);
+            best_author_str = corpus.strings.view(corpus.quotes[best_row].author);
+            best_book_str = corpus.strings.view(corpus.quotes[best_row].book);
         }
-        quotes_loaded = true; // Setze das Flag, dass Zitate nun geladen sind.
-        cout << "C++: Erfolgreich " << all_quotes.size() << " Zitate geladen." << endl;
-        return true;
-    } catch (const exception& e) {
-        // Allgemeine Fehlerbehandlung beim Laden oder Parsen der JSON-Datei.
-        cerr << "C++: Fehler beim Laden der Zitate: " << e.what() << endl;
-        return false;
     }
+
+    // Formatiere das Ergebnis in einem einzigen String.
+    string result_str = "✨ Passendstes Zitat:\n";
+    result_str += "\"" + best_quote_str + "\"\n";
+    result_str += "- " + best_author_str + ", " + best_book_str + "\n";
+    result_str += "(Ähnlichkeit: " + to_string(best_score) + ")";
+
+    return result_str;
+}
+
+// Kopiert einen C++-String in einen neu alloziierten C-String für Python.
+// Der Speicher MUSS später mit 'free_string' freigegeben werden.
+char* to_c_string(const string& str) {
+    // +1 für das Nullterminierungszeichen, das das Ende des C-Strings markiert.
+    char* c_str_result = new char[str.length() + 1];
+    // Kopiere den C++-String in den alloziierten C-String-Speicher.
+    strcpy(c_str_result, str.c_str());
+    return c_str_result;
+}
+
+// Legt das Speicherformat der Zitat-Embeddings fest: "f32" (Standard), "f16" oder "bf16".
+// Halbe Präzision halbiert den Speicher und die Speicherbandbreite jeder Suche;
+// für das Cosine-Ranking der MiniLM-Vektoren reicht sie aus (prüfbar mit
+// 'quote_precision_check'). Queries bleiben float32.
+// Muss vor dem ersten Laden der Zitate aufgerufen werden und gilt nur für JSON-Dateien
+// (Snapshots werden im Format geladen, mit dem sie veröffentlicht wurden).
+// Rückgabe: 0 bei Erfolg, -1 bei unbekanntem Format oder wenn schon geladen wurde.
+extern "C" EXPORT_DLL int set_embedding_storage(const char* type_name) {
+    EmbeddingType type;
+    if (atomic_load(&current_corpus) != nullptr || !parse_embedding_type(type_name, &type)) {
+        return -1;
+    }
+    if (select_score_kernel(0, type) == nullptr) {
+        cerr << "C++: Fehler: Speicherformat '" << type_name << "' braucht einen Build mit QUOTE_USE_GGML." << endl;
+        return -1;
+    }
+    embedding_storage = type;
+    return 0;
 }
 
 // Die Hauptfunktion, die von Python über ctypes aufgerufen wird.
@@ -107,73 +254,359 @@ bool load_quotes_from_json(const char* filename) {
 // Argumente:
 //   - user_embedding_arr: Zeiger auf das User-Embedding (ein C-Array von Floats), das von Python kommt.
 //   - embedding_dim: Die Größe (Anzahl der Elemente) des User-Embeddings.
-//   - quotes_file_path: Der Pfad zur JSON-Datei mit allen Zitat-Embeddings.
+//   - quotes_file_path: Der Pfad zur JSON-Datei mit allen Zitat-Embeddings oder zu einem
+//     Index-Verzeichnis mit MANIFEST (siehe 'quote_index_tool').
 // Rückgabetyp:
 //   - char*: Ein Zeiger auf einen C-String. Dieser String enthält das gefundene Zitat und seine Metadaten.
 //     WICHTIG: Dieser String wird im C++-Code dynamisch alloziiert (`new char[]`) und MUSS später in Python
 //     mit der 'free_string'-Funktion freigegeben werden, um Memory Leaks zu verhindern!
 extern "C" EXPORT_DLL char* find_best_quote(float* user_embedding_arr, int embedding_dim, const char* quotes_file_path) {
     // Sicherstellen, dass die Zitate in den Speicher geladen sind.
-    // 'load_quotes_from_json' wird nur beim ersten Aufruf wirklich laden.
-    if (!quotes_loaded) {
-        if (!load_quotes_from_json(quotes_file_path)) {
-            // Wenn das Laden fehlschlägt, geben wir eine Fehlermeldung zurück.
-            char* error_msg = new char[50]; // Genug Platz für die Fehlermeldung
-            strcpy(error_msg, "ERROR: C++ Konnte Zitate nicht laden.");
-            return error_msg;
-        }
+    // 'load_quotes' wird nur beim ersten Aufruf wirklich laden.
+    if (!load_quotes(quotes_file_path)) {
+        // Wenn das Laden fehlschlägt, geben wir eine Fehlermeldung zurück.
+        char* error_msg = new char[50]; // Genug Platz für die Fehlermeldung
+        strcpy(error_msg, "ERROR: C++ Konnte Zitate nicht laden.");
+        return error_msg;
     }
 
     // Prüfen, ob Zitate überhaupt geladen wurden (kann bei leerer Datei passieren).
-    if (all_quotes.empty()) {
+    shared_ptr<const QuoteCorpus> corpus = acquire_corpus();
+    if (corpus->quotes.empty()) {
         char* error_msg = new char[50];
         strcpy(error_msg, "ERROR: C++ Keine Zitate geladen.");
         return error_msg;
     }
 
-    // Das User-Embedding von einem C-Array (Pointer) in einen C++-Vektor konvertieren.
-    vector<float> user_embedding(user_embedding_arr, user_embedding_arr + embedding_dim);
+    return to_c_string(search_best_quote(*corpus, user_embedding_arr, embedding_dim));
+}
 
-    float best_score = -1.0;
-    string best_quote_str = "Kein passendes Zitat gefunden."; // Standardmeldung
-    string best_author_str = "";
-    string best_book_str = "";
+// Prüft sofort (statt beim nächsten Intervall), ob im Index-Verzeichnis ein neuer
+// Snapshot veröffentlicht oder ein Rollback gemacht wurde, und wechselt dann.
+// Rückgabe: 1 = gewechselt, 0 = unverändert oder kein Index-Verzeichnis, -1 = Fehler
+// (der bisherige Korpus bleibt aktiv).
+extern "C" EXPORT_DLL int quote_reload() {
+    return reload_if_changed(true);
+}
+
+// Eine Hilfsfunktion, die ebenfalls exportiert wird, um den in C++ alloziierten String-Speicher freizugeben.
+// Python MUSS diese Funktion aufrufen, nachdem es den von 'find_best_quote' erhaltenen String verwendet hat.
+extern "C" EXPORT_DLL void free_string(char* s) {
+    delete[] s; // Gib den Speicher frei.
+}
+
+// --- Asynchrone Such-API ---
+//
+// Der FastAPI-Handler ist async. Ein synchroner Aufruf von 'find_best_quote'
+// blockiert den Event-Loop für die Dauer der Suche. Deshalb gibt es zusätzlich
+// eine nicht-blockierende Schnittstelle:
+//   1. quote_async_init:   lädt die Zitate und startet den Worker-Pool.
+//   2. quote_submit:       reicht eine Suche ein und kehrt sofort mit einer ID zurück.
+//   3. Fertigmeldung entweder über den Callback (läuft im Worker-Thread) oder über
+//      quote_poll. Für quote_poll signalisiert ein Dateideskriptor
+//      (quote_async_notify_fd, eventfd unter Linux, sonst eine Pipe) neue
+//      Ergebnisse, sodass Python ihn mit 'loop.add_reader' überwachen kann.
+//   4. quote_async_shutdown: arbeitet offene Suchen ab und beendet die Worker.
+//
+// Jeder Worker hat eine eigene lock-freie MPSC-Queue (beliebig viele
+// einreichende Threads, genau ein konsumierender Worker). quote_submit verteilt
+// die Suchen reihum auf die Worker.
+
+// Callback für fertige Suchen. 'result' gehört danach dem Aufrufer und MUSS
+// mit 'free_string' freigegeben werden.
+typedef void (*quote_callback)(long long request_id, char* result, void* user_data);
+
+// Eine eingereichte Suche (gleichzeitig Knoten der MPSC-Queue).
+struct QuoteTask {
+    atomic<QuoteTask*> next{nullptr};
+    long long id = 0;
+    vector<float> embedding;
+    quote_callback callback = nullptr;
+    void* user_data = nullptr;
+};
+
+// Lock-freie MPSC-Queue nach Dmitry Vyukov (intrusiv, mit Stub-Knoten).
+// push darf von beliebigen Threads aufgerufen werden, pop nur vom Worker.
+class MpscQueue {
+public:
+    MpscQueue() : head(&stub), tail(&stub) {}
 
-    // Schleife durch alle geladenen Zitate, um das beste Match zu finden.
-    for (const auto& quote_data : all_quotes) {
-        // Sicherstellen, dass die Dimensionen der Embeddings übereinstimmen.
-        if (quote_data.embedding.size() != embedding_dim) {
-            cerr << "C++: Warnung: Embedding-Dimensionen stimmen nicht ueberein. Ueberspringe Zitat." << endl;
+    void push(QuoteTask* task) {
+        task->next.store(nullptr, memory_order_relaxed);
+        QuoteTask* prev = head.exchange(task, memory_order_acq_rel);
+        prev->next.store(task, memory_order_release);
+    }
+
+    // Gibt nullptr zurück, wenn die Queue leer ist oder ein Producer gerade
+    // mitten in push steckt (der Task erscheint dann beim nächsten Aufruf).
+    QuoteTask* pop() {
+        QuoteTask* t = tail;
+        QuoteTask* next = t->next.load(memory_order_acquire);
+        if (t == &stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            tail = next;
+            t = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail = next;
+            return t;
+        }
+        if (t != head.load(memory_order_acquire)) {
+            return nullptr;
+        }
+        push(&stub);
+        next = t->next.load(memory_order_acquire);
+        if (next != nullptr) {
+            tail = next;
+            return t;
+        }
+        return nullptr;
+    }
+
+private:
+    atomic<QuoteTask*> head; // von Producern geschrieben
+    QuoteTask* tail;         // nur vom Consumer benutzt
+    QuoteTask stub;
+};
+
+// Ein Worker mit seiner Queue. Mutex und Condition Variable werden nur zum
+// Schlafen benutzt, wenn die Queue leer ist; das Einreichen selbst ist lock-frei.
+struct QuoteWorker {
+    MpscQueue queue;
+    atomic<size_t> pending{0};
+    atomic<bool> sleeping{false};
+    mutex sleep_mutex;
+    condition_variable wake;
+    thread handle;
+};
+
+// Ergebnis einer Suche ohne Callback, abholbar über quote_poll.
+struct CompletedQuote {
+    long long id;
+    char* result;
+};
+
+// Zustand der Async-API.
+vector<unique_ptr<QuoteWorker>> async_workers;
+atomic<bool> async_running{false};
+atomic<long long> async_next_id{1};
+atomic<size_t> async_next_worker{0};
+mutex completed_mutex;
+vector<CompletedQuote> completed_quotes;
+// Benachrichtigungs-Deskriptoren: eventfd (Lesen und Schreiben über dasselbe fd)
+// oder die beiden Enden einer Pipe. -1, wenn nicht verfügbar (Windows).
+int notify_read_fd = -1;
+int notify_write_fd = -1;
+
+// Signalisiert über den Deskriptor, dass neue Ergebnisse bereitliegen.
+void signal_completion() {
+#ifdef __linux__
+    if (notify_write_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t written = write(notify_write_fd, &one, sizeof(one));
+        (void) written; // Zähler-Überlauf ist unkritisch, der Leser wird trotzdem geweckt.
+    }
+#elif !defined(_WIN32)
+    if (notify_write_fd >= 0) {
+        char one = 1;
+        ssize_t written = write(notify_write_fd, &one, 1);
+        (void) written; // Volle Pipe heißt: der Leser ist ohnehin schon benachrichtigt.
+    }
+#endif
+}
+
+// Leert den Deskriptor, damit 'add_reader' erst beim nächsten Ergebnis wieder feuert.
+void drain_notify_fd() {
+#ifndef _WIN32
+    if (notify_read_fd >= 0) {
+        char buffer[64];
+        while (read(notify_read_fd, buffer, sizeof(buffer)) > 0) {
+        }
+    }
+#endif
+}
+
+void run_quote_task(QuoteTask* task) {
+    // Jede Suche hält ihren Korpus fest; ein gleichzeitiger Snapshot-Wechsel
+    // gibt den alten Korpus erst frei, wenn die letzte Suche darauf fertig ist.
+    shared_ptr<const QuoteCorpus> corpus = acquire_corpus();
+    char* result = to_c_string(search_best_quote(*corpus, task->embedding.data(), (int) task->embedding.size()));
+    if (task->callback != nullptr) {
+        task->callback(task->id, result, task->user_data);
+    } else {
+        {
+            lock_guard<mutex> lock(completed_mutex);
+            completed_quotes.push_back({task->id, result});
+        }
+        signal_completion();
+    }
+    delete task;
+}
+
+void quote_worker_loop(QuoteWorker* worker) {
+    while (true) {
+        QuoteTask* task = worker->queue.pop();
+        if (task != nullptr) {
+            worker->pending.fetch_sub(1);
+            run_quote_task(task);
             continue;
         }
-        // Berechne die Ähnlichkeit zwischen dem User-Embedding und dem Zitat-Embedding.
-        float score = cosine_similarity(user_embedding, quote_data.embedding);
-        // Wenn dieser Score besser ist, aktualisiere das beste Zitat.
-        if (score > best_score) {
-            best_score = score;
-            best_quote_str = quote_data.quote;
-            best_author_str = quote_data.author;
-            best_book_str = quote_data.book;
+        // Erst beenden, wenn nichts mehr aussteht (Shutdown arbeitet die Queue ab).
+        if (!async_running.load() && worker->pending.load() == 0) {
+            break;
         }
+        unique_lock<mutex> lock(worker->sleep_mutex);
+        worker->sleeping.store(true);
+        worker->wake.wait(lock, [worker] {
+            return worker->pending.load() > 0 || !async_running.load();
+        });
+        worker->sleeping.store(false);
     }
+}
 
-    // Formatiere das Ergebnis in einem einzigen String.
-    string result_str = "✨ Passendstes Zitat:\n";
-    result_str += "\"" + best_quote_str + "\"\n";
-    result_str += "- " + best_author_str + ", " + best_book_str + "\n";
-    result_str += "(Ähnlichkeit: " + to_string(best_score) + ")";
+// Startet den Worker-Pool und lädt die Zitate (falls noch nicht geschehen).
+// Argumente:
+//   - quotes_file_path: Der Pfad zur JSON-Datei oder zum Index-Verzeichnis (wie bei 'find_best_quote').
+//   - n_workers: Anzahl der Worker-Threads (<= 0: Anzahl der CPU-Kerne).
+// Rückgabe: 0 bei Erfolg, -1 bei Fehlern.
+extern "C" EXPORT_DLL int quote_async_init(const char* quotes_file_path, int n_workers) {
+    if (async_running.load()) {
+        return 0; // Bereits gestartet.
+    }
+    // Die Zitate werden hier geladen, bevor Worker existieren: danach wird der
+    // Korpus nur noch gelesen (oder atomar ersetzt) und die Worker brauchen keine Synchronisation.
+    if (!load_quotes(quotes_file_path)) {
+        return -1;
+    }
 
-    // Alloziere Speicher für den String, der an Python zurückgegeben wird.
-    // +1 für das Nullterminierungszeichen, das das Ende des C-Strings markiert.
-    char* c_str_result = new char[result_str.length() + 1];
-    // Kopiere den C++-String in den alloziierten C-String-Speicher.
-    strcpy(c_str_result, result_str.c_str());
+#ifdef __linux__
+    notify_read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    notify_write_fd = notify_read_fd;
+#elif !defined(_WIN32)
+    int fds[2];
+    if (pipe(fds) == 0) {
+        for (int fd : fds) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        notify_read_fd = fds[0];
+        notify_write_fd = fds[1];
+    }
+#endif
 
-    return c_str_result; // Gib den Zeiger auf den C-String zurück.
+    if (n_workers <= 0) {
+        n_workers = max(1u, thread::hardware_concurrency());
+    }
+    async_running.store(true);
+    for (int i = 0; i < n_workers; i++) {
+        async_workers.push_back(make_unique<QuoteWorker>());
+    }
+    for (auto& worker : async_workers) {
+        worker->handle = thread(quote_worker_loop, worker.get());
+    }
+    cout << "C++: Async-Suche mit " << n_workers << " Worker(n) gestartet." << endl;
+    return 0;
 }
 
-// Eine Hilfsfunktion, die ebenfalls exportiert wird, um den in C++ alloziierten String-Speicher freizugeben.
-// Python MUSS diese Funktion aufrufen, nachdem es den von 'find_best_quote' erhaltenen String verwendet hat.
-extern "C" EXPORT_DLL void free_string(char* s) {
-    delete[] s; // Gib den Speicher frei.
-}
\ No newline at end of file
+// Gibt den Deskriptor zurück, der bei neuen Ergebnissen lesbar wird
+// (-1, wenn es keinen gibt, z.B. unter Windows: dann Callbacks verwenden).
+extern "C" EXPORT_DLL int quote_async_notify_fd() {
+    return notify_read_fd;
+}
+
+// Reicht eine Suche ein und kehrt sofort zurück. Das Embedding wird kopiert.
+// Argumente:
+//   - user_embedding_arr / embedding_dim: wie bei 'find_best_quote'.
+//   - callback: wird im Worker-Thread mit dem Ergebnis aufgerufen; nullptr,
+//     wenn das Ergebnis stattdessen über 'quote_poll' abgeholt werden soll.
+//   - user_data: wird unverändert an den Callback übergeben.
+// Rückgabe: die ID der Suche (> 0) oder -1, wenn die Async-API nicht läuft.
+extern "C" EXPORT_DLL long long quote_submit(const float* user_embedding_arr, int embedding_dim,
+                                            quote_callback callback, void* user_data) {
+    if (!async_running.load() || async_workers.empty()) {
+        return -1;
+    }
+    QuoteTask* task = new QuoteTask();
+    task->id = async_next_id.fetch_add(1);
+    task->embedding.assign(user_embedding_arr, user_embedding_arr + embedding_dim);
+    task->callback = callback;
+    task->user_data = user_data;
+
+    QuoteWorker* worker = async_workers[async_next_worker.fetch_add(1) % async_workers.size()].get();
+    long long id = task->id; // Nach push kann der Worker den Task jederzeit freigeben.
+    worker->pending.fetch_add(1);
+    worker->queue.push(task);
+    // Nur wenn der Worker schläft, ist ein Lock zum Aufwecken nötig.
+    if (worker->sleeping.load()) {
+        lock_guard<mutex> lock(worker->sleep_mutex);
+        worker->wake.notify_one();
+    }
+    return id;
+}
+
+// Holt bis zu 'max_results' fertige Ergebnisse ab (nur für Suchen ohne Callback).
+// 'request_ids' und 'results' müssen Platz für 'max_results' Einträge haben.
+// Jeder zurückgegebene String MUSS mit 'free_string' freigegeben werden.
+// Rückgabe: Anzahl der abgeholten Ergebnisse.
+extern "C" EXPORT_DLL int quote_poll(long long* request_ids, char** results, int max_results) {
+    // Erst den Deskriptor leeren, dann die Liste lesen: ein Ergebnis, das
+    // dazwischen fertig wird, signalisiert den Deskriptor erneut.
+    drain_notify_fd();
+    lock_guard<mutex> lock(completed_mutex);
+    int n = min(max_results, (int) completed_quotes.size());
+    for (int i = 0; i < n; i++) {
+        request_ids[i] = completed_quotes[i].id;
+        results[i] = completed_quotes[i].result;
+    }
+    completed_quotes.erase(completed_quotes.begin(), completed_quotes.begin() + n);
+    if (!completed_quotes.empty()) {
+        signal_completion(); // Rest beim nächsten Aufruf abholen.
+    }
+    return n;
+}
+
+// Beendet den Worker-Pool. Bereits eingereichte Suchen werden noch abgearbeitet.
+extern "C" EXPORT_DLL void quote_async_shutdown() {
+    if (!async_running.exchange(false)) {
+        return;
+    }
+    for (auto& worker : async_workers) {
+        {
+            lock_guard<mutex> lock(worker->sleep_mutex);
+        }
+        worker->wake.notify_all();
+    }
+    for (auto& worker : async_workers) {
+        worker->handle.join();
+    }
+    async_workers.clear();
+
+    lock_guard<mutex> lock(completed_mutex);
+    for (auto& completed : completed_quotes) {
+        delete[] completed.result;
+    }
+    completed_quotes.clear();
+#ifndef _WIN32
+    if (notify_write_fd >= 0 && notify_write_fd != notify_read_fd) {
+        close(notify_write_fd);
+    }
+    if (notify_read_fd >= 0) {
+        close(notify_read_fd);
+    }
+#endif
+    notify_read_fd = -1;
+    notify_write_fd = -1;
+}
+
+// Beendet den Worker-Pool beim Entladen der Bibliothek, falls Python
+// 'quote_async_shutdown' nicht selbst aufgerufen hat (sonst würden beim
+// Zerstören der globalen Variablen noch laufende std::threads terminate() auslösen).
+// Steht bewusst nach allen Async-Globals, damit es vor ihnen zerstört wird.
+struct AsyncShutdownGuard {
+    ~AsyncShutdownGuard() {
+        quote_async_shutdown();
+    }
+} async_shutdown_guard;
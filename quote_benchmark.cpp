@@ -0,0 +1,115 @@
+// Benchmark für den Scoring-Kernel der Zitatsuche.
+//
+// Vergleicht pro Embedding-Dimension die ursprüngliche Suche (ein vector<float>
+// pro Zitat, cosine_similarity berechnet beide Normen bei jedem Vergleich neu)
+// mit dem Kernel des Index (zusammenhängende, ausgerichtete Matrix und beim
+// Laden vorberechnete Normen) auf zufälligen Embeddings und gibt die Zeit pro
+// Suche sowie den Speedup aus.
+//
+// Bauen und starten (mit denselben Optimierungs-Flags wie die Bibliothek):
+//   g++ -std=c++17 -O3 quote_benchmark.cpp -o quote_benchmark
+//   ./quote_benchmark [anzahl_zitate] [wiederholungen]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "quote_kernels.h"
+
+using namespace std;
+
+// Die Suche vor dem Index (mental_health_main.cpp), als Vergleichswert.
+static float cosine_similarity(const vector<float>& a, const vector<float>& b) {
+    float dot = 0.0, normA = 0.0, normB = 0.0;
+    for (size_t i = 0; i < a.size(); i++) {
+        dot += a[i] * b[i];
+        normA += a[i] * a[i];
+        normB += b[i] * b[i];
+    }
+    return dot / (sqrt(normA) * sqrt(normB) + 1e-10);
+}
+
+static size_t search_baseline(const vector<float>& query, const vector<vector<float>>& quotes, float* best_score) {
+    float best = -1.0f;
+    size_t best_row = quotes.size();
+    for (size_t r = 0; r < quotes.size(); r++) {
+        float score = cosine_similarity(query, quotes[r]);
+        if (score > best) {
+            best = score;
+            best_row = r;
+        }
+    }
+    *best_score = best;
+    return best_row;
+}
+
+// Misst die durchschnittliche Zeit (in Mikrosekunden) einer kompletten Suche.
+template <typename Search>
+static double time_search(Search search, int repetitions, size_t* best_row) {
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < repetitions; i++) {
+        *best_row = search();
+    }
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, micro>(end - start).count() / repetitions;
+}
+
+// Anzahl der abwechselnden Messrunden; gewertet wird jeweils die schnellste Runde,
+// damit Störungen durch andere Prozesse das Ergebnis nicht verfälschen.
+static const int BENCH_ROUNDS = 7;
+
+int main(int argc, char** argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 500;
+    int repetitions = argc > 2 ? atoi(argv[2]) : 100;
+
+    mt19937 rng(42);
+    normal_distribution<float> dist(0.0f, 1.0f);
+
+    printf("Zitate: %zu, Wiederholungen: %d\n", count, repetitions);
+    printf("%6s  %-12s  %13s  %12s  %8s\n", "dim", "kernel", "original [us]", "index [us]", "speedup");
+
+    for (size_t dim : {300, 384, 768, 1024}) {
+        size_t stride = embedding_stride(dim);
+
+        vector<vector<float>> quotes(count, vector<float>(dim));
+        AlignedFloats rows = make_aligned_floats(count * stride);
+        vector<float> norms(count);
+        for (size_t r = 0; r < count; r++) {
+            float* row = rows.get() + r * stride;
+            for (size_t i = 0; i < stride; i++) {
+                row[i] = i < dim ? dist(rng) : 0.0f;
+            }
+            copy(row, row + dim, quotes[r].begin());
+            norms[r] = vector_norm(row, dim);
+        }
+
+        vector<float> query(dim);
+        AlignedFloats query_row = make_aligned_floats(stride);
+        for (size_t i = 0; i < stride; i++) {
+            query_row.get()[i] = i < dim ? dist(rng) : 0.0f;
+        }
+        copy(query_row.get(), query_row.get() + dim, query.begin());
+        float query_norm = vector_norm(query_row.get(), dim);
+
+        ScoreKernel kernel = select_score_kernel(dim);
+        float best_score = 0.0f;
+        size_t best_baseline = 0, best_index = 0;
+        double t_baseline = 1e30, t_index = 1e30;
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            t_baseline = min(t_baseline, time_search([&] { return search_baseline(query, quotes, &best_score); },
+                                                     repetitions, &best_baseline));
+            t_index = min(t_index, time_search([&] {
+                return kernel(query_row.get(), query_norm, rows.get(), norms.data(), count, stride, &best_score);
+            }, repetitions, &best_index));
+        }
+
+        printf("%6zu  %-12s  %13.1f  %12.1f  %7.2fx%s\n", dim, score_kernel_name(dim),
+               t_baseline, t_index, t_baseline / t_index,
+               best_baseline == best_index ? "" : "  (ABWEICHUNG!)");
+    }
+    return 0;
+}
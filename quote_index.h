@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "quote_kernels.h"
+
+// --- Such-Index für die Zitat-Embeddings ---
+//
+// Alle Zitat-Embeddings als eine zusammenhängende, ausgerichtete Matrix im
+// gewählten Speicherformat (f32, f16 oder bf16) plus vorberechnete Normen und
+// der beim Laden gewählte Scoring-Kernel. Nach 'build' bzw. 'attach' wird der
+// Index nur noch gelesen und kann aus mehreren Threads gleichzeitig durchsucht werden.
+//
+// 'embeddings' und 'norms' zeigen entweder auf eigene Puffer (build) oder auf
+// fremden Speicher, z.B. eine per mmap eingeblendete Snapshot-Datei (attach).
+struct QuoteIndex {
+    EmbeddingType type = EmbeddingType::F32;
+    size_t dim = 0;                            // Embedding-Dimension aller Zitate im Index
+    size_t stride = 0;                         // Zeilenabstand in Elementen (siehe embedding_stride)
+    size_t count = 0;                          // Anzahl der Zeilen
+    const unsigned char* embeddings = nullptr; // 'count' Zeilen mit Abstand 'stride'
+    const float* norms = nullptr;              // Norm jeder Zeile (aus den float32-Werten berechnet)
+    ScoreKernel kernel = nullptr;
+    DotKernel dot = nullptr;
+
+    // Eigene Puffer, falls der Index mit 'build' aufgebaut wurde.
+    AlignedBytes owned_embeddings;
+    std::vector<float> owned_norms;
+
+    size_t row_bytes() const {
+        return stride * embedding_type_size(type);
+    }
+
+    // Baut den Index aus float32-Zeilen (alle mit Länge 'dim') im Format 'type' auf.
+    // Gibt false zurück, wenn das Format in diesem Build nicht verfügbar ist.
+    bool build(const std::vector<std::vector<float>>& rows, size_t dim_, EmbeddingType type_) {
+        if (select_score_kernel(dim_, type_) == nullptr) {
+            return false;
+        }
+#ifdef QUOTE_USE_GGML
+        ggml_cpu_init(); // Initialisiert die Umrechnungstabellen für die Dot-Kernels.
+#endif
+        type = type_;
+        dim = dim_;
+        count = rows.size();
+        stride = embedding_stride(dim, embedding_type_size(type));
+        owned_embeddings = make_aligned_array<unsigned char>(count * row_bytes() + EMBEDDING_ALIGNMENT);
+        owned_norms.resize(count);
+        for (size_t r = 0; r < count; r++) {
+            convert_embedding(rows[r].data(), dim, stride, type, owned_embeddings.get() + r * row_bytes());
+            owned_norms[r] = vector_norm(rows[r].data(), dim);
+        }
+        embeddings = owned_embeddings.get();
+        norms = owned_norms.data();
+        kernel = select_score_kernel(dim, type);
+        dot = select_dot_kernel(type);
+        return true;
+    }
+
+    // Verwendet bereits fertige Zeilen und Normen aus fremdem Speicher, ohne sie
+    // zu kopieren. 'rows_' muss auf EMBEDDING_ALIGNMENT Bytes ausgerichtet sein
+    // und so lange gültig bleiben wie der Index.
+    bool attach(const void* rows_, const float* norms_, size_t count_, size_t dim_, size_t stride_, EmbeddingType type_) {
+        if (select_score_kernel(dim_, type_) == nullptr ||
+            stride_ != embedding_stride(dim_, embedding_type_size(type_)) ||
+            reinterpret_cast<uintptr_t>(rows_) % EMBEDDING_ALIGNMENT != 0) {
+            return false;
+        }
+#ifdef QUOTE_USE_GGML
+        ggml_cpu_init();
+#endif
+        type = type_;
+        dim = dim_;
+        stride = stride_;
+        count = count_;
+        embeddings = static_cast<const unsigned char*>(rows_);
+        norms = norms_;
+        kernel = select_score_kernel(dim, type);
+        dot = select_dot_kernel(type);
+        return true;
+    }
+
+    // Wandelt eine float32-Query in einen ausgerichteten, aufgefüllten Puffer im
+    // Speicherformat des Index um und berechnet ihre Norm.
+    AlignedBytes prepare_query(const float* query, float* query_norm) const {
+        AlignedBytes prepared = make_aligned_array<unsigned char>(row_bytes() + EMBEDDING_ALIGNMENT);
+        convert_embedding(query, dim, stride, type, prepared.get());
+        *query_norm = vector_norm(query, dim);
+        return prepared;
+    }
+
+    // Sucht die Zeile mit der höchsten Cosine Similarity (oder 'count', falls keine).
+    size_t search(const float* query, float* best_score) const {
+        float query_norm = 0.0f;
+        AlignedBytes prepared = prepare_query(query, &query_norm);
+        return kernel(prepared.get(), query_norm, embeddings, norms, count, stride, best_score);
+    }
+
+    // Cosine Similarity einer vorbereiteten Query mit einer einzelnen Zeile.
+    float score(const unsigned char* prepared_query, float query_norm, size_t row) const {
+        return dot(prepared_query, embeddings + row * row_bytes(), stride) / (query_norm * norms[row] + 1e-10f);
+    }
+};
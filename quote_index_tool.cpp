@@ -0,0 +1,136 @@
+// Verwaltet das Index-Verzeichnis der Zitatsuche (siehe quote_snapshot.h).
+//
+// Ein neuer Zitat-Korpus wird als unveränderlicher Snapshot veröffentlicht; die
+// laufende Bibliothek wechselt beim nächsten Blick ins MANIFEST (höchstens eine
+// Sekunde später, oder sofort über 'quote_reload') ohne Neustart dorthin.
+//
+// Bauen:
+//   g++ -std=c++17 -O2 quote_index_tool.cpp -o quote_index_tool
+//   (für f16/bf16 zusätzlich wie bei quote_precision_check mit -DQUOTE_USE_GGML und ggml)
+// Befehle:
+//   ./quote_index_tool publish <index_dir> <quotes.json> [f32|f16|bf16]
+//   ./quote_index_tool rollback <index_dir>     vorherigen Snapshot wieder aktivieren
+//   ./quote_index_tool status <index_dir>       aktuellen Snapshot und Historie anzeigen
+//   ./quote_index_tool verify <index_dir>       alle Snapshots im MANIFEST laden und prüfen
+//
+// Der Server benutzt das Index-Verzeichnis, wenn QUOTE_INDEX_DIR gesetzt ist.
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include "quote_snapshot.h"
+
+using namespace std;
+
+static void print_entry(const char* label, const SnapshotEntry& entry) {
+    printf("%-8s v%-4llu %s  %s\n", label, (unsigned long long) entry.version, checksum_hex(entry.checksum).c_str(),
+           entry.file.c_str());
+}
+
+static int usage() {
+    cerr << "Verwendung:\n"
+            "  quote_index_tool publish <index_dir> <quotes.json> [f32|f16|bf16]\n"
+            "  quote_index_tool rollback <index_dir>\n"
+            "  quote_index_tool status <index_dir>\n"
+            "  quote_index_tool verify <index_dir>" << endl;
+    return 2;
+}
+
+static int publish(const string& dir, const string& json_path, const char* type_name) {
+    EmbeddingType type = EmbeddingType::F32;
+    if (type_name != nullptr && !parse_embedding_type(type_name, &type)) {
+        cerr << "Fehler: Unbekanntes Speicherformat '" << type_name << "'." << endl;
+        return 1;
+    }
+    QuoteCorpus corpus;
+    string error;
+    if (!load_corpus_from_json(json_path, type, corpus, &error)) {
+        cerr << "Fehler: " << error << endl;
+        return 1;
+    }
+    SnapshotEntry entry;
+    if (!publish_snapshot(dir, corpus, &entry, &error)) {
+        cerr << "Fehler: " << error << endl;
+        return 1;
+    }
+    printf("%zu Zitate (Dimension %zu, %s) veroeffentlicht.\n", corpus.quotes.size(), corpus.index.dim,
+           embedding_type_name(corpus.index.type));
+    print_entry("aktiv", entry);
+    return 0;
+}
+
+static int rollback(const string& dir) {
+    SnapshotEntry entry;
+    string error;
+    if (!rollback_snapshot(dir, &entry, &error)) {
+        cerr << "Fehler: " << error << endl;
+        return 1;
+    }
+    print_entry("aktiv", entry);
+    return 0;
+}
+
+static int status(const string& dir) {
+    IndexManifest manifest;
+    string error;
+    if (!read_manifest(dir, manifest, &error)) {
+        cerr << "Fehler: " << error << endl;
+        return 1;
+    }
+    print_entry("aktiv", manifest.current);
+    for (auto it = manifest.history.rbegin(); it != manifest.history.rend(); ++it) {
+        print_entry("vorher", *it);
+    }
+    return 0;
+}
+
+static int verify(const string& dir) {
+    IndexManifest manifest;
+    string error;
+    if (!read_manifest(dir, manifest, &error)) {
+        cerr << "Fehler: " << error << endl;
+        return 1;
+    }
+    vector<SnapshotEntry> entries = manifest.history;
+    entries.push_back(manifest.current);
+    int failures = 0;
+    for (const SnapshotEntry& entry : entries) {
+        QuoteCorpus corpus;
+        string path = (filesystem::path(dir) / entry.file).string();
+        if (!load_snapshot(path, corpus, &error)) {
+            printf("FEHLER  v%llu: %s\n", (unsigned long long) entry.version, error.c_str());
+            failures++;
+        } else if (corpus.checksum != entry.checksum) {
+            printf("FEHLER  v%llu: Pruefsumme passt nicht zum MANIFEST\n", (unsigned long long) entry.version);
+            failures++;
+        } else {
+            printf("ok      v%llu: %zu Zitate, Dimension %zu, %s\n", (unsigned long long) entry.version,
+                   corpus.quotes.size(), corpus.index.dim, embedding_type_name(corpus.index.type));
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        return usage();
+    }
+    string command = argv[1];
+    string dir = argv[2];
+    if (command == "publish" && (argc == 4 || argc == 5)) {
+        return publish(dir, argv[3], argc == 5 ? argv[4] : nullptr);
+    }
+    if (command == "rollback" && argc == 3) {
+        return rollback(dir);
+    }
+    if (command == "status" && argc == 3) {
+        return status(dir);
+    }
+    if (command == "verify" && argc == 3) {
+        return verify(dir);
+    }
+    return usage();
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <string_view>
+
+// Mit QUOTE_USE_GGML werden zusätzlich FP16/BF16-Embeddings unterstützt. Dafür
+// werden die Typen und Dot-Kernels von ggml (llama.cpp/ggml) verwendet, die
+// Bibliothek muss dann gegen ggml-base und ggml-cpu gelinkt werden.
+#ifdef QUOTE_USE_GGML
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+// Aus ggml/src/ggml-cpu/vec.h: nicht Teil der öffentlichen Header, aber von
+// libggml-cpu exportiert. Beide Vektoren müssen im selben Format vorliegen.
+extern "C" {
+void ggml_vec_dot_f16(int n, float* s, size_t bs, ggml_fp16_t* x, size_t bx, ggml_fp16_t* y, size_t by, int nrc);
+void ggml_vec_dot_bf16(int n, float* s, size_t bs, ggml_bf16_t* x, size_t bx, ggml_bf16_t* y, size_t by, int nrc);
+}
+#endif
+
+// --- Scoring-Kernels für die Zitatsuche ---
+//
+// Die Zitat-Embeddings liegen als eine zusammenhängende Matrix im Speicher
+// (eine Zeile pro Zitat, jede Zeile auf EMBEDDING_ALIGNMENT Bytes ausgerichtet,
+// mit vorberechneten Normen). float32 läuft für alle Dimensionen über einen
+// Kernel: Varianten mit der Dimension als Compile-Zeit-Konstante waren nicht
+// schneller (siehe quote_benchmark.cpp). Der Kernel für das Speicherformat wird
+// EINMAL beim Laden des Index ausgewählt (select_score_kernel) und nicht pro Zitat.
+
+// Ausrichtung der Embedding-Zeilen in Bytes (eine Cache-Line, passt auch für AVX-512).
+constexpr size_t EMBEDDING_ALIGNMENT = 64;
+// Anzahl der Floats pro Block bzw. der parallelen Akkumulatoren im Kernel.
+constexpr size_t KERNEL_LANES = EMBEDDING_ALIGNMENT / sizeof(float);
+
+#if defined(__GNUC__) || defined(__clang__)
+#define QUOTE_ASSUME_ALIGNED(p) static_cast<const float*>(__builtin_assume_aligned((p), EMBEDDING_ALIGNMENT))
+#define QUOTE_RESTRICT __restrict__
+#else
+#define QUOTE_ASSUME_ALIGNED(p) (p)
+#define QUOTE_RESTRICT __restrict
+#endif
+
+// Speicher mit EMBEDDING_ALIGNMENT-Ausrichtung (C++17 aligned new).
+template <typename T>
+struct AlignedDeleter {
+    void operator()(T* p) const {
+        ::operator delete[](p, std::align_val_t(EMBEDDING_ALIGNMENT));
+    }
+};
+template <typename T>
+using AlignedArray = std::unique_ptr<T[], AlignedDeleter<T>>;
+using AlignedFloats = AlignedArray<float>;
+using AlignedBytes = AlignedArray<unsigned char>;
+
+template <typename T>
+inline AlignedArray<T> make_aligned_array(size_t count) {
+    void* p = ::operator new[](count * sizeof(T), std::align_val_t(EMBEDDING_ALIGNMENT));
+    return AlignedArray<T>(static_cast<T*>(p));
+}
+
+inline AlignedFloats make_aligned_floats(size_t count) {
+    return make_aligned_array<float>(count);
+}
+
+// Speicherformat der Zitat-Embeddings im Index. Queries sind immer float32.
+enum class EmbeddingType {
+    F32,
+    F16,   // IEEE half precision (ggml_fp16_t), nur mit QUOTE_USE_GGML
+    BF16,  // bfloat16 (ggml_bf16_t), nur mit QUOTE_USE_GGML
+};
+
+inline size_t embedding_type_size(EmbeddingType type) {
+    return type == EmbeddingType::F32 ? sizeof(float) : 2;
+}
+
+inline const char* embedding_type_name(EmbeddingType type) {
+    switch (type) {
+        case EmbeddingType::F16:  return "f16";
+        case EmbeddingType::BF16: return "bf16";
+        default:                  return "f32";
+    }
+}
+
+// Liest ein Speicherformat aus seinem Namen ("f32", "f16", "bf16").
+inline bool parse_embedding_type(const char* name, EmbeddingType* type) {
+    std::string_view n(name);
+    if (n == "f32")  { *type = EmbeddingType::F32;  return true; }
+    if (n == "f16")  { *type = EmbeddingType::F16;  return true; }
+    if (n == "bf16") { *type = EmbeddingType::BF16; return true; }
+    return false;
+}
+
+// Zeilenabstand (in Elementen) für eine gegebene Dimension: aufgerundet auf
+// ein Vielfaches von EMBEDDING_ALIGNMENT Bytes, damit jede Zeile ausgerichtet
+// beginnt. Die Auffüllung ist 0.
+inline size_t embedding_stride(size_t dim, size_t element_size = sizeof(float)) {
+    size_t per_line = EMBEDDING_ALIGNMENT / element_size;
+    return (dim + per_line - 1) / per_line * per_line;
+}
+
+// Summiert N Akkumulatoren paarweise (Baumreduktion). Eine serielle Summe würde
+// eine Kette von N abhängigen Additionen erzeugen, die bei kurzen Vektoren mehr
+// Zeit kostet als die eigentlichen Multiplikationen.
+template <size_t N>
+inline float reduce_lanes(float* acc) {
+    static_assert((N & (N - 1)) == 0, "N muss eine Zweierpotenz sein");
+    for (size_t width = N / 2; width > 0; width /= 2) {
+        for (size_t l = 0; l < width; l++) {
+            acc[l] += acc[l + width];
+        }
+    }
+    return acc[0];
+}
+
+// Skalarprodukt für beliebige Dimensionen. 'stride' ist ein
+// Vielfaches von KERNEL_LANES und die Auffüllung ist 0, daher kann immer
+// blockweise gerechnet werden.
+inline float dot_generic(const float* QUOTE_RESTRICT a, const float* QUOTE_RESTRICT b, size_t stride) {
+    a = QUOTE_ASSUME_ALIGNED(a);
+    b = QUOTE_ASSUME_ALIGNED(b);
+    float acc[KERNEL_LANES] = {};
+    for (size_t i = 0; i < stride; i += KERNEL_LANES) {
+        for (size_t l = 0; l < KERNEL_LANES; l++) {
+            acc[l] += a[i + l] * b[i + l];
+        }
+    }
+    return reduce_lanes<KERNEL_LANES>(acc);
+}
+
+// Signatur eines Such-Kernels: durchsucht 'count' Zeilen und gibt den Index der
+// Zeile mit der höchsten Cosine Similarity zurück (oder 'count', falls keine
+// Zeile besser als -1 ist). Der beste Score wird in 'best_score' geschrieben.
+//   - query:      ausgerichteter, mit 0 aufgefüllter Query-Vektor (Länge 'stride')
+//                 im Speicherformat des Index
+//   - query_norm: vorberechnete Norm des Query-Vektors
+//   - rows:       Embedding-Matrix, 'count' Zeilen mit Abstand 'stride' (in Elementen)
+//   - row_norms:  vorberechnete Normen der Zeilen
+typedef size_t (*ScoreKernel)(const void* query, float query_norm,
+                              const void* rows, const float* row_norms,
+                              size_t count, size_t stride, float* best_score);
+
+// Skalarprodukt einer Query mit einer einzelnen Zeile (beide im Speicherformat des Index).
+typedef float (*DotKernel)(const void* query, const void* row, size_t stride);
+
+// Gemeinsame Suchschleife; 'Dot' ist der jeweilige Skalarprodukt-Kernel.
+// Die Formel entspricht der ursprünglichen cosine_similarity (inkl. 1e-10).
+template <typename T, typename Dot>
+inline size_t scan_best(const T* query, float query_norm,
+                        const T* rows, const float* row_norms,
+                        size_t count, size_t stride, float* best_score, Dot dot) {
+    float best = -1.0f;
+    size_t best_row = count;
+    for (size_t r = 0; r < count; r++) {
+        float score = dot(query, rows + r * stride) / (query_norm * row_norms[r] + 1e-10f);
+        if (score > best) {
+            best = score;
+            best_row = r;
+        }
+    }
+    *best_score = best;
+    return best_row;
+}
+
+inline size_t score_kernel_generic(const void* query, float query_norm,
+                                   const void* rows, const float* row_norms,
+                                   size_t count, size_t stride, float* best_score) {
+    return scan_best(static_cast<const float*>(query), query_norm, static_cast<const float*>(rows),
+                     row_norms, count, stride, best_score,
+                     [stride](const float* a, const float* b) { return dot_generic(a, b, stride); });
+}
+
+inline float dot_kernel_f32(const void* query, const void* row, size_t stride) {
+    return dot_generic(static_cast<const float*>(query), static_cast<const float*>(row), stride);
+}
+
+#ifdef QUOTE_USE_GGML
+// FP16/BF16: die Zeilen werden direkt im Halbformat an die Dot-Kernels von ggml
+// übergeben, die beim Laden in float32 umrechnen und akkumulieren. Die Query
+// wird dafür einmal pro Suche ins selbe Format konvertiert. Die Auffüllung ist
+// 0, daher kann über den ganzen Zeilenabstand gerechnet werden.
+template <typename T, void (*VEC_DOT)(int, float*, size_t, T*, size_t, T*, size_t, int)>
+inline float dot_ggml(const T* a, const T* b, size_t stride) {
+    float sum = 0.0f;
+    VEC_DOT((int) stride, &sum, 0, const_cast<T*>(a), 0, const_cast<T*>(b), 0, 1);
+    return sum;
+}
+
+template <typename T, void (*VEC_DOT)(int, float*, size_t, T*, size_t, T*, size_t, int)>
+size_t score_kernel_ggml(const void* query, float query_norm,
+                         const void* rows, const float* row_norms,
+                         size_t count, size_t stride, float* best_score) {
+    return scan_best(static_cast<const T*>(query), query_norm, static_cast<const T*>(rows),
+                     row_norms, count, stride, best_score,
+                     [stride](const T* a, const T* b) { return dot_ggml<T, VEC_DOT>(a, b, stride); });
+}
+
+template <typename T, void (*VEC_DOT)(int, float*, size_t, T*, size_t, T*, size_t, int)>
+float dot_kernel_ggml(const void* query, const void* row, size_t stride) {
+    return dot_ggml<T, VEC_DOT>(static_cast<const T*>(query), static_cast<const T*>(row), stride);
+}
+#endif
+
+// Wählt den Kernel für das Speicherformat aus. Wird einmal beim Laden aufgerufen.
+// Gibt nullptr zurück, wenn das Format nicht verfügbar ist.
+inline ScoreKernel select_score_kernel(size_t /*dim*/, EmbeddingType type = EmbeddingType::F32) {
+    switch (type) {
+#ifdef QUOTE_USE_GGML
+        case EmbeddingType::F16:  return score_kernel_ggml<ggml_fp16_t, ggml_vec_dot_f16>;
+        case EmbeddingType::BF16: return score_kernel_ggml<ggml_bf16_t, ggml_vec_dot_bf16>;
+#endif
+        case EmbeddingType::F32:  return score_kernel_generic;
+        default:                  return nullptr;
+    }
+}
+
+// Skalarprodukt-Kernel für einzelne Zeilen (z.B. für komplette Rankings).
+inline DotKernel select_dot_kernel(EmbeddingType type) {
+    switch (type) {
+#ifdef QUOTE_USE_GGML
+        case EmbeddingType::F16:  return dot_kernel_ggml<ggml_fp16_t, ggml_vec_dot_f16>;
+        case EmbeddingType::BF16: return dot_kernel_ggml<ggml_bf16_t, ggml_vec_dot_bf16>;
+#endif
+        case EmbeddingType::F32:  return dot_kernel_f32;
+        default:                  return nullptr;
+    }
+}
+
+// Name des gewählten Kernels (für Logs und den Benchmark).
+inline const char* score_kernel_name(size_t /*dim*/, EmbeddingType type = EmbeddingType::F32) {
+    switch (type) {
+        case EmbeddingType::F16:  return "ggml_vec_dot_f16";
+        case EmbeddingType::BF16: return "ggml_vec_dot_bf16";
+        default:                  return "generic";
+    }
+}
+
+// Rechnet 'dim' Floats ins Speicherformat um und füllt bis 'stride' mit 0 auf.
+// 'dst' muss Platz für 'stride' Elemente des Formats haben.
+inline bool convert_embedding(const float* src, size_t dim, size_t stride, EmbeddingType type, void* dst) {
+    switch (type) {
+        case EmbeddingType::F32: {
+            float* out = static_cast<float*>(dst);
+            std::copy(src, src + dim, out);
+            std::fill(out + dim, out + stride, 0.0f);
+            return true;
+        }
+#ifdef QUOTE_USE_GGML
+        case EmbeddingType::F16: {
+            ggml_fp16_t* out = static_cast<ggml_fp16_t*>(dst);
+            ggml_fp32_to_fp16_row(src, out, (int64_t) dim);
+            std::fill(out + dim, out + stride, ggml_fp32_to_fp16(0.0f));
+            return true;
+        }
+        case EmbeddingType::BF16: {
+            ggml_bf16_t* out = static_cast<ggml_bf16_t*>(dst);
+            ggml_fp32_to_bf16_row(src, out, (int64_t) dim);
+            std::fill(out + dim, out + stride, ggml_fp32_to_bf16(0.0f));
+            return true;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+// Euklidische Norm eines Vektors (wird beim Laden pro Zeile vorberechnet).
+inline float vector_norm(const float* v, size_t dim) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < dim; i++) {
+        sum += v[i] * v[i];
+    }
+    return std::sqrt(sum);
+}
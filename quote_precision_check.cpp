@@ -0,0 +1,155 @@
+// Prüft, wie gut FP16/BF16-Embeddings das FP32-Ranking der Zitatsuche erhalten.
+//
+// Jedes Zitat aus der JSON-Datei wird als Query gegen alle anderen Zitate
+// gesucht (zusätzlich optional die Embeddings aus 'user_embedding.json').
+// Pro Speicherformat werden die Rankings mit FP32 verglichen:
+//   - Top-1:      Anteil der Queries mit demselben besten Zitat
+//   - Top-5:      durchschnittliche Überschneidung der fünf besten Zitate
+//   - Δ Score:    mittlere und maximale Abweichung der Cosine Similarity
+//   - Zeit:       durchschnittliche Dauer einer kompletten Suche
+//
+// Bauen (ggml aus llama.cpp, z.B. nach 'cmake -S llama.cpp -B llama.cpp/build'):
+//   g++ -std=c++17 -O3 -DQUOTE_USE_GGML -Illama.cpp/ggml/include quote_precision_check.cpp
+//       -o quote_precision_check -Lllama.cpp/build/bin -lggml-base -lggml-cpu
+// Starten:
+//   ./quote_precision_check [quotes_with_embeddings.json] [user_embedding.json]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <vector>
+
+#include "json.hpp"
+#include "quote_index.h"
+
+#ifndef QUOTE_USE_GGML
+#error "quote_precision_check braucht FP16/BF16-Unterstuetzung: mit -DQUOTE_USE_GGML bauen"
+#endif
+
+using json = nlohmann::json;
+using namespace std;
+
+// Anzahl der verglichenen besten Zitate für die Top-k-Überschneidung.
+static const size_t TOP_K = 5;
+
+// Cosine Similarity der Query mit allen Zeilen des Index.
+static vector<float> score_all(const QuoteIndex& index, const float* query) {
+    float query_norm = 0.0f;
+    AlignedBytes prepared = index.prepare_query(query, &query_norm);
+    vector<float> scores(index.count);
+    for (size_t r = 0; r < index.count; r++) {
+        scores[r] = index.score(prepared.get(), query_norm, r);
+    }
+    return scores;
+}
+
+// Indizes der 'k' besten Zeilen, absteigend nach Score. 'skip' wird ausgelassen
+// (das Zitat, das selbst als Query dient).
+static vector<size_t> top_k(const vector<float>& scores, size_t k, size_t skip) {
+    vector<size_t> order(scores.size());
+    iota(order.begin(), order.end(), 0);
+    order.erase(remove(order.begin(), order.end(), skip), order.end());
+    k = min(k, order.size());
+    partial_sort(order.begin(), order.begin() + k, order.end(),
+                 [&](size_t a, size_t b) { return scores[a] > scores[b]; });
+    order.resize(k);
+    return order;
+}
+
+int main(int argc, char** argv) {
+    const char* quotes_path = argc > 1 ? argv[1] : "quotes_with_embeddings.json";
+    const char* user_path = argc > 2 ? argv[2] : "user_embedding.json";
+
+    ifstream quotes_file(quotes_path);
+    if (!quotes_file.is_open()) {
+        cerr << "Fehler: Zitatendatei '" << quotes_path << "' konnte nicht geoeffnet werden." << endl;
+        return 1;
+    }
+    json quotes_json;
+    quotes_file >> quotes_json;
+
+    vector<vector<float>> rows;
+    for (const auto& item : quotes_json) {
+        rows.push_back(item["embedding"].get<vector<float>>());
+        if (rows.back().size() != rows.front().size()) {
+            rows.pop_back(); // Wie beim Laden in der Bibliothek: abweichende Dimension überspringen.
+        }
+    }
+    if (rows.empty()) {
+        cerr << "Fehler: Keine Zitate gefunden." << endl;
+        return 1;
+    }
+    size_t dim = rows.front().size();
+
+    // Queries: alle Zitate (ohne sich selbst) plus optional das gespeicherte User-Embedding.
+    vector<vector<float>> queries = rows;
+    vector<size_t> skip(rows.size());
+    iota(skip.begin(), skip.end(), 0);
+    ifstream user_file(user_path);
+    if (user_file.is_open()) {
+        json user_json;
+        user_file >> user_json;
+        vector<float> user_embedding = user_json["embedding"].get<vector<float>>();
+        if (user_embedding.size() == dim) {
+            queries.push_back(user_embedding);
+            skip.push_back(rows.size()); // nichts auslassen
+        }
+    }
+
+    QuoteIndex reference;
+    reference.build(rows, dim, EmbeddingType::F32);
+    vector<vector<float>> reference_scores;
+    for (const auto& query : queries) {
+        reference_scores.push_back(score_all(reference, query.data()));
+    }
+
+    printf("Zitate: %zu, Dimension: %zu, Queries: %zu\n", rows.size(), dim, queries.size());
+    printf("%-6s  %10s  %8s  %8s  %12s  %12s  %10s\n",
+           "format", "bytes", "top-1", "top-5", "mittl. dScore", "max. dScore", "suche [us]");
+
+    for (EmbeddingType type : {EmbeddingType::F32, EmbeddingType::F16, EmbeddingType::BF16}) {
+        QuoteIndex index;
+        index.build(rows, dim, type);
+
+        size_t top1_matches = 0;
+        double top5_overlap = 0.0, delta_sum = 0.0, delta_max = 0.0;
+        size_t delta_count = 0;
+        for (size_t q = 0; q < queries.size(); q++) {
+            vector<float> scores = score_all(index, queries[q].data());
+            vector<size_t> expected = top_k(reference_scores[q], TOP_K, skip[q]);
+            vector<size_t> actual = top_k(scores, TOP_K, skip[q]);
+
+            top1_matches += expected.front() == actual.front();
+            size_t overlap = 0;
+            for (size_t r : actual) {
+                overlap += find(expected.begin(), expected.end(), r) != expected.end();
+            }
+            top5_overlap += (double) overlap / expected.size();
+
+            for (size_t r = 0; r < scores.size(); r++) {
+                double delta = fabs((double) scores[r] - reference_scores[q][r]);
+                delta_sum += delta;
+                delta_max = max(delta_max, delta);
+                delta_count++;
+            }
+        }
+
+        // Zeit pro Suche mit dem beim Laden gewählten Kernel (wie in der Bibliothek).
+        const int repetitions = 200;
+        float best_score = 0.0f;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < repetitions; i++) {
+            index.search(queries[i % queries.size()].data(), &best_score);
+        }
+        double search_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / repetitions;
+
+        printf("%-6s  %10zu  %7.1f%%  %7.1f%%  %12.2e  %12.2e  %10.1f\n", embedding_type_name(type),
+               index.count * index.row_bytes(), 100.0 * top1_matches / queries.size(),
+               100.0 * top5_overlap / queries.size(), delta_sum / delta_count, delta_max, search_us);
+    }
+    return 0;
+}
@@ -0,0 +1,159 @@
+// Prüft, dass Suchen nicht auf einen Snapshot-Wechsel warten.
+//
+// Legt ein Index-Verzeichnis mit zwei abwechselnd veröffentlichten Korpora an
+// (alle Zitate und die erste Hälfte) und sucht über die exportierte Schnittstelle
+// der Bibliothek, während ein zweiter Thread lädt:
+//   1. Ein Thread hält den Lade-Mutex wie ein laufendes 'quote_reload'. Die Suche
+//      muss zurückkehren, bevor er ihn freigibt.
+//   2. Ein Thread veröffentlicht die Korpora abwechselnd und ruft jedes Mal
+//      'quote_reload' auf. Jede gleichzeitige Suche muss ein Zitat liefern, und
+//      kein Wechsel darf fehlschlagen (einen Teil der Wechsel übernehmen die
+//      Suchen selbst beim Blick ins MANIFEST, dann liefert 'quote_reload' 0).
+//
+// Bauen und starten:
+//   g++ -std=c++17 -O2 -pthread quote_reload_check.cpp mental_health_main.cpp -o quote_reload_check
+//   ./quote_reload_check [quotes_with_embeddings.json]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.hpp"
+#include "quote_snapshot.h"
+
+using json = nlohmann::json;
+using namespace std;
+
+// Aus mental_health_main.cpp.
+extern "C" char* find_best_quote(float* user_embedding_arr, int embedding_dim, const char* quotes_file_path);
+extern "C" int quote_reload();
+extern "C" void free_string(char* s);
+extern mutex corpus_load_mutex;
+
+// Sucht einmal und gibt zurück, ob ein Zitat gefunden wurde.
+static bool search_ok(vector<float>& query, const string& dir) {
+    char* result = find_best_quote(query.data(), (int) query.size(), dir.c_str());
+    bool ok = strncmp(result, "ERROR", 5) != 0;
+    free_string(result);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    const char* quotes_path = argc > 1 ? argv[1] : "quotes_with_embeddings.json";
+
+    ifstream quotes_file(quotes_path);
+    if (!quotes_file.is_open()) {
+        cerr << "Fehler: Zitatendatei '" << quotes_path << "' konnte nicht geoeffnet werden." << endl;
+        return 1;
+    }
+    json quotes_json;
+    quotes_file >> quotes_json;
+    if (quotes_json.size() < 2) {
+        cerr << "Fehler: Mindestens zwei Zitate noetig." << endl;
+        return 1;
+    }
+    vector<float> query = quotes_json[0]["embedding"].get<vector<float>>();
+
+    filesystem::path dir = filesystem::temp_directory_path() / "quote_reload_check";
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+
+    // Korpus B: die erste Hälfte der Zitate, damit sich die Prüfsummen unterscheiden.
+    string half_path = (dir / "half.json").string();
+    {
+        json half = json::array();
+        for (size_t i = 0; i < quotes_json.size() / 2; i++) {
+            half.push_back(quotes_json[i]);
+        }
+        ofstream(half_path) << half.dump();
+    }
+
+    QuoteCorpus corpora[2];
+    SnapshotEntry entry;
+    string error;
+    if (!load_corpus_from_json(quotes_path, EmbeddingType::F32, corpora[0], &error) ||
+        !load_corpus_from_json(half_path, EmbeddingType::F32, corpora[1], &error) ||
+        !publish_snapshot((dir / "index").string(), corpora[0], &entry, &error)) {
+        cerr << "Fehler: " << error << endl;
+        return 1;
+    }
+    string index_dir = (dir / "index").string();
+
+    int failures = 0;
+
+    // Erste Suche lädt den Korpus.
+    if (!search_ok(query, index_dir)) {
+        cerr << "Fehler: Zitate konnten nicht geladen werden." << endl;
+        return 1;
+    }
+
+    // 1. Suche, während ein anderer Thread den Lade-Mutex hält.
+    {
+        atomic<bool> locked{false};
+        atomic<bool> released{false};
+        thread loader([&] {
+            lock_guard<mutex> lock(corpus_load_mutex);
+            locked.store(true);
+            this_thread::sleep_for(chrono::milliseconds(500));
+            released.store(true);
+        });
+        while (!locked.load()) {
+            this_thread::yield();
+        }
+        bool ok = search_ok(query, index_dir);
+        bool waited = released.load();
+        loader.join();
+        printf("%-40s %s\n", "Suche waehrend gehaltenem Lade-Mutex:", ok && !waited ? "ok" : "FEHLER");
+        if (!ok || waited) {
+            failures++;
+        }
+    }
+
+    // 2. Suchen, während ein anderer Thread Snapshots wechselt.
+    {
+        const int n_reloads = 20;
+        atomic<bool> done{false};
+        int n_switched = 0, n_failed = 0;
+        thread reloader([&] {
+            SnapshotEntry published;
+            string reload_error;
+            for (int i = 1; i <= n_reloads; i++) {
+                if (!publish_snapshot(index_dir, corpora[i % 2], &published, &reload_error)) {
+                    cerr << "Fehler: " << reload_error << endl;
+                    n_failed++;
+                    break;
+                }
+                int status = quote_reload();
+                n_switched += status == 1;
+                n_failed += status < 0;
+            }
+            done.store(true);
+        });
+        size_t n_searches = 0, n_errors = 0;
+        double max_ms = 0.0;
+        while (!done.load()) {
+            auto start = chrono::steady_clock::now();
+            n_errors += !search_ok(query, index_dir);
+            max_ms = max(max_ms, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+            n_searches++;
+        }
+        reloader.join();
+        bool ok = n_errors == 0 && n_failed == 0;
+        printf("%-40s %s (%d/%d Wechsel ueber quote_reload, %zu Suchen, %zu Fehler, max. %.2f ms)\n",
+               "Suchen waehrend quote_reload:", ok ? "ok" : "FEHLER", n_switched, n_reloads, n_searches, n_errors, max_ms);
+        if (!ok) {
+            failures++;
+        }
+    }
+
+    filesystem::remove_all(dir);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,544 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>      // Für _commit
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "json.hpp"
+#include "quote_index.h"
+#include "string_arena.h"
+
+// --- Zitat-Korpus, Snapshot-Dateien und Index-Verzeichnis ---
+//
+// Ein Korpus sind alle Zitate mit Metadaten (String-Arena) und Such-Index. Er
+// kann aus der JSON-Datei aufgebaut oder aus einer binären Snapshot-Datei
+// geladen werden. Snapshots werden per mmap eingeblendet: die Embeddings und
+// Normen werden direkt aus der Datei benutzt und nicht kopiert.
+//
+// Für das Ausrollen neuer Korpora gibt es ein Index-Verzeichnis:
+//
+//   <index_dir>/MANIFEST                               aktueller Snapshot + Historie (JSON)
+//   <index_dir>/snapshots/snapshot-000003-<hash>.qidx  unveränderliche Snapshots
+//
+// Snapshots werden nie überschrieben. Ein neuer Snapshot wird erst vollständig
+// geschrieben und dann per atomarem rename des MANIFEST aktiviert; Leser folgen
+// dem MANIFEST (siehe mental_health_main.cpp). Ein Rollback schreibt nur das
+// MANIFEST neu und zeigt wieder auf den vorherigen Snapshot.
+
+// Struktur zum Speichern der Details eines Zitats.
+// Die Texte liegen in der String-Arena des Korpus, hier stehen nur Handles.
+// Das Embedding liegt nicht hier, sondern als Zeile im Such-Index
+// (gleicher Index wie in 'QuoteCorpus::quotes').
+struct QuoteData {
+    StringRef quote;
+    StringRef author;
+    StringRef book;
+};
+
+// Eine read-only per mmap eingeblendete Datei.
+class MappedFile {
+public:
+    static std::unique_ptr<MappedFile> open(const std::string& path, std::string* error) {
+        std::unique_ptr<MappedFile> file(new MappedFile());
+#ifdef _WIN32
+        file->file_handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file->file_handle == INVALID_HANDLE_VALUE) {
+            *error = "Datei '" + path + "' konnte nicht geoeffnet werden";
+            return nullptr;
+        }
+        LARGE_INTEGER size;
+        GetFileSizeEx(file->file_handle, &size);
+        file->length = (size_t) size.QuadPart;
+        if (file->length > 0) {
+            file->mapping_handle = CreateFileMappingA(file->file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (file->mapping_handle != nullptr) {
+                file->address = MapViewOfFile(file->mapping_handle, FILE_MAP_READ, 0, 0, 0);
+            }
+            if (file->address == nullptr) {
+                *error = "Datei '" + path + "' konnte nicht eingeblendet werden";
+                return nullptr;
+            }
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            *error = "Datei '" + path + "' konnte nicht geoeffnet werden";
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            *error = "Datei '" + path + "' konnte nicht gelesen werden";
+            return nullptr;
+        }
+        file->length = (size_t) st.st_size;
+        if (file->length > 0) {
+            void* address = mmap(nullptr, file->length, PROT_READ, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) {
+                ::close(fd);
+                *error = "Datei '" + path + "' konnte nicht eingeblendet werden";
+                return nullptr;
+            }
+            file->address = address;
+        }
+        ::close(fd); // Die Abbildung bleibt auch ohne offenen Deskriptor gültig.
+#endif
+        return file;
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (address != nullptr) {
+            UnmapViewOfFile(address);
+        }
+        if (mapping_handle != nullptr) {
+            CloseHandle(mapping_handle);
+        }
+        if (file_handle != INVALID_HANDLE_VALUE) {
+            CloseHandle(file_handle);
+        }
+#else
+        if (address != nullptr) {
+            munmap(address, length);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return static_cast<const unsigned char*>(address); }
+    size_t size() const { return length; }
+
+private:
+    MappedFile() = default;
+
+    void* address = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE file_handle = INVALID_HANDLE_VALUE;
+    HANDLE mapping_handle = nullptr;
+#endif
+};
+
+// Alle Zitate mit Metadaten und Such-Index.
+struct QuoteCorpus {
+    std::vector<QuoteData> quotes;
+    StringArena strings;
+    QuoteIndex index;
+    std::unique_ptr<MappedFile> mapping; // Nur bei Snapshots: die eingeblendete Datei
+    std::string source;                  // Datei, aus der der Korpus geladen wurde
+    uint64_t checksum = 0;               // Prüfsumme des Snapshots (0 bei JSON)
+};
+
+// Baut einen Korpus aus der JSON-Datei mit Zitaten und Embeddings auf.
+// Zitate mit abweichender Embedding-Dimension werden übersprungen.
+inline bool load_corpus_from_json(const std::string& path, EmbeddingType type, QuoteCorpus& corpus, std::string* error) {
+    try {
+        std::ifstream quotes_file(path);
+        if (!quotes_file.is_open()) {
+            *error = "Zitatendatei '" + path + "' konnte nicht geoeffnet werden.";
+            return false;
+        }
+        nlohmann::json quotes_json;
+        quotes_file >> quotes_json; // JSON-Daten aus der Datei in das 'quotes_json'-Objekt lesen.
+
+        // Überprüfen, ob das gelesene JSON ein Array ist (wie erwartet).
+        if (!quotes_json.is_array()) {
+            *error = "Zitatendatei ist kein JSON-Array. Erwartet wurde eine Liste von Zitaten.";
+            return false;
+        }
+
+        // Die Embeddings werden erst gesammelt und danach in die ausgerichtete Matrix kopiert.
+        std::vector<std::vector<float>> embeddings;
+        size_t dim = 0;
+
+        // Iteriere über jedes JSON-Objekt (Zitat) im Array.
+        for (const auto& item : quotes_json) {
+            // Hole das Embedding; '.get<vector<float>>()' konvertiert das JSON-Array in einen C++-Vektor.
+            std::vector<float> embedding = item["embedding"].get<std::vector<float>>();
+            // Das erste Zitat legt die Dimension des Index fest. Zitate mit anderer
+            // Dimension werden hier einmalig aussortiert, damit die Suche pro Zitat
+            // keine Dimensionsprüfung mehr braucht.
+            if (embeddings.empty()) {
+                dim = embedding.size();
+            } else if (embedding.size() != dim) {
+                std::cerr << "C++: Warnung: Embedding-Dimensionen stimmen nicht ueberein. Ueberspringe Zitat." << std::endl;
+                continue;
+            }
+            QuoteData qd;
+            // Greife auf die Zitat-, Autor- und Buchinformationen zu.
+            // '.value()' bietet einen Standardwert, falls ein Schlüssel im JSON fehlt, um Abstürze zu vermeiden.
+            // 'intern' legt jeden Text nur einmal in der Arena ab.
+            qd.quote = corpus.strings.intern(item.value("quote", "Unbekanntes Zitat"));
+            qd.author = corpus.strings.intern(item.value("author", "Unbekannter Autor"));
+            qd.book = corpus.strings.intern(item.value("book", "Unbekanntes Buch"));
+            corpus.quotes.push_back(qd);
+            embeddings.push_back(std::move(embedding));
+        }
+
+        // Index aufbauen: ausgerichtete Matrix im gewählten Format (Auffüllung mit 0), Normen und Kernel.
+        if (!corpus.index.build(embeddings, dim, type)) {
+            *error = std::string("Speicherformat '") + embedding_type_name(type) +
+                     "' ist nicht verfuegbar (ohne QUOTE_USE_GGML gebaut).";
+            return false;
+        }
+        // Es kommen keine Texte mehr hinzu: Dedup-Tabelle freigeben, Puffer verkleinern.
+        corpus.strings.finish();
+        corpus.source = path;
+        return true;
+    } catch (const std::exception& e) {
+        // Allgemeine Fehlerbehandlung beim Laden oder Parsen der JSON-Datei.
+        *error = std::string("Fehler beim Laden der Zitate: ") + e.what();
+        return false;
+    }
+}
+
+// --- Snapshot-Dateiformat ---
+//
+// Header, danach die Abschnitte jeweils auf EMBEDDING_ALIGNMENT Bytes ausgerichtet:
+// Zitat-Handles (QuoteData), Normen (float), String-Arena (Bytes) und die
+// Embedding-Matrix im Speicherformat des Index. Alle Zahlen in der Byte-Reihenfolge
+// der Maschine (die Snapshots werden auf derselben Plattform erzeugt und gelesen).
+
+constexpr char SNAPSHOT_MAGIC[4] = {'Q', 'I', 'D', 'X'};
+constexpr uint32_t SNAPSHOT_FORMAT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t format_version;
+    uint32_t embedding_type;     // EmbeddingType
+    uint32_t reserved;
+    uint64_t dim;
+    uint64_t stride;
+    uint64_t count;
+    uint64_t quotes_offset;      // count * QuoteData
+    uint64_t norms_offset;       // count * float
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t embeddings_offset;  // count * stride Elemente
+    uint64_t file_size;
+    uint64_t checksum;           // FNV-1a über alle Bytes nach dem Header
+};
+
+static_assert(sizeof(QuoteData) == 24, "QuoteData wird unverändert in Snapshots geschrieben");
+static_assert(sizeof(SnapshotHeader) % 8 == 0, "SnapshotHeader darf kein Padding am Ende haben");
+
+// FNV-1a (64 Bit) über einen Speicherbereich.
+inline uint64_t snapshot_checksum(const unsigned char* data, size_t size) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+inline std::string checksum_hex(uint64_t checksum) {
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long) checksum);
+    return buffer;
+}
+
+inline uint64_t align_offset(uint64_t offset) {
+    return (offset + EMBEDDING_ALIGNMENT - 1) / EMBEDDING_ALIGNMENT * EMBEDDING_ALIGNMENT;
+}
+
+// Schreibt eine Datei vollständig und erzwingt, dass sie auf dem Datenträger liegt,
+// bevor sie per rename sichtbar gemacht wird.
+inline bool write_file_durable(const std::string& path, const void* data, size_t size, std::string* error) {
+#ifdef _WIN32
+    int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+    if (fd < 0) {
+        *error = "Datei '" + path + "' konnte nicht angelegt werden";
+        return false;
+    }
+    const char* p = static_cast<const char*>(data);
+    size_t written = 0;
+    bool ok = true;
+    while (ok && written < size) {
+#ifdef _WIN32
+        int n = _write(fd, p + written, (unsigned) std::min<size_t>(size - written, 1 << 30));
+#else
+        ssize_t n = ::write(fd, p + written, size - written);
+#endif
+        ok = n > 0;
+        written += ok ? (size_t) n : 0;
+    }
+#ifdef _WIN32
+    ok = ok && _commit(fd) == 0;
+    _close(fd);
+#else
+    ok = ok && fsync(fd) == 0;
+    ::close(fd);
+#endif
+    if (!ok) {
+        *error = "Datei '" + path + "' konnte nicht geschrieben werden";
+    }
+    return ok;
+}
+
+// Ersetzt 'to' atomar durch 'from' (rename bzw. MoveFileEx) und synchronisiert
+// unter POSIX das Verzeichnis, damit der neue Name einen Absturz übersteht.
+inline bool atomic_replace(const std::string& from, const std::string& to, std::string* error) {
+    std::error_code ec;
+    std::filesystem::rename(from, to, ec);
+    if (ec) {
+        *error = "'" + from + "' konnte nicht nach '" + to + "' umbenannt werden: " + ec.message();
+        return false;
+    }
+#ifndef _WIN32
+    std::string dir = std::filesystem::path(to).parent_path().string();
+    int dir_fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        ::close(dir_fd);
+    }
+#endif
+    return true;
+}
+
+// Schreibt einen Korpus als Snapshot-Datei. Die Prüfsumme wird zurückgegeben.
+inline bool write_snapshot(const QuoteCorpus& corpus, const std::string& path, uint64_t* checksum, std::string* error) {
+    const QuoteIndex& index = corpus.index;
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.format_version = SNAPSHOT_FORMAT_VERSION;
+    header.embedding_type = (uint32_t) index.type;
+    header.dim = index.dim;
+    header.stride = index.stride;
+    header.count = index.count;
+    header.quotes_offset = align_offset(sizeof(SnapshotHeader));
+    header.norms_offset = align_offset(header.quotes_offset + index.count * sizeof(QuoteData));
+    header.strings_offset = align_offset(header.norms_offset + index.count * sizeof(float));
+    header.strings_size = corpus.strings.size();
+    header.embeddings_offset = align_offset(header.strings_offset + header.strings_size);
+    header.file_size = header.embeddings_offset + index.count * index.row_bytes();
+
+    // Die Arena und die Handles werden unverändert übernommen.
+    std::vector<unsigned char> buffer(header.file_size, 0);
+    std::memcpy(buffer.data() + header.quotes_offset, corpus.quotes.data(), index.count * sizeof(QuoteData));
+    std::memcpy(buffer.data() + header.norms_offset, index.norms, index.count * sizeof(float));
+    std::memcpy(buffer.data() + header.strings_offset, corpus.strings.data(), header.strings_size);
+    std::memcpy(buffer.data() + header.embeddings_offset, index.embeddings, index.count * index.row_bytes());
+    header.checksum = snapshot_checksum(buffer.data() + sizeof(SnapshotHeader), buffer.size() - sizeof(SnapshotHeader));
+    std::memcpy(buffer.data(), &header, sizeof(header));
+
+    *checksum = header.checksum;
+    return write_file_durable(path, buffer.data(), buffer.size(), error);
+}
+
+// Lädt einen Snapshot per mmap. Header, Abschnittsgrenzen und Prüfsumme werden
+// geprüft, bevor der Korpus benutzt wird.
+inline bool load_snapshot(const std::string& path, QuoteCorpus& corpus, std::string* error) {
+    std::unique_ptr<MappedFile> file = MappedFile::open(path, error);
+    if (!file) {
+        return false;
+    }
+    SnapshotHeader header;
+    if (file->size() < sizeof(header)) {
+        *error = "Snapshot '" + path + "' ist zu kurz";
+        return false;
+    }
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.format_version != SNAPSHOT_FORMAT_VERSION) {
+        *error = "'" + path + "' ist kein Snapshot im Format " + std::to_string(SNAPSHOT_FORMAT_VERSION);
+        return false;
+    }
+    EmbeddingType type = (EmbeddingType) header.embedding_type;
+    size_t row_bytes = header.stride * embedding_type_size(type);
+    if (header.file_size != file->size() ||
+        header.quotes_offset + header.count * sizeof(QuoteData) > header.norms_offset ||
+        header.norms_offset + header.count * sizeof(float) > header.strings_offset ||
+        header.strings_offset + header.strings_size > header.embeddings_offset ||
+        header.embeddings_offset + header.count * row_bytes != header.file_size) {
+        *error = "Snapshot '" + path + "' ist beschaedigt (Abschnittsgrenzen)";
+        return false;
+    }
+    uint64_t checksum = snapshot_checksum(file->data() + sizeof(header), file->size() - sizeof(header));
+    if (checksum != header.checksum) {
+        *error = "Snapshot '" + path + "' ist beschaedigt (Pruefsumme)";
+        return false;
+    }
+
+    const unsigned char* base = file->data();
+    corpus.quotes.resize(header.count);
+    std::memcpy(corpus.quotes.data(), base + header.quotes_offset, header.count * sizeof(QuoteData));
+    for (const QuoteData& qd : corpus.quotes) {
+        for (const StringRef& ref : {qd.quote, qd.author, qd.book}) {
+            if ((uint64_t) ref.offset + ref.length > header.strings_size) {
+                *error = "Snapshot '" + path + "' ist beschaedigt (Texte)";
+                return false;
+            }
+        }
+    }
+    corpus.strings.assign(reinterpret_cast<const char*>(base + header.strings_offset), header.strings_size);
+    if (!corpus.index.attach(base + header.embeddings_offset, reinterpret_cast<const float*>(base + header.norms_offset),
+                             header.count, header.dim, header.stride, type)) {
+        *error = std::string("Snapshot '") + path + "' braucht das Speicherformat '" + embedding_type_name(type) +
+                 "', das in diesem Build nicht verfuegbar ist";
+        return false;
+    }
+    corpus.mapping = std::move(file);
+    corpus.source = path;
+    corpus.checksum = checksum;
+    return true;
+}
+
+// --- Index-Verzeichnis mit MANIFEST ---
+
+// Ein Eintrag im MANIFEST: Snapshot-Datei (relativ zum Index-Verzeichnis),
+// fortlaufende Versionsnummer und Prüfsumme.
+struct SnapshotEntry {
+    uint64_t version = 0;
+    std::string file;
+    uint64_t checksum = 0;
+};
+
+struct IndexManifest {
+    uint64_t last_version = 0;          // Höchste jemals vergebene Version
+    SnapshotEntry current;              // Aktiver Snapshot
+    std::vector<SnapshotEntry> history; // Vorherige Snapshots, ältester zuerst
+};
+
+constexpr const char* MANIFEST_NAME = "MANIFEST";
+
+// Ein Pfad ist ein Index-Verzeichnis, wenn er ein MANIFEST enthält.
+inline bool is_index_dir(const std::string& path) {
+    std::error_code ec;
+    return std::filesystem::is_regular_file(std::filesystem::path(path) / MANIFEST_NAME, ec);
+}
+
+inline bool read_manifest(const std::string& dir, IndexManifest& manifest, std::string* error) {
+    std::string path = (std::filesystem::path(dir) / MANIFEST_NAME).string();
+    try {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            *error = "MANIFEST '" + path + "' konnte nicht geoeffnet werden";
+            return false;
+        }
+        nlohmann::json j;
+        file >> j;
+        auto read_entry = [](const nlohmann::json& e) {
+            SnapshotEntry entry;
+            entry.version = e.at("version").get<uint64_t>();
+            entry.file = e.at("file").get<std::string>();
+            entry.checksum = std::stoull(e.at("checksum").get<std::string>(), nullptr, 16);
+            return entry;
+        };
+        manifest.last_version = j.at("last_version").get<uint64_t>();
+        manifest.current = read_entry(j.at("current"));
+        manifest.history.clear();
+        for (const auto& e : j.at("history")) {
+            manifest.history.push_back(read_entry(e));
+        }
+        return true;
+    } catch (const std::exception& e) {
+        *error = "MANIFEST '" + path + "' ist ungueltig: " + e.what();
+        return false;
+    }
+}
+
+// Schreibt das MANIFEST über eine temporäre Datei und atomares rename: Leser sehen
+// immer entweder das alte oder das neue MANIFEST, nie ein halb geschriebenes.
+inline bool write_manifest(const std::string& dir, const IndexManifest& manifest, std::string* error) {
+    auto write_entry = [](const SnapshotEntry& entry) {
+        return nlohmann::json{{"version", entry.version}, {"file", entry.file}, {"checksum", checksum_hex(entry.checksum)}};
+    };
+    nlohmann::json j;
+    j["last_version"] = manifest.last_version;
+    j["current"] = write_entry(manifest.current);
+    j["history"] = nlohmann::json::array();
+    for (const auto& entry : manifest.history) {
+        j["history"].push_back(write_entry(entry));
+    }
+    std::string text = j.dump(2) + "\n";
+    std::string path = (std::filesystem::path(dir) / MANIFEST_NAME).string();
+    std::string tmp_path = path + ".tmp";
+    return write_file_durable(tmp_path, text.data(), text.size(), error) && atomic_replace(tmp_path, path, error);
+}
+
+// Schreibt den Korpus als neuen, unveränderlichen Snapshot ins Index-Verzeichnis
+// und macht ihn über das MANIFEST zum aktiven Snapshot.
+inline bool publish_snapshot(const std::string& dir, const QuoteCorpus& corpus, SnapshotEntry* published, std::string* error) {
+    IndexManifest manifest;
+    bool has_manifest = is_index_dir(dir);
+    if (has_manifest && !read_manifest(dir, manifest, error)) {
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(dir) / "snapshots", ec);
+    if (ec) {
+        *error = "Verzeichnis '" + dir + "/snapshots' konnte nicht angelegt werden: " + ec.message();
+        return false;
+    }
+
+    SnapshotEntry entry;
+    entry.version = manifest.last_version + 1;
+    std::string tmp_path = (std::filesystem::path(dir) / "snapshots" / "snapshot.tmp").string();
+    if (!write_snapshot(corpus, tmp_path, &entry.checksum, error)) {
+        return false;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "snapshot-%06llu-%s.qidx", (unsigned long long) entry.version,
+             checksum_hex(entry.checksum).c_str());
+    entry.file = std::string("snapshots/") + name;
+    if (!atomic_replace(tmp_path, (std::filesystem::path(dir) / entry.file).string(), error)) {
+        return false;
+    }
+
+    if (has_manifest) {
+        manifest.history.push_back(manifest.current);
+    }
+    manifest.current = entry;
+    manifest.last_version = entry.version;
+    if (!write_manifest(dir, manifest, error)) {
+        return false;
+    }
+    *published = entry;
+    return true;
+}
+
+// Macht den vorherigen Snapshot wieder zum aktiven. Der bisher aktive Snapshot
+// bleibt als Datei erhalten, wird aber aus dem MANIFEST entfernt.
+inline bool rollback_snapshot(const std::string& dir, SnapshotEntry* restored, std::string* error) {
+    IndexManifest manifest;
+    if (!read_manifest(dir, manifest, error)) {
+        return false;
+    }
+    if (manifest.history.empty()) {
+        *error = "Es gibt keinen vorherigen Snapshot";
+        return false;
+    }
+    manifest.current = manifest.history.back();
+    manifest.history.pop_back();
+    if (!write_manifest(dir, manifest, error)) {
+        return false;
+    }
+    *restored = manifest.current;
+    return true;
+}
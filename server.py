@@ -4,6 +4,8 @@ from sentence_transformers import SentenceTransformer
 import uvicorn
 import ctypes
 import os
+import asyncio
+import itertools
 import json # Nützlich für detailliertere Fehlerbehandlung oder zukünftige JSON-Verarbeitung
 from fastapi.middleware.cors import CORSMiddleware
 
@@ -44,11 +46,17 @@ library_name = "mental_health_main.dll" if os.name == "nt" else "mental_health_m
 # Die Bibliothek und quotes_with_embeddings.json sollten im selben Verzeichnis wie dieses Skript sein.
 LIBRARY_PATH = os.path.join(os.path.dirname(__file__), library_name)
 QUOTES_JSON_PATH = os.path.join(os.path.dirname(__file__), "quotes_with_embeddings.json")
+# Optional ein Index-Verzeichnis mit MANIFEST (siehe quote_index_tool.cpp) statt der JSON-Datei.
+# Neue Snapshots werden dann ohne Neustart übernommen, sobald sie veröffentlicht sind.
+QUOTES_PATH = os.environ.get("QUOTE_INDEX_DIR", QUOTES_JSON_PATH)
 
 # Überprüfe, ob die C++-Bibliothek existiert, bevor wir versuchen, sie zu laden
 if not os.path.exists(LIBRARY_PATH):
     raise RuntimeError(f"Python: FEHLER: C++-Bibliothek nicht gefunden unter: {LIBRARY_PATH}")
 
+# Signatur des Callbacks der Async-API: (request_id, result, user_data).
+QUOTE_CALLBACK = ctypes.CFUNCTYPE(None, ctypes.c_longlong, ctypes.POINTER(ctypes.c_char), ctypes.c_void_p)
+
 # Lade die C++-Bibliothek und konfiguriere die Funktionen für ctypes
 quote_matcher_lib = None # Initialisiere als None, falls das Laden fehlschlägt
 try:
@@ -71,11 +79,149 @@ try:
     quote_matcher_lib.free_string.argtypes = [ctypes.POINTER(ctypes.c_char)] # Nimmt einen Zeiger auf einen C-String
     quote_matcher_lib.free_string.restype = None # Gibt nichts zurück
 
+    # Speicherformat der Zitat-Embeddings ("f32", "f16" oder "bf16"), muss vor dem
+    # ersten Laden gesetzt werden. f16/bf16 halbieren den Speicher pro Suche,
+    # brauchen aber eine Bibliothek, die mit QUOTE_USE_GGML gebaut wurde.
+    EMBEDDING_STORAGE = os.environ.get("QUOTE_EMBEDDING_TYPE", "f32")
+    if hasattr(quote_matcher_lib, "set_embedding_storage"):
+        quote_matcher_lib.set_embedding_storage.argtypes = [ctypes.c_char_p]
+        quote_matcher_lib.set_embedding_storage.restype = ctypes.c_int
+        if quote_matcher_lib.set_embedding_storage(EMBEDDING_STORAGE.encode('utf-8')) != 0:
+            print(f"Python: Speicherformat '{EMBEDDING_STORAGE}' nicht verfügbar, verwende f32.")
+
+    # Konfiguration der Async-API (quote_async_init/quote_submit/quote_poll), falls die
+    # Bibliothek sie schon enthält. Ältere Builds haben nur `find_best_quote`.
+    if hasattr(quote_matcher_lib, "quote_submit"):
+        quote_matcher_lib.quote_async_init.argtypes = [ctypes.c_char_p, ctypes.c_int]
+        quote_matcher_lib.quote_async_init.restype = ctypes.c_int
+        quote_matcher_lib.quote_async_notify_fd.argtypes = []
+        quote_matcher_lib.quote_async_notify_fd.restype = ctypes.c_int
+        quote_matcher_lib.quote_submit.argtypes = [
+            ctypes.POINTER(ctypes.c_float), # user_embedding_arr
+            ctypes.c_int,                   # embedding_dim
+            QUOTE_CALLBACK,                 # callback (NULL = Ergebnis über quote_poll abholen)
+            ctypes.c_void_p                 # user_data
+        ]
+        quote_matcher_lib.quote_submit.restype = ctypes.c_longlong
+        quote_matcher_lib.quote_poll.argtypes = [
+            ctypes.POINTER(ctypes.c_longlong),
+            ctypes.POINTER(ctypes.POINTER(ctypes.c_char)),
+            ctypes.c_int
+        ]
+        quote_matcher_lib.quote_poll.restype = ctypes.c_int
+        quote_matcher_lib.quote_async_shutdown.argtypes = []
+        quote_matcher_lib.quote_async_shutdown.restype = None
+
     print("Python: C++-Bibliothek erfolgreich geladen und Funktionen konfiguriert.")
 except Exception as e:
     print(f"Python: FEHLER beim Laden oder Initialisieren der C++-Bibliothek: {e}")
     quote_matcher_lib = None # Falls ein Fehler auftritt, wird quote_matcher_lib auf None gesetzt
 
+# --- Nicht-blockierende Zitatsuche ---
+# Die Suche läuft im Worker-Pool der C++-Bibliothek. Der Event-Loop wartet nur auf
+# die Fertigmeldung und kann in der Zwischenzeit andere Anfragen bearbeiten.
+#  - Unter Linux/macOS meldet ein Dateideskriptor (eventfd/Pipe) fertige Ergebnisse;
+#    der Loop überwacht ihn mit `add_reader` und holt sie mit `quote_poll` ab.
+#  - Unter Windows gibt es keinen Deskriptor; dann ruft C++ einen Callback auf,
+#    der das Ergebnis per `call_soon_threadsafe` an den Loop übergibt.
+#  - Ohne Async-API (alte Bibliothek) läuft `find_best_quote` in einem Thread-Pool.
+class AsyncQuoteSearch:
+    POLL_BATCH = 64
+
+    def __init__(self, lib, quotes_path):
+        self.lib = lib
+        self.quotes_path = quotes_path
+        self.loop = None
+        self.notify_fd = -1
+        self.pending = {}                 # request_id bzw. Callback-Schlüssel -> Future
+        self.callback_keys = itertools.count(1)
+        self.callback = QUOTE_CALLBACK(self._on_callback) # Referenz halten, sonst sammelt der GC sie ein
+        self.poll_ids = (ctypes.c_longlong * self.POLL_BATCH)()
+        self.poll_results = (ctypes.POINTER(ctypes.c_char) * self.POLL_BATCH)()
+        self.available = hasattr(lib, "quote_submit")
+
+    def _start(self):
+        self.loop = asyncio.get_running_loop()
+        if not self.available:
+            return
+        if self.lib.quote_async_init(self.quotes_path.encode('utf-8'), 0) != 0:
+            print("Python: Async-Suche konnte nicht gestartet werden, verwende synchrone Suche.")
+            self.available = False
+            return
+        self.notify_fd = self.lib.quote_async_notify_fd()
+        if self.notify_fd >= 0:
+            self.loop.add_reader(self.notify_fd, self._on_ready)
+
+    @staticmethod
+    def _take_string(result_ptr, lib):
+        result_str = ctypes.cast(result_ptr, ctypes.c_char_p).value.decode('utf-8')
+        lib.free_string(result_ptr) # WICHTIG: Speicher in C++ freigeben
+        return result_str
+
+    def _on_ready(self):
+        # Läuft im Event-Loop, wenn der Deskriptor lesbar ist.
+        while True:
+            n = self.lib.quote_poll(self.poll_ids, self.poll_results, self.POLL_BATCH)
+            for i in range(n):
+                result_str = self._take_string(self.poll_results[i], self.lib)
+                future = self.pending.pop(self.poll_ids[i], None)
+                if future is not None and not future.done():
+                    future.set_result(result_str)
+            if n < self.POLL_BATCH:
+                break
+
+    def _on_callback(self, request_id, result_ptr, user_data):
+        # Läuft im C++-Worker-Thread (ctypes hält dafür kurz die GIL).
+        result_str = self._take_string(result_ptr, self.lib)
+        self.loop.call_soon_threadsafe(self._resolve, user_data, result_str)
+
+    def _resolve(self, key, result_str):
+        future = self.pending.pop(key, None)
+        if future is not None and not future.done():
+            future.set_result(result_str)
+
+    def _find_sync(self, c_float_array, embedding_dim):
+        result_ptr = self.lib.find_best_quote(c_float_array, embedding_dim, self.quotes_path.encode('utf-8'))
+        return self._take_string(result_ptr, self.lib)
+
+    async def find(self, embedding_list):
+        if self.loop is None:
+            self._start()
+        embedding_dim = len(embedding_list)
+        c_float_array = (ctypes.c_float * embedding_dim)(*embedding_list)
+
+        if not self.available:
+            return await self.loop.run_in_executor(None, self._find_sync, c_float_array, embedding_dim)
+
+        future = self.loop.create_future()
+        if self.notify_fd >= 0:
+            # Zwischen submit und dem Eintragen gibt es kein await, daher kann
+            # _on_ready das Ergebnis nicht vorher abholen.
+            request_id = self.lib.quote_submit(c_float_array, embedding_dim, QUOTE_CALLBACK(), None)
+            key = request_id
+        else:
+            key = next(self.callback_keys)
+            request_id = self.lib.quote_submit(c_float_array, embedding_dim, self.callback, key)
+        if request_id < 0:
+            raise RuntimeError("C++ Async-Suche ist nicht gestartet.")
+        self.pending[key] = future
+        return await future
+
+    def shutdown(self):
+        if self.loop is not None and self.notify_fd >= 0:
+            self.loop.remove_reader(self.notify_fd)
+        if self.available and self.loop is not None:
+            self.lib.quote_async_shutdown()
+        self.loop = None
+
+quote_search = AsyncQuoteSearch(quote_matcher_lib, QUOTES_PATH) if quote_matcher_lib is not None else None
+
+# Worker-Pool der C++-Bibliothek beim Beenden des Servers sauber stoppen.
+@app.on_event("shutdown")
+async def shutdown_quote_search():
+    if quote_search is not None:
+        quote_search.shutdown()
+
 # Pydantic-Modell für die eingehenden Anfragen von Flutter
 class TextInput(BaseModel):
     text: str
@@ -96,28 +242,11 @@ async def get_quote_from_text(input_data: TextInput):
         # model.encode gibt ein NumPy-Array zurück, .tolist() wandelt es in eine Python-Liste von Floats um.
         embedding_list = model.encode(input_data.text).tolist()
 
-        # 2. Embedding für C++ vorbereiten (ctypes-Kompatibilität)
-        embedding_dim = len(embedding_list)
-        # Erstelle ein C-kompatibles Array von `c_float` aus der Python-Liste.
-        # (*embedding_list) entpackt die Liste in einzelne Argumente für den Array-Konstruktor.
-        c_float_array = (ctypes.c_float * embedding_dim)(*embedding_list)
-
-        # 3. C++-Funktion zur Zitatensuche aufrufen
-        # Übergabe des C-Arrays, der Dimension und des Pfades zur Zitat-JSON-Datei.
-        # Der Pfad muss als `bytes` übergeben werden (`.encode('utf-8')`).
-        result_ptr = quote_matcher_lib.find_best_quote(
-            c_float_array,
-            embedding_dim,
-            QUOTES_JSON_PATH.encode('utf-8')
-        )
-
-        # 4. Ergebnis von C++ in Python-String konvertieren
-        # ctypes.cast wandelt den Zeiger in einen `c_char_p` (C-String-Zeiger).
-        # .value holt die Bytes, .decode('utf-8') konvertiert Bytes in einen Python-String.
-        result_str = ctypes.cast(result_ptr, ctypes.c_char_p).value.decode('utf-8')
-
-        # 5. WICHTIG: Speicher in C++ freigeben, um Memory Leaks zu verhindern!
-        quote_matcher_lib.free_string(result_ptr)
+        # 2.-5. Zitatsuche in C++ (nicht-blockierend, siehe AsyncQuoteSearch)
+        # Das Embedding wird dort in ein C-Array von `c_float` kopiert, an den
+        # Worker-Pool der Bibliothek übergeben und das Ergebnis als Python-String
+        # zurückgegeben; der C++-Speicher wird dabei bereits freigegeben.
+        result_str = await quote_search.find(embedding_list)
 
         # 6. Fehlerbehandlung für C++-Fehlermeldungen
         if result_str.startswith("ERROR:"):
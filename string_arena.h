@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// --- String-Arena mit Interning für die Zitat-Metadaten ---
+//
+// Alle Texte (Zitat, Autor, Buch) liegen hintereinander in EINEM Byte-Puffer.
+// Ein Zitat speichert nur Handles (Offset + Länge) statt eigener std::strings.
+// Gleiche Texte werden nur einmal abgelegt: Autor und Buch wiederholen sich
+// über viele Zitate (z.B. "Ryan Holiday" / "The Obstacle Is the Way").
+//
+// Die Handles sind Offsets und keine Zeiger, daher bleiben sie gültig, wenn der
+// Puffer wächst, und Puffer plus Handles können unverändert in eine Datei
+// geschrieben und wieder geladen werden.
+
+// Handle auf einen Text in der Arena.
+struct StringRef {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+};
+
+class StringArena {
+public:
+    // Legt einen Text ab (oder findet ihn, falls schon vorhanden) und gibt sein Handle zurück.
+    StringRef intern(std::string_view text) {
+        if (slots.empty() || (used_slots + 1) * 2 > slots.size()) {
+            grow_table();
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash(text) & mask; ; i = (i + 1) & mask) {
+            if (slots[i].offset == EMPTY_SLOT) {
+                StringRef ref{(uint32_t) bytes.size(), (uint32_t) text.size()};
+                bytes.append(text.data(), text.size());
+                slots[i] = ref;
+                used_slots++;
+                return ref;
+            }
+            if (view(slots[i]) == text) {
+                return slots[i];
+            }
+        }
+    }
+
+    // Liefert den Text zu einem Handle (gültig, solange die Arena nicht verändert wird).
+    std::string_view view(StringRef ref) const {
+        return std::string_view(bytes.data() + ref.offset, ref.length);
+    }
+
+    // Gibt die Dedup-Tabelle frei, wenn keine Texte mehr hinzukommen, und
+    // verkleinert den Puffer auf seine tatsächliche Größe.
+    void finish() {
+        std::vector<StringRef>().swap(slots);
+        used_slots = 0;
+        bytes.shrink_to_fit();
+    }
+
+    // Ersetzt den Inhalt durch einen fertigen Puffer (z.B. aus einer Index-Datei).
+    void assign(const char* data, size_t size) {
+        bytes.assign(data, size);
+        std::vector<StringRef>().swap(slots);
+        used_slots = 0;
+    }
+
+    // Roher Puffer (zum Schreiben in eine Datei) und seine Größe in Bytes.
+    const char* data() const { return bytes.data(); }
+    size_t size() const { return bytes.size(); }
+
+private:
+    // Markiert einen freien Platz in der Dedup-Tabelle.
+    static constexpr uint32_t EMPTY_SLOT = UINT32_MAX;
+
+    // FNV-1a: einfach und für kurze Texte ausreichend gut verteilt.
+    static size_t hash(std::string_view text) {
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : text) {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        return (size_t) h;
+    }
+
+    // Verdoppelt die Dedup-Tabelle (offene Adressierung, Größe immer eine Zweierpotenz).
+    void grow_table() {
+        std::vector<StringRef> old_slots(slots.empty() ? 64 : slots.size() * 2, StringRef{EMPTY_SLOT, 0});
+        old_slots.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const StringRef& ref : old_slots) {
+            if (ref.offset == EMPTY_SLOT) {
+                continue;
+            }
+            size_t i = hash(view(ref)) & mask;
+            while (slots[i].offset != EMPTY_SLOT) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = ref;
+        }
+    }
+
+    std::string bytes;             // alle Texte hintereinander (ohne Trennzeichen)
+    std::vector<StringRef> slots;  // Dedup-Tabelle, nur während des Aufbaus belegt
+    size_t used_slots = 0;
+};